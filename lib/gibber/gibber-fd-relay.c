@@ -0,0 +1,430 @@
+/*
+ * gibber-fd-relay.c - Source for GibberFdRelay
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Moves data between two connected GibberFdTransports without it ever
+ * reaching userspace: each direction has a pipe, and splice() moves data
+ * from one socket into the pipe and from the pipe into the other socket.
+ * A direction only reads when its pipe is empty, so a slow reader on one
+ * side holds back the writer on the other, as gibber_transport_send()
+ * callers blocking on "buffer-empty" would.
+ *
+ * When one side reaches the end of its stream, whatever it sent is
+ * flushed to the other side and then it is disconnected, just as the
+ * transport would have disconnected itself.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+
+#include "gibber-fd-relay.h"
+
+#define DEBUG_FLAG DEBUG_NET
+#include "gibber-debug.h"
+
+/* Most data to have in flight in each direction; reading stops until the
+ * pipe has been emptied into the other socket */
+#define RELAY_PIPE_SIZE (64 * 1024)
+
+/* Give the main loop a chance after this many pipefuls in one go */
+#define RELAY_MAX_PER_WAKEUP 16
+
+typedef struct {
+  GibberFdRelay *relay;
+  /* reads from transports[index] and writes to the other one */
+  guint index;
+  int pipe[2];
+  gsize in_pipe;
+  guint64 bytes;
+  guint watch_in;
+  guint watch_out;
+  gboolean eof;
+} RelayDirection;
+
+struct _GibberFdRelay {
+  GibberFdTransport *transports[2];
+  GIOChannel *channels[2];
+  gulong disconnected_ids[2];
+  RelayDirection directions[2];
+
+  GibberFdRelayProgressFunc progress;
+  gpointer user_data;
+
+  gboolean stopped;
+  /* gibber_fd_relay_free() was called from one of our callbacks */
+  gboolean freed;
+  guint busy;
+};
+
+#ifdef HAVE_SPLICE
+
+static void
+relay_stop (GibberFdRelay *relay)
+{
+  guint i;
+
+  if (relay->stopped)
+    return;
+
+  relay->stopped = TRUE;
+
+  for (i = 0; i < 2; i++)
+    {
+      RelayDirection *d = &relay->directions[i];
+
+      if (d->watch_in != 0)
+        g_source_remove (d->watch_in);
+
+      if (d->watch_out != 0)
+        g_source_remove (d->watch_out);
+
+      d->watch_in = 0;
+      d->watch_out = 0;
+
+      g_signal_handler_disconnect (relay->transports[i],
+          relay->disconnected_ids[i]);
+      gibber_fd_transport_set_relayed (relay->transports[i], FALSE);
+    }
+
+  DEBUG ("Relayed %" G_GUINT64_FORMAT " and %" G_GUINT64_FORMAT " bytes",
+      relay->directions[0].bytes, relay->directions[1].bytes);
+}
+
+static void
+relay_destroy (GibberFdRelay *relay)
+{
+  guint i;
+
+  relay_stop (relay);
+
+  for (i = 0; i < 2; i++)
+    {
+      close (relay->directions[i].pipe[0]);
+      close (relay->directions[i].pipe[1]);
+      g_io_channel_unref (relay->channels[i]);
+      g_object_unref (relay->transports[i]);
+    }
+
+  g_slice_free (GibberFdRelay, relay);
+}
+
+/* Stops relaying and disconnects @transport, which has either reached the
+ * end of its stream or failed */
+static void
+relay_finish (GibberFdRelay *relay,
+              GibberFdTransport *transport)
+{
+  relay_stop (relay);
+  gibber_transport_disconnect (GIBBER_TRANSPORT (transport));
+}
+
+static ssize_t
+relay_splice (int fd_in,
+              int fd_out,
+              gsize len)
+{
+  ssize_t ret;
+
+  do
+    ret = splice (fd_in, NULL, fd_out, NULL, len,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+static gboolean relay_in_cb (GIOChannel *source, GIOCondition condition,
+    gpointer data);
+static gboolean relay_out_cb (GIOChannel *source, GIOCondition condition,
+    gpointer data);
+
+static void
+relay_update_watches (RelayDirection *d)
+{
+  GibberFdRelay *relay = d->relay;
+  gboolean want_in = !d->eof && d->in_pipe == 0;
+  gboolean want_out = d->in_pipe > 0;
+
+  if (want_in && d->watch_in == 0)
+    {
+      d->watch_in = g_io_add_watch (relay->channels[d->index],
+          G_IO_IN | G_IO_HUP, relay_in_cb, d);
+    }
+  else if (!want_in && d->watch_in != 0)
+    {
+      g_source_remove (d->watch_in);
+      d->watch_in = 0;
+    }
+
+  if (want_out && d->watch_out == 0)
+    {
+      d->watch_out = g_io_add_watch (relay->channels[1 - d->index],
+          G_IO_OUT, relay_out_cb, d);
+    }
+  else if (!want_out && d->watch_out != 0)
+    {
+      g_source_remove (d->watch_out);
+      d->watch_out = 0;
+    }
+}
+
+static void
+relay_pump (RelayDirection *d)
+{
+  GibberFdRelay *relay = d->relay;
+  GibberFdTransport *from = relay->transports[d->index];
+  GibberFdTransport *to = relay->transports[1 - d->index];
+  guint n;
+
+  for (n = 0; n < RELAY_MAX_PER_WAKEUP; n++)
+    {
+      ssize_t ret;
+
+      if (d->in_pipe > 0)
+        {
+          ret = relay_splice (d->pipe[0], to->fd, d->in_pipe);
+
+          if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+          if (ret < 0)
+            {
+              DEBUG ("Writing failed: %s", g_strerror (errno));
+              relay_finish (relay, to);
+              return;
+            }
+
+          d->in_pipe -= ret;
+          d->bytes += ret;
+
+          if (relay->progress != NULL)
+            {
+              relay->progress (relay, to, ret, relay->user_data);
+
+              if (relay->stopped)
+                return;
+            }
+
+          if (d->in_pipe > 0)
+            break;
+        }
+
+      if (d->eof)
+        break;
+
+      ret = relay_splice (from->fd, d->pipe[1], RELAY_PIPE_SIZE);
+
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+
+      if (ret < 0)
+        {
+          DEBUG ("Reading failed: %s", g_strerror (errno));
+          relay_finish (relay, from);
+          return;
+        }
+
+      if (ret == 0)
+        {
+          d->eof = TRUE;
+          break;
+        }
+
+      d->in_pipe = ret;
+    }
+
+  if (d->eof && d->in_pipe == 0)
+    {
+      DEBUG ("End of stream; everything has been passed on");
+      relay_finish (relay, from);
+      return;
+    }
+
+  relay_update_watches (d);
+}
+
+static gboolean
+relay_wakeup (RelayDirection *d)
+{
+  GibberFdRelay *relay = d->relay;
+
+  relay->busy++;
+  relay_pump (d);
+  relay->busy--;
+
+  if (relay->freed && relay->busy == 0)
+    relay_destroy (relay);
+
+  /* relay_pump() adds a new watch if it still wants one */
+  return FALSE;
+}
+
+static gboolean
+relay_in_cb (GIOChannel *source,
+             GIOCondition condition,
+             gpointer data)
+{
+  RelayDirection *d = data;
+
+  d->watch_in = 0;
+  return relay_wakeup (d);
+}
+
+static gboolean
+relay_out_cb (GIOChannel *source,
+              GIOCondition condition,
+              gpointer data)
+{
+  RelayDirection *d = data;
+
+  d->watch_out = 0;
+  return relay_wakeup (d);
+}
+
+static void
+relay_transport_disconnected_cb (GibberTransport *transport,
+                                 GibberFdRelay *relay)
+{
+  DEBUG ("Transport disconnected; stop relaying");
+  relay_stop (relay);
+}
+
+#endif
+
+/**
+ * gibber_fd_relay_new:
+ * @a: a connected transport with nothing waiting to be written
+ * @b: another one
+ * @progress: called as data is written to either transport, or %NULL
+ * @user_data: passed to @progress
+ * @error: used to return an error
+ *
+ * Starts moving data between @a and @b in the kernel. Until the relay is
+ * freed or either transport is disconnected, neither transport reads from
+ * its socket; nothing else should write to them either.
+ *
+ * Returns: a new relay, or %NULL if relaying isn't possible
+ */
+GibberFdRelay *
+gibber_fd_relay_new (GibberFdTransport *a,
+                     GibberFdTransport *b,
+                     GibberFdRelayProgressFunc progress,
+                     gpointer user_data,
+                     GError **error)
+{
+#ifdef HAVE_SPLICE
+  GibberFdRelay *relay;
+  GibberFdTransport *transports[2] = { a, b };
+  guint i;
+
+  for (i = 0; i < 2; i++)
+    {
+      if (transports[i]->fd < 0 ||
+          !gibber_transport_buffer_is_empty (GIBBER_TRANSPORT (transports[i])))
+        {
+          g_set_error_literal (error, GIBBER_FD_TRANSPORT_ERROR,
+              GIBBER_FD_TRANSPORT_ERROR_FAILED,
+              "Transports must be connected and have nothing to send");
+          return NULL;
+        }
+    }
+
+  relay = g_slice_new0 (GibberFdRelay);
+  relay->progress = progress;
+  relay->user_data = user_data;
+
+  for (i = 0; i < 2; i++)
+    {
+      RelayDirection *d = &relay->directions[i];
+
+      if (pipe (d->pipe) != 0)
+        {
+          g_set_error (error, GIBBER_FD_TRANSPORT_ERROR,
+              GIBBER_FD_TRANSPORT_ERROR_FAILED, "Can't create a pipe: %s",
+              g_strerror (errno));
+
+          if (i == 1)
+            {
+              close (relay->directions[0].pipe[0]);
+              close (relay->directions[0].pipe[1]);
+            }
+
+          g_slice_free (GibberFdRelay, relay);
+          return NULL;
+        }
+
+      fcntl (d->pipe[0], F_SETFL, O_NONBLOCK);
+      fcntl (d->pipe[1], F_SETFL, O_NONBLOCK);
+      d->relay = relay;
+      d->index = i;
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      relay->transports[i] = g_object_ref (transports[i]);
+      relay->channels[i] = g_io_channel_unix_new (transports[i]->fd);
+      relay->disconnected_ids[i] = g_signal_connect (transports[i],
+          "disconnected", G_CALLBACK (relay_transport_disconnected_cb),
+          relay);
+      gibber_fd_transport_set_relayed (transports[i], TRUE);
+    }
+
+  DEBUG ("Relaying between fds %d and %d", a->fd, b->fd);
+
+  relay_update_watches (&relay->directions[0]);
+  relay_update_watches (&relay->directions[1]);
+
+  return relay;
+#else
+  g_set_error_literal (error, GIBBER_FD_TRANSPORT_ERROR,
+      GIBBER_FD_TRANSPORT_ERROR_FAILED, "splice() isn't available");
+  return NULL;
+#endif
+}
+
+/**
+ * gibber_fd_relay_free:
+ * @relay: a relay
+ *
+ * Stops relaying and hands both transports back to themselves. Data which
+ * was read from one side but not yet written to the other is lost.
+ */
+void
+gibber_fd_relay_free (GibberFdRelay *relay)
+{
+#ifdef HAVE_SPLICE
+  if (relay->busy > 0)
+    {
+      relay_stop (relay);
+      relay->freed = TRUE;
+      return;
+    }
+
+  relay_destroy (relay);
+#endif
+}
@@ -0,0 +1,42 @@
+/*
+ * gibber-fd-relay.h - Header for GibberFdRelay
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GIBBER_FD_RELAY_H__
+#define __GIBBER_FD_RELAY_H__
+
+#include <glib.h>
+
+#include "gibber-fd-transport.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GibberFdRelay GibberFdRelay;
+
+/* Called whenever @bytes more have been written to @to */
+typedef void (* GibberFdRelayProgressFunc) (GibberFdRelay *relay,
+    GibberFdTransport *to, gsize bytes, gpointer user_data);
+
+GibberFdRelay *gibber_fd_relay_new (GibberFdTransport *a,
+    GibberFdTransport *b, GibberFdRelayProgressFunc progress,
+    gpointer user_data, GError **error);
+void gibber_fd_relay_free (GibberFdRelay *relay);
+
+G_END_DECLS
+
+#endif /* #ifndef __GIBBER_FD_RELAY_H__ */
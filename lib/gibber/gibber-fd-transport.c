@@ -29,6 +29,10 @@
 # include <unistd.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
 #include "gibber-sockets.h"
 #include "gibber-fd-transport.h"
 
@@ -72,6 +76,94 @@ gibber_fd_transport_error_quark (void)
   return quark;
 }
 
+/* Size of the chunks we copy unsent data into; small sends are appended to
+ * the last chunk rather than getting one each */
+#define OUTPUT_CHUNK_SIZE 16384
+
+/* Maximum number of chunks to hand to writev() at once */
+#define OUTPUT_MAX_IOV 64
+
+/* Read buffers start at READ_BUFFER_MIN bytes, double whenever a read fills
+ * them, up to READ_BUFFER_MAX, and halve again after READ_BUFFER_SHRINK_AFTER
+ * reads in a row which used less than a quarter of them */
+#define READ_BUFFER_MIN 4096
+#define READ_BUFFER_MAX (256 * 1024)
+#define READ_BUFFER_SHRINK_AFTER 16
+
+/* Number of distinct read buffer sizes, and how many spare buffers of each
+ * size to keep around for the next transport that wants one */
+#define READ_BUFFER_SIZES 7
+#define READ_BUFFER_POOL_SIZE 4
+
+/* When the fd is readable, keep reading until it would block, but give the
+ * main loop a chance after this many reads or this many microseconds */
+#define READ_MAX_PER_WAKEUP 16
+#define READ_TIME_BUDGET 2000
+
+static GSList *read_buffer_pool[READ_BUFFER_SIZES];
+static guint read_buffer_pool_len[READ_BUFFER_SIZES];
+
+static guint
+read_buffer_size_class (gsize size)
+{
+  guint i;
+
+  for (i = 0; ((gsize) READ_BUFFER_MIN << i) < size; i++)
+    ;
+
+  g_assert (i < READ_BUFFER_SIZES);
+  return i;
+}
+
+/* Returns a buffer with room for @size bytes plus a terminating NUL */
+static guint8 *
+read_buffer_get (gsize size)
+{
+  guint i = read_buffer_size_class (size);
+  guint8 *buffer;
+
+  if (read_buffer_pool[i] == NULL)
+    return g_malloc (size + 1);
+
+  buffer = read_buffer_pool[i]->data;
+  read_buffer_pool[i] = g_slist_delete_link (read_buffer_pool[i],
+      read_buffer_pool[i]);
+  read_buffer_pool_len[i]--;
+  return buffer;
+}
+
+static void
+read_buffer_release (guint8 *buffer,
+    gsize size)
+{
+  guint i = read_buffer_size_class (size);
+
+  if (read_buffer_pool_len[i] >= READ_BUFFER_POOL_SIZE)
+    {
+      g_free (buffer);
+      return;
+    }
+
+  read_buffer_pool[i] = g_slist_prepend (read_buffer_pool[i], buffer);
+  read_buffer_pool_len[i]++;
+}
+
+typedef struct {
+  guint8 *data;
+  gsize len;
+  /* how much of @data has been written already */
+  gsize offset;
+  /* size of @data */
+  gsize allocated;
+} OutputChunk;
+
+static void
+output_chunk_free (OutputChunk *chunk)
+{
+  g_free (chunk->data);
+  g_slice_free (OutputChunk, chunk);
+}
+
 /* private structure */
 typedef struct _GibberFdTransportPrivate GibberFdTransportPrivate;
 
@@ -82,8 +174,19 @@ struct _GibberFdTransportPrivate
   guint watch_in;
   guint watch_out;
   guint watch_err;
-  GString *output_buffer;
+  /* OutputChunk *, oldest first */
+  GQueue output_queue;
+  /* total unwritten bytes in @output_queue */
+  gsize output_queued;
+  /* NULL until the first read */
+  guint8 *read_buffer;
+  gsize read_buffer_size;
+  /* consecutive reads which used less than a quarter of @read_buffer */
+  guint small_reads;
+  GibberFdTransportReadStats read_stats;
   gboolean receiving_blocked;
+  /* a GibberFdRelay is reading from the fd for us */
+  gboolean relayed;
 };
 
 #define GIBBER_FD_TRANSPORT_GET_PRIVATE(o)  \
@@ -97,7 +200,9 @@ gibber_fd_transport_init (GibberFdTransport *self)
   GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
   self->fd = -1;
   priv->channel = NULL;
-  priv->output_buffer = NULL;
+  g_queue_init (&priv->output_queue);
+  priv->output_queued = 0;
+  priv->read_buffer_size = READ_BUFFER_MIN;
   priv->watch_in = 0;
   priv->watch_out = 0;
   priv->watch_err = 0;
@@ -154,6 +259,12 @@ gibber_fd_transport_dispose (GObject *object)
 void
 gibber_fd_transport_finalize (GObject *object)
 {
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (object);
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  if (priv->read_buffer != NULL)
+    read_buffer_release (priv->read_buffer, priv->read_buffer_size);
+
   G_OBJECT_CLASS (gibber_fd_transport_parent_class)->finalize (object);
 }
 
@@ -169,6 +280,13 @@ _do_disconnect (GibberFdTransport *self)
 
   DEBUG ("Closing the fd transport");
 
+  if (priv->read_stats.wakeups > 0)
+    DEBUG ("Read %" G_GUINT64_FORMAT " bytes in %" G_GUINT64_FORMAT
+        " reads over %" G_GUINT64_FORMAT " wakeups (%" G_GUINT64_FORMAT
+        " bytes per wakeup)", priv->read_stats.bytes, priv->read_stats.reads,
+        priv->read_stats.wakeups,
+        priv->read_stats.bytes / priv->read_stats.wakeups);
+
   if (priv->channel != NULL)
     {
       if (priv->watch_in != 0)
@@ -190,11 +308,9 @@ _do_disconnect (GibberFdTransport *self)
     }
   self->fd = -1;
 
-  if (priv->output_buffer)
-    {
-      g_string_free (priv->output_buffer, TRUE);
-      priv->output_buffer = NULL;
-    }
+  g_queue_foreach (&priv->output_queue, (GFunc) output_chunk_free, NULL);
+  g_queue_clear (&priv->output_queue);
+  priv->output_queued = 0;
 
   if (!priv->dispose_has_run)
     /* If we are disposing we don't care about the state anymore */
@@ -203,16 +319,9 @@ _do_disconnect (GibberFdTransport *self)
 }
 
 static gboolean
-_try_write (GibberFdTransport *self, const guint8 *data, int len,
-    gsize *written, GError **err)
+_check_write_result (GibberFdTransport *self, GibberFdIOResult result,
+    GError *error, GError **err)
 {
-  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
-  GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS (self);
-  GibberFdIOResult result;
-  GError *error = NULL;
-
-  result = cls->write (self, priv->channel, data, len, written, &error);
-
   switch (result)
     {
       case GIBBER_FD_IO_RESULT_SUCCESS:
@@ -233,6 +342,158 @@ _try_write (GibberFdTransport *self, const guint8 *data, int len,
     return TRUE;
 }
 
+static gboolean
+_try_write (GibberFdTransport *self, const guint8 *data, int len,
+    gsize *written, GError **err)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS (self);
+  GibberFdIOResult result;
+  GError *error = NULL;
+
+  result = cls->write (self, priv->channel, data, len, written, &error);
+
+  return _check_write_result (self, result, error, err);
+}
+
+static void
+_output_queue_append (GibberFdTransport *self, const guint8 *data,
+    gsize len)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  OutputChunk *tail = g_queue_peek_tail (&priv->output_queue);
+  OutputChunk *chunk;
+
+  priv->output_queued += len;
+
+  if (tail != NULL && tail->allocated - tail->len >= len)
+    {
+      memcpy (tail->data + tail->len, data, len);
+      tail->len += len;
+      return;
+    }
+
+  chunk = g_slice_new0 (OutputChunk);
+  chunk->allocated = MAX (len, OUTPUT_CHUNK_SIZE);
+  chunk->data = g_malloc (chunk->allocated);
+  memcpy (chunk->data, data, len);
+  chunk->len = len;
+  g_queue_push_tail (&priv->output_queue, chunk);
+}
+
+/* Drop @written bytes from the front of the output queue */
+static void
+_output_queue_consume (GibberFdTransport *self, gsize written)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  g_assert (written <= priv->output_queued);
+  priv->output_queued -= written;
+
+  while (written > 0)
+    {
+      OutputChunk *head = g_queue_peek_head (&priv->output_queue);
+      gsize remaining = head->len - head->offset;
+
+      if (written < remaining)
+        {
+          head->offset += written;
+          break;
+        }
+
+      written -= remaining;
+      output_chunk_free (g_queue_pop_head (&priv->output_queue));
+    }
+}
+
+#ifdef HAVE_SYS_UIO_H
+/* Write out as much of the queue as possible with one writev() */
+static GibberFdIOResult
+_output_queue_writev (GibberFdTransport *self, gsize *written,
+    GError **error)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  struct iovec iov[OUTPUT_MAX_IOV];
+  GList *l;
+  int n = 0;
+  ssize_t ret;
+
+  for (l = priv->output_queue.head; l != NULL && n < OUTPUT_MAX_IOV;
+      l = l->next)
+    {
+      OutputChunk *chunk = l->data;
+
+      iov[n].iov_base = chunk->data + chunk->offset;
+      iov[n].iov_len = chunk->len - chunk->offset;
+      n++;
+    }
+
+  *written = 0;
+
+  do
+    ret = writev (self->fd, iov, n);
+  while (ret < 0 && errno == EINTR);
+
+  if (ret >= 0)
+    {
+      *written = ret;
+      return GIBBER_FD_IO_RESULT_SUCCESS;
+    }
+
+  if (errno == EAGAIN || errno == EWOULDBLOCK)
+    return GIBBER_FD_IO_RESULT_AGAIN;
+
+  g_set_error_literal (error, GIBBER_FD_TRANSPORT_ERROR,
+      errno == EPIPE ? GIBBER_FD_TRANSPORT_ERROR_PIPE
+          : GIBBER_FD_TRANSPORT_ERROR_FAILED,
+      g_strerror (errno));
+  return GIBBER_FD_IO_RESULT_ERROR;
+}
+#endif
+
+/* Returns FALSE if the transport was disconnected */
+static gboolean
+_output_queue_flush (GibberFdTransport *self)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS (self);
+  OutputChunk *head;
+  gsize written;
+
+#ifdef HAVE_SYS_UIO_H
+  /* Subclasses overriding write() need to see each chunk themselves */
+  if (cls->write == gibber_fd_transport_write)
+    {
+      GibberFdIOResult result;
+      GError *error = NULL;
+
+      result = _output_queue_writev (self, &written, &error);
+
+      if (!_check_write_result (self, result, error, NULL))
+        return FALSE;
+
+      _output_queue_consume (self, written);
+      return TRUE;
+    }
+#endif
+
+  while ((head = g_queue_peek_head (&priv->output_queue)) != NULL)
+    {
+      gsize remaining = head->len - head->offset;
+
+      if (!_try_write (self, head->data + head->offset, remaining, &written,
+            NULL))
+        return FALSE;
+
+      _output_queue_consume (self, written);
+
+      if (written < remaining)
+        break;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 _writeout (GibberFdTransport *self, const guint8 *data, gsize len,
     GError **error)
@@ -241,7 +502,7 @@ _writeout (GibberFdTransport *self, const guint8 *data, gsize len,
   gsize written = 0;
 
   DEBUG ("Writing out %" G_GSIZE_FORMAT " bytes", len);
-  if (priv->output_buffer == NULL || priv->output_buffer->len == 0)
+  if (priv->output_queued == 0)
     {
       /* We've got nothing buffer yet so try to write out directly */
       if (!_try_write (self, data, len, &written, error))
@@ -256,16 +517,7 @@ _writeout (GibberFdTransport *self, const guint8 *data, gsize len,
       return TRUE;
     }
 
-  if (priv->output_buffer)
-    {
-      g_string_append_len (priv->output_buffer, (gchar *) data + written,
-        len - written);
-    }
-  else
-    {
-      priv->output_buffer = g_string_new_len ((gchar *) data + written,
-          len - written);
-    }
+  _output_queue_append (self, data + written, len - written);
 
   if (!priv->watch_out)
     {
@@ -285,24 +537,45 @@ _channel_io_in (GIOChannel *source, GIOCondition condition, gpointer data)
   GibberFdIOResult result;
   GError *error = NULL;
   GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS(self);
+  gint64 deadline = g_get_monotonic_time () + READ_TIME_BUDGET;
+  gboolean ret = TRUE;
+  guint i;
 
-  result = cls->read (self, priv->channel, &error);
+  /* The data-received handler may drop the last reference to us */
+  g_object_ref (self);
+  priv->read_stats.wakeups++;
 
-  switch (result)
+  for (i = 0; i < READ_MAX_PER_WAKEUP; i++)
     {
-      case GIBBER_FD_IO_RESULT_SUCCESS:
-      case GIBBER_FD_IO_RESULT_AGAIN:
+      result = cls->read (self, priv->channel, &error);
+
+      if (result == GIBBER_FD_IO_RESULT_AGAIN)
+        break;
+
+      if (result == GIBBER_FD_IO_RESULT_ERROR ||
+          result == GIBBER_FD_IO_RESULT_EOF)
+        {
+          if (result == GIBBER_FD_IO_RESULT_ERROR)
+            {
+              gibber_transport_emit_error (GIBBER_TRANSPORT(self), error);
+              g_clear_error (&error);
+            }
+
+          DEBUG("Failed to read from the transport, closing..");
+          _do_disconnect (self);
+          ret = FALSE;
+          break;
+        }
+
+      /* The handler may have closed us, asked us to stop reading, or handed
+       * the fd to a GibberFdRelay */
+      if (priv->channel == NULL || priv->receiving_blocked ||
+          priv->relayed || g_get_monotonic_time () >= deadline)
         break;
-      case GIBBER_FD_IO_RESULT_ERROR:
-        gibber_transport_emit_error (GIBBER_TRANSPORT(self), error);
-        /* Deliberately falling through */
-      case GIBBER_FD_IO_RESULT_EOF:
-        DEBUG("Failed to read from the transport, closing..");
-        _do_disconnect (self);
-        return FALSE;
     }
 
-  return TRUE;
+  g_object_unref (self);
+  return ret;
 }
 
 static gboolean
@@ -311,21 +584,14 @@ _channel_io_out (GIOChannel *source, GIOCondition condition, gpointer data)
   GibberFdTransport *self = GIBBER_FD_TRANSPORT (data);
   GibberFdTransportPrivate *priv =
      GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
-  gsize written;
 
-  g_assert (priv->output_buffer);
-  if (!_try_write (self, (guint8 *) priv->output_buffer->str,
-                   priv->output_buffer->len, &written, NULL))
+  g_assert (priv->output_queued > 0);
+  if (!_output_queue_flush (self))
     {
       return FALSE;
     }
 
-  if (written > 0 )
-    {
-      priv->output_buffer = g_string_erase (priv->output_buffer, 0, written);
-    }
-
-  if (priv->output_buffer->len == 0)
+  if (priv->output_queued == 0)
     {
       priv->watch_out = 0;
       gibber_transport_emit_buffer_empty (GIBBER_TRANSPORT (self));
@@ -411,26 +677,69 @@ gibber_fd_transport_write (GibberFdTransport *fd_transport,
     g_assert_not_reached ();
 }
 
-#define BUFSIZE 1024
+/* Pick the size of the next read based on how much this one got */
+static void
+_read_buffer_adapt (GibberFdTransport *self, gsize bytes_read)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  gsize new_size = priv->read_buffer_size;
+
+  if (bytes_read == priv->read_buffer_size)
+    {
+      priv->small_reads = 0;
+
+      if (new_size < READ_BUFFER_MAX)
+        new_size *= 2;
+    }
+  else if (bytes_read < priv->read_buffer_size / 4)
+    {
+      if (++priv->small_reads >= READ_BUFFER_SHRINK_AFTER &&
+          new_size > READ_BUFFER_MIN)
+        {
+          priv->small_reads = 0;
+          new_size /= 2;
+        }
+    }
+  else
+    {
+      priv->small_reads = 0;
+    }
+
+  if (new_size != priv->read_buffer_size)
+    {
+      DEBUG ("Resizing read buffer to %" G_GSIZE_FORMAT " bytes", new_size);
+      read_buffer_release (priv->read_buffer, priv->read_buffer_size);
+      priv->read_buffer = read_buffer_get (new_size);
+      priv->read_buffer_size = new_size;
+    }
+}
 
 GibberFdIOResult
 gibber_fd_transport_read (GibberFdTransport *transport,
     GIOChannel *channel, GError **error)
 {
-  guint8  buf[BUFSIZE + 1];
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (transport);
+  guint8 *buf;
   GIOStatus status;
   gsize bytes_read;
 
-  status = g_io_channel_read_chars (channel, (gchar *) buf, BUFSIZE,
-    &bytes_read, error);
+  if (priv->read_buffer == NULL)
+    priv->read_buffer = read_buffer_get (priv->read_buffer_size);
+
+  buf = priv->read_buffer;
+  status = g_io_channel_read_chars (channel, (gchar *) buf,
+    priv->read_buffer_size, &bytes_read, error);
 
   switch (status)
     {
       case G_IO_STATUS_NORMAL:
         buf[bytes_read] = '\0';
         DEBUG ("Received %" G_GSIZE_FORMAT " bytes", bytes_read);
+        priv->read_stats.reads++;
+        priv->read_stats.bytes += bytes_read;
         gibber_transport_received_data (GIBBER_TRANSPORT (transport),
             buf, bytes_read);
+        _read_buffer_adapt (transport, bytes_read);
         return GIBBER_FD_IO_RESULT_SUCCESS;
       case G_IO_STATUS_ERROR:
         return GIBBER_FD_IO_RESULT_ERROR;
@@ -505,6 +814,55 @@ gibber_fd_transport_send (GibberTransport *transport,
   return _writeout (GIBBER_FD_TRANSPORT (transport), data, size, error);
 }
 
+/**
+ * gibber_fd_transport_get_read_stats:
+ * @self: a transport
+ * @stats: (out): filled in with how much has been read so far
+ *
+ * Lets callers see how well reads are being batched: a high
+ * bytes / wakeups ratio means few main loop iterations per byte.
+ */
+void
+gibber_fd_transport_get_read_stats (GibberFdTransport *self,
+    GibberFdTransportReadStats *stats)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  *stats = priv->read_stats;
+}
+
+/**
+ * gibber_fd_transport_set_relayed:
+ * @self: a transport
+ * @relayed: whether something else is reading from the fd
+ *
+ * Used by GibberFdRelay to stop the transport reading from its fd while the
+ * relay is. gibber_transport_block_receiving() still records whether the
+ * transport should read once it's no longer relayed.
+ */
+void
+gibber_fd_transport_set_relayed (GibberFdTransport *self,
+    gboolean relayed)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  gboolean blocked = priv->receiving_blocked;
+
+  if (priv->relayed == relayed)
+    return;
+
+  if (relayed)
+    {
+      gibber_fd_transport_block_receiving (GIBBER_TRANSPORT (self), TRUE);
+      priv->relayed = TRUE;
+    }
+  else
+    {
+      priv->relayed = FALSE;
+    }
+
+  gibber_fd_transport_block_receiving (GIBBER_TRANSPORT (self), blocked);
+}
+
 void
 gibber_fd_transport_disconnect (GibberTransport *transport)
 {
@@ -554,7 +912,7 @@ gibber_fd_transport_buffer_is_empty (GibberTransport *transport)
   GibberFdTransportPrivate *priv =
      GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
 
-  return (priv->output_buffer == NULL || priv->output_buffer->len == 0);
+  return (priv->output_queued == 0);
 }
 
 static void
@@ -573,7 +931,7 @@ gibber_fd_transport_block_receiving (GibberTransport *transport,
   else if (!block && priv->watch_in == 0)
     {
       DEBUG ("unblock receiving from the transport");
-      if (priv->channel != NULL)
+      if (priv->channel != NULL && !priv->relayed)
         {
 #ifdef G_OS_WIN32
           /* workaround for GLib bug #338943 */
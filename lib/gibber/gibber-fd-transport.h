@@ -47,6 +47,14 @@ typedef enum
 typedef struct _GibberFdTransport GibberFdTransport;
 typedef struct _GibberFdTransportClass GibberFdTransportClass;
 
+typedef struct {
+    /* number of times the fd was found readable */
+    guint64 wakeups;
+    /* number of successful reads */
+    guint64 reads;
+    guint64 bytes;
+} GibberFdTransportReadStats;
+
 
 struct _GibberFdTransportClass {
     GibberTransportClass parent_class;
@@ -91,6 +99,12 @@ GibberFdIOResult gibber_fd_transport_read (GibberFdTransport *transport,
     GIOChannel *channel,
     GError **error);
 
+void gibber_fd_transport_get_read_stats (GibberFdTransport *self,
+    GibberFdTransportReadStats *stats);
+
+void gibber_fd_transport_set_relayed (GibberFdTransport *self,
+    gboolean relayed);
+
 G_END_DECLS
 
 #endif /* #ifndef __GIBBER_FD_TRANSPORT_H__*/
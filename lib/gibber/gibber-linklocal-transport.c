@@ -36,9 +36,6 @@
 #define DEBUG_FLAG DEBUG_NET
 #include "gibber-debug.h"
 
-/* Buffer size used for reading input */
-#define BUFSIZE 1024
-
 G_DEFINE_TYPE(GibberLLTransport, gibber_ll_transport, GIBBER_TYPE_FD_TRANSPORT)
 
 GQuark
@@ -198,6 +198,8 @@ try_to_connect (GibberTCPTransport *self)
     {
       DEBUG ("connect succeeded");
 
+      /* The fd now belongs to the fd transport */
+      g_io_channel_set_close_on_unref (priv->channel, FALSE);
       clean_all_connect_attempts (self);
       gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (self), fd, TRUE);
       return FALSE;
@@ -261,7 +263,9 @@ new_connect_attempt (GibberTCPTransport *self)
 
   gibber_socket_set_nonblocking (fd);
   priv->channel = gibber_io_channel_new_from_socket (fd);
-  g_io_channel_set_close_on_unref (priv->channel, FALSE);
+  /* Close the socket if this attempt fails or is abandoned, which happens
+   * whenever a SOCKS5 bytestream gives up on a slower streamhost */
+  g_io_channel_set_close_on_unref (priv->channel, TRUE);
   g_io_channel_set_encoding (priv->channel, NULL, NULL);
   g_io_channel_set_buffered (priv->channel, FALSE);
 
@@ -0,0 +1,613 @@
+/*
+ * base64.c - Gabble's base64 codec
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * In-band bytestreams and avatars spend much of their time converting to
+ * and from base64. This produces exactly the same output as GLib's
+ * g_base64_encode() and g_base64_decode(), but works on whole groups of
+ * characters at a time and writes into buffers the caller already has,
+ * rather than allocating a new one for every stanza.
+ *
+ * Where the CPU has SSE2 or (64-bit) NEON, long runs are converted 16 or 64
+ * characters at a time with vector instructions; anything those kernels
+ * don't handle, such as padding, line breaks and the tail, goes through the
+ * table-driven code below, which is also used everywhere else.
+ */
+
+#include "config.h"
+#include "base64.h"
+
+#include <string.h>
+
+#ifdef HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
+#ifdef HAVE_NEON
+# include <arm_neon.h>
+#endif
+
+static const gchar alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* 0xff for characters which aren't part of the encoding, which are skipped
+ * when decoding. '=' counts as 0, and trailing ones are dealt with when a
+ * group of four is complete. */
+static guint8 decode_table[256];
+
+/* Each pair of output characters for every 12-bit input value */
+static gchar encode_pairs[4096 * 2];
+
+/* Encodes as many whole groups of three bytes from the start of @data as
+ * the kernel deals with at once, and returns how many bytes it used */
+typedef gsize (*EncodeKernel) (const guint8 *data, gsize len, gchar *out);
+
+/* Decodes whole groups of four characters from the start of @in, stopping
+ * before the first block containing anything but the 64 characters of the
+ * alphabet, and returns how many characters it used */
+typedef gsize (*DecodeKernel) (const guchar *in, gsize len, guint8 *out);
+
+static gsize
+encode_scalar (const guint8 *data,
+    gsize len,
+    gchar *out)
+{
+  gsize used;
+  guint32 v;
+
+  for (used = 0; len - used >= 3; used += 3, data += 3, out += 4)
+    {
+      v = (data[0] << 16) | (data[1] << 8) | data[2];
+      memcpy (out, encode_pairs + 2 * (v >> 12), 2);
+      memcpy (out + 2, encode_pairs + 2 * (v & 0xfff), 2);
+    }
+
+  return used;
+}
+
+#ifdef HAVE_SSE2
+
+#define SSE2_FUNCTION __attribute__ ((target ("sse2")))
+
+/* @mask ? @a : @b, bytewise */
+static inline __m128i SSE2_FUNCTION
+sse2_select (__m128i mask,
+    __m128i a,
+    __m128i b)
+{
+  return _mm_or_si128 (_mm_and_si128 (mask, a), _mm_andnot_si128 (mask, b));
+}
+
+/* Turns 16 6-bit values into their characters */
+static inline __m128i SSE2_FUNCTION
+sse2_encode_chars (__m128i values)
+{
+  __m128i offset = _mm_set1_epi8 ('A');
+
+  offset = sse2_select (_mm_cmpgt_epi8 (values, _mm_set1_epi8 (25)),
+      _mm_set1_epi8 ('a' - 26), offset);
+  offset = sse2_select (_mm_cmpgt_epi8 (values, _mm_set1_epi8 (51)),
+      _mm_set1_epi8 ('0' - 52), offset);
+  offset = sse2_select (_mm_cmpeq_epi8 (values, _mm_set1_epi8 (62)),
+      _mm_set1_epi8 ('+' - 62), offset);
+  offset = sse2_select (_mm_cmpeq_epi8 (values, _mm_set1_epi8 (63)),
+      _mm_set1_epi8 ('/' - 63), offset);
+
+  return _mm_add_epi8 (values, offset);
+}
+
+/* 12 bytes to 16 characters at a time. SSE2 can't shuffle bytes, so each
+ * group of three is loaded into its own 32-bit lane, and the vector unit
+ * splits the lanes into 6-bit values and looks up their characters. */
+static gsize SSE2_FUNCTION
+encode_sse2 (const guint8 *data,
+    gsize len,
+    gchar *out)
+{
+  const __m128i mask = _mm_set1_epi32 (0x3f);
+  gsize used;
+
+  /* the last group's load reads a byte beyond it */
+  for (used = 0; len - used >= 16; used += 12, data += 12, out += 16)
+    {
+      guint32 groups[4];
+      __m128i v, values;
+      guint i;
+
+      for (i = 0; i < 4; i++)
+        {
+          memcpy (groups + i, data + 3 * i, 4);
+          groups[i] = GUINT32_FROM_BE (groups[i]) >> 8;
+        }
+
+      v = _mm_loadu_si128 ((const __m128i *) groups);
+
+      /* x86 is little-endian, so the first character of each group goes
+       * in the lowest byte of its lane */
+      values = _mm_and_si128 (_mm_srli_epi32 (v, 18), mask);
+      values = _mm_or_si128 (values,
+          _mm_slli_epi32 (_mm_and_si128 (_mm_srli_epi32 (v, 12), mask), 8));
+      values = _mm_or_si128 (values,
+          _mm_slli_epi32 (_mm_and_si128 (_mm_srli_epi32 (v, 6), mask), 16));
+      values = _mm_or_si128 (values,
+          _mm_slli_epi32 (_mm_and_si128 (v, mask), 24));
+
+      _mm_storeu_si128 ((__m128i *) out, sse2_encode_chars (values));
+    }
+
+  return used;
+}
+
+/* Whether each character is between @lo and @hi inclusive; anything over
+ * 127 is negative here, so never is */
+static inline __m128i SSE2_FUNCTION
+sse2_in_range (__m128i c,
+    gchar lo,
+    gchar hi)
+{
+  return _mm_and_si128 (_mm_cmpgt_epi8 (c, _mm_set1_epi8 (lo - 1)),
+      _mm_cmplt_epi8 (c, _mm_set1_epi8 (hi + 1)));
+}
+
+/* 16 characters to 12 bytes at a time */
+static gsize SSE2_FUNCTION
+decode_sse2 (const guchar *in,
+    gsize len,
+    guint8 *out)
+{
+  gsize used;
+
+  for (used = 0; len - used >= 16; used += 16, in += 16, out += 12)
+    {
+      __m128i c = _mm_loadu_si128 ((const __m128i *) in);
+      __m128i upper = sse2_in_range (c, 'A', 'Z');
+      __m128i lower = sse2_in_range (c, 'a', 'z');
+      __m128i digit = sse2_in_range (c, '0', '9');
+      __m128i plus = _mm_cmpeq_epi8 (c, _mm_set1_epi8 ('+'));
+      __m128i slash = _mm_cmpeq_epi8 (c, _mm_set1_epi8 ('/'));
+      __m128i values, w, v;
+      guint32 groups[4];
+      guint i;
+
+      if (_mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (upper, lower),
+              _mm_or_si128 (_mm_or_si128 (digit, plus), slash))) != 0xffff)
+        break;
+
+      values = _mm_and_si128 (upper, _mm_sub_epi8 (c, _mm_set1_epi8 ('A')));
+      values = _mm_or_si128 (values, _mm_and_si128 (lower,
+          _mm_sub_epi8 (c, _mm_set1_epi8 ('a' - 26))));
+      values = _mm_or_si128 (values, _mm_and_si128 (digit,
+          _mm_add_epi8 (c, _mm_set1_epi8 (52 - '0'))));
+      values = _mm_or_si128 (values, _mm_and_si128 (plus,
+          _mm_set1_epi8 (62)));
+      values = _mm_or_si128 (values, _mm_and_si128 (slash,
+          _mm_set1_epi8 (63)));
+
+      /* pairs of 6-bit values into 12 bits, then pairs of those into the
+       * 24 bits of each group */
+      w = _mm_or_si128 (
+          _mm_slli_epi16 (_mm_and_si128 (values, _mm_set1_epi16 (0xff)), 6),
+          _mm_srli_epi16 (values, 8));
+      v = _mm_or_si128 (
+          _mm_slli_epi32 (_mm_and_si128 (w, _mm_set1_epi32 (0xffff)), 12),
+          _mm_srli_epi32 (w, 16));
+
+      _mm_storeu_si128 ((__m128i *) groups, v);
+
+      for (i = 0; i < 4; i++)
+        {
+          out[3 * i] = groups[i] >> 16;
+          out[3 * i + 1] = groups[i] >> 8;
+          out[3 * i + 2] = groups[i];
+        }
+    }
+
+  return used;
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+/* The alphabet, and decode_table for the first 128 characters except that
+ * '=' is invalid, in the form the table lookup instructions want */
+static uint8x16x4_t neon_alphabet;
+static uint8x16x4_t neon_decode_low;
+static uint8x16x4_t neon_decode_high;
+
+static uint8x16x4_t
+neon_load_table (const guint8 *table)
+{
+  uint8x16x4_t t;
+
+  t.val[0] = vld1q_u8 (table);
+  t.val[1] = vld1q_u8 (table + 16);
+  t.val[2] = vld1q_u8 (table + 32);
+  t.val[3] = vld1q_u8 (table + 48);
+  return t;
+}
+
+static void
+neon_tables_init (void)
+{
+  guint8 table[128];
+
+  neon_alphabet = neon_load_table ((const guint8 *) alphabet);
+
+  memcpy (table, decode_table, sizeof (table));
+  table['='] = 0xff;
+  neon_decode_low = neon_load_table (table);
+  neon_decode_high = neon_load_table (table + 64);
+}
+
+/* 48 bytes to 64 characters at a time; the loads and stores split and
+ * merge the groups, so all the arithmetic is on whole vectors */
+static gsize
+encode_neon (const guint8 *data,
+    gsize len,
+    gchar *out)
+{
+  const uint8x16_t mask = vdupq_n_u8 (0x3f);
+  gsize used;
+
+  for (used = 0; len - used >= 48; used += 48, data += 48, out += 64)
+    {
+      uint8x16x3_t bytes = vld3q_u8 (data);
+      uint8x16x4_t chars;
+
+      chars.val[0] = vshrq_n_u8 (bytes.val[0], 2);
+      chars.val[1] = vandq_u8 (vorrq_u8 (vshlq_n_u8 (bytes.val[0], 4),
+          vshrq_n_u8 (bytes.val[1], 4)), mask);
+      chars.val[2] = vandq_u8 (vorrq_u8 (vshlq_n_u8 (bytes.val[1], 2),
+          vshrq_n_u8 (bytes.val[2], 6)), mask);
+      chars.val[3] = vandq_u8 (bytes.val[2], mask);
+
+      chars.val[0] = vqtbl4q_u8 (neon_alphabet, chars.val[0]);
+      chars.val[1] = vqtbl4q_u8 (neon_alphabet, chars.val[1]);
+      chars.val[2] = vqtbl4q_u8 (neon_alphabet, chars.val[2]);
+      chars.val[3] = vqtbl4q_u8 (neon_alphabet, chars.val[3]);
+
+      vst4q_u8 ((guint8 *) out, chars);
+    }
+
+  return used;
+}
+
+/* Looks each character up in the decode table; lookups out of range give
+ * 0, so characters over 127 come out as 0 and have to be caught by the
+ * caller */
+static inline uint8x16_t
+neon_decode_values (uint8x16_t c)
+{
+  return vorrq_u8 (vqtbl4q_u8 (neon_decode_low, c),
+      vqtbl4q_u8 (neon_decode_high, veorq_u8 (c, vdupq_n_u8 (0x40))));
+}
+
+/* 64 characters to 48 bytes at a time */
+static gsize
+decode_neon (const guchar *in,
+    gsize len,
+    guint8 *out)
+{
+  gsize used;
+
+  for (used = 0; len - used >= 64; used += 64, in += 64, out += 48)
+    {
+      uint8x16x4_t chars = vld4q_u8 (in);
+      uint8x16x4_t values;
+      uint8x16x3_t bytes;
+      uint8x16_t bad;
+      guint i;
+
+      for (i = 0; i < 4; i++)
+        values.val[i] = neon_decode_values (chars.val[i]);
+
+      bad = vorrq_u8 (vorrq_u8 (values.val[0], chars.val[0]),
+          vorrq_u8 (values.val[1], chars.val[1]));
+      bad = vorrq_u8 (bad, vorrq_u8 (values.val[2], chars.val[2]));
+      bad = vorrq_u8 (bad, vorrq_u8 (values.val[3], chars.val[3]));
+
+      if (vmaxvq_u8 (bad) & 0x80)
+        break;
+
+      bytes.val[0] = vorrq_u8 (vshlq_n_u8 (values.val[0], 2),
+          vshrq_n_u8 (values.val[1], 4));
+      bytes.val[1] = vorrq_u8 (vshlq_n_u8 (values.val[1], 4),
+          vshrq_n_u8 (values.val[2], 2));
+      bytes.val[2] = vorrq_u8 (vshlq_n_u8 (values.val[2], 6),
+          values.val[3]);
+
+      vst3q_u8 (out, bytes);
+    }
+
+  return used;
+}
+
+#endif /* HAVE_NEON */
+
+/* NULL where there's nothing better than decoding a group at a time */
+static const struct {
+    EncodeKernel encode;
+    DecodeKernel decode;
+} kernels[NUM_GABBLE_BASE64_KERNELS] = {
+    { encode_scalar, NULL },
+#ifdef HAVE_SSE2
+    { encode_sse2, decode_sse2 },
+#else
+    { NULL, NULL },
+#endif
+#ifdef HAVE_NEON
+    { encode_neon, decode_neon },
+#else
+    { NULL, NULL },
+#endif
+};
+
+static GabbleBase64Kernel kernel = GABBLE_BASE64_KERNEL_SCALAR;
+
+static gboolean
+kernel_supported (GabbleBase64Kernel k)
+{
+  if (kernels[k].encode == NULL)
+    return FALSE;
+
+#ifdef HAVE_SSE2
+  if (k == GABBLE_BASE64_KERNEL_SSE2)
+    return __builtin_cpu_supports ("sse2");
+#endif
+
+  /* every 64-bit ARM CPU has NEON */
+  return TRUE;
+}
+
+static void
+tables_init (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      GabbleBase64Kernel k;
+
+      guint i;
+
+      memset (decode_table, 0xff, sizeof (decode_table));
+
+      for (i = 0; i < 64; i++)
+        decode_table[(guchar) alphabet[i]] = i;
+
+      decode_table['='] = 0;
+
+      for (i = 0; i < 4096; i++)
+        {
+          encode_pairs[2 * i] = alphabet[i >> 6];
+          encode_pairs[2 * i + 1] = alphabet[i & 0x3f];
+        }
+
+#ifdef HAVE_NEON
+      neon_tables_init ();
+#endif
+
+      /* the best one this CPU can run */
+      for (k = 0; k < NUM_GABBLE_BASE64_KERNELS; k++)
+        {
+          if (kernel_supported (k))
+            kernel = k;
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+/*
+ * gabble_base64_set_kernel:
+ *
+ * Makes everything below use @k, rather than the best one available. This
+ * is only meant for testing.
+ *
+ * Returns: %FALSE if @k wasn't compiled in or this CPU can't run it
+ */
+gboolean
+gabble_base64_set_kernel (GabbleBase64Kernel k)
+{
+  g_return_val_if_fail (k < NUM_GABBLE_BASE64_KERNELS, FALSE);
+
+  tables_init ();
+
+  if (!kernel_supported (k))
+    return FALSE;
+
+  kernel = k;
+  return TRUE;
+}
+
+/*
+ * gabble_base64_encode_to:
+ * @out: where to write the encoding, which must have room for
+ *  GABBLE_BASE64_ENCODED_SIZE (@len) + 1 bytes
+ *
+ * Encodes @data as g_base64_encode() would, followed by a NUL.
+ *
+ * Returns: the length of the encoding, not counting the NUL
+ */
+gsize
+gabble_base64_encode_to (const guint8 *data,
+    gsize len,
+    gchar *out)
+{
+  gchar *p = out;
+  gsize used;
+  guint32 v;
+
+  tables_init ();
+
+  used = kernels[kernel].encode (data, len, p);
+  data += used;
+  len -= used;
+  p += used / 3 * 4;
+
+  /* whatever the kernel left */
+  used = encode_scalar (data, len, p);
+  data += used;
+  len -= used;
+  p += used / 3 * 4;
+
+  if (len > 0)
+    {
+      v = data[0] << 16;
+
+      if (len == 2)
+        v |= data[1] << 8;
+
+      p[0] = alphabet[v >> 18];
+      p[1] = alphabet[(v >> 12) & 0x3f];
+      p[2] = (len == 2) ? alphabet[(v >> 6) & 0x3f] : '=';
+      p[3] = '=';
+      p += 4;
+    }
+
+  *p = '\0';
+  return p - out;
+}
+
+/* Appends the encoding of @data to @out */
+void
+gabble_base64_encode_append (GString *out,
+    const guint8 *data,
+    gsize len)
+{
+  gsize old_len = out->len;
+
+  g_string_set_size (out, old_len + GABBLE_BASE64_ENCODED_SIZE (len));
+  gabble_base64_encode_to (data, len, out->str + old_len);
+}
+
+/*
+ * gabble_base64_decode_step:
+ * @out: where to write the decoded data, which must have room for
+ *  GABBLE_BASE64_DECODED_MAX_SIZE (@len) bytes
+ * @state: carries partial groups from one call to the next
+ *
+ * Decodes @len characters of base64 as g_base64_decode_step() would. Unlike
+ * GLib, padding is still recognised if a group is split between calls.
+ *
+ * Returns: the number of bytes written to @out
+ */
+gsize
+gabble_base64_decode_step (const gchar *in,
+    gsize len,
+    guint8 *out,
+    GabbleBase64DecodeState *state)
+{
+  const guchar *p = (const guchar *) in;
+  const guchar *end = p + len;
+  guint8 *o = out;
+  guint32 v = state->bits;
+  guint n = state->n_chars;
+  DecodeKernel decode;
+
+  tables_init ();
+  decode = kernels[kernel].decode;
+
+  while (p < end)
+    {
+      guchar c;
+      guint8 rank;
+
+      if (n == 0 && decode != NULL)
+        {
+          gsize used = decode (p, end - p, o);
+
+          if (used > 0)
+            {
+              o += used / 4 * 3;
+              state->last[1] = p[used - 2];
+              state->last[0] = p[used - 1];
+              p += used;
+              continue;
+            }
+        }
+
+      /* Whole groups of four valid characters, none of them padding that
+       * matters, can be done in one go */
+      if (n == 0 && end - p >= 4)
+        {
+          guint8 a = decode_table[p[0]], b = decode_table[p[1]],
+              c2 = decode_table[p[2]], d = decode_table[p[3]];
+
+          if (((a | b | c2 | d) & 0x80) == 0 && p[2] != '=' && p[3] != '=')
+            {
+              v = (a << 18) | (b << 12) | (c2 << 6) | d;
+              o[0] = v >> 16;
+              o[1] = v >> 8;
+              o[2] = v;
+              o += 3;
+              state->last[1] = p[2];
+              state->last[0] = p[3];
+              p += 4;
+              continue;
+            }
+        }
+
+      c = *p++;
+      rank = decode_table[c];
+
+      if (rank == 0xff)
+        continue;
+
+      state->last[1] = state->last[0];
+      state->last[0] = c;
+      v = (v << 6) | rank;
+
+      if (++n == 4)
+        {
+          *o++ = v >> 16;
+
+          if (state->last[1] != '=')
+            *o++ = v >> 8;
+
+          if (state->last[0] != '=')
+            *o++ = v;
+
+          n = 0;
+        }
+    }
+
+  state->bits = v;
+  state->n_chars = n;
+
+  return o - out;
+}
+
+/* Appends the decoding of the NUL-terminated @in to @out, as
+ * g_base64_decode() would */
+void
+gabble_base64_decode_append (GString *out,
+    const gchar *in)
+{
+  GabbleBase64DecodeState state = { 0, 0, { 0, 0 } };
+  gsize old_len = out->len;
+  gsize len = strlen (in);
+  gsize written;
+
+  g_string_set_size (out, old_len + GABBLE_BASE64_DECODED_MAX_SIZE (len));
+  written = gabble_base64_decode_step (in, len, (guint8 *) out->str + old_len,
+      &state);
+  g_string_set_size (out, old_len + written);
+}
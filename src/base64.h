@@ -0,0 +1,62 @@
+/*
+ * base64.h - Headers for Gabble's base64 codec
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_BASE64_H__
+#define __GABBLE_BASE64_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Length of the encoding of @len bytes, not counting the trailing NUL */
+#define GABBLE_BASE64_ENCODED_SIZE(len) (((len) + 2) / 3 * 4)
+
+/* Most bytes that decoding @len characters in one step can produce */
+#define GABBLE_BASE64_DECODED_MAX_SIZE(len) ((len) / 4 * 3 + 3)
+
+/* Ways of converting long runs of characters. At most one of the vector
+ * ones is built, and the scalar one is always available. */
+typedef enum {
+    GABBLE_BASE64_KERNEL_SCALAR,
+    GABBLE_BASE64_KERNEL_SSE2,
+    GABBLE_BASE64_KERNEL_NEON,
+    NUM_GABBLE_BASE64_KERNELS
+} GabbleBase64Kernel;
+
+gboolean gabble_base64_set_kernel (GabbleBase64Kernel k);
+
+gsize gabble_base64_encode_to (const guint8 *data, gsize len, gchar *out);
+void gabble_base64_encode_append (GString *out, const guint8 *data,
+    gsize len);
+
+/* Initialize to all zeroes */
+typedef struct {
+    guint32 bits;
+    guint n_chars;
+    /* the last two characters seen, most recent first */
+    gchar last[2];
+} GabbleBase64DecodeState;
+
+gsize gabble_base64_decode_step (const gchar *in, gsize len, guint8 *out,
+    GabbleBase64DecodeState *state);
+void gabble_base64_decode_append (GString *out, const gchar *in);
+
+G_END_DECLS
+
+#endif /* __GABBLE_BASE64_H__ */
@@ -43,6 +43,7 @@
 #include "namespaces.h"
 #include "presence-cache.h"
 #include "private-tubes-factory.h"
+#include "socks5-proxy-cache.h"
 #include "util.h"
 
 G_DEFINE_TYPE (GabbleBytestreamFactory, gabble_bytestream_factory,
@@ -59,6 +60,15 @@ G_DEFINE_TYPE (GabbleBytestreamFactory, gabble_bytestream_factory,
 /* 6 hours */
 #define PROXIES_LIST_LIFE_TIME 6 * 60 * 60
 
+/* How many bytes of IBB data may be waiting for acks across the whole
+ * connection. Anything we send queues behind IBB data on the way to the
+ * server, so this is what keeps presences and messages from being held up by
+ * file transfers. The limit halves, down to IBB_MIN_IN_FLIGHT, when the server
+ * tells us to slow down, and creeps back up by IBB_IN_FLIGHT_STEP per ack. */
+#define IBB_MAX_IN_FLIGHT (64 * 1024)
+#define IBB_MIN_IN_FLIGHT (8 * 1024)
+#define IBB_IN_FLIGHT_STEP 512
+
 /* properties */
 enum
 {
@@ -181,6 +191,17 @@ struct _GabbleBytestreamFactoryPrivate
   /* Time stamp of the proxies list received from TELEPATHY_PROXIES_SERVICE */
   GTimeVal proxies_list_stamp;
 
+  /* How well the proxies we know about have worked, kept across
+   * connections; created once we're connected */
+  GabbleSocks5ProxyCache *proxy_cache;
+  /* TRUE once we've had to look for proxies on this connection, rather
+   * than making do with fresh ones from the cache */
+  gboolean looked_for_proxies;
+
+  /* IBB payload bytes sent and not yet acked, and the current limit on that */
+  gsize ibb_in_flight;
+  gsize ibb_max_in_flight;
+
   gboolean dispose_has_run;
 };
 
@@ -232,6 +253,10 @@ gabble_bytestream_factory_init (GabbleBytestreamFactory *self)
       bytestream_id_equal, bytestream_id_free, g_object_unref);
 
   memset (&priv->proxies_list_stamp, 0, sizeof (GTimeVal));
+
+  priv->ibb_max_in_flight = IBB_MAX_IN_FLIGHT;
+
+  gabble_bytestream_socks5_stats_init ();
 }
 
 static gint
@@ -245,6 +270,23 @@ cmp_proxy (gconstpointer a,
   return strcmp (proxy_a->jid, proxy_b->jid);
 }
 
+static gint
+cmp_proxy_cost (gconstpointer a,
+    gconstpointer b,
+    gpointer user_data)
+{
+  GabbleSocks5ProxyCache *cache = user_data;
+  gint64 cost_a = gabble_socks5_proxy_cache_get_cost (cache,
+      ((const GabbleSocks5Proxy *) a)->jid);
+  gint64 cost_b = gabble_socks5_proxy_cache_get_cost (cache,
+      ((const GabbleSocks5Proxy *) b)->jid);
+
+  if (cost_a < cost_b)
+    return -1;
+
+  return (cost_a > cost_b);
+}
+
 static void
 add_proxy_to_list (GabbleBytestreamFactory *self,
     GabbleSocks5Proxy *proxy,
@@ -350,6 +392,10 @@ socks5_proxy_query_reply_cb (GabbleConnection *conn,
 
   add_proxy_to_list (self , proxy, fallback);
 
+  if (priv->proxy_cache != NULL)
+    gabble_socks5_proxy_cache_add (priv->proxy_cache, jid, host, port,
+        fallback);
+
   return;
 
 fail:
@@ -402,10 +448,22 @@ disco_item_found_cb (GabbleDisco *disco,
                      GabbleDiscoItem *item,
                      GabbleBytestreamFactory *self)
 {
+  GabbleBytestreamFactoryPrivate *priv = self->priv;
+
   if (tp_strdiff (item->category, "proxy") ||
       tp_strdiff (item->type, "bytestreams"))
     return;
 
+  /* We offered it as soon as we connected; it'll be asked again once the
+   * cache entry has gone stale */
+  if (priv->proxy_cache != NULL &&
+      gabble_socks5_proxy_cache_is_fresh (priv->proxy_cache, item->jid))
+    {
+      DEBUG ("%s is a proxy we've seen recently; not asking it again",
+          item->jid);
+      return;
+    }
+
   send_proxy_query (self, item->jid, FALSE);
 }
 
@@ -507,8 +565,34 @@ gabble_bytestream_factory_query_socks5_proxies (GabbleBytestreamFactory *self)
       self);
   guint nb_proxies_found;
   guint nb_proxies_needed;
+  guint nb_fresh = 0;
+  GSList *l;
   GTimeVal now;
 
+  /* If the cache gave us enough proxies which have worked recently, there's
+   * no need to look for more, or even to fetch the list of them. Once
+   * they've gone stale or failed we do, and from then on we keep asking
+   * one more each time, as ever, to keep the cache up to date. */
+  if (!priv->looked_for_proxies && priv->proxy_cache != NULL)
+    {
+      for (l = priv->socks5_proxies; l != NULL; l = l->next)
+        nb_fresh += gabble_socks5_proxy_cache_is_fresh (priv->proxy_cache,
+            ((GabbleSocks5Proxy *) l->data)->jid);
+
+      for (l = priv->socks5_fallback_proxies; l != NULL; l = l->next)
+        nb_fresh += gabble_socks5_proxy_cache_is_fresh (priv->proxy_cache,
+            ((GabbleSocks5Proxy *) l->data)->jid);
+
+      if (nb_fresh >= NB_MIN_SOCKS5_PROXIES)
+        {
+          DEBUG ("%u cached proxies have worked recently; not looking for "
+              "more", nb_fresh);
+          return;
+        }
+    }
+
+  priv->looked_for_proxies = TRUE;
+
   if (priv->socks5_potential_proxies == NULL)
     {
       DEBUG ("No proxies list; request one");
@@ -607,6 +691,36 @@ porter_available_cb (
       NULL);
 }
 
+/* Offer the proxies which worked last time straight away, rather than
+ * waiting for them to be discovered again */
+static void
+load_cached_proxies (GabbleBytestreamFactory *self)
+{
+  GabbleBytestreamFactoryPrivate *priv = self->priv;
+  TpBaseConnection *base = TP_BASE_CONNECTION (priv->conn);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  GList *usable, *l;
+
+  priv->proxy_cache = gabble_socks5_proxy_cache_new (tp_handle_inspect (
+        contact_repo, tp_base_connection_get_self_handle (base)));
+
+  usable = gabble_socks5_proxy_cache_get_usable (priv->proxy_cache);
+
+  /* add_proxy_to_list() prepends, so add the best ones last */
+  for (l = g_list_last (usable); l != NULL; l = l->prev)
+    {
+      GabbleSocks5ProxyRecord *record = l->data;
+
+      DEBUG ("Using cached SOCKS5 proxy %s (%s:%u)", record->jid,
+          record->host, record->port);
+      add_proxy_to_list (self, gabble_socks5_proxy_new (record->jid,
+            record->host, record->port), record->fallback);
+    }
+
+  g_list_free (usable);
+}
+
 static void
 conn_status_changed_cb (GabbleConnection *conn,
                         TpConnectionStatus status,
@@ -639,6 +753,9 @@ conn_status_changed_cb (GabbleConnection *conn,
       priv->next_query = priv->socks5_potential_proxies;
 
       g_strfreev (jids);
+
+      if (priv->proxy_cache == NULL)
+        load_cached_proxies (self);
     }
 }
 
@@ -723,6 +840,9 @@ gabble_bytestream_factory_dispose (GObject *object)
   g_slist_free (priv->socks5_potential_proxies);
   priv->socks5_potential_proxies = NULL;
 
+  tp_clear_pointer (&priv->proxy_cache, gabble_socks5_proxy_cache_free);
+  gabble_bytestream_socks5_stats_finalize ();
+
   if (G_OBJECT_CLASS (gabble_bytestream_factory_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_bytestream_factory_parent_class)->dispose (object);
 }
@@ -835,6 +955,18 @@ remove_bytestream (GabbleBytestreamFactory *self,
   g_free (bsid.jid);
 }
 
+/* Whether the user turned on carrying data in-band while SOCKS5 connects */
+static gboolean
+bytestream_factory_allows_parallel (GabbleBytestreamFactory *self)
+{
+  GabbleBytestreamFactoryPrivate *priv =
+      GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (self);
+  gboolean parallel;
+
+  g_object_get (priv->conn, "parallel-bytestreams", &parallel, NULL);
+  return parallel;
+}
+
 /**
  * streaminit_parse_request
  *
@@ -853,7 +985,8 @@ streaminit_parse_request (WockyStanza *message,
                           const gchar **stream_init_id,
                           const gchar **mime_type,
                           GSList **stream_methods,
-                          gboolean *multiple)
+                          gboolean *multiple,
+                          gboolean *parallel)
 {
   WockyNode *iq = wocky_stanza_get_top_node (message);
   WockyNode *feature, *x, *si_multiple, *field;
@@ -963,6 +1096,9 @@ streaminit_parse_request (WockyStanza *message,
   else
     *multiple = TRUE;
 
+  *parallel = (si_multiple != NULL &&
+      wocky_node_get_child (si_multiple, "parallel") != NULL);
+
   return TRUE;
 }
 
@@ -1032,7 +1168,7 @@ static GabbleBytestreamMultiple *gabble_bytestream_factory_create_multiple (
     GabbleBytestreamFactory *self, TpHandle peer_handle,
     const gchar *stream_id, const gchar *stream_init_id,
     const gchar *peer_resource, const gchar *self_jid,
-    GabbleBytestreamState state);
+    gboolean parallel, GabbleBytestreamState state);
 
 static GabbleBytestreamIBB *gabble_bytestream_factory_create_ibb (
     GabbleBytestreamFactory *fac, TpHandle peer_handle, const gchar *stream_id,
@@ -1132,7 +1268,7 @@ bytestream_factory_iq_si_cb (
   GSList *l;
   const gchar *profile, *from, *stream_id, *stream_init_id, *mime_type;
   GSList *stream_methods = NULL;
-  gboolean multiple;
+  gboolean multiple, parallel;
   gchar *peer_resource = NULL;
   gchar *self_jid = NULL;
 
@@ -1144,13 +1280,19 @@ bytestream_factory_iq_si_cb (
    * it or send an error reply */
 
   if (!streaminit_parse_request (msg, si, &profile, &from, &stream_id,
-        &stream_init_id, &mime_type, &stream_methods, &multiple))
+        &stream_init_id, &mime_type, &stream_methods, &multiple, &parallel))
     {
       wocky_porter_send_iq_error (porter, msg,
           WOCKY_XMPP_ERROR_BAD_REQUEST, "failed to parse SI request");
       goto out;
     }
 
+  if (parallel && !bytestream_factory_allows_parallel (self))
+    {
+      DEBUG ("peer asked for IBB and SOCKS5 in parallel but it's disabled");
+      parallel = FALSE;
+    }
+
   DEBUG ("received a SI request");
 
   room_handle = gabble_get_room_handle_from_jid (room_repo, from);
@@ -1211,7 +1353,7 @@ bytestream_factory_iq_si_cb (
 
       bytestream = (GabbleBytestreamIface *)
           gabble_bytestream_factory_create_multiple (self, peer_handle,
-            stream_id, stream_init_id, peer_resource, self_jid,
+            stream_id, stream_init_id, peer_resource, self_jid, parallel,
             GABBLE_BYTESTREAM_STATE_LOCAL_PENDING);
     }
 
@@ -1852,6 +1994,7 @@ gabble_bytestream_factory_create_multiple (GabbleBytestreamFactory *self,
                                            const gchar *stream_init_id,
                                            const gchar *peer_resource,
                                            const gchar *self_jid,
+                                           gboolean parallel,
                                            GabbleBytestreamState state)
 {
   GabbleBytestreamFactoryPrivate *priv;
@@ -1870,6 +2013,7 @@ gabble_bytestream_factory_create_multiple (GabbleBytestreamFactory *self,
       "peer-resource", peer_resource,
       "factory", self,
       "self-jid", self_jid,
+      "parallel", parallel,
       NULL);
 
   gabble_signal_connect_weak (multiple, "state-changed",
@@ -1904,8 +2048,10 @@ streaminit_get_multiple_bytestream (GabbleBytestreamFactory *self,
   if (si_multi == NULL)
     return NULL;
 
+  /* The receiver only echoes <parallel/> if it will use both methods */
   bytestream = gabble_bytestream_factory_create_multiple (self, peer_handle,
       stream_id, NULL, peer_resource, self_jid,
+      wocky_node_get_child (si_multi, "parallel") != NULL,
       GABBLE_BYTESTREAM_STATE_INITIATING);
 
   wocky_node_iter_init (&i, si_multi, "value", NULL);
@@ -2148,7 +2294,9 @@ END:
  * @object: the handler will follow the lifetime of this object,
  * which means that if the object is destroyed the callback will not be invoked.
  *
- * Send a Stream Initiation (XEP-0095) request.
+ * Send a Stream Initiation (XEP-0095) request. If the connection's
+ * parallel-bytestreams parameter is set, the receiver is asked to let IBB
+ * carry the data while SOCKS5 is being set up.
  */
 void
 gabble_bytestream_factory_negotiate_stream (GabbleBytestreamFactory *self,
@@ -2168,6 +2316,21 @@ gabble_bytestream_factory_negotiate_stream (GabbleBytestreamFactory *self,
 
   priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (self);
 
+  if (bytestream_factory_allows_parallel (self))
+    {
+      WockyNode *si, *si_multiple = NULL;
+
+      si = wocky_node_get_child_ns (wocky_stanza_get_top_node (msg), "si",
+          NS_SI);
+
+      if (si != NULL)
+        si_multiple = wocky_node_get_child_ns (si, "si-multiple",
+            NS_SI_MULTIPLE);
+
+      if (si_multiple != NULL)
+        wocky_node_add_child (si_multiple, "parallel");
+    }
+
   data = g_slice_new (struct _streaminit_reply_cb_data);
   data->self = g_object_ref (self);
   data->stream_id = g_strdup (stream_id);
@@ -2220,6 +2383,8 @@ gabble_bytestream_factory_make_accept_iq (const gchar *full_jid,
  * @full_jid: the full jid of the stream initiator
  * @stream_init_id: the id of the SI request
  * @stream_methods: a list of the accepted string methods
+ * @parallel: whether we'll use IBB and SOCKS5 at the same time, as the
+ *  initiator asked
  *
  * Create an IQ stanza accepting a stream in response to
  * a si-multiple SI request.
@@ -2228,7 +2393,8 @@ gabble_bytestream_factory_make_accept_iq (const gchar *full_jid,
 WockyStanza *
 gabble_bytestream_factory_make_multi_accept_iq (const gchar *full_jid,
                                                 const gchar *stream_init_id,
-                                                GList *stream_methods)
+                                                GList *stream_methods,
+                                                gboolean parallel)
 {
   WockyStanza *msg;
   WockyNode *multi_node;
@@ -2250,6 +2416,9 @@ gabble_bytestream_factory_make_multi_accept_iq (const gchar *full_jid,
       wocky_node_add_child_with_content (multi_node, "value", l->data);
     }
 
+  if (parallel)
+    wocky_node_add_child (multi_node, "parallel");
+
   return msg;
 }
 
@@ -2258,7 +2427,143 @@ gabble_bytestream_factory_get_socks5_proxies (GabbleBytestreamFactory *self)
 {
   GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
       self);
-
-  return g_slist_concat (g_slist_copy (priv->socks5_proxies),
+  GSList *proxies = g_slist_concat (g_slist_copy (priv->socks5_proxies),
       g_slist_copy (priv->socks5_fallback_proxies));
+
+  if (priv->proxy_cache == NULL)
+    return proxies;
+
+  /* Best first. The sort is stable, so proxies we know nothing about keep
+   * their places relative to each other. */
+  return g_slist_sort_with_data (proxies, cmp_proxy_cost, priv->proxy_cache);
+}
+
+/*
+ * gabble_bytestream_factory_lookup_socks5_proxy:
+ *
+ * Returns: (transfer none): what we know about @jid as a relay, or %NULL if
+ *  it isn't one of our proxies
+ */
+const GabbleSocks5ProxyRecord *
+gabble_bytestream_factory_lookup_socks5_proxy (GabbleBytestreamFactory *self,
+    const gchar *jid)
+{
+  GabbleBytestreamFactoryPrivate *priv = self->priv;
+
+  if (priv->proxy_cache == NULL)
+    return NULL;
+
+  return gabble_socks5_proxy_cache_lookup (priv->proxy_cache, jid);
+}
+
+/*
+ * gabble_bytestream_factory_report_socks5_proxy_connect:
+ * @latency: how long it took to get through the proxy, in microseconds;
+ *  ignored unless @success is %TRUE
+ *
+ * Called by SOCKS5 bytestreams whenever they've tried to use @jid as a relay,
+ * which may or may not be one of our proxies.
+ */
+void
+gabble_bytestream_factory_report_socks5_proxy_connect (
+    GabbleBytestreamFactory *self,
+    const gchar *jid,
+    gboolean success,
+    gint64 latency)
+{
+  GabbleBytestreamFactoryPrivate *priv = self->priv;
+
+  if (priv->proxy_cache != NULL)
+    gabble_socks5_proxy_cache_record_connect (priv->proxy_cache, jid,
+        success, latency);
+}
+
+/*
+ * gabble_bytestream_factory_report_socks5_proxy_transfer:
+ * @duration: how long @bytes took to move through @jid, in microseconds,
+ *  not counting any time the stream was idle
+ *
+ * Called by SOCKS5 bytestreams which used @jid as a relay when they're closed.
+ */
+void
+gabble_bytestream_factory_report_socks5_proxy_transfer (
+    GabbleBytestreamFactory *self,
+    const gchar *jid,
+    guint64 bytes,
+    gint64 duration)
+{
+  GabbleBytestreamFactoryPrivate *priv = self->priv;
+
+  if (priv->proxy_cache != NULL)
+    gabble_socks5_proxy_cache_record_transfer (priv->proxy_cache, jid, bytes,
+        duration);
+}
+
+/*
+ * gabble_bytestream_factory_ibb_reserve:
+ *
+ * Called by IBB bytestreams before sending @bytes of data. Returns FALSE if
+ * the connection has too much IBB data in flight already, in which case the
+ * bytestream will be told to try again by
+ * gabble_bytestream_ibb_headroom_available(). Something can always be sent if
+ * nothing else is in flight, however big it is.
+ */
+gboolean
+gabble_bytestream_factory_ibb_reserve (GabbleBytestreamFactory *self,
+    gsize bytes)
+{
+  GabbleBytestreamFactoryPrivate *priv = self->priv;
+
+  if (priv->ibb_in_flight > 0 &&
+      priv->ibb_in_flight + bytes > priv->ibb_max_in_flight)
+    return FALSE;
+
+  priv->ibb_in_flight += bytes;
+  return TRUE;
+}
+
+/*
+ * gabble_bytestream_factory_ibb_release:
+ * @congested: %TRUE if the server refused the data because we're sending too
+ *  fast
+ *
+ * Called by IBB bytestreams when @bytes they reserved have been acked, or
+ * will never be.
+ */
+void
+gabble_bytestream_factory_ibb_release (GabbleBytestreamFactory *self,
+    gsize bytes,
+    gboolean congested)
+{
+  GabbleBytestreamFactoryPrivate *priv = self->priv;
+  GList *streams, *l;
+
+  g_assert (bytes <= priv->ibb_in_flight);
+  priv->ibb_in_flight -= bytes;
+
+  if (congested)
+    {
+      priv->ibb_max_in_flight = MAX (priv->ibb_max_in_flight / 2,
+          IBB_MIN_IN_FLIGHT);
+      DEBUG ("server is congested; allowing %" G_GSIZE_FORMAT
+          " bytes of IBB data in flight", priv->ibb_max_in_flight);
+    }
+  else if (priv->ibb_max_in_flight < IBB_MAX_IN_FLIGHT)
+    {
+      priv->ibb_max_in_flight = MIN (
+          priv->ibb_max_in_flight + IBB_IN_FLIGHT_STEP, IBB_MAX_IN_FLIGHT);
+    }
+
+  if (priv->dispose_has_run ||
+      priv->ibb_in_flight >= priv->ibb_max_in_flight)
+    return;
+
+  /* Waking a bytestream up can close it and so remove it from the table */
+  streams = g_hash_table_get_values (priv->ibb_bytestreams);
+  g_list_foreach (streams, (GFunc) g_object_ref, NULL);
+
+  for (l = streams; l != NULL; l = l->next)
+    gabble_bytestream_ibb_headroom_available (l->data);
+
+  g_list_free_full (streams, g_object_unref);
 }
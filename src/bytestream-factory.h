@@ -29,6 +29,7 @@
 #include "bytestream-multiple.h"
 #include "bytestream-socks5.h"
 #include "connection.h"
+#include "socks5-proxy-cache.h"
 
 G_BEGIN_DECLS
 
@@ -95,7 +96,7 @@ WockyStanza *gabble_bytestream_factory_make_accept_iq (const gchar *full_jid,
 
 WockyStanza *gabble_bytestream_factory_make_multi_accept_iq (
     const gchar *full_jid, const gchar *stream_init_id,
-    GList *stream_methods);
+    GList *stream_methods, gboolean parallel);
 
 void gabble_bytestream_factory_negotiate_stream (
     GabbleBytestreamFactory *fac, WockyStanza *msg, const gchar *stream_id,
@@ -110,6 +111,20 @@ GSList *gabble_bytestream_factory_get_socks5_proxies (
 void gabble_bytestream_factory_query_socks5_proxies (
     GabbleBytestreamFactory *self);
 
+const GabbleSocks5ProxyRecord *gabble_bytestream_factory_lookup_socks5_proxy (
+    GabbleBytestreamFactory *self, const gchar *jid);
+void gabble_bytestream_factory_report_socks5_proxy_connect (
+    GabbleBytestreamFactory *self, const gchar *jid, gboolean success,
+    gint64 latency);
+void gabble_bytestream_factory_report_socks5_proxy_transfer (
+    GabbleBytestreamFactory *self, const gchar *jid, guint64 bytes,
+    gint64 duration);
+
+gboolean gabble_bytestream_factory_ibb_reserve (GabbleBytestreamFactory *self,
+    gsize bytes);
+void gabble_bytestream_factory_ibb_release (GabbleBytestreamFactory *self,
+    gsize bytes, gboolean congested);
+
 G_END_DECLS
 
 #endif /* #ifndef __BYTESTREAM_FACTORY_H__ */
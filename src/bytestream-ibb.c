@@ -29,12 +29,14 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_BYTESTREAM
 
+#include "base64.h"
 #include "bytestream-factory.h"
 #include "bytestream-iface.h"
 #include "connection.h"
 #include "conn-util.h"
 #include "debug.h"
 #include "disco.h"
+#include "metrics.h"
 #include "namespaces.h"
 #include "util.h"
 
@@ -64,9 +66,34 @@ enum
 
 #define READ_BUFFER_MAX_SIZE (512 * 1024)
 
-/* the number of not acked stanzas allowed. Once this number reached, we stop
- * sending and wait for acks. */
-#define WINDOW_SIZE 10
+/* The number of not acked stanzas allowed. Once this number is reached, we
+ * stop sending and wait for acks. It starts at IBB_WINDOW_INITIAL and grows by
+ * one for each window's worth of acks, up to IBB_WINDOW_MAX. When acks start
+ * taking more than IBB_RTT_INFLATION times as long as the quickest one we've
+ * seen (plus IBB_RTT_SLACK microseconds, to ignore jitter on fast links),
+ * something between us and the peer is queueing our data, so the window
+ * halves; once it's at IBB_WINDOW_MIN, we send smaller stanzas instead,
+ * down to IBB_BLOCK_SIZE_MIN bytes. */
+#define IBB_WINDOW_INITIAL 10
+#define IBB_WINDOW_MIN 1
+#define IBB_WINDOW_MAX 64
+#define IBB_RTT_INFLATION 3
+#define IBB_RTT_SLACK (50 * 1000)
+#define IBB_BLOCK_SIZE_MIN 1024
+
+/* One of our data stanzas waiting for its ack */
+typedef struct {
+  /* counts every stanza we send; unlike seq, doesn't wrap */
+  guint64 index;
+  gsize len;
+  gint64 sent_at;
+} SentStanza;
+
+static void
+sent_stanza_free (SentStanza *sent)
+{
+  g_slice_free (SentStanza, sent);
+}
 
 struct _GabbleBytestreamIBBPrivate
 {
@@ -90,12 +117,29 @@ struct _GabbleBytestreamIBBPrivate
   /* list of reffed (WockyStanza *) */
   GSList *received_stanzas_not_acked;
 
-  /* (WockyStanza *) -> TRUE
+  /* (WockyStanza *) -> owned SentStanza
    * We don't keep a ref on the WockyStanza as we just use this table to track
    * stanzas waiting for reply. The stanza is never used (and so deferenced). */
   GHashTable *sent_stanzas_not_acked;
   GString *write_buffer;
   gboolean write_blocked;
+  /* Reused for the base64 encoding of each stanza we send */
+  GString *encode_buffer;
+  /* TRUE if we have data to send but the connection has too much IBB data in
+   * flight already; see gabble_bytestream_factory_ibb_reserve() */
+  gboolean waiting_for_headroom;
+
+  /* Congestion control; see IBB_WINDOW_INITIAL */
+  guint window;
+  guint send_block_size;
+  guint acks_since_growth;
+  guint64 next_index;
+  /* Don't shrink the window again because of stanzas sent before this one,
+   * as they were sent before it last shrank */
+  guint64 recovery_index;
+  GabbleBytestreamIBBStats stats;
+  gint64 first_sent_at;
+  gint64 last_acked_at;
 
   gboolean dispose_has_run;
 };
@@ -113,10 +157,44 @@ gabble_bytestream_ibb_init (GabbleBytestreamIBB *self)
   priv->read_buffer = NULL;
   priv->received_stanzas_not_acked = NULL;
 
-  priv->sent_stanzas_not_acked = g_hash_table_new (g_direct_hash,
-      g_direct_equal);
+  priv->sent_stanzas_not_acked = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) sent_stanza_free);
   priv->write_buffer = NULL;
   priv->write_blocked = FALSE;
+  priv->encode_buffer = g_string_new (NULL);
+  priv->window = IBB_WINDOW_INITIAL;
+}
+
+static void
+ibb_release (GabbleBytestreamIBB *self,
+    gsize len,
+    gboolean congested)
+{
+  GabbleBytestreamFactory *factory = self->priv->conn->bytestream_factory;
+
+  if (factory != NULL)
+    gabble_bytestream_factory_ibb_release (factory, len, congested);
+}
+
+/* We won't hear about whatever's still in flight, so stop counting it
+ * against the connection */
+static void
+ibb_release_all (GabbleBytestreamIBB *self)
+{
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+  GHashTableIter iter;
+  gpointer value;
+  gsize len = 0;
+
+  g_hash_table_iter_init (&iter, priv->sent_stanzas_not_acked);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    len += ((SentStanza *) value)->len;
+
+  g_hash_table_remove_all (priv->sent_stanzas_not_acked);
+
+  if (len > 0)
+    ibb_release (self, len, FALSE);
 }
 
 static void
@@ -142,6 +220,20 @@ gabble_bytestream_ibb_dispose (GObject *object)
       priv->close_iq_to_ack = NULL;
     }
 
+  if (priv->stats.bytes_sent > 0)
+    {
+      GabbleBytestreamIBBStats stats;
+
+      gabble_bytestream_ibb_get_stats (self, &stats);
+      DEBUG ("%" G_GUINT64_FORMAT " bytes acked at %" G_GUINT64_FORMAT
+          " bytes/s; RTT %" G_GINT64_FORMAT " us (min %" G_GINT64_FORMAT
+          " us); final window %u stanzas of %u bytes", stats.bytes_acked,
+          stats.throughput, stats.srtt, stats.min_rtt, stats.window,
+          stats.block_size);
+    }
+
+  ibb_release_all (self);
+
   G_OBJECT_CLASS (gabble_bytestream_ibb_parent_class)->dispose (object);
 }
 
@@ -162,6 +254,7 @@ gabble_bytestream_ibb_finalize (GObject *object)
   if (priv->write_buffer != NULL)
     g_string_free (priv->write_buffer, TRUE);
 
+  g_string_free (priv->encode_buffer, TRUE);
   g_hash_table_unref (priv->sent_stanzas_not_acked);
 
   G_OBJECT_CLASS (gabble_bytestream_ibb_parent_class)->finalize (object);
@@ -252,6 +345,7 @@ gabble_bytestream_ibb_set_property (GObject *object,
         break;
       case PROP_BLOCK_SIZE:
         priv->block_size = g_value_get_uint (value);
+        priv->send_block_size = priv->block_size;
         break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -399,6 +493,60 @@ send_close_stanza (GabbleBytestreamIBB *self)
 static guint
 send_data (GabbleBytestreamIBB *self, const gchar *str, guint len);
 
+static void flush_write_buffer (GabbleBytestreamIBB *self);
+
+static void
+ibb_ack_received (GabbleBytestreamIBB *self,
+    const SentStanza *sent)
+{
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+  gint64 now = g_get_monotonic_time ();
+  gint64 rtt = now - sent->sent_at;
+
+  priv->stats.bytes_acked += sent->len;
+  priv->last_acked_at = now;
+
+  if (priv->stats.min_rtt == 0 || rtt < priv->stats.min_rtt)
+    priv->stats.min_rtt = rtt;
+
+  if (priv->stats.srtt == 0)
+    priv->stats.srtt = rtt;
+  else
+    priv->stats.srtt = (7 * priv->stats.srtt + rtt) / 8;
+
+  if (priv->stats.srtt >
+      IBB_RTT_INFLATION * priv->stats.min_rtt + IBB_RTT_SLACK)
+    {
+      /* Only back off once per round trip */
+      if (sent->index < priv->recovery_index)
+        return;
+
+      priv->recovery_index = priv->next_index;
+      priv->acks_since_growth = 0;
+
+      if (priv->window > IBB_WINDOW_MIN)
+        priv->window = MAX (priv->window / 2, IBB_WINDOW_MIN);
+      else
+        priv->send_block_size = MAX (priv->send_block_size / 2,
+            MIN (IBB_BLOCK_SIZE_MIN, priv->block_size));
+
+      DEBUG ("RTT is %" G_GINT64_FORMAT " us (min %" G_GINT64_FORMAT
+          " us); backing off to %u stanzas of %u bytes", priv->stats.srtt,
+          priv->stats.min_rtt, priv->window, priv->send_block_size);
+      return;
+    }
+
+  if (++priv->acks_since_growth < priv->window)
+    return;
+
+  priv->acks_since_growth = 0;
+
+  if (priv->send_block_size < priv->block_size)
+    priv->send_block_size = MIN (priv->send_block_size * 2, priv->block_size);
+  else if (priv->window < IBB_WINDOW_MAX)
+    priv->window++;
+}
+
 static void
 iq_reply_cb (
     GObject *source,
@@ -411,6 +559,8 @@ iq_reply_cb (
    * key */
   gpointer sent_msg = tp_weak_ref_get_user_data (weak_ref);
   GabbleBytestreamIBBPrivate *priv;
+  SentStanza sent = { 0, 0, 0 };
+  SentStanza *found;
   GError *error = NULL;
 
   tp_weak_ref_destroy (weak_ref);
@@ -420,21 +570,58 @@ iq_reply_cb (
     return;
 
   priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
-  g_hash_table_remove (priv->sent_stanzas_not_acked, sent_msg);
+
+  /* Not found if we're being disposed and have forgotten about it already */
+  found = g_hash_table_lookup (priv->sent_stanzas_not_acked, sent_msg);
+
+  if (found != NULL)
+    {
+      sent = *found;
+      g_hash_table_remove (priv->sent_stanzas_not_acked, sent_msg);
+    }
 
   if (!conn_util_send_iq_finish (GABBLE_CONNECTION (source), result, NULL, &error))
     {
+      /* The data is lost and IBB can't resend it, but at least make sure
+       * that other bytestreams on this connection slow down */
+      gboolean congested = (error->domain == WOCKY_XMPP_ERROR &&
+          (error->code == WOCKY_XMPP_ERROR_RESOURCE_CONSTRAINT ||
+           error->code == WOCKY_XMPP_ERROR_POLICY_VIOLATION));
+
       DEBUG ("error sending IBB stanza: %s #%u '%s'. Closing the bytestream",
           g_quark_to_string (error->domain), error->code, error->message);
       g_clear_error (&error);
+
       /* FIXME: we should be able to feed this up to the application somehow. */
       gabble_bytestream_iface_close (GABBLE_BYTESTREAM_IFACE (self), NULL);
+
+      if (found != NULL)
+        ibb_release (self, sent.len, congested);
     }
-  else if (priv->write_buffer != NULL)
+  else
+    {
+      if (found != NULL)
+        {
+          ibb_ack_received (self, &sent);
+          ibb_release (self, sent.len, FALSE);
+        }
+
+      flush_write_buffer (self);
+    }
+
+  g_object_unref (self);
+}
+
+static void
+flush_write_buffer (GabbleBytestreamIBB *self)
+{
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+
+  if (priv->write_buffer != NULL)
     {
       guint sent;
 
-      DEBUG ("A stanza has been acked. Try to flush the buffer");
+      DEBUG ("Try to flush the buffer");
 
       sent = send_data (self, priv->write_buffer->str, priv->write_buffer->len);
       if (sent == priv->write_buffer->len)
@@ -462,8 +649,6 @@ iq_reply_cb (
               priv->write_buffer->len);
         }
     }
-
-  g_object_unref (self);
 }
 
 static guint
@@ -479,14 +664,15 @@ send_data (GabbleBytestreamIBB *self,
   while (sent < len)
     {
       WockyStanza *iq;
+      SentStanza *sent_stanza;
       guint send_now, remaining;
-      gchar *seq, *encoded;
+      gchar *seq;
       guint nb_stanzas_waiting;
 
       remaining = (len - sent);
 
       nb_stanzas_waiting = g_hash_table_size (priv->sent_stanzas_not_acked);
-      if (nb_stanzas_waiting >= WINDOW_SIZE)
+      if (nb_stanzas_waiting >= priv->window)
         {
           DEBUG ("Window is full (%u). Stop sending stanzas",
               nb_stanzas_waiting);
@@ -494,10 +680,10 @@ send_data (GabbleBytestreamIBB *self,
         }
 
       /* We can send stanzas */
-      if (remaining > priv->block_size)
+      if (remaining > priv->send_block_size)
         {
           /* We can't send all the remaining data in one stanza */
-          send_now = priv->block_size;
+          send_now = priv->send_block_size;
         }
       else
         {
@@ -505,13 +691,25 @@ send_data (GabbleBytestreamIBB *self,
           send_now = remaining;
         }
 
-      encoded = g_base64_encode ((const guchar *) str + sent, send_now);
+      if (priv->conn->bytestream_factory != NULL &&
+          !gabble_bytestream_factory_ibb_reserve (
+            priv->conn->bytestream_factory, send_now))
+        {
+          DEBUG ("Too much IBB data in flight on this connection. "
+              "Stop sending stanzas");
+          priv->waiting_for_headroom = TRUE;
+          break;
+        }
+
+      g_string_truncate (priv->encode_buffer, 0);
+      gabble_base64_encode_append (priv->encode_buffer,
+          (const guint8 *) str + sent, send_now);
       seq = g_strdup_printf ("%u", priv->seq++);
 
       iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_SET,
           NULL, priv->peer_jid,
           '(', "data",
-            '$', encoded,
+            '$', priv->encode_buffer->str,
             ':', NS_IBB,
             '@', "sid", priv->stream_id,
             '@', "seq", seq,
@@ -520,12 +718,19 @@ send_data (GabbleBytestreamIBB *self,
       conn_util_send_iq_async (priv->conn, iq, NULL,
           iq_reply_cb, tp_weak_ref_new (self, iq, NULL));
 
-      g_free (encoded);
       g_free (seq);
       g_object_unref (iq);
 
-      g_hash_table_insert (priv->sent_stanzas_not_acked, iq,
-          GUINT_TO_POINTER (TRUE));
+      sent_stanza = g_slice_new (SentStanza);
+      sent_stanza->index = priv->next_index++;
+      sent_stanza->len = send_now;
+      sent_stanza->sent_at = g_get_monotonic_time ();
+      g_hash_table_insert (priv->sent_stanzas_not_acked, iq, sent_stanza);
+
+      if (priv->first_sent_at == 0)
+        priv->first_sent_at = sent_stanza->sent_at;
+
+      priv->stats.bytes_sent += send_now;
 
       DEBUG ("send %d bytes (window size: %u)", send_now,
           nb_stanzas_waiting + 1);
@@ -565,6 +770,8 @@ gabble_bytestream_ibb_send (GabbleBytestreamIface *iface,
       DEBUG ("sending data while the bytestream was blocked");
     }
 
+  gabble_metrics_count (GABBLE_METRIC_IBB_BYTES_SENT, len);
+
   if (priv->write_buffer != NULL)
     {
       DEBUG ("Write buffer is not empty. Buffering data");
@@ -607,8 +814,6 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
   GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
   WockyNode *data;
   GString *str;
-  guchar *st;
-  gsize outlen;
   TpHandle sender;
 
   /* caller must have checked for this in order to know which bytestream to
@@ -634,18 +839,12 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
 
   /* FIXME: check sequence number */
 
-  st = g_base64_decode (data->content, &outlen);
-  str = g_string_new_len ((gchar *) st, outlen);
-  g_free (st);
-  if (str == NULL)
-    {
-      DEBUG ("base64 decoding failed");
-      if (is_iq)
-        wocky_porter_send_iq_error (
-            wocky_session_get_porter (priv->conn->session), msg,
-            WOCKY_XMPP_ERROR_BAD_REQUEST, "base64 decoding failed");
-      return;
-    }
+  str = g_string_new (NULL);
+
+  if (data->content != NULL)
+    gabble_base64_decode_append (str, data->content);
+
+  gabble_metrics_count (GABBLE_METRIC_IBB_BYTES_RECEIVED, str->len);
 
   if (priv->read_blocked)
     {
@@ -959,3 +1158,38 @@ bytestream_iface_init (gpointer g_iface,
   klass->accept = gabble_bytestream_ibb_accept;
   klass->block_reading = gabble_bytestream_ibb_block_reading;
 }
+
+/*
+ * gabble_bytestream_ibb_headroom_available:
+ *
+ * Called by the bytestream factory when IBB data in flight on the connection
+ * has been acked, so we can try sending again if that's what we were waiting
+ * for.
+ */
+void
+gabble_bytestream_ibb_headroom_available (GabbleBytestreamIBB *self)
+{
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+
+  if (!priv->waiting_for_headroom)
+    return;
+
+  priv->waiting_for_headroom = FALSE;
+  flush_write_buffer (self);
+}
+
+void
+gabble_bytestream_ibb_get_stats (GabbleBytestreamIBB *self,
+    GabbleBytestreamIBBStats *stats)
+{
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+  gint64 elapsed = priv->last_acked_at - priv->first_sent_at;
+
+  *stats = priv->stats;
+  stats->window = priv->window;
+  stats->block_size = priv->send_block_size;
+  stats->throughput = 0;
+
+  if (priv->first_sent_at != 0 && elapsed > 0)
+    stats->throughput = priv->stats.bytes_acked * G_USEC_PER_SEC / elapsed;
+}
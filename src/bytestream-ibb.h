@@ -65,6 +65,24 @@ void gabble_bytestream_ibb_receive (GabbleBytestreamIBB *ibb,
 void gabble_bytestream_ibb_close_received (GabbleBytestreamIBB *ibb,
     WockyStanza *iq);
 
+void gabble_bytestream_ibb_headroom_available (GabbleBytestreamIBB *self);
+
+typedef struct {
+    guint64 bytes_sent;
+    guint64 bytes_acked;
+    /* acked bytes per second, from sending the first data to the last ack */
+    guint64 throughput;
+    /* smoothed and quickest time for data to be acked, in microseconds */
+    gint64 srtt;
+    gint64 min_rtt;
+    /* current limit on stanzas in flight, and on bytes in each one */
+    guint window;
+    guint block_size;
+} GabbleBytestreamIBBStats;
+
+void gabble_bytestream_ibb_get_stats (GabbleBytestreamIBB *self,
+    GabbleBytestreamIBBStats *stats);
+
 G_END_DECLS
 
 #endif /* #ifndef __GABBLE_BYTESTREAM_IBB_H__ */
@@ -180,6 +180,35 @@ gabble_bytestream_iface_block_reading (GabbleBytestreamIface *self,
   /* else: do nothing. Some bytestreams like IBB can't implement read_block. */
 }
 
+/*
+ * gabble_bytestream_iface_splice
+ *
+ * Asks the bytestream to move data between the peer and @transport by
+ * itself, without going through "data-received" and
+ * gabble_bytestream_iface_send(). Only possible when both ends are plain
+ * sockets with nothing buffered. Once this returns TRUE the caller must not
+ * send data on @transport or @bytestream; @progress is called instead of
+ * "data-received" and the transport handler. Ends are signalled as usual,
+ * by the transport being disconnected or the bytestream closing.
+ *
+ * Returns: TRUE if data is now being spliced
+ */
+gboolean
+gabble_bytestream_iface_splice (GabbleBytestreamIface *self,
+                                GibberTransport *transport,
+                                GabbleBytestreamSpliceProgress progress,
+                                gpointer user_data)
+{
+  gboolean (*virtual_method)(GabbleBytestreamIface *, GibberTransport *,
+      GabbleBytestreamSpliceProgress, gpointer) =
+    GABBLE_BYTESTREAM_IFACE_GET_CLASS (self)->splice;
+
+  if (virtual_method == NULL)
+    return FALSE;
+
+  return virtual_method (self, transport, progress, user_data);
+}
+
 GType
 gabble_bytestream_iface_get_type (void)
 {
@@ -23,6 +23,8 @@
 #include <glib-object.h>
 #include <wocky/wocky.h>
 
+#include <gibber/gibber-transport.h>
+
 G_BEGIN_DECLS
 
 typedef enum
@@ -48,6 +50,12 @@ typedef void (* GabbleBytestreamAugmentSiAcceptReply) (
 typedef struct _GabbleBytestreamIface GabbleBytestreamIface;
 typedef struct _GabbleBytestreamIfaceClass GabbleBytestreamIfaceClass;
 
+/* @received bytes more have gone from the peer to the spliced transport,
+ * and @sent bytes more the other way */
+typedef void (* GabbleBytestreamSpliceProgress) (
+    GabbleBytestreamIface *bytestream, gsize received, gsize sent,
+    gpointer user_data);
+
 struct _GabbleBytestreamIfaceClass {
   GTypeInterface parent;
 
@@ -58,6 +66,10 @@ struct _GabbleBytestreamIfaceClass {
   void (*accept) (GabbleBytestreamIface *bytestream,
       GabbleBytestreamAugmentSiAcceptReply func, gpointer user_data);
   void (*block_reading) (GabbleBytestreamIface *bytestream, gboolean block);
+  /* Optional */
+  gboolean (*splice) (GabbleBytestreamIface *bytestream,
+      GibberTransport *transport, GabbleBytestreamSpliceProgress progress,
+      gpointer user_data);
 };
 
 GType gabble_bytestream_iface_get_type (void);
@@ -88,6 +100,10 @@ void gabble_bytestream_iface_accept (GabbleBytestreamIface *bytestream,
 void gabble_bytestream_iface_block_reading (GabbleBytestreamIface *bytestream,
     gboolean block);
 
+gboolean gabble_bytestream_iface_splice (GabbleBytestreamIface *bytestream,
+    GibberTransport *transport, GabbleBytestreamSpliceProgress progress,
+    gpointer user_data);
+
 G_END_DECLS
 
 #endif /* #ifndef __GABBLE_BYTESTREAM_IFACE_H__ */
@@ -29,11 +29,13 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_BYTESTREAM
 
+#include "base64.h"
 #include "bytestream-factory.h"
 #include "bytestream-iface.h"
 #include "connection.h"
 #include "debug.h"
 #include "disco.h"
+#include "metrics.h"
 #include "namespaces.h"
 #include "util.h"
 
@@ -41,6 +43,15 @@
  * ejabberd's default 64k maximum stanza size */
 #define MAX_BLOCK_SIZE (1024 * 45)
 
+/* Most data we'll buffer for one sender's fragmented message. There's no way
+ * to tell a MUC member to slow down, so anything bigger is dropped. This is
+ * the same limit the D-Bus tubes on top of us have for their queues. */
+#define MAX_REASSEMBLY_SIZE (4096 * 1024)
+
+/* Partial messages are dropped if the next fragment hasn't arrived after this
+ * many seconds */
+#define REASSEMBLY_TIMEOUT 60
+
 static void
 bytestream_iface_init (gpointer g_iface, gpointer iface_data);
 
@@ -70,18 +81,35 @@ struct _GabbleBytestreamMucPrivate
   gchar *stream_id;
   GabbleBytestreamState state;
   const gchar *peer_jid;
-  /* (gchar *): sender's muc-JID -> (GString *): accumulated message data */
+  /* (gchar *): sender's muc-JID -> (Reassembly *) */
   GHashTable *buffers;
+  /* Checks for abandoned messages in @buffers while it's not empty */
+  guint reassembly_timer;
+  /* Reused for the base64 encoding of each stanza we send, and decoding of
+   * unfragmented ones we receive */
+  GString *encode_buffer;
+  GString *decode_buffer;
 
   gboolean dispose_has_run;
 };
 
 #define GABBLE_BYTESTREAM_MUC_GET_PRIVATE(obj) ((obj)->priv)
 
+/* A message someone's sending in fragments */
+typedef struct {
+  GString *data;
+  /* when the last fragment arrived, from g_get_monotonic_time() */
+  gint64 updated;
+  /* the message got too big, so ignore it until the sender starts another
+   * one */
+  gboolean discarding;
+} Reassembly;
+
 static void
-free_buffer (GString *buffer)
+reassembly_free (Reassembly *reassembly)
 {
-  g_string_free (buffer, TRUE);
+  g_string_free (reassembly->data, TRUE);
+  g_slice_free (Reassembly, reassembly);
 }
 
 static void
@@ -92,7 +120,9 @@ gabble_bytestream_muc_init (GabbleBytestreamMuc *self)
 
   self->priv = priv;
   priv->buffers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
-      (GDestroyNotify) free_buffer);
+      (GDestroyNotify) reassembly_free);
+  priv->encode_buffer = g_string_new (NULL);
+  priv->decode_buffer = g_string_new (NULL);
 }
 
 static void
@@ -111,6 +141,12 @@ gabble_bytestream_muc_dispose (GObject *object)
       gabble_bytestream_iface_close (GABBLE_BYTESTREAM_IFACE (self), NULL);
     }
 
+  if (priv->reassembly_timer != 0)
+    {
+      g_source_remove (priv->reassembly_timer);
+      priv->reassembly_timer = 0;
+    }
+
   G_OBJECT_CLASS (gabble_bytestream_muc_parent_class)->dispose (object);
 }
 
@@ -121,6 +157,8 @@ gabble_bytestream_muc_finalize (GObject *object)
   GabbleBytestreamMucPrivate *priv = GABBLE_BYTESTREAM_MUC_GET_PRIVATE (self);
 
   g_free (priv->stream_id);
+  g_string_free (priv->encode_buffer, TRUE);
+  g_string_free (priv->decode_buffer, TRUE);
 
   if (priv->buffers != NULL)
     {
@@ -288,13 +326,13 @@ send_data_to (GabbleBytestreamMuc *self,
       return FALSE;
     }
 
+  gabble_metrics_count (GABBLE_METRIC_MUC_BYTES_SENT, len);
   sent = 0;
   stanza_count = 0;
 
   while (sent < len)
     {
       gboolean ret;
-      gchar *encoded;
       guint send_now;
       GError *error = NULL;
       WockyStanza *msg;
@@ -339,8 +377,10 @@ send_data_to (GabbleBytestreamMuc *self,
             frag = FRAG_LAST;
         }
 
-      encoded = g_base64_encode ((const guchar *) str + sent, send_now);
-      wocky_node_set_content (data, encoded);
+      g_string_truncate (priv->encode_buffer, 0);
+      gabble_base64_encode_append (priv->encode_buffer,
+          (const guint8 *) str + sent, send_now);
+      wocky_node_set_content (data, priv->encode_buffer->str);
 
       switch (frag)
         {
@@ -358,8 +398,6 @@ send_data_to (GabbleBytestreamMuc *self,
       DEBUG ("send %d bytes", send_now);
       ret = _gabble_connection_send (priv->conn, msg, &error);
 
-      g_free (encoded);
-
       if (!ret)
         {
           DEBUG ("error sending pseusdo IBB Muc stanza: %s", error->message);
@@ -395,6 +433,36 @@ gabble_bytestream_muc_send (GabbleBytestreamIface *iface,
   return send_data_to (self, priv->peer_jid, TRUE, len, str);
 }
 
+static gboolean
+reassembly_timeout_cb (gpointer user_data)
+{
+  GabbleBytestreamMuc *self = GABBLE_BYTESTREAM_MUC (user_data);
+  GabbleBytestreamMucPrivate *priv = GABBLE_BYTESTREAM_MUC_GET_PRIVATE (self);
+  gint64 cutoff = g_get_monotonic_time () -
+      REASSEMBLY_TIMEOUT * G_USEC_PER_SEC;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, priv->buffers);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      Reassembly *reassembly = value;
+
+      if (reassembly->updated < cutoff)
+        {
+          DEBUG ("Drop abandoned incomplete buffer of %s", (gchar *) key);
+          g_hash_table_iter_remove (&iter);
+        }
+    }
+
+  if (g_hash_table_size (priv->buffers) > 0)
+    return TRUE;
+
+  priv->reassembly_timer = 0;
+  return FALSE;
+}
+
 void
 gabble_bytestream_muc_receive (GabbleBytestreamMuc *self,
                                WockyStanza *msg)
@@ -404,14 +472,10 @@ gabble_bytestream_muc_receive (GabbleBytestreamMuc *self,
       (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
   const gchar *from;
   WockyNode *data;
-  GString *str;
-  guchar *st;
-  gsize outlen;
   TpHandle sender;
-  GString *buffer;
+  Reassembly *reassembly;
   const gchar *frag_val;
   guint frag;
-  gboolean fully_received = FALSE;
 
   /* caller must have checked for this in order to know which bytestream to
    * route this packet to */
@@ -455,83 +519,102 @@ gabble_bytestream_muc_receive (GabbleBytestreamMuc *self,
       return;
     }
 
-  st = g_base64_decode (data->content, &outlen);
-  str = g_string_new_len ((const gchar *) st, outlen);
-  g_free (st);
-  if (str == NULL)
+  if (frag == FRAG_COMPLETE)
     {
-      DEBUG ("base64 decoding failed");
-      return;
-    }
+      if (g_hash_table_remove (priv->buffers, from))
+        DEBUG ("Drop incomplete buffer of %s. "
+            "Received new unfragmented data", from);
 
-  buffer = g_hash_table_lookup (priv->buffers, from);
+      g_string_truncate (priv->decode_buffer, 0);
 
-  if (frag == FRAG_COMPLETE)
-    {
-      if (buffer != NULL)
-        {
-          DEBUG ("Drop incomplete buffer of %s. "
-              "Received new unfragmented data", from);
-          g_hash_table_remove (priv->buffers, from);
-        }
+      if (data->content != NULL)
+        gabble_base64_decode_append (priv->decode_buffer, data->content);
 
-      fully_received = TRUE;
+      DEBUG ("fully received %" G_GSIZE_FORMAT " bytes of data",
+          priv->decode_buffer->len);
+      gabble_metrics_count (GABBLE_METRIC_MUC_BYTES_RECEIVED,
+          priv->decode_buffer->len);
+      g_signal_emit_by_name (G_OBJECT (self), "data-received", sender,
+          priv->decode_buffer);
+      return;
     }
 
-  else if (frag == FRAG_FIRST)
+  reassembly = g_hash_table_lookup (priv->buffers, from);
+
+  if (frag == FRAG_FIRST)
     {
-      if (buffer != NULL)
+      if (reassembly != NULL)
         {
           DEBUG ("Drop incomplete buffer of %s. "
               "Received first part of new data", from);
-          g_hash_table_remove (priv->buffers, from);
+          g_string_truncate (reassembly->data, 0);
+          reassembly->discarding = FALSE;
         }
       else
         {
           DEBUG ("New buffer for %s", from);
+          reassembly = g_slice_new0 (Reassembly);
+          /* this fragment, and at least one more */
+          reassembly->data = g_string_sized_new (2 * MAX_BLOCK_SIZE);
+          g_hash_table_insert (priv->buffers, g_strdup (from), reassembly);
+
+          if (priv->reassembly_timer == 0)
+            priv->reassembly_timer = g_timeout_add_seconds (
+                REASSEMBLY_TIMEOUT, reassembly_timeout_cb, self);
         }
-
-      g_hash_table_insert (priv->buffers, g_strdup (from), str);
     }
+  else if (reassembly == NULL)
+    {
+      DEBUG ("Drop %s part stanza from %s, first parts not buffered",
+          frag_val, from);
+      return;
+    }
+
+  reassembly->updated = g_get_monotonic_time ();
 
-  else if (frag == FRAG_MIDDLE)
+  if (!reassembly->discarding && data->content != NULL)
     {
-      if (buffer == NULL)
+      gsize max_len = reassembly->data->len +
+          GABBLE_BASE64_DECODED_MAX_SIZE (strlen (data->content));
+
+      if (max_len > MAX_REASSEMBLY_SIZE)
         {
-          DEBUG ("Drop middle part stanza from %s, first parts not buffered",
-              from);
+          DEBUG ("Message from %s is too big; ignoring it", from);
+          reassembly->discarding = TRUE;
+          g_string_free (reassembly->data, TRUE);
+          reassembly->data = g_string_new (NULL);
         }
       else
         {
-          DEBUG ("Append data to buffer of %s (%" G_GSIZE_FORMAT " bytes)", from, str->len);
-          g_string_append_len (buffer, str->str, str->len);
+          /* decode straight into the buffer */
+          gabble_base64_decode_append (reassembly->data, data->content);
+          DEBUG ("Append data to buffer of %s (%" G_GSIZE_FORMAT " bytes)",
+              from, reassembly->data->len);
         }
-
-      g_string_free (str, TRUE);
     }
 
-  else if (frag == FRAG_LAST)
+  if (frag == FRAG_LAST)
     {
-      if (buffer == NULL)
-          {
-            DEBUG ("Drop last part stanza from %s, first parts not buffered",
-                from);
-            g_string_free (str, TRUE);
-          }
-      else
+      gpointer key;
+
+      /* take it out of the table first, in case a data-received handler
+       * closes us */
+      g_hash_table_lookup_extended (priv->buffers, from, &key, NULL);
+      g_hash_table_steal (priv->buffers, from);
+
+      if (!reassembly->discarding)
         {
           DEBUG ("Received last part from %s, buffer flushed", from);
-          g_string_prepend_len (str, buffer->str, buffer->len);
-          g_hash_table_remove (priv->buffers, from);
-          fully_received = TRUE;
+          DEBUG ("fully received %" G_GSIZE_FORMAT " bytes of data",
+              reassembly->data->len);
+          gabble_metrics_count (GABBLE_METRIC_MUC_BYTES_RECEIVED,
+              reassembly->data->len);
+          g_signal_emit_by_name (G_OBJECT (self), "data-received", sender,
+              reassembly->data);
         }
-    }
 
-  if (fully_received)
-    {
-      DEBUG ("fully received %" G_GSIZE_FORMAT " bytes of data", str->len);
-      g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, str);
-      g_string_free (str, TRUE);
+      g_free (key);
+      reassembly_free (reassembly);
     }
 }
 
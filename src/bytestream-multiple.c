@@ -20,6 +20,8 @@
 #include "config.h"
 #include "bytestream-multiple.h"
 
+#include <string.h>
+
 #include <dbus/dbus-glib.h>
 #include <dbus/dbus-glib-lowlevel.h>
 
@@ -59,9 +61,20 @@ enum
   PROP_PROTOCOL,
   PROP_FACTORY,
   PROP_SELF_JID,
+  PROP_PARALLEL,
   LAST_PROPERTY
 };
 
+/* In parallel mode, the first thing each side sends through SOCKS5 is how
+ * many bytes it sent in-band before switching, as a big-endian 64-bit
+ * integer. Anything arriving over SOCKS5 is held back until the peer's
+ * in-band data has caught up with that. */
+#define SWITCH_HEADER_SIZE 8
+
+/* Stop reading from SOCKS5 if this much is waiting for in-band data which
+ * hasn't arrived yet */
+#define PENDING_MAX_SIZE (256 * 1024)
+
 struct _GabbleBytestreamMultiplePrivate
 {
   GabbleConnection *conn;
@@ -79,12 +92,34 @@ struct _GabbleBytestreamMultiplePrivate
   GabbleBytestreamIface *active_bytestream;
   gboolean read_blocked;
 
+  /* Whether to run IBB and SOCKS5 side by side; requested by the initiator
+   * and confirmed by the target when accepting */
+  gboolean parallel;
+  gboolean parallel_started;
+  /* IBB, used until SOCKS5 is open; either can be NULL once it failed */
+  GabbleBytestreamIface *carrier;
+  /* SOCKS5 */
+  GabbleBytestreamIface *preferred;
+  guint64 carrier_sent;
+  guint64 carrier_received;
+  gboolean send_switched;
+  gboolean recv_switched;
+  /* what the peer sent in-band before switching, once we know */
+  gboolean switch_offset_known;
+  guint64 switch_offset;
+  /* SOCKS5 data waiting for the in-band data to catch up */
+  GString *pending;
+  gboolean write_blocked;
+
   gboolean dispose_has_run;
 };
 
 #define GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE(obj) ((obj)->priv)
 
 static void bytestream_activate_next (GabbleBytestreamMultiple *self);
+static gboolean bytestream_start_parallel (GabbleBytestreamMultiple *self);
+static void parallel_detach (GabbleBytestreamMultiple *self,
+    GabbleBytestreamIface *bytestream);
 
 static void
 gabble_bytestream_multiple_init (GabbleBytestreamMultiple *self)
@@ -133,6 +168,9 @@ gabble_bytestream_multiple_finalize (GObject *object)
   g_free (priv->peer_jid);
   g_free (priv->self_full_jid);
 
+  if (priv->pending != NULL)
+    g_string_free (priv->pending, TRUE);
+
   G_OBJECT_CLASS (gabble_bytestream_multiple_parent_class)->finalize (object);
 }
 
@@ -181,6 +219,9 @@ gabble_bytestream_multiple_get_property (GObject *object,
       case PROP_SELF_JID:
         g_value_set_string (value, priv->self_full_jid);
         break;
+      case PROP_PARALLEL:
+        g_value_set_boolean (value, priv->parallel);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -231,6 +272,9 @@ gabble_bytestream_multiple_set_property (GObject *object,
         g_free (priv->self_full_jid);
         priv->self_full_jid = g_value_dup_string (value);
         break;
+      case PROP_PARALLEL:
+        priv->parallel = g_value_get_boolean (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -340,6 +384,15 @@ gabble_bytestream_multiple_class_init (
       G_PARAM_CONSTRUCT_ONLY  | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_SELF_JID,
       param_spec);
+
+  param_spec = g_param_spec_boolean (
+      "parallel",
+      "Parallel",
+      "Whether to carry data in-band while SOCKS5 is being set up",
+      FALSE,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_PARALLEL,
+      param_spec);
 }
 
 /*
@@ -363,6 +416,20 @@ gabble_bytestream_multiple_send (GabbleBytestreamIface *iface,
       return FALSE;
     }
 
+  if (priv->parallel_started)
+    {
+      if (priv->send_switched)
+        return gabble_bytestream_iface_send (priv->preferred, len, str);
+
+      g_assert (priv->carrier != NULL);
+
+      if (!gabble_bytestream_iface_send (priv->carrier, len, str))
+        return FALSE;
+
+      priv->carrier_sent += len;
+      return TRUE;
+    }
+
   g_assert (priv->active_bytestream != NULL);
 
   return gabble_bytestream_iface_send (priv->active_bytestream, len, str);
@@ -384,7 +451,7 @@ gabble_bytestream_multiple_accept (GabbleBytestreamIface *iface,
   WockyStanza *msg;
   WockyNode *si;
   GList *all_methods;
-  gchar *current_method;
+  gchar *current_method = NULL;
 
   /* We cannot just call the accept method of the active bytestream because
    * the result stanza is different if we are using si-multiple */
@@ -397,12 +464,29 @@ gabble_bytestream_multiple_accept (GabbleBytestreamIface *iface,
 
   g_return_if_fail (priv->active_bytestream != NULL);
 
+  if (priv->parallel && !bytestream_start_parallel (self))
+    {
+      DEBUG ("peer asked for IBB and SOCKS5 in parallel but we can't use "
+          "both; falling back one at a time");
+      priv->parallel = FALSE;
+    }
+
   all_methods = g_list_copy (priv->fallback_stream_methods);
-  g_object_get (priv->active_bytestream, "protocol", &current_method, NULL);
-  all_methods = g_list_prepend (all_methods, current_method);
+
+  if (priv->parallel)
+    {
+      all_methods = g_list_prepend (all_methods, (gpointer) NS_IBB);
+      all_methods = g_list_prepend (all_methods, (gpointer) NS_BYTESTREAMS);
+    }
+  else
+    {
+      g_object_get (priv->active_bytestream, "protocol", &current_method,
+          NULL);
+      all_methods = g_list_prepend (all_methods, current_method);
+    }
 
   msg = gabble_bytestream_factory_make_multi_accept_iq (priv->peer_jid,
-      priv->stream_init_id, all_methods);
+      priv->stream_init_id, all_methods, priv->parallel);
 
   g_free (current_method);
   g_list_free (all_methods);
@@ -421,8 +505,20 @@ gabble_bytestream_multiple_accept (GabbleBytestreamIface *iface,
     {
       DEBUG ("stream %s with %s is now accepted", priv->stream_id,
           priv->peer_jid);
-      g_object_set (priv->active_bytestream, "state",
-          GABBLE_BYTESTREAM_STATE_ACCEPTED, NULL);
+
+      if (priv->parallel)
+        {
+          /* Only the carrier's state is reflected until one of them opens */
+          g_object_set (priv->preferred, "state",
+              GABBLE_BYTESTREAM_STATE_ACCEPTED, NULL);
+          g_object_set (priv->carrier, "state",
+              GABBLE_BYTESTREAM_STATE_ACCEPTED, NULL);
+        }
+      else
+        {
+          g_object_set (priv->active_bytestream, "state",
+              GABBLE_BYTESTREAM_STATE_ACCEPTED, NULL);
+        }
     }
 
   g_object_unref (msg);
@@ -446,6 +542,30 @@ gabble_bytestream_multiple_close (GabbleBytestreamIface *iface,
      /* bytestream already closed, do nothing */
      return;
 
+  if (priv->parallel_started)
+    {
+      GabbleBytestreamIface *preferred = priv->preferred;
+      GabbleBytestreamIface *carrier = priv->carrier;
+
+      g_object_ref (self);
+
+      if (preferred != NULL)
+        {
+          parallel_detach (self, preferred);
+          gabble_bytestream_iface_close (preferred, error);
+        }
+
+      if (carrier != NULL)
+        {
+          parallel_detach (self, carrier);
+          gabble_bytestream_iface_close (carrier, error);
+        }
+
+      g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_CLOSED, NULL);
+      g_object_unref (self);
+      return;
+    }
+
   if (priv->active_bytestream != NULL)
     gabble_bytestream_iface_close (priv->active_bytestream, error);
   else
@@ -479,6 +599,28 @@ gabble_bytestream_multiple_initiate (GabbleBytestreamIface *iface)
       return FALSE;
     }
 
+  if (priv->parallel && !bytestream_start_parallel (self))
+    {
+      DEBUG ("peer agreed to IBB and SOCKS5 in parallel but didn't offer "
+          "both; falling back one at a time");
+      priv->parallel = FALSE;
+    }
+
+  if (priv->parallel)
+    {
+      gboolean carrier_ok, preferred_ok = FALSE;
+
+      /* Either of them is enough to get the data flowing. Initiating one
+       * can fail synchronously and take the other down with it, so check
+       * again before initiating the second. */
+      carrier_ok = gabble_bytestream_iface_initiate (priv->carrier);
+
+      if (priv->preferred != NULL)
+        preferred_ok = gabble_bytestream_iface_initiate (priv->preferred);
+
+      return carrier_ok || preferred_ok;
+    }
+
   return gabble_bytestream_iface_initiate (priv->active_bytestream);
 }
 
@@ -597,6 +739,361 @@ bytestream_activate_next (GabbleBytestreamMultiple *self)
       G_CALLBACK (bytestream_write_blocked_cb), self);
 }
 
+/*
+ * Parallel mode
+ *
+ * IBB is slow but almost always gets through, while SOCKS5 can take a long
+ * time to fail when no direct path exists. Rather than waiting for that,
+ * both are set up at once: data goes in-band until SOCKS5 is open, then
+ * each side sends a switch header (see SWITCH_HEADER_SIZE) and moves its
+ * outgoing data to SOCKS5. The carrier stays open, idle, until the whole
+ * bytestream is closed.
+ */
+
+static void
+parallel_detach (GabbleBytestreamMultiple *self,
+                 GabbleBytestreamIface *bytestream)
+{
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  g_signal_handlers_disconnect_matched (bytestream, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+
+  /* As with active_bytestream, the factory holds the reference */
+  if (bytestream == priv->carrier)
+    priv->carrier = NULL;
+  else if (bytestream == priv->preferred)
+    priv->preferred = NULL;
+}
+
+static void
+parallel_lost (GabbleBytestreamMultiple *self,
+               GabbleBytestreamIface *bytestream)
+{
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+  gboolean was_carrier = (bytestream == priv->carrier);
+  gboolean recoverable;
+
+  parallel_detach (self, bytestream);
+
+  if (was_carrier)
+    /* Losing the carrier only matters if data might still be in it */
+    recoverable = (priv->state != GABBLE_BYTESTREAM_STATE_OPEN ||
+        (priv->send_switched && priv->recv_switched));
+  else
+    /* Once either side has switched to SOCKS5 there's no going back: the
+     * peer won't resend through the carrier what it sent us after its
+     * switch header, which may still have been on its way */
+    recoverable = (!priv->send_switched && !priv->switch_offset_known &&
+        priv->pending->len == 0);
+
+  if (recoverable && (priv->carrier != NULL || priv->preferred != NULL))
+    {
+      DEBUG ("%s failed; carrying on without it",
+          was_carrier ? "in-band carrier" : "SOCKS5");
+      return;
+    }
+
+  DEBUG ("%s failed; closing", was_carrier ? "in-band carrier" : "SOCKS5");
+  gabble_bytestream_iface_close (GABBLE_BYTESTREAM_IFACE (self), NULL);
+}
+
+static void
+parallel_update_preferred_blocking (GabbleBytestreamMultiple *self)
+{
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  if (priv->preferred == NULL)
+    return;
+
+  gabble_bytestream_iface_block_reading (priv->preferred,
+      priv->read_blocked || (!priv->recv_switched &&
+        priv->pending->len >= PENDING_MAX_SIZE));
+}
+
+static void
+parallel_maybe_switch_receiving (GabbleBytestreamMultiple *self)
+{
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  if (priv->recv_switched || !priv->switch_offset_known ||
+      priv->carrier_received < priv->switch_offset)
+    return;
+
+  if (priv->carrier_received > priv->switch_offset)
+    DEBUG ("peer sent %" G_GUINT64_FORMAT " bytes in-band but said it "
+        "would send %" G_GUINT64_FORMAT, priv->carrier_received,
+        priv->switch_offset);
+
+  DEBUG ("in-band data complete; now receiving through SOCKS5");
+  priv->recv_switched = TRUE;
+
+  if (priv->pending->len > 0)
+    {
+      g_signal_emit_by_name (G_OBJECT (self), "data-received",
+          priv->peer_handle, priv->pending);
+      g_string_truncate (priv->pending, 0);
+    }
+
+  if (priv->state != GABBLE_BYTESTREAM_STATE_CLOSED)
+    parallel_update_preferred_blocking (self);
+}
+
+static void
+parallel_data_received_cb (GabbleBytestreamIface *bytestream,
+                           TpHandle sender,
+                           GString *str,
+                           gpointer user_data)
+{
+  GabbleBytestreamMultiple *self = GABBLE_BYTESTREAM_MULTIPLE (user_data);
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  if (bytestream == priv->preferred && priv->recv_switched)
+    {
+      g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, str);
+      return;
+    }
+
+  g_object_ref (self);
+
+  if (bytestream == priv->carrier)
+    {
+      priv->carrier_received += str->len;
+      g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, str);
+    }
+  else
+    {
+      g_string_append_len (priv->pending, str->str, str->len);
+
+      if (!priv->switch_offset_known &&
+          priv->pending->len >= SWITCH_HEADER_SIZE)
+        {
+          const guchar *header = (const guchar *) priv->pending->str;
+          guint i;
+
+          priv->switch_offset = 0;
+
+          for (i = 0; i < SWITCH_HEADER_SIZE; i++)
+            priv->switch_offset = (priv->switch_offset << 8) | header[i];
+
+          g_string_erase (priv->pending, 0, SWITCH_HEADER_SIZE);
+          priv->switch_offset_known = TRUE;
+
+          DEBUG ("peer switched to SOCKS5 after sending %" G_GUINT64_FORMAT
+              " bytes in-band", priv->switch_offset);
+        }
+
+      parallel_update_preferred_blocking (self);
+    }
+
+  if (priv->state != GABBLE_BYTESTREAM_STATE_CLOSED)
+    parallel_maybe_switch_receiving (self);
+
+  g_object_unref (self);
+}
+
+static void
+parallel_switch_sending (GabbleBytestreamMultiple *self)
+{
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+  guchar header[SWITCH_HEADER_SIZE];
+  guint i;
+
+  for (i = 0; i < SWITCH_HEADER_SIZE; i++)
+    header[i] = (priv->carrier_sent >> (8 * (SWITCH_HEADER_SIZE - 1 - i)))
+        & 0xff;
+
+  DEBUG ("SOCKS5 is open; switching after %" G_GUINT64_FORMAT " bytes "
+      "in-band", priv->carrier_sent);
+
+  if (!gabble_bytestream_iface_send (priv->preferred, SWITCH_HEADER_SIZE,
+        (const gchar *) header))
+    {
+      DEBUG ("couldn't send the switch header");
+      parallel_lost (self, priv->preferred);
+      return;
+    }
+
+  priv->send_switched = TRUE;
+
+  if (priv->write_blocked)
+    {
+      priv->write_blocked = FALSE;
+      g_signal_emit_by_name (G_OBJECT (self), "write-blocked", FALSE);
+    }
+}
+
+static void
+parallel_state_changed_cb (GabbleBytestreamIface *bytestream,
+                           GabbleBytestreamState state,
+                           gpointer user_data)
+{
+  GabbleBytestreamMultiple *self = GABBLE_BYTESTREAM_MULTIPLE (user_data);
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  if (state == GABBLE_BYTESTREAM_STATE_CLOSED)
+    {
+      parallel_lost (self, bytestream);
+      return;
+    }
+
+  if (state != GABBLE_BYTESTREAM_STATE_OPEN)
+    {
+      if (bytestream == priv->carrier &&
+          priv->state != GABBLE_BYTESTREAM_STATE_OPEN)
+        g_object_set (self, "state", state, NULL);
+
+      return;
+    }
+
+  g_object_ref (self);
+
+  if (bytestream == priv->preferred)
+    parallel_switch_sending (self);
+
+  /* Switching may have failed, leaving only a carrier that isn't open */
+  if ((bytestream == priv->carrier || bytestream == priv->preferred) &&
+      priv->state != GABBLE_BYTESTREAM_STATE_OPEN &&
+      priv->state != GABBLE_BYTESTREAM_STATE_CLOSED)
+    g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
+
+  g_object_unref (self);
+}
+
+static void
+parallel_write_blocked_cb (GabbleBytestreamIface *bytestream,
+                           gboolean blocked,
+                           gpointer user_data)
+{
+  GabbleBytestreamMultiple *self = GABBLE_BYTESTREAM_MULTIPLE (user_data);
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  /* Only the stream we're currently sending through matters */
+  if ((bytestream == priv->preferred) != priv->send_switched)
+    return;
+
+  if (priv->write_blocked == blocked)
+    return;
+
+  priv->write_blocked = blocked;
+  g_signal_emit_by_name (G_OBJECT (self), "write-blocked", blocked);
+}
+
+static void
+parallel_connection_error_cb (GabbleBytestreamIface *failed,
+                              gpointer user_data)
+{
+  GabbleBytestreamMultiple *self = GABBLE_BYTESTREAM_MULTIPLE (user_data);
+
+  parallel_lost (self, failed);
+}
+
+static void
+parallel_connect (GabbleBytestreamMultiple *self,
+                  GabbleBytestreamIface *bytestream)
+{
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  gabble_bytestream_iface_block_reading (bytestream, priv->read_blocked);
+
+  g_signal_connect (bytestream, "connection-error",
+      G_CALLBACK (parallel_connection_error_cb), self);
+  g_signal_connect (bytestream, "data-received",
+      G_CALLBACK (parallel_data_received_cb), self);
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (parallel_state_changed_cb), self);
+  g_signal_connect (bytestream, "write-blocked",
+      G_CALLBACK (parallel_write_blocked_cb), self);
+}
+
+/* Turns the active bytestream and its IBB or SOCKS5 counterpart from the
+ * fallback list into a parallel pair. Returns FALSE, changing nothing, if
+ * we don't have both. */
+static gboolean
+bytestream_start_parallel (GabbleBytestreamMultiple *self)
+{
+  GabbleBytestreamMultiplePrivate *priv =
+      GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+  GabbleBytestreamIface *other;
+  const gchar *other_method;
+  gchar *current_method;
+  GList *link;
+
+  g_return_val_if_fail (priv->active_bytestream != NULL, FALSE);
+
+  if (priv->parallel_started)
+    return TRUE;
+
+  g_object_get (priv->active_bytestream, "protocol", &current_method, NULL);
+
+  if (!tp_strdiff (current_method, NS_BYTESTREAMS))
+    other_method = NS_IBB;
+  else if (!tp_strdiff (current_method, NS_IBB))
+    other_method = NS_BYTESTREAMS;
+  else
+    other_method = NULL;
+
+  g_free (current_method);
+
+  if (other_method == NULL)
+    return FALSE;
+
+  link = g_list_find_custom (priv->fallback_stream_methods, other_method,
+      (GCompareFunc) strcmp);
+
+  if (link == NULL)
+    return FALSE;
+
+  g_free (link->data);
+  priv->fallback_stream_methods = g_list_delete_link (
+      priv->fallback_stream_methods, link);
+
+  other = gabble_bytestream_factory_create_from_method (priv->factory,
+      other_method, priv->peer_handle, priv->stream_id, priv->stream_init_id,
+      priv->peer_resource, priv->self_full_jid, priv->state);
+  g_assert (other != NULL);
+
+  g_signal_handlers_disconnect_by_func (priv->active_bytestream,
+      bytestream_connection_error_cb, self);
+  g_signal_handlers_disconnect_by_func (priv->active_bytestream,
+      bytestream_data_received_cb, self);
+  g_signal_handlers_disconnect_by_func (priv->active_bytestream,
+      bytestream_state_changed_cb, self);
+  g_signal_handlers_disconnect_by_func (priv->active_bytestream,
+      bytestream_write_blocked_cb, self);
+
+  if (!tp_strdiff (other_method, NS_IBB))
+    {
+      priv->preferred = priv->active_bytestream;
+      priv->carrier = other;
+    }
+  else
+    {
+      priv->carrier = priv->active_bytestream;
+      priv->preferred = other;
+    }
+
+  priv->active_bytestream = NULL;
+  priv->pending = g_string_new ("");
+  priv->parallel_started = TRUE;
+
+  DEBUG ("using IBB and SOCKS5 in parallel for stream %s", priv->stream_id);
+
+  parallel_connect (self, priv->carrier);
+  parallel_connect (self, priv->preferred);
+
+  return TRUE;
+}
+
 /*
  * gabble_bytestream_multiple_add_bytestream
  *
@@ -618,7 +1115,7 @@ gabble_bytestream_multiple_add_stream_method (GabbleBytestreamMultiple *self,
   priv->fallback_stream_methods = g_list_append (
       priv->fallback_stream_methods, g_strdup (method));
 
-  if (priv->active_bytestream == NULL)
+  if (priv->active_bytestream == NULL && !priv->parallel_started)
     bytestream_activate_next (self);
 }
 
@@ -628,7 +1125,7 @@ gabble_bytestream_multiple_has_stream_method (GabbleBytestreamMultiple *self)
   GabbleBytestreamMultiplePrivate *priv =
     GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
 
-  if (priv->active_bytestream != NULL)
+  if (priv->active_bytestream != NULL || priv->parallel_started)
     return TRUE;
 
   return (g_list_length (priv->fallback_stream_methods) != 0);
@@ -647,10 +1144,49 @@ gabble_bytestream_multiple_block_reading (GabbleBytestreamIface *iface,
 
   priv->read_blocked = block;
 
+  if (priv->parallel_started)
+    {
+      if (priv->carrier != NULL)
+        gabble_bytestream_iface_block_reading (priv->carrier, block);
+
+      parallel_update_preferred_blocking (self);
+      return;
+    }
+
   g_assert (priv->active_bytestream != NULL);
   gabble_bytestream_iface_block_reading (priv->active_bytestream, block);
 }
 
+static gboolean
+gabble_bytestream_multiple_splice (GabbleBytestreamIface *iface,
+                                   GibberTransport *transport,
+                                   GabbleBytestreamSpliceProgress progress,
+                                   gpointer user_data)
+{
+  GabbleBytestreamMultiple *self = GABBLE_BYTESTREAM_MULTIPLE (iface);
+  GabbleBytestreamMultiplePrivate *priv =
+    GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  /* The sub-bytestream passes itself to @progress; callers only use the
+   * counts */
+  if (priv->parallel_started)
+    {
+      /* Only once the carrier is done with in both directions */
+      if (!priv->send_switched || !priv->recv_switched ||
+          priv->pending->len > 0)
+        return FALSE;
+
+      return gabble_bytestream_iface_splice (priv->preferred, transport,
+          progress, user_data);
+    }
+
+  if (priv->active_bytestream == NULL)
+    return FALSE;
+
+  return gabble_bytestream_iface_splice (priv->active_bytestream, transport,
+      progress, user_data);
+}
+
 static void
 bytestream_iface_init (gpointer g_iface,
                        gpointer iface_data)
@@ -662,4 +1198,5 @@ bytestream_iface_init (gpointer g_iface,
   klass->close = gabble_bytestream_multiple_close;
   klass->accept = gabble_bytestream_multiple_accept;
   klass->block_reading = gabble_bytestream_multiple_block_reading;
+  klass->splice = gabble_bytestream_multiple_splice;
 }
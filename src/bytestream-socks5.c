@@ -48,6 +48,7 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include <gibber/gibber-fd-relay.h>
 #include <gibber/gibber-transport.h>
 #include <gibber/gibber-tcp-transport.h>
 #include <gibber/gibber-listener.h>
@@ -61,7 +62,9 @@
 #include "debug.h"
 #include "disco.h"
 #include "gabble-signals-marshal.h"
+#include "metrics.h"
 #include "namespaces.h"
+#include "socks5-proxy-cache.h"
 #include "util.h"
 
 static void
@@ -123,11 +126,34 @@ typedef enum _Socks5State Socks5State;
 #define CONNECT_REPLY_TIMEOUT 30
 #define CONNECT_TIMEOUT 10
 
+/* Rather than giving each streamhost CONNECT_TIMEOUT in turn, the target
+ * starts connecting to the next one whenever STREAMHOST_STAGGER_MS has passed
+ * without any attempt finishing the SOCKS5 handshake, and uses whichever
+ * finishes first. */
+#define STREAMHOST_STAGGER_MS 250
+#define STREAMHOST_MAX_ATTEMPTS 4
+
+/* Streamhosts are tried in order of how long we expect the handshake to
+ * take, based on previous bytestreams. Ones we know nothing about are
+ * assumed to take STREAMHOST_DEFAULT_LATENCY, so they keep the order the
+ * initiator offered them in; each failure since the last success adds
+ * STREAMHOST_FAILURE_PENALTY. What we know about our own proxies comes from
+ * the factory's proxy cache; for everything else, such as the initiator's
+ * own addresses, we keep streamhost_stats, forgetting about a streamhost we
+ * haven't tried for STREAMHOST_STATS_LIFETIME and remembering at most
+ * STREAMHOST_STATS_MAX of them. */
+#define STREAMHOST_DEFAULT_LATENCY (500 * G_TIME_SPAN_MILLISECOND)
+#define STREAMHOST_FAILURE_PENALTY (5 * G_TIME_SPAN_SECOND)
+#define STREAMHOST_STATS_LIFETIME G_TIME_SPAN_HOUR
+#define STREAMHOST_STATS_MAX 256
+
 struct _Streamhost
 {
   gchar *jid;
   gchar *host;
   guint16 port;
+  /* only meaningful while sorting */
+  gint64 expected_latency;
 };
 typedef struct _Streamhost Streamhost;
 
@@ -161,6 +187,179 @@ streamhost_free (Streamhost *streamhost)
   g_slice_free (Streamhost, streamhost);
 }
 
+typedef struct
+{
+  guint successes;
+  guint failures;
+  /* failures since the last success */
+  guint recent_failures;
+  /* smoothed time to finish the handshake, in microseconds */
+  gint64 latency;
+  gint64 last_used;
+} StreamhostStats;
+
+/* host:port => owned StreamhostStats, shared by all connections; it exists
+ * while any bytestream factory does */
+static GHashTable *streamhost_stats = NULL;
+static gsize streamhost_stats_refcount = 0;
+
+static gchar *
+streamhost_stats_key (const Streamhost *streamhost)
+{
+  return g_strdup_printf ("%s:%u", streamhost->host, streamhost->port);
+}
+
+static void
+streamhost_stats_free (StreamhostStats *stats)
+{
+  g_slice_free (StreamhostStats, stats);
+}
+
+static StreamhostStats *
+streamhost_stats_lookup (const Streamhost *streamhost)
+{
+  StreamhostStats *stats;
+  gchar *key;
+
+  if (streamhost_stats == NULL)
+    return NULL;
+
+  key = streamhost_stats_key (streamhost);
+  stats = g_hash_table_lookup (streamhost_stats, key);
+  g_free (key);
+
+  if (stats != NULL &&
+      g_get_monotonic_time () - stats->last_used > STREAMHOST_STATS_LIFETIME)
+    return NULL;
+
+  return stats;
+}
+
+static void
+streamhost_stats_evict_oldest (void)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  gpointer oldest_key = NULL;
+  gint64 oldest = G_MAXINT64;
+
+  g_hash_table_iter_init (&iter, streamhost_stats);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      StreamhostStats *stats = value;
+
+      if (stats->last_used < oldest)
+        {
+          oldest = stats->last_used;
+          oldest_key = key;
+        }
+    }
+
+  if (oldest_key != NULL)
+    g_hash_table_remove (streamhost_stats, oldest_key);
+}
+
+/* @latency is only used if @success is TRUE */
+static void
+streamhost_stats_record (const Streamhost *streamhost,
+                         gboolean success,
+                         gint64 latency)
+{
+  StreamhostStats *stats;
+  gchar *key;
+
+  /* a bytestream can outlive the last factory */
+  if (streamhost_stats == NULL)
+    return;
+
+  key = streamhost_stats_key (streamhost);
+  stats = g_hash_table_lookup (streamhost_stats, key);
+
+  if (stats == NULL)
+    {
+      if (g_hash_table_size (streamhost_stats) >= STREAMHOST_STATS_MAX)
+        streamhost_stats_evict_oldest ();
+
+      stats = g_slice_new0 (StreamhostStats);
+      g_hash_table_insert (streamhost_stats, key, stats);
+    }
+  else
+    {
+      g_free (key);
+
+      /* Start again if it's been so long that we'd ignore what we know */
+      if (g_get_monotonic_time () - stats->last_used >
+          STREAMHOST_STATS_LIFETIME)
+        memset (stats, 0, sizeof (StreamhostStats));
+    }
+
+  stats->last_used = g_get_monotonic_time ();
+
+  if (success)
+    {
+      if (stats->successes == 0)
+        stats->latency = latency;
+      else
+        stats->latency = (7 * stats->latency + latency) / 8;
+
+      stats->successes++;
+      stats->recent_failures = 0;
+    }
+  else
+    {
+      stats->failures++;
+      stats->recent_failures++;
+    }
+}
+
+void
+gabble_bytestream_socks5_stats_init (void)
+{
+  if (streamhost_stats_refcount++ == 0)
+    {
+      g_assert (streamhost_stats == NULL);
+      streamhost_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+          g_free, (GDestroyNotify) streamhost_stats_free);
+    }
+}
+
+void
+gabble_bytestream_socks5_stats_finalize (void)
+{
+  g_assert (streamhost_stats_refcount > 0);
+
+  if (--streamhost_stats_refcount == 0)
+    tp_clear_pointer (&streamhost_stats, g_hash_table_unref);
+}
+
+static gint
+streamhost_compare_expected_latency (gconstpointer a,
+                                     gconstpointer b)
+{
+  const Streamhost *streamhost_a = a;
+  const Streamhost *streamhost_b = b;
+
+  if (streamhost_a->expected_latency < streamhost_b->expected_latency)
+    return -1;
+
+  return streamhost_a->expected_latency > streamhost_b->expected_latency;
+}
+
+/* One of the connections the target races to the initiator's streamhosts,
+ * or one of the target's connections to the initiator's listener, in which
+ * case @streamhost is NULL */
+typedef struct
+{
+  GabbleBytestreamSocks5 *self;
+  /* borrowed from priv->streamhosts */
+  Streamhost *streamhost;
+  GibberTransport *transport;
+  Socks5State state;
+  GString *read_buffer;
+  gint64 started;
+  guint timer_id;
+} StreamhostAttempt;
+
 struct _GabbleBytestreamSocks5Private
 {
   GabbleConnection *conn;
@@ -177,6 +376,20 @@ struct _GabbleBytestreamSocks5Private
 
   /* List of Streamhost */
   GSList *streamhosts;
+  /* StreamhostAttempts in progress (the target's connections out, or the
+   * initiator's connections in), the first streamhost not tried yet, and the
+   * one we ended up using */
+  GSList *attempts;
+  GSList *next_streamhost;
+  guint stagger_timer_id;
+  Streamhost *used_streamhost;
+
+  /* When the initiator started connecting to proxy_jid, or 0 once we've
+   * told the factory how that went */
+  gint64 proxy_connect_started;
+  /* How fast data went through the relay we're using, if any, for the
+   * factory's proxy statistics */
+  GabbleSocks5ProxyMeter relay_meter;
 
   /* Connections to streamhosts are async, so we keep the IQ set message
    * around */
@@ -191,11 +404,77 @@ struct _GabbleBytestreamSocks5Private
 
   GString *read_buffer;
 
+  /* Set once data is spliced between transport and a local socket */
+  GibberFdRelay *relay;
+  GabbleBytestreamSpliceProgress splice_progress;
+  gpointer splice_progress_data;
+
   gboolean dispose_has_run;
 };
 
 #define GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE(obj) ((obj)->priv)
 
+/* The proxy cache's record for @streamhost, if it's one of our proxies */
+static const GabbleSocks5ProxyRecord *
+streamhost_lookup_proxy (GabbleBytestreamSocks5 *self,
+                         const Streamhost *streamhost)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+  GabbleBytestreamFactory *factory = priv->conn->bytestream_factory;
+
+  if (factory == NULL)
+    return NULL;
+
+  return gabble_bytestream_factory_lookup_socks5_proxy (factory,
+      streamhost->jid);
+}
+
+/* @latency is only used if @success is TRUE */
+static void
+streamhost_record (GabbleBytestreamSocks5 *self,
+                   const Streamhost *streamhost,
+                   gboolean success,
+                   gint64 latency)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+
+  if (streamhost_lookup_proxy (self, streamhost) != NULL)
+    gabble_bytestream_factory_report_socks5_proxy_connect (
+        priv->conn->bytestream_factory, streamhost->jid, success, latency);
+  else
+    streamhost_stats_record (streamhost, success, latency);
+}
+
+static gint64
+streamhost_expected_latency (GabbleBytestreamSocks5 *self,
+                             const Streamhost *streamhost)
+{
+  const GabbleSocks5ProxyRecord *proxy = streamhost_lookup_proxy (self,
+      streamhost);
+  StreamhostStats *stats;
+  gint64 latency = STREAMHOST_DEFAULT_LATENCY;
+
+  if (proxy != NULL)
+    {
+      if (proxy->latency > 0)
+        latency = proxy->latency;
+
+      return latency + proxy->recent_failures * STREAMHOST_FAILURE_PENALTY;
+    }
+
+  stats = streamhost_stats_lookup (streamhost);
+
+  if (stats == NULL)
+    return latency;
+
+  if (stats->successes > 0)
+    latency = stats->latency;
+
+  return latency + stats->recent_failures * STREAMHOST_FAILURE_PENALTY;
+}
+
 static void socks5_connect (GabbleBytestreamSocks5 *self);
 
 static void gabble_bytestream_socks5_close (GabbleBytestreamIface *iface,
@@ -203,6 +482,8 @@ static void gabble_bytestream_socks5_close (GabbleBytestreamIface *iface,
 
 static void socks5_error (GabbleBytestreamSocks5 *self);
 
+static void cancel_streamhost_attempts (GabbleBytestreamSocks5 *self);
+
 static void transport_handler (GibberTransport *transport,
     GibberBuffer *data, gpointer user_data);
 
@@ -241,6 +522,7 @@ gabble_bytestream_socks5_dispose (GObject *object)
   priv->dispose_has_run = TRUE;
 
   stop_timer (self);
+  cancel_streamhost_attempts (self);
 
   if (priv->bytestream_state != GABBLE_BYTESTREAM_STATE_CLOSED)
     {
@@ -490,6 +772,20 @@ write_to_transport (GabbleBytestreamSocks5 *self,
   return TRUE;
 }
 
+static void
+socks5_send_auth_request (GibberTransport *transport)
+{
+  guint8 msg[3];
+
+  msg[0] = SOCKS5_VERSION;
+  /* Number of auth methods we are offering, we support just
+   * SOCKS5_AUTH_NONE */
+  msg[1] = 1;
+  msg[2] = SOCKS5_AUTH_NONE;
+
+  gibber_transport_send (transport, msg, 3, NULL);
+}
+
 static void
 transport_connected_cb (GibberTransport *transport,
                         GabbleBytestreamSocks5 *self)
@@ -499,25 +795,12 @@ transport_connected_cb (GibberTransport *transport,
 
   stop_timer (self);
 
-  if (priv->socks5_state == SOCKS5_STATE_TARGET_TRYING_CONNECT ||
-      priv->socks5_state == SOCKS5_STATE_INITIATOR_TRYING_CONNECT)
+  if (priv->socks5_state == SOCKS5_STATE_INITIATOR_TRYING_CONNECT)
     {
-      gchar msg[3];
-
       DEBUG ("transport is connected. Sending auth request");
 
-      msg[0] = SOCKS5_VERSION;
-      /* Number of auth methods we are offering, we support just
-       * SOCKS5_AUTH_NONE */
-      msg[1] = 1;
-      msg[2] = SOCKS5_AUTH_NONE;
-
-      write_to_transport (self, msg, 3, NULL);
-
-      if (priv->socks5_state == SOCKS5_STATE_TARGET_TRYING_CONNECT)
-        priv->socks5_state = SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT;
-      else
-        priv->socks5_state = SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT;
+      socks5_send_auth_request (transport);
+      priv->socks5_state = SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT;
     }
 }
 
@@ -550,6 +833,10 @@ socks5_close_transport (GabbleBytestreamSocks5 *self)
   GabbleBytestreamSocks5Private *priv =
     GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
 
+  cancel_streamhost_attempts (self);
+
+  tp_clear_pointer (&priv->relay, gibber_fd_relay_free);
+
   if (priv->read_buffer != NULL)
     {
       g_string_free (priv->read_buffer, TRUE);
@@ -562,12 +849,91 @@ socks5_close_transport (GabbleBytestreamSocks5 *self)
   g_signal_handlers_disconnect_matched (priv->transport,
       G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, self);
 
+  if (GIBBER_IS_FD_TRANSPORT (priv->transport))
+    {
+      GibberFdTransportReadStats stats;
+
+      /* how well reads were batched: ideally many per main loop wakeup */
+      gibber_fd_transport_get_read_stats (
+          GIBBER_FD_TRANSPORT (priv->transport), &stats);
+      gabble_metrics_count (GABBLE_METRIC_SOCKS5_READ_WAKEUPS,
+          stats.wakeups);
+      gabble_metrics_count (GABBLE_METRIC_SOCKS5_READS, stats.reads);
+    }
+
   tp_clear_object (&priv->transport);
 }
 
+/* The JID of the proxy this bytestream goes through, or NULL if it's a
+ * direct connection */
+static const gchar *
+socks5_relay_jid (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+    GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  if (priv->proxy_jid != NULL)
+    return priv->proxy_jid;
+
+  if (priv->used_streamhost != NULL &&
+      tp_strdiff (priv->used_streamhost->jid, priv->peer_jid))
+    return priv->used_streamhost->jid;
+
+  return NULL;
+}
+
+static void
+socks5_count_relayed_data (GabbleBytestreamSocks5 *self,
+                           gsize len)
+{
+  GabbleBytestreamSocks5Private *priv =
+    GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  if (socks5_relay_jid (self) != NULL)
+    gabble_socks5_proxy_meter_add (&priv->relay_meter, len,
+        g_get_monotonic_time ());
+}
+
+static void
+report_relay_transfer (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+    GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  const gchar *jid = socks5_relay_jid (self);
+
+  if (jid == NULL || priv->relay_meter.bytes == 0 ||
+      priv->conn->bytestream_factory == NULL)
+    return;
+
+  gabble_bytestream_factory_report_socks5_proxy_transfer (
+      priv->conn->bytestream_factory, jid, priv->relay_meter.bytes,
+      priv->relay_meter.duration);
+  memset (&priv->relay_meter, 0, sizeof (priv->relay_meter));
+}
+
+/* Tell the factory whether the initiator got through to the proxy the
+ * target picked, the first time we know */
+static void
+report_proxy_connect (GabbleBytestreamSocks5 *self,
+                      gboolean success)
+{
+  GabbleBytestreamSocks5Private *priv =
+    GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  if (priv->proxy_connect_started == 0 ||
+      priv->conn->bytestream_factory == NULL)
+    return;
+
+  gabble_bytestream_factory_report_socks5_proxy_connect (
+      priv->conn->bytestream_factory, priv->proxy_jid, success,
+      g_get_monotonic_time () - priv->proxy_connect_started);
+  priv->proxy_connect_started = 0;
+}
+
 static void
 bytestream_closed (GabbleBytestreamSocks5 *self)
 {
+  report_relay_transfer (self);
   socks5_close_transport (self);
   g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_CLOSED, NULL);
 }
@@ -625,30 +991,17 @@ socks5_error (GabbleBytestreamSocks5 *self)
   previous_state = priv->socks5_state;
   priv->socks5_state = SOCKS5_STATE_ERROR;
 
+  /* Only does anything if we were on our way to the target's proxy */
+  report_proxy_connect (self, FALSE);
+
   switch (previous_state)
     {
       case SOCKS5_STATE_TARGET_TRYING_CONNECT:
       case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
       case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
-        /* The attempt for connect to the streamhost failed */
+        /* None of the streamhosts worked */
         socks5_close_transport (self);
 
-        if (priv->streamhosts != NULL)
-          {
-            /* Remove the failed streamhost */
-            streamhost_free (priv->streamhosts->data);
-            priv->streamhosts = g_slist_delete_link (priv->streamhosts,
-                priv->streamhosts);
-          }
-
-        if (priv->streamhosts != NULL)
-          {
-            DEBUG ("connection to streamhost failed, trying the next one");
-
-            socks5_connect (self);
-            return;
-          }
-
         DEBUG ("no more streamhosts to try");
 
         g_signal_emit_by_name (self, "connection-error");
@@ -663,12 +1016,6 @@ socks5_error (GabbleBytestreamSocks5 *self)
         priv->msg_for_acknowledge_connection = NULL;
         break;
 
-      case SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST:
-      case SOCKS5_STATE_INITIATOR_AWAITING_COMMAND:
-        DEBUG ("Something goes wrong during SOCKS5 negotiation. Don't close "
-            "the bytestream yet as the target can still try other streamhosts");
-        break;
-
       default:
         DEBUG ("error, closing the connection\n");
         gabble_bytestream_socks5_close (GABBLE_BYTESTREAM_IFACE (self), NULL);
@@ -741,7 +1088,7 @@ target_got_connect_reply (GabbleBytestreamSocks5 *self)
   g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
 
   /* Acknowledge the connection */
-  current_streamhost = priv->streamhosts->data;
+  current_streamhost = priv->used_streamhost;
   wocky_porter_acknowledge_iq (porter, priv->msg_for_acknowledge_connection,
       '(', "query", ':', NS_BYTESTREAMS,
         /* streamhost-used informs the other end of the streamhost we
@@ -791,6 +1138,7 @@ socks5_activation_reply_cb (
     }
 
   DEBUG ("Proxy activated the bytestream. It's now open");
+  report_proxy_connect (self, TRUE);
 
   priv->socks5_state = SOCKS5_STATE_CONNECTED;
   g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
@@ -799,6 +1147,7 @@ socks5_activation_reply_cb (
   goto out;
 
 activation_failed:
+  report_proxy_connect (self, FALSE);
   g_signal_emit_by_name (self, "connection-error");
   g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_CLOSED, NULL);
 
@@ -835,6 +1184,246 @@ initiator_got_connect_reply (GabbleBytestreamSocks5 *self)
   g_object_unref (iq);
 }
 
+static gchar *
+socks5_stream_domain (GabbleBytestreamSocks5 *self,
+                      gboolean target)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+
+  if (target)
+    return compute_domain (priv->stream_id, priv->peer_jid,
+        priv->self_full_jid);
+  else
+    return compute_domain (priv->stream_id, priv->self_full_jid,
+        priv->peer_jid);
+}
+
+/* Returns the number of bytes used by the reply to our auth request, 0 if it
+ * hasn't all arrived yet, or -1 if we were refused */
+static gssize
+socks5_parse_auth_reply (GString *string)
+{
+  /* The response is 2 bytes-long */
+  if (string->len < 2)
+    return 0;
+
+  if (string->str[0] != SOCKS5_VERSION ||
+      string->str[1] != SOCKS5_STATUS_OK)
+    {
+      DEBUG ("Authentication failed");
+      return -1;
+    }
+
+  return 2;
+}
+
+static void
+socks5_send_connect_request (GabbleBytestreamSocks5 *self,
+                             GibberTransport *transport,
+                             gboolean target)
+{
+  guint8 msg[SOCKS5_CONNECT_LENGTH];
+  gchar *domain;
+
+  domain = socks5_stream_domain (self, target);
+
+  msg[0] = SOCKS5_VERSION;
+  msg[1] = SOCKS5_CMD_CONNECT;
+  msg[2] = SOCKS5_RESERVED;
+  msg[3] = SOCKS5_ATYP_DOMAIN;
+  /* Length of a hex SHA1 */
+  msg[4] = 40;
+  /* Domain name: SHA-1(sid + initiator + target) */
+  memcpy (&msg[5], domain, 40);
+  /* Port: 0 */
+  msg[45] = 0x00;
+  msg[46] = 0x00;
+
+  g_free (domain);
+
+  gibber_transport_send (transport, msg, SOCKS5_CONNECT_LENGTH, NULL);
+}
+
+/* Returns the number of bytes used by the reply to our CONNECT command, 0 if
+ * it hasn't all arrived yet, or -1 if the connection was refused */
+static gssize
+socks5_parse_connect_reply (GabbleBytestreamSocks5 *self,
+                            GString *string,
+                            gboolean target)
+{
+  gchar *domain;
+  /* the length of the BND.ADDR field */
+  guint8 addr_len;
+
+  if (string->len < SOCKS5_MIN_LENGTH)
+    return 0;
+
+  if (string->str[0] != SOCKS5_VERSION ||
+      string->str[1] != SOCKS5_STATUS_OK ||
+      string->str[2] != SOCKS5_RESERVED)
+    {
+      DEBUG ("Connection refused");
+      return -1;
+    }
+
+  if (string->str[3] == SOCKS5_ATYP_DOMAIN)
+    {
+      /* correct domain. The first byte of the domain contains its
+       * length */
+      addr_len = (guint8) string->str[4];
+      addr_len += 1;
+    }
+  else if (string->str[3] == 0x00)
+    {
+      DEBUG ("Got 0x00 as domain. Pretend it's ok to be able to interop "
+          "with ejabberd < 2.0.2");
+      addr_len = 0;
+    }
+  else
+    {
+      DEBUG ("Wrong domain");
+      return -1;
+    }
+
+  if ((guint8) string->len < SOCKS5_MIN_LENGTH + addr_len)
+    /* We didn't receive the full packet yet */
+    return 0;
+
+  if (
+      /* first half of the port number */
+      string->str[4 + addr_len] != 0 ||
+      /* second half of the port number */
+      string->str[5 + addr_len] != 0)
+    {
+      DEBUG ("Connection refused");
+      return -1;
+    }
+
+  domain = socks5_stream_domain (self, target);
+
+  if (addr_len > 0)
+    {
+      if (!check_domain (&string->str[5], addr_len - 1, domain))
+        {
+          /* Thanks Pidgin... */
+          DEBUG ("Ignoring to interop with buggy implementations");
+        }
+    }
+
+  g_free (domain);
+
+  return SOCKS5_MIN_LENGTH + addr_len;
+}
+
+/* Returns the number of bytes used by the target's auth request, 0 if it
+ * hasn't all arrived yet, or -1 if it doesn't offer unauthenticated access */
+static gssize
+socks5_parse_auth_request (GString *string)
+{
+  guint auth_len;
+  guint i;
+
+  /* SOCKS5_VERSION + # of methods + methods */
+  if (string->len < 2)
+    return 0;
+
+  if (string->str[0] != SOCKS5_VERSION)
+    {
+      DEBUG ("Authentication failed");
+      return -1;
+    }
+
+  auth_len = string->str[1] + 2;
+  if (string->len < auth_len)
+    /* We are still receiving some auth method */
+    return 0;
+
+  for (i = 2; i < auth_len; i++)
+    {
+      if (string->str[i] == SOCKS5_AUTH_NONE)
+        return auth_len;
+    }
+
+  DEBUG ("Unauthenticated access is not supported by the streamhost");
+  return -1;
+}
+
+/* Returns the number of bytes used by the target's CONNECT command, 0 if it
+ * hasn't all arrived yet, or -1 if it's invalid or isn't for this
+ * bytestream. The only command the SOCKS5 bytestreams XEP uses is CONNECT
+ * with ATYP = DOMAIN, PORT = 0 and DOMAIN = SHA1(sid + initiator + target) */
+static gssize
+socks5_parse_connect_request (GabbleBytestreamSocks5 *self,
+                              GString *string)
+{
+  gchar *domain;
+  /* the length of the DST.ADDR field */
+  guint8 addr_len;
+  gboolean ok;
+
+  if (string->len < SOCKS5_MIN_LENGTH)
+    return 0;
+
+  addr_len = (guint8) string->str[4];
+  /* the first byte is the length */
+  addr_len += 1;
+
+  if ((guint8) string->len < SOCKS5_MIN_LENGTH + addr_len)
+    /* We didn't receive the full packet yet */
+    return 0;
+
+  if (string->str[0] != SOCKS5_VERSION ||
+      string->str[1] != SOCKS5_CMD_CONNECT ||
+      string->str[2] != SOCKS5_RESERVED ||
+      string->str[3] != SOCKS5_ATYP_DOMAIN ||
+      /* first half of the port number */
+      string->str[4 + addr_len] != 0 ||
+      /* second half of the port number */
+      string->str[5 + addr_len] != 0)
+    {
+      DEBUG ("Invalid SOCKS5 connect message");
+      return -1;
+    }
+
+  domain = socks5_stream_domain (self, FALSE);
+  ok = check_domain (&string->str[5], addr_len - 1, domain);
+  g_free (domain);
+
+  if (!ok)
+    {
+      DEBUG ("Reject connection to prevent spoofing");
+      return -1;
+    }
+
+  return SOCKS5_MIN_LENGTH + addr_len;
+}
+
+static void
+socks5_send_connect_reply (GabbleBytestreamSocks5 *self,
+                           GibberTransport *transport)
+{
+  guint8 msg[SOCKS5_CONNECT_LENGTH];
+  gchar *domain;
+
+  domain = socks5_stream_domain (self, FALSE);
+
+  msg[0] = SOCKS5_VERSION;
+  msg[1] = SOCKS5_STATUS_OK;
+  msg[2] = SOCKS5_RESERVED;
+  msg[3] = SOCKS5_ATYP_DOMAIN;
+  msg[4] = SHA1_LENGTH;
+  /* Domain name: SHA-1(sid + initiator + target) */
+  memcpy (&msg[5], domain, SHA1_LENGTH);
+  /* Port: 0 */
+  msg[45] = 0x00;
+  msg[46] = 0x00;
+
+  g_free (domain);
+
+  gibber_transport_send (transport, msg, SOCKS5_CONNECT_LENGTH, NULL);
+}
+
 /* Process the received data and returns the number of bytes that have been
  * used */
 static gssize
@@ -843,401 +1432,487 @@ socks5_handle_received_data (GabbleBytestreamSocks5 *self,
 {
   GabbleBytestreamSocks5Private *priv =
       GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
-  gchar msg[SOCKS5_CONNECT_LENGTH];
-  guint auth_len;
-  guint i;
-  gchar *domain;
-  /* the length of the BND.ADDR field */
-  guint8 addr_len;
   gsize len;
+  gssize used;
 
   switch (priv->socks5_state)
     {
-      case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
       case SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT:
         /* We sent an authorization request and we are awaiting for a
-         * response, the response is 2 bytes-long */
-        if (string->len < 2)
-          return 0;
-
-        if (string->str[0] != SOCKS5_VERSION ||
-            string->str[1] != SOCKS5_STATUS_OK)
+         * response */
+        used = socks5_parse_auth_reply (string);
+        if (used <= 0)
           {
-            DEBUG ("Authentication failed");
+            if (used < 0)
+              socks5_error (self);
 
-            socks5_error (self);
-            return -1;
+            return used;
           }
 
         /* We have been authorized, let's send a CONNECT command */
 
         DEBUG ("Received auth reply. Sending CONNECT command");
 
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
-          {
-            domain = compute_domain (priv->stream_id, priv->peer_jid,
-                priv->self_full_jid);
-          }
-        else
-          {
-            /* SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT */
-            domain = compute_domain (priv->stream_id, priv->self_full_jid,
-                priv->peer_jid);
-          }
+        socks5_send_connect_request (self, priv->transport, FALSE);
+        priv->socks5_state = SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED;
 
-        msg[0] = SOCKS5_VERSION;
-        msg[1] = SOCKS5_CMD_CONNECT;
-        msg[2] = SOCKS5_RESERVED;
-        msg[3] = SOCKS5_ATYP_DOMAIN;
-        /* Length of a hex SHA1 */
-        msg[4] = 40;
-        /* Domain name: SHA-1(sid + initiator + target) */
-        memcpy (&msg[5], domain, 40);
-        /* Port: 0 */
-        msg[45] = 0x00;
-        msg[46] = 0x00;
-
-        g_free (domain);
-
-        write_to_transport (self, msg, SOCKS5_CONNECT_LENGTH, NULL);
-
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
-          priv->socks5_state = SOCKS5_STATE_TARGET_CONNECT_REQUESTED;
-        else
-          /* SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT */
-          priv->socks5_state = SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED;
-
-        /* Older version of Gabble (pre 0.7.22) are bugged and just send 2
-         * bytes as CONNECT reply. We set a timer to not wait the full reply
-         * forever if we are connected to such Gabble.
-         * Once timed out, the SOCKS5 negotiation will fail and Gabble
-         * will switch to IBB as a fallback. */
+        /* Don't wait forever for a proxy which doesn't reply */
         start_timer (self, CONNECT_REPLY_TIMEOUT);
 
-        return 2;
+        return used;
 
-      case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
       case SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED:
         /* We sent a CONNECT request and are awaiting for the response */
-        if (string->len < SOCKS5_MIN_LENGTH)
+        used = socks5_parse_connect_reply (self, string, FALSE);
+        if (used == 0)
           return 0;
 
-        if (string->str[0] != SOCKS5_VERSION ||
-            string->str[1] != SOCKS5_STATUS_OK ||
-            string->str[2] != SOCKS5_RESERVED)
-          {
-            DEBUG ("Connection refused");
+        stop_timer (self);
 
+        if (used < 0)
+          {
             socks5_error (self);
             return -1;
           }
 
-        if (string->str[3] == SOCKS5_ATYP_DOMAIN)
-          {
-            /* correct domain. The first byte of the domain contains its
-             * length */
-            addr_len = (guint8) string->str[4];
-            addr_len += 1;
-          }
-        else if (string->str[3] == 0x00)
-          {
-            DEBUG ("Got 0x00 as domain. Pretend it's ok to be able to interop "
-                "with ejabberd < 2.0.2");
-            addr_len = 0;
-          }
-        else
-          {
-            DEBUG ("Wrong domain");
+        initiator_got_connect_reply (self);
 
-            socks5_error (self);
-            return -1;
-          }
+        return used;
 
-        if ((guint8) string->len < SOCKS5_MIN_LENGTH + addr_len)
-          /* We didn't receive the full packet yet */
-          return 0;
+      case SOCKS5_STATE_CONNECTED:
+        /* We are connected, everything we receive now is data */
 
-        stop_timer (self);
+        /* store the buffer len because if something went wront in the
+         * data-received callback, the bytestream could be freed and so the
+         * priv->read_buffer */
+        len = string->len;
+        socks5_count_relayed_data (self, len);
+        gabble_metrics_count (GABBLE_METRIC_SOCKS5_BYTES_RECEIVED, len);
+        g_signal_emit_by_name (G_OBJECT (self), "data-received",
+            priv->peer_handle, string);
 
-        if (
-            /* first half of the port number */
-            string->str[4 + addr_len] != 0 ||
-            /* second half of the port number */
-            string->str[5 + addr_len] != 0)
-          {
-            DEBUG ("Connection refused");
+        return len;
 
-            socks5_error (self);
-            return -1;
-          }
+      case SOCKS5_STATE_ERROR:
+        /* An error occurred and the channel will be closed in an idle
+         * callback, so let's just throw away the data we receive */
+        DEBUG ("An error occurred, throwing away received data");
+        return string->len;
 
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
-          {
-            domain = compute_domain (priv->stream_id, priv->peer_jid,
-                priv->self_full_jid);
-          }
-        else
-          {
-            /* SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED */
-            domain = compute_domain (priv->stream_id, priv->self_full_jid,
-                priv->peer_jid);
-          }
+      case SOCKS5_STATE_TARGET_TRYING_CONNECT:
+      case SOCKS5_STATE_INITIATOR_TRYING_CONNECT:
+        DEBUG ("Impossible to receive data when not yet connected to the "
+            "socket");
+        break;
 
-        if (addr_len > 0)
-          {
-            if (!check_domain (&string->str[5], addr_len - 1, domain))
-              {
-                /* Thanks Pidgin... */
-                DEBUG ("Ignoring to interop with buggy implementations");
-              }
-          }
+      case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
+      case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
+      case SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST:
+      case SOCKS5_STATE_INITIATOR_AWAITING_COMMAND:
+        DEBUG ("Handshakes are done by StreamhostAttempts");
+        break;
 
-        g_free (domain);
+      case SOCKS5_STATE_INITIATOR_OFFER_SENT:
+        DEBUG ("Shouldn't receive data when we just sent the offer");
+        break;
 
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
-          target_got_connect_reply (self);
-        else
-          /* SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED */
-          initiator_got_connect_reply (self);
+      case SOCKS5_STATE_INITIATOR_ACTIVATION_SENT:
+        DEBUG ("Shouldn't receive data before we received activation reply");
+        break;
 
-        return SOCKS5_MIN_LENGTH + addr_len;
+      case SOCKS5_STATE_INVALID:
+        DEBUG ("Invalid SOCKS5 state");
+        break;
+    }
 
-      case SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST:
-        /* A client connected to us and we are awaiting for the authorization
-         * request (at least 2 bytes) */
-        if (string->len < 2)
-          return 0;
+  g_assert_not_reached ();
+  return string->len;
+}
 
-        if (string->str[0] != SOCKS5_VERSION)
-          {
-            DEBUG ("Authentication failed");
+static void
+socks5_process_read_buffer (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  gssize used_bytes;
 
-            socks5_error (self);
-            return -1;
-          }
+  /* If something goes wrong in socks5_handle_received_data, the bytestream
+   * could be closed and disposed. Ref it to artificially keep this bytestream
+   * object alive while we are in this function. */
+  g_object_ref (self);
 
-        /* The auth request string is SOCKS5_VERSION + # of methods + methods */
-        auth_len = string->str[1] + 2;
-        if (string->len < auth_len)
-          /* We are still receiving some auth method */
-          return 0;
+  while (priv->read_buffer != NULL && priv->read_buffer->len > 0)
+    {
+      /* socks5_handle_received_data() processes the data and returns the
+       * number of bytes that have been used. 0 means that there is not enough
+       * data to do anything, so we just wait for more data from the socket */
+      used_bytes = socks5_handle_received_data (self, priv->read_buffer);
+
+      if (priv->read_buffer == NULL)
+        /* If something did wrong in socks5_handle_received_data, the
+         * bytestream can be closed and so destroyed. */
+        break;
+
+      g_string_erase (priv->read_buffer, 0, used_bytes);
+
+      if (used_bytes <= 0)
+        break;
+    }
+
+  g_object_unref (self);
+}
+
+static void
+transport_handler (GibberTransport *transport,
+                   GibberBuffer *data,
+                   gpointer user_data)
+
+{
+  GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (user_data);
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  g_assert (priv->read_buffer != NULL);
+  g_string_append_len (priv->read_buffer, (const gchar *) data->data,
+      data->length);
+
+  socks5_process_read_buffer (self);
+}
+
+static void
+streamhost_attempt_free (StreamhostAttempt *attempt)
+{
+  if (attempt->timer_id != 0)
+    g_source_remove (attempt->timer_id);
+
+  if (attempt->transport != NULL)
+    {
+      g_signal_handlers_disconnect_matched (attempt->transport,
+          G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, attempt);
+      gibber_transport_set_handler (attempt->transport, NULL, NULL);
+      gibber_transport_disconnect (attempt->transport);
+      g_object_unref (attempt->transport);
+    }
+
+  g_string_free (attempt->read_buffer, TRUE);
+  g_slice_free (StreamhostAttempt, attempt);
+}
+
+static void
+cancel_streamhost_attempts (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  GSList *attempts = priv->attempts;
+
+  if (priv->stagger_timer_id != 0)
+    {
+      g_source_remove (priv->stagger_timer_id);
+      priv->stagger_timer_id = 0;
+    }
+
+  priv->attempts = NULL;
+  priv->next_streamhost = NULL;
+  g_slist_foreach (attempts, (GFunc) streamhost_attempt_free, NULL);
+  g_slist_free (attempts);
+}
 
-        for (i = 2; i < auth_len; i++)
-          {
-            if (string->str[i] == SOCKS5_AUTH_NONE)
-              {
-                /* Authorize the connection */
-                msg[0] = SOCKS5_VERSION;
-                msg[1] = SOCKS5_AUTH_NONE;
+static void start_next_attempt (GabbleBytestreamSocks5 *self);
+static void schedule_next_attempt (GabbleBytestreamSocks5 *self);
 
-                DEBUG ("Received auth request. Sending auth reply");
-                write_to_transport (self, msg, 2, NULL);
+static void
+streamhost_attempt_failed (StreamhostAttempt *attempt)
+{
+  GabbleBytestreamSocks5 *self = attempt->self;
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
 
-                priv->socks5_state = SOCKS5_STATE_INITIATOR_AWAITING_COMMAND;
+  DEBUG ("connection to streamhost %s (%s:%u) failed",
+      attempt->streamhost->jid, attempt->streamhost->host,
+      attempt->streamhost->port);
 
-                return auth_len;
-              }
-          }
+  streamhost_record (self, attempt->streamhost, FALSE, 0);
 
-        DEBUG ("Unauthenticated access is not supported by the streamhost");
+  priv->attempts = g_slist_remove (priv->attempts, attempt);
+  streamhost_attempt_free (attempt);
 
-        socks5_error (self);
+  if (priv->next_streamhost != NULL)
+    {
+      /* No point waiting for the stagger timer */
+      DEBUG ("trying the next one");
+      g_object_ref (self);
+      start_next_attempt (self);
+      schedule_next_attempt (self);
+      g_object_unref (self);
+    }
+  else if (priv->attempts == NULL)
+    {
+      socks5_error (self);
+    }
+}
 
-        return -1;
+static void
+streamhost_attempt_succeeded (StreamhostAttempt *attempt)
+{
+  GabbleBytestreamSocks5 *self = attempt->self;
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  GibberTransport *transport = attempt->transport;
+  gint64 latency = g_get_monotonic_time () - attempt->started;
+
+  DEBUG ("SOCKS5 handshake with streamhost %s (%s:%u) done after %"
+      G_GINT64_FORMAT " ms; cancelling %u other attempts",
+      attempt->streamhost->jid, attempt->streamhost->host,
+      attempt->streamhost->port, latency / G_TIME_SPAN_MILLISECOND,
+      g_slist_length (priv->attempts) - 1);
+
+  streamhost_record (self, attempt->streamhost, TRUE, latency);
+  priv->used_streamhost = attempt->streamhost;
+
+  /* Take the transport away from the attempt before getting rid of them */
+  priv->attempts = g_slist_remove (priv->attempts, attempt);
+  g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, attempt);
+  gibber_transport_set_handler (transport, NULL, NULL);
+  attempt->transport = NULL;
+  cancel_streamhost_attempts (self);
 
-      case SOCKS5_STATE_INITIATOR_AWAITING_COMMAND:
-        /* The client has been authorized and we are waiting for a command,
-         * the only one supported by the SOCKS5 bytestreams XEP is
-         * CONNECT with:
-         *  - ATYP = DOMAIN
-         *  - PORT = 0
-         *  - DOMAIN = SHA1(sid + initiator + target)
-         */
-        if (string->len < SOCKS5_MIN_LENGTH)
-          return 0;
+  set_transport (self, transport);
+  g_object_unref (transport);
 
-        addr_len = (guint8) string->str[4];
-        /* the first byte is the length */
-        addr_len += 1;
+  /* Anything after the CONNECT reply is data */
+  g_string_append_len (priv->read_buffer, attempt->read_buffer->str,
+      attempt->read_buffer->len);
+  streamhost_attempt_free (attempt);
 
-        if ((guint8) string->len < SOCKS5_MIN_LENGTH + addr_len)
-          /* We didn't receive the full packet yet */
-          return 0;
+  g_object_ref (self);
+  target_got_connect_reply (self);
+  socks5_process_read_buffer (self);
+  g_object_unref (self);
+}
 
-        if (string->str[0] != SOCKS5_VERSION ||
-            string->str[1] != SOCKS5_CMD_CONNECT ||
-            string->str[2] != SOCKS5_RESERVED ||
-            string->str[3] != SOCKS5_ATYP_DOMAIN ||
-            /* first half of the port number */
-            string->str[4 + addr_len] != 0 ||
-            /* second half of the port number */
-            string->str[5 + addr_len] != 0)
-          {
-            DEBUG ("Invalid SOCKS5 connect message");
+static gboolean
+streamhost_attempt_timer_cb (gpointer user_data)
+{
+  StreamhostAttempt *attempt = user_data;
 
-            socks5_error (self);
-            return -1;
-          }
+  DEBUG ("Timed out connecting to streamhost %s", attempt->streamhost->jid);
 
-        domain = compute_domain (priv->stream_id, priv->self_full_jid,
-            priv->peer_jid);
+  attempt->timer_id = 0;
+  streamhost_attempt_failed (attempt);
+  return FALSE;
+}
 
-        if (!check_domain (&string->str[5], addr_len - 1, domain))
-          {
-            DEBUG ("Reject connection to prevent spoofing");
-            socks5_close_transport (self);
-            socks5_error (self);
-            g_free (domain);
-            return -1;
-          }
+static void
+streamhost_attempt_start_timer (StreamhostAttempt *attempt,
+                                guint seconds)
+{
+  if (attempt->timer_id != 0)
+    g_source_remove (attempt->timer_id);
 
-        msg[0] = SOCKS5_VERSION;
-        msg[1] = SOCKS5_STATUS_OK;
-        msg[2] = SOCKS5_RESERVED;
-        msg[3] = SOCKS5_ATYP_DOMAIN;
-        msg[4] = SHA1_LENGTH;
-        /* Domain name: SHA-1(sid + initiator + target) */
-        memcpy (&msg[5], domain, 40);
-        /* Port: 0 */
-        msg[45] = 0x00;
-        msg[46] = 0x00;
+  attempt->timer_id = g_timeout_add_seconds (seconds,
+      streamhost_attempt_timer_cb, attempt);
+}
 
-        g_free (domain);
+static void
+streamhost_attempt_connected_cb (GibberTransport *transport,
+                                 StreamhostAttempt *attempt)
+{
+  DEBUG ("connected to streamhost %s. Sending auth request",
+      attempt->streamhost->jid);
 
-        DEBUG ("Received CONNECT cmd. Sending CONNECT reply");
-        write_to_transport (self, msg, 47, NULL);
+  socks5_send_auth_request (transport);
+  attempt->state = SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT;
 
-        priv->socks5_state = SOCKS5_STATE_CONNECTED;
+  /* The streamhost could accept the connection and never answer */
+  streamhost_attempt_start_timer (attempt, CONNECT_TIMEOUT);
+}
 
-        /* Sock5 is connected but the bytestream is not open yet as we need
-         * to wait for the IQ reply. Stop reading until the bytestream
-         * is open to avoid data loss. */
-        gibber_transport_block_receiving (priv->transport, TRUE);
+static void
+streamhost_attempt_disconnected_cb (GibberTransport *transport,
+                                    StreamhostAttempt *attempt)
+{
+  streamhost_attempt_failed (attempt);
+}
 
-        DEBUG ("sock5 stream connected. Stop to listen for connections");
-        g_assert (priv->listener != NULL);
-        tp_clear_object (&priv->listener);
+static void
+streamhost_attempt_handler (GibberTransport *transport,
+                            GibberBuffer *data,
+                            gpointer user_data)
+{
+  StreamhostAttempt *attempt = user_data;
+  gssize used;
 
-        return SOCKS5_MIN_LENGTH + addr_len;
+  g_string_append_len (attempt->read_buffer, (const gchar *) data->data,
+      data->length);
 
-      case SOCKS5_STATE_CONNECTED:
-        /* We are connected, everything we receive now is data */
+  if (attempt->state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
+    {
+      used = socks5_parse_auth_reply (attempt->read_buffer);
+      if (used == 0)
+        return;
 
-        /* store the buffer len because if something went wront in the
-         * data-received callback, the bytestream could be freed and so the
-         * priv->read_buffer */
-        len = string->len;
-        g_signal_emit_by_name (G_OBJECT (self), "data-received",
-            priv->peer_handle, string);
+      if (used < 0)
+        {
+          streamhost_attempt_failed (attempt);
+          return;
+        }
 
-        return len;
+      g_string_erase (attempt->read_buffer, 0, used);
 
-      case SOCKS5_STATE_ERROR:
-        /* An error occurred and the channel will be closed in an idle
-         * callback, so let's just throw away the data we receive */
-        DEBUG ("An error occurred, throwing away received data");
-        return string->len;
+      DEBUG ("Received auth reply from %s. Sending CONNECT command",
+          attempt->streamhost->jid);
+      socks5_send_connect_request (attempt->self, transport, TRUE);
+      attempt->state = SOCKS5_STATE_TARGET_CONNECT_REQUESTED;
 
-      case SOCKS5_STATE_TARGET_TRYING_CONNECT:
-      case SOCKS5_STATE_INITIATOR_TRYING_CONNECT:
-        DEBUG ("Impossible to receive data when not yet connected to the "
-            "socket");
-        break;
+      /* Older version of Gabble (pre 0.7.22) are bugged and just send 2
+       * bytes as CONNECT reply. We set a timer to not wait the full reply
+       * forever if we are connected to such Gabble.
+       * Once timed out, the SOCKS5 negotiation will fail and Gabble
+       * will switch to IBB as a fallback. */
+      streamhost_attempt_start_timer (attempt, CONNECT_REPLY_TIMEOUT);
+    }
 
-      case SOCKS5_STATE_INITIATOR_OFFER_SENT:
-        DEBUG ("Shouldn't receive data when we just sent the offer");
-        break;
+  if (attempt->state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
+    {
+      used = socks5_parse_connect_reply (attempt->self, attempt->read_buffer,
+          TRUE);
+      if (used == 0)
+        return;
 
-      case SOCKS5_STATE_INITIATOR_ACTIVATION_SENT:
-        DEBUG ("Shouldn't receive data before we received activation reply");
-        break;
+      if (used < 0)
+        {
+          streamhost_attempt_failed (attempt);
+          return;
+        }
 
-      case SOCKS5_STATE_INVALID:
-        DEBUG ("Invalid SOCKS5 state");
-        break;
+      g_string_erase (attempt->read_buffer, 0, used);
+      streamhost_attempt_succeeded (attempt);
     }
-
-  g_assert_not_reached ();
-  return string->len;
 }
 
+static gboolean stagger_timer_cb (gpointer user_data);
+
 static void
-transport_handler (GibberTransport *transport,
-                   GibberBuffer *data,
-                   gpointer user_data)
+schedule_next_attempt (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  if (priv->stagger_timer_id != 0 || priv->attempts == NULL ||
+      priv->next_streamhost == NULL)
+    return;
+
+  priv->stagger_timer_id = g_timeout_add (STREAMHOST_STAGGER_MS,
+      stagger_timer_cb, self);
+}
 
+static gboolean
+stagger_timer_cb (gpointer user_data)
 {
   GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (user_data);
   GabbleBytestreamSocks5Private *priv =
       GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
-  gssize used_bytes;
 
-  g_assert (priv->read_buffer != NULL);
-  g_string_append_len (priv->read_buffer, (const gchar *) data->data,
-      data->length);
+  priv->stagger_timer_id = 0;
 
-  /* If something goes wrong in socks5_handle_received_data, the bytestream
-   * could be closed and disposed. Ref it to artificially keep this bytestream
-   * object alive while we are in this function. */
+  /* Starting an attempt can fail straight away and end the whole thing */
   g_object_ref (self);
 
-  do
+  if (g_slist_length (priv->attempts) < STREAMHOST_MAX_ATTEMPTS)
     {
-      /* socks5_handle_received_data() processes the data and returns the
-       * number of bytes that have been used. 0 means that there is not enough
-       * data to do anything, so we just wait for more data from the socket */
-      used_bytes = socks5_handle_received_data (self, priv->read_buffer);
-
-      if (priv->read_buffer == NULL)
-        /* If something did wrong in socks5_handle_received_data, the
-         * bytestream can be closed and so destroyed. */
-        break;
-
-      g_string_erase (priv->read_buffer, 0, used_bytes);
+      DEBUG ("no streamhost has answered yet; trying another one as well");
+      start_next_attempt (self);
     }
-  while (used_bytes > 0 && priv->read_buffer->len > 0);
+
+  schedule_next_attempt (self);
 
   g_object_unref (self);
+  return FALSE;
 }
 
 static void
-socks5_connect (GabbleBytestreamSocks5 *self)
+start_next_attempt (GabbleBytestreamSocks5 *self)
 {
   GabbleBytestreamSocks5Private *priv =
       GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
-  Streamhost* streamhost;
+  Streamhost *streamhost;
+  StreamhostAttempt *attempt;
   GibberTCPTransport *transport;
 
-  priv->socks5_state = SOCKS5_STATE_TARGET_TRYING_CONNECT;
-
-  if (priv->streamhosts != NULL)
-    {
-      streamhost = priv->streamhosts->data;
-    }
-  else
-    {
-      DEBUG ("No more streamhosts to try, closing");
-
-      socks5_error (self);
-      return;
-    }
+  g_assert (priv->next_streamhost != NULL);
+  streamhost = priv->next_streamhost->data;
+  priv->next_streamhost = priv->next_streamhost->next;
 
   DEBUG ("Trying streamhost %s on port %d", streamhost->host,
       streamhost->port);
 
   transport = gibber_tcp_transport_new ();
-  set_transport (self, GIBBER_TRANSPORT (transport));
-  g_object_unref (transport);
+
+  attempt = g_slice_new0 (StreamhostAttempt);
+  attempt->self = self;
+  attempt->streamhost = streamhost;
+  attempt->transport = g_object_ref (transport);
+  attempt->state = SOCKS5_STATE_TARGET_TRYING_CONNECT;
+  attempt->read_buffer = g_string_sized_new (SOCKS5_MIN_LENGTH + 256);
+  attempt->started = g_get_monotonic_time ();
+  priv->attempts = g_slist_prepend (priv->attempts, attempt);
+
+  gibber_transport_set_handler (attempt->transport,
+      streamhost_attempt_handler, attempt);
+  g_signal_connect (transport, "connected",
+      G_CALLBACK (streamhost_attempt_connected_cb), attempt);
+  g_signal_connect (transport, "disconnected",
+      G_CALLBACK (streamhost_attempt_disconnected_cb), attempt);
 
   /* We don't wait to wait for the TCP timeout is the host is unreachable */
-  start_timer (self, CONNECT_TIMEOUT);
+  streamhost_attempt_start_timer (attempt, CONNECT_TIMEOUT);
 
+  /* This can fail, and so free the attempt, before returning */
   gibber_tcp_transport_connect (transport, streamhost->host,
       streamhost->port);
+  g_object_unref (transport);
 
   /* We'll send the auth request once the transport is connected */
 }
 
+static void
+socks5_connect (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  GSList *l;
+
+  priv->socks5_state = SOCKS5_STATE_TARGET_TRYING_CONNECT;
+
+  if (priv->streamhosts == NULL)
+    {
+      DEBUG ("No streamhosts to try, closing");
+
+      socks5_error (self);
+      return;
+    }
+
+  /* Try the ones which worked quickest last time first. The sort is stable,
+   * so streamhosts we don't know about stay in the initiator's order. */
+  for (l = priv->streamhosts; l != NULL; l = l->next)
+    {
+      Streamhost *streamhost = l->data;
+
+      streamhost->expected_latency = streamhost_expected_latency (self,
+          streamhost);
+    }
+
+  priv->streamhosts = g_slist_sort (priv->streamhosts,
+      streamhost_compare_expected_latency);
+  priv->next_streamhost = priv->streamhosts;
+
+  g_object_ref (self);
+  start_next_attempt (self);
+  schedule_next_attempt (self);
+  g_object_unref (self);
+}
+
 /**
  * gabble_bytestream_socks5_add_streamhost
  *
@@ -1374,6 +2049,9 @@ gabble_bytestream_socks5_send (GabbleBytestreamIface *iface,
   /* At this point we know that the bytestream has not been closed */
   g_object_unref (self);
 
+  socks5_count_relayed_data (self, len);
+  gabble_metrics_count (GABBLE_METRIC_SOCKS5_BYTES_SENT, len);
+
   if (!gibber_transport_buffer_is_empty (priv->transport))
     {
       /* We >don't want to send more data while the buffer isn't empty */
@@ -1531,6 +2209,7 @@ initiator_connected_to_proxy (GabbleBytestreamSocks5 *self)
 
   DEBUG ("connect to proxy: %s (%s:%d)", proxy->jid, proxy->host, proxy->port);
   priv->socks5_state = SOCKS5_STATE_INITIATOR_TRYING_CONNECT;
+  priv->proxy_connect_started = g_get_monotonic_time ();
 
   transport = gibber_tcp_transport_new ();
   set_transport (self, GIBBER_TRANSPORT (transport));
@@ -1591,6 +2270,10 @@ socks5_init_reply_cb (
               goto socks5_init_error;
             }
 
+          /* so nothing connecting to us directly is needed any more */
+          cancel_streamhost_attempts (self);
+          tp_clear_object (&priv->listener);
+
           priv->proxy_jid = g_strdup (jid);
           initiator_connected_to_proxy (self);
           goto out;
@@ -1610,8 +2293,10 @@ socks5_init_reply_cb (
       /* yeah, stream initiated */
       DEBUG ("Socks5 stream initiated using stream: %s", jid);
       g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
-      /* We can read data from the sock5 socket now */
+      /* We can read data from the sock5 socket now, starting with anything
+       * which came in with the CONNECT command */
       gibber_transport_block_receiving (priv->transport, FALSE);
+      socks5_process_read_buffer (self);
       goto out;
     }
 
@@ -1855,6 +2540,120 @@ get_local_interfaces_ips (void)
 
 #endif /* ! G_OS_WIN32 */
 
+static void
+incoming_attempt_failed (StreamhostAttempt *attempt)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (attempt->self);
+
+  /* The target can still get through on another of its connections, or
+   * another streamhost */
+  DEBUG ("dropping incoming connection");
+
+  priv->attempts = g_slist_remove (priv->attempts, attempt);
+  streamhost_attempt_free (attempt);
+}
+
+static void
+incoming_attempt_succeeded (StreamhostAttempt *attempt)
+{
+  GabbleBytestreamSocks5 *self = attempt->self;
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  GibberTransport *transport = attempt->transport;
+
+  DEBUG ("Received CONNECT cmd. Sending CONNECT reply; closing %u other "
+      "incoming connections", g_slist_length (priv->attempts) - 1);
+  socks5_send_connect_reply (self, transport);
+
+  /* Take the transport away from the attempt before getting rid of them */
+  priv->attempts = g_slist_remove (priv->attempts, attempt);
+  g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, attempt);
+  gibber_transport_set_handler (transport, NULL, NULL);
+  attempt->transport = NULL;
+  cancel_streamhost_attempts (self);
+
+  priv->socks5_state = SOCKS5_STATE_CONNECTED;
+  set_transport (self, transport);
+  g_object_unref (transport);
+
+  /* Anything after the CONNECT command is data, which is processed once the
+   * target tells us the bytestream is open */
+  g_string_append_len (priv->read_buffer, attempt->read_buffer->str,
+      attempt->read_buffer->len);
+  streamhost_attempt_free (attempt);
+
+  /* Sock5 is connected but the bytestream is not open yet as we need
+   * to wait for the IQ reply. Stop reading until the bytestream
+   * is open to avoid data loss. */
+  gibber_transport_block_receiving (priv->transport, TRUE);
+
+  DEBUG ("sock5 stream connected. Stop to listen for connections");
+  g_assert (priv->listener != NULL);
+  tp_clear_object (&priv->listener);
+}
+
+static void
+incoming_attempt_disconnected_cb (GibberTransport *transport,
+                                  StreamhostAttempt *attempt)
+{
+  incoming_attempt_failed (attempt);
+}
+
+static void
+incoming_attempt_handler (GibberTransport *transport,
+                          GibberBuffer *data,
+                          gpointer user_data)
+{
+  StreamhostAttempt *attempt = user_data;
+  gssize used;
+
+  g_string_append_len (attempt->read_buffer, (const gchar *) data->data,
+      data->length);
+
+  if (attempt->state == SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST)
+    {
+      guint8 msg[2] = { SOCKS5_VERSION, SOCKS5_AUTH_NONE };
+
+      used = socks5_parse_auth_request (attempt->read_buffer);
+      if (used == 0)
+        return;
+
+      if (used < 0)
+        {
+          incoming_attempt_failed (attempt);
+          return;
+        }
+
+      g_string_erase (attempt->read_buffer, 0, used);
+
+      DEBUG ("Received auth request. Sending auth reply");
+      gibber_transport_send (transport, msg, 2, NULL);
+      attempt->state = SOCKS5_STATE_INITIATOR_AWAITING_COMMAND;
+    }
+
+  if (attempt->state == SOCKS5_STATE_INITIATOR_AWAITING_COMMAND)
+    {
+      used = socks5_parse_connect_request (attempt->self,
+          attempt->read_buffer);
+      if (used == 0)
+        return;
+
+      if (used < 0)
+        {
+          incoming_attempt_failed (attempt);
+          return;
+        }
+
+      g_string_erase (attempt->read_buffer, 0, used);
+      incoming_attempt_succeeded (attempt);
+    }
+}
+
+/* The target may connect to several of the addresses we offered at once, all
+ * of them reaching this listener, so each connection does its own handshake
+ * and the first to send a valid CONNECT is used */
 static void
 new_connection_cb (GibberListener *listener,
                    GibberTransport *transport,
@@ -1865,11 +2664,30 @@ new_connection_cb (GibberListener *listener,
   GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (user_data);
   GabbleBytestreamSocks5Private *priv =
     GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  StreamhostAttempt *attempt;
+
+  if (priv->socks5_state != SOCKS5_STATE_INITIATOR_OFFER_SENT)
+    {
+      DEBUG ("not expecting a connection (state: %u); closing it",
+          priv->socks5_state);
+      gibber_transport_disconnect (transport);
+      return;
+    }
 
   DEBUG ("New connection...");
 
-  priv->socks5_state = SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST;
-  set_transport (self, transport);
+  attempt = g_slice_new0 (StreamhostAttempt);
+  attempt->self = self;
+  attempt->transport = g_object_ref (transport);
+  attempt->state = SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST;
+  attempt->read_buffer = g_string_sized_new (SOCKS5_MIN_LENGTH + 256);
+  attempt->started = g_get_monotonic_time ();
+  priv->attempts = g_slist_prepend (priv->attempts, attempt);
+
+  gibber_transport_set_handler (transport, incoming_attempt_handler,
+      attempt);
+  g_signal_connect (transport, "disconnected",
+      G_CALLBACK (incoming_attempt_disconnected_cb), attempt);
 }
 
 /*
@@ -2016,6 +2834,73 @@ gabble_bytestream_socks5_block_reading (GabbleBytestreamIface *iface,
     gibber_transport_block_receiving (priv->transport, block);
 }
 
+static void
+relay_progress_cb (GibberFdRelay *relay,
+                   GibberFdTransport *to,
+                   gsize bytes,
+                   gpointer user_data)
+{
+  GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (user_data);
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  gboolean to_peer = (GIBBER_TRANSPORT (to) == priv->transport);
+
+  socks5_count_relayed_data (self, bytes);
+  gabble_metrics_count (to_peer ? GABBLE_METRIC_SOCKS5_BYTES_SENT :
+      GABBLE_METRIC_SOCKS5_BYTES_RECEIVED, bytes);
+
+  if (priv->splice_progress == NULL)
+    return;
+
+  if (to_peer)
+    priv->splice_progress (GABBLE_BYTESTREAM_IFACE (self), 0, bytes,
+        priv->splice_progress_data);
+  else
+    priv->splice_progress (GABBLE_BYTESTREAM_IFACE (self), bytes, 0,
+        priv->splice_progress_data);
+}
+
+static gboolean
+gabble_bytestream_socks5_splice (GabbleBytestreamIface *iface,
+                                 GibberTransport *transport,
+                                 GabbleBytestreamSpliceProgress progress,
+                                 gpointer user_data)
+{
+  GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (iface);
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  GError *error = NULL;
+
+  if (priv->bytestream_state != GABBLE_BYTESTREAM_STATE_OPEN ||
+      priv->socks5_state != SOCKS5_STATE_CONNECTED ||
+      priv->relay != NULL)
+    return FALSE;
+
+  /* Anything we've already read has to go through data-received */
+  if (priv->read_buffer != NULL && priv->read_buffer->len > 0)
+    return FALSE;
+
+  if (!GIBBER_IS_FD_TRANSPORT (priv->transport) ||
+      !GIBBER_IS_FD_TRANSPORT (transport))
+    return FALSE;
+
+  priv->relay = gibber_fd_relay_new (GIBBER_FD_TRANSPORT (priv->transport),
+      GIBBER_FD_TRANSPORT (transport), relay_progress_cb, self, &error);
+
+  if (priv->relay == NULL)
+    {
+      DEBUG ("can't splice: %s", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  priv->splice_progress = progress;
+  priv->splice_progress_data = user_data;
+
+  DEBUG ("stream %s is now spliced to a local socket", priv->stream_id);
+  return TRUE;
+}
+
 static void
 bytestream_iface_init (gpointer g_iface,
                        gpointer iface_data)
@@ -2027,4 +2912,5 @@ bytestream_iface_init (gpointer g_iface,
   klass->close = gabble_bytestream_socks5_close;
   klass->accept = gabble_bytestream_socks5_accept;
   klass->block_reading = gabble_bytestream_socks5_block_reading;
+  klass->splice = gabble_bytestream_socks5_splice;
 }
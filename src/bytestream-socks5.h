@@ -67,6 +67,9 @@ void gabble_bytestream_socks5_add_streamhost (GabbleBytestreamSocks5 *socks5,
 void gabble_bytestream_socks5_connect_to_streamhost (
     GabbleBytestreamSocks5 *socks5, WockyStanza *msg);
 
+void gabble_bytestream_socks5_stats_init (void);
+void gabble_bytestream_socks5_stats_finalize (void);
+
 G_END_DECLS
 
 #endif /* #ifndef __GABBLE_BYTESTREAM_SOCKS5_H__ */
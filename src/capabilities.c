@@ -235,6 +235,109 @@ omits_content_creators (WockyNode *identity)
     }
 }
 
+/* Features we expect to see in most disco replies. These get a fixed bit in
+ * every GabbleCapabilitySet, so that comparing, merging and hashing sets made
+ * up only of these is a handful of word operations; anything else goes into
+ * a per-set overflow TpHandleSet. There can be at most
+ * KNOWN_FEATURE_WORDS * 64 of these. */
+static const gchar * const known_features[] = {
+    QUIRK_OMITS_CONTENT_CREATORS,
+    QUIRK_GOOGLE_WEBMAIL_CLIENT,
+    QUIRK_ANDROID_GTALK_CLIENT,
+
+    NS_AMP,
+    NS_BYTESTREAMS,
+    NS_CAPS,
+    NS_CHAT_STATES,
+    NS_DISCO_INFO,
+    NS_DISCO_ITEMS,
+    NS_FEATURENEG,
+    NS_FILE_TRANSFER,
+    NS_GOOGLE_CAPS,
+    NS_GOOGLE_FEAT_SESSION,
+    NS_GOOGLE_FEAT_SHARE,
+    NS_GOOGLE_FEAT_VOICE,
+    NS_GOOGLE_FEAT_VIDEO,
+    NS_GOOGLE_FEAT_CAMERA,
+    NS_GOOGLE_TRANSPORT_P2P,
+    NS_IBB,
+    NS_JINGLE015,
+    NS_JINGLE032,
+    NS_JINGLE_DESCRIPTION_AUDIO,
+    NS_JINGLE_DESCRIPTION_VIDEO,
+    NS_JINGLE_RTP,
+    NS_JINGLE_RTP_AUDIO,
+    NS_JINGLE_RTP_VIDEO,
+    NS_JINGLE_RTCP_FB,
+    NS_JINGLE_RTP_HDREXT,
+    NS_JINGLE_TRANSPORT_RAWUDP,
+    NS_JINGLE_TRANSPORT_ICEUDP,
+    NS_LAST,
+    NS_MUC,
+    NS_MUC_BYTESTREAM,
+    NS_MUC_USER,
+    NS_MUJI,
+    NS_NICK,
+    NS_NICK "+notify",
+    NS_OOB,
+    NS_OLPC_BUDDY_PROPS,
+    NS_OLPC_BUDDY_PROPS "+notify",
+    NS_OLPC_ACTIVITIES,
+    NS_OLPC_ACTIVITIES "+notify",
+    NS_OLPC_CURRENT_ACTIVITY,
+    NS_OLPC_CURRENT_ACTIVITY "+notify",
+    NS_OLPC_ACTIVITY_PROPS,
+    NS_OLPC_ACTIVITY_PROPS "+notify",
+    NS_PUBSUB,
+    NS_RECEIPTS,
+    NS_REGISTER,
+    NS_SEARCH,
+    NS_SI,
+    NS_SI_MULTIPLE,
+    NS_TUBES,
+    NS_TEMPPRES,
+    NS_TP_FT_METADATA,
+    NS_TP_FT_METADATA_SERVICE,
+    NS_VCARD_TEMP,
+    NS_VERSION,
+    NS_GEOLOC,
+    NS_GEOLOC "+notify",
+    NS_X_CONFERENCE,
+    NS_X_DATA,
+
+    /* Not used by Gabble, but advertised by many other clients */
+    "http://jabber.org/protocol/activity",
+    "http://jabber.org/protocol/activity+notify",
+    "http://jabber.org/protocol/commands",
+    "http://jabber.org/protocol/mood",
+    "http://jabber.org/protocol/mood+notify",
+    "http://jabber.org/protocol/rosterx",
+    "http://jabber.org/protocol/tune",
+    "http://jabber.org/protocol/tune+notify",
+    "http://jabber.org/protocol/xhtml-im",
+    "jabber:iq:time",
+    "jabber:x:event",
+    "urn:xmpp:attention:0",
+    "urn:xmpp:avatar:data",
+    "urn:xmpp:avatar:metadata",
+    "urn:xmpp:avatar:metadata+notify",
+    "urn:xmpp:bob",
+    "urn:xmpp:carbons:2",
+    "urn:xmpp:delay",
+    "urn:xmpp:jingle:apps:file-transfer:3",
+    "urn:xmpp:jingle:transports:ibb:1",
+    "urn:xmpp:jingle:transports:s5b:1",
+    "urn:xmpp:ping",
+    "urn:xmpp:time",
+};
+
+#define KNOWN_FEATURE_WORDS 2
+
+G_STATIC_ASSERT (G_N_ELEMENTS (known_features) <= KNOWN_FEATURE_WORDS * 64);
+
+/* gchar * in known_features => its index + 1 */
+static GHashTable *known_feature_ids = NULL;
+
 static gsize feature_handles_refcount = 0;
 /* The handles in this repository are not really handles in the tp-spec sense
  * of the word; we're just using it as a convenient implementation of a
@@ -251,6 +354,7 @@ gabble_capabilities_init (gpointer conn)
   if (feature_handles_refcount++ == 0)
     {
       const Feature *feat;
+      guint i;
 
       g_assert (feature_handles == NULL);
       /* TpDynamicHandleRepo wants a handle type, which isn't relevant here
@@ -259,6 +363,13 @@ gabble_capabilities_init (gpointer conn)
       feature_handles = tp_dynamic_handle_repo_new (TP_HANDLE_TYPE_CONTACT,
           NULL, NULL);
 
+      g_assert (known_feature_ids == NULL);
+      known_feature_ids = g_hash_table_new (g_str_hash, g_str_equal);
+
+      for (i = 0; i < G_N_ELEMENTS (known_features); i++)
+        g_hash_table_insert (known_feature_ids, (gchar *) known_features[i],
+            GUINT_TO_POINTER (i + 1));
+
       /* make the pre-cooked bundles */
 
       legacy_caps = gabble_capability_set_new ();
@@ -373,21 +484,60 @@ gabble_capabilities_finalize (gpointer conn)
       olpc_caps = NULL;
 
       tp_clear_object (&feature_handles);
+      tp_clear_pointer (&known_feature_ids, g_hash_table_unref);
     }
 }
 
 struct _GabbleCapabilitySet {
-    TpHandleSet *handles;
+    /* bit n is set if known_features[n] is in the set */
+    guint64 known[KNOWN_FEATURE_WORDS];
+    /* any other features, or NULL if there are none */
+    TpHandleSet *others;
 };
 
+/* Returns the index of @cap in known_features, or -1 */
+static gint
+known_feature_index (const gchar *cap)
+{
+  gpointer id = g_hash_table_lookup (known_feature_ids, cap);
+
+  return GPOINTER_TO_INT (id) - 1;
+}
+
+#define KNOWN_WORD(i) ((i) / 64)
+#define KNOWN_BIT(i) (G_GUINT64_CONSTANT (1) << ((i) % 64))
+
+static guint
+count_bits (guint64 word)
+{
+  guint n;
+
+  for (n = 0; word != 0; n++)
+    word &= word - 1;
+
+  return n;
+}
+
+static gboolean
+others_is_empty (const GabbleCapabilitySet *caps)
+{
+  return (caps->others == NULL || tp_handle_set_size (caps->others) == 0);
+}
+
+static TpHandleSet *
+ensure_others (GabbleCapabilitySet *caps)
+{
+  if (caps->others == NULL)
+    caps->others = tp_handle_set_new (feature_handles);
+
+  return caps->others;
+}
+
 GabbleCapabilitySet *
 gabble_capability_set_new (void)
 {
-  GabbleCapabilitySet *ret = g_slice_new0 (GabbleCapabilitySet);
-
   g_assert (feature_handles != NULL);
-  ret->handles = tp_handle_set_new (feature_handles);
-  return ret;
+  return g_slice_new0 (GabbleCapabilitySet);
 }
 
 GabbleCapabilitySet *
@@ -452,14 +602,22 @@ void
 gabble_capability_set_update (GabbleCapabilitySet *target,
     const GabbleCapabilitySet *source)
 {
-  TpIntset *ret;
+  guint i;
+
   g_return_if_fail (target != NULL);
   g_return_if_fail (source != NULL);
 
-  ret = tp_handle_set_update (target->handles,
-    tp_handle_set_peek (source->handles));
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    target->known[i] |= source->known[i];
 
-  tp_intset_destroy (ret);
+  if (!others_is_empty (source))
+    {
+      TpIntset *ret;
+
+      ret = tp_handle_set_update (ensure_others (target),
+          tp_handle_set_peek (source->others));
+      tp_intset_destroy (ret);
+    }
 }
 
 typedef struct {
@@ -483,6 +641,7 @@ gabble_capability_set_intersect (GabbleCapabilitySet *target,
     const GabbleCapabilitySet *source)
 {
   IntersectHelper data = { NULL, NULL };
+  guint i;
 
   g_return_if_fail (target != NULL);
   g_return_if_fail (source != NULL);
@@ -490,15 +649,27 @@ gabble_capability_set_intersect (GabbleCapabilitySet *target,
   if (target == source)
     return;
 
-  data.intersect_with = source->handles;
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    target->known[i] &= source->known[i];
 
-  tp_handle_set_foreach (target->handles, intersect_helper, &data);
+  if (target->others == NULL)
+    return;
+
+  if (others_is_empty (source))
+    {
+      tp_clear_pointer (&target->others, tp_handle_set_destroy);
+      return;
+    }
+
+  data.intersect_with = source->others;
+
+  tp_handle_set_foreach (target->others, intersect_helper, &data);
 
   while (data.deleted != NULL)
     {
       DEBUG ("dropping %s", tp_handle_inspect (feature_handles,
             GPOINTER_TO_UINT (data.deleted->data)));
-      tp_handle_set_remove (target->handles,
+      tp_handle_set_remove (target->others,
           GPOINTER_TO_UINT (data.deleted->data));
       data.deleted = g_slist_delete_link (data.deleted, data.deleted);
     }
@@ -516,6 +687,8 @@ void
 gabble_capability_set_exclude (GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *removed)
 {
+  guint i;
+
   g_return_if_fail (caps != NULL);
   g_return_if_fail (removed != NULL);
 
@@ -525,7 +698,11 @@ gabble_capability_set_exclude (GabbleCapabilitySet *caps,
       return;
     }
 
-  tp_handle_set_foreach (removed->handles, remove_from_set, caps->handles);
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    caps->known[i] &= ~removed->known[i];
+
+  if (caps->others != NULL && removed->others != NULL)
+    tp_handle_set_foreach (removed->others, remove_from_set, caps->others);
 }
 
 void
@@ -533,12 +710,21 @@ gabble_capability_set_add (GabbleCapabilitySet *caps,
     const gchar *cap)
 {
   TpHandle handle;
+  gint i;
 
   g_return_if_fail (caps != NULL);
   g_return_if_fail (cap != NULL);
 
+  i = known_feature_index (cap);
+
+  if (i >= 0)
+    {
+      caps->known[KNOWN_WORD (i)] |= KNOWN_BIT (i);
+      return;
+    }
+
   handle = tp_handle_ensure (feature_handles, cap, NULL, NULL);
-  tp_handle_set_add (caps->handles, handle);
+  tp_handle_set_add (ensure_others (caps), handle);
 }
 
 gboolean
@@ -546,16 +732,30 @@ gabble_capability_set_remove (GabbleCapabilitySet *caps,
     const gchar *cap)
 {
   TpHandle handle;
+  gint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (cap != NULL, FALSE);
 
+  i = known_feature_index (cap);
+
+  if (i >= 0)
+    {
+      gboolean was_member = (caps->known[KNOWN_WORD (i)] & KNOWN_BIT (i)) != 0;
+
+      caps->known[KNOWN_WORD (i)] &= ~KNOWN_BIT (i);
+      return was_member;
+    }
+
+  if (caps->others == NULL)
+    return FALSE;
+
   handle = tp_handle_lookup (feature_handles, cap, NULL, NULL);
 
   if (handle == 0)
     return FALSE;
 
-  return tp_handle_set_remove (caps->handles, handle);
+  return tp_handle_set_remove (caps->others, handle);
 }
 
 void
@@ -563,9 +763,8 @@ gabble_capability_set_clear (GabbleCapabilitySet *caps)
 {
   g_return_if_fail (caps != NULL);
 
-  /* There is no tp_handle_set_clear, so do the next best thing */
-  tp_handle_set_destroy (caps->handles);
-  caps->handles = tp_handle_set_new (feature_handles);
+  memset (caps->known, 0, sizeof (caps->known));
+  tp_clear_pointer (&caps->others, tp_handle_set_destroy);
 }
 
 void
@@ -573,15 +772,25 @@ gabble_capability_set_free (GabbleCapabilitySet *caps)
 {
   g_return_if_fail (caps != NULL);
 
-  tp_handle_set_destroy (caps->handles);
+  tp_clear_pointer (&caps->others, tp_handle_set_destroy);
   g_slice_free (GabbleCapabilitySet, caps);
 }
 
 gint
 gabble_capability_set_size (const GabbleCapabilitySet *caps)
 {
+  gint size = 0;
+  guint i;
+
   g_return_val_if_fail (caps != NULL, 0);
-  return tp_handle_set_size (caps->handles);
+
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    size += count_bits (caps->known[i]);
+
+  if (caps->others != NULL)
+    size += tp_handle_set_size (caps->others);
+
+  return size;
 }
 
 /* By design, this function can be used as a GabbleCapabilitySetPredicate */
@@ -590,10 +799,19 @@ gabble_capability_set_has (const GabbleCapabilitySet *caps,
     const gchar *cap)
 {
   TpHandle handle;
+  gint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (cap != NULL, FALSE);
 
+  i = known_feature_index (cap);
+
+  if (i >= 0)
+    return (caps->known[KNOWN_WORD (i)] & KNOWN_BIT (i)) != 0;
+
+  if (caps->others == NULL)
+    return FALSE;
+
   handle = tp_handle_lookup (feature_handles, cap, NULL, NULL);
 
   if (handle == 0)
@@ -602,7 +820,7 @@ gabble_capability_set_has (const GabbleCapabilitySet *caps,
       return FALSE;
     }
 
-  return tp_handle_set_is_member (caps->handles, handle);
+  return tp_handle_set_is_member (caps->others, handle);
 }
 
 /* By design, this function can be used as a GabbleCapabilitySetPredicate */
@@ -612,15 +830,26 @@ gabble_capability_set_has_one (const GabbleCapabilitySet *caps,
 {
   TpIntsetFastIter iter;
   guint element;
+  guint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (alternatives != NULL, FALSE);
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (alternatives->handles));
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    {
+      if ((caps->known[i] & alternatives->known[i]) != 0)
+        return TRUE;
+    }
+
+  if (caps->others == NULL || alternatives->others == NULL)
+    return FALSE;
+
+  tp_intset_fast_iter_init (&iter,
+      tp_handle_set_peek (alternatives->others));
 
   while (tp_intset_fast_iter_next (&iter, &element))
     {
-      if (tp_handle_set_is_member (caps->handles, element))
+      if (tp_handle_set_is_member (caps->others, element))
         {
           return TRUE;
         }
@@ -636,15 +865,28 @@ gabble_capability_set_at_least (const GabbleCapabilitySet *caps,
 {
   TpIntsetFastIter iter;
   guint element;
+  guint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (query != NULL, FALSE);
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (query->handles));
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    {
+      if ((query->known[i] & ~caps->known[i]) != 0)
+        return FALSE;
+    }
+
+  if (others_is_empty (query))
+    return TRUE;
+
+  if (caps->others == NULL)
+    return FALSE;
+
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (query->others));
 
   while (tp_intset_fast_iter_next (&iter, &element))
     {
-      if (!tp_handle_set_is_member (caps->handles, element))
+      if (!tp_handle_set_is_member (caps->others, element))
         {
           return FALSE;
         }
@@ -657,11 +899,56 @@ gboolean
 gabble_capability_set_equals (const GabbleCapabilitySet *a,
     const GabbleCapabilitySet *b)
 {
+  guint i;
+
   g_return_val_if_fail (a != NULL, FALSE);
   g_return_val_if_fail (b != NULL, FALSE);
 
-  return tp_intset_is_equal (tp_handle_set_peek (a->handles),
-      tp_handle_set_peek (b->handles));
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    {
+      if (a->known[i] != b->known[i])
+        return FALSE;
+    }
+
+  if (others_is_empty (a) || others_is_empty (b))
+    return others_is_empty (a) && others_is_empty (b);
+
+  return tp_intset_is_equal (tp_handle_set_peek (a->others),
+      tp_handle_set_peek (b->others));
+}
+
+/*
+ * gabble_capability_set_hash:
+ *
+ * Returns: a hash of @caps, such that sets which are
+ *  gabble_capability_set_equals() have the same hash. Unknown features are
+ *  hashed by their position in a per-process string pool, so the result is
+ *  only meaningful within one process.
+ */
+guint
+gabble_capability_set_hash (const GabbleCapabilitySet *caps)
+{
+  TpIntsetFastIter iter;
+  guint element;
+  guint hash = 0;
+  guint i;
+
+  g_return_val_if_fail (caps != NULL, 0);
+
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    hash = (hash * 31) + (guint) (caps->known[i] ^ (caps->known[i] >> 32));
+
+  if (caps->others == NULL)
+    return hash;
+
+  /* The fast iterator's order is not defined, so combine these with an
+   * order-independent operation. */
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (caps->others));
+
+  while (tp_intset_fast_iter_next (&iter, &element))
+    hash ^= element * 2654435761u;
+
+  return hash;
 }
 
 /* Does not iterate over quirks, only real features. */
@@ -671,11 +958,22 @@ gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
 {
   TpIntsetFastIter iter;
   guint element;
+  guint i;
 
   g_return_if_fail (caps != NULL);
   g_return_if_fail (func != NULL);
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (caps->handles));
+  for (i = 0; i < G_N_ELEMENTS (known_features); i++)
+    {
+      if ((caps->known[KNOWN_WORD (i)] & KNOWN_BIT (i)) != 0 &&
+          known_features[i][0] != QUIRK_PREFIX_CHAR)
+        func ((gchar *) known_features[i], user_data);
+    }
+
+  if (caps->others == NULL)
+    return;
+
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (caps->others));
 
   while (tp_intset_fast_iter_next (&iter, &element))
     {
@@ -688,6 +986,35 @@ gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
     }
 }
 
+static void
+append_feature (GString *ret,
+    const gchar *var,
+    const gchar *indent)
+{
+  if (var[0] == QUIRK_PREFIX_CHAR)
+    {
+      g_string_append_printf (ret, "%sQuirk:   %s\n", indent, var + 1);
+    }
+  else
+    {
+      g_string_append_printf (ret, "%sFeature: %s\n", indent, var);
+    }
+}
+
+static void
+append_known (GString *ret,
+    const guint64 *known,
+    const gchar *indent)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (known_features); i++)
+    {
+      if ((known[KNOWN_WORD (i)] & KNOWN_BIT (i)) != 0)
+        append_feature (ret, known_features[i], indent);
+    }
+}
+
 static void
 append_intset (GString *ret,
     const TpIntset *cap_ints,
@@ -704,14 +1031,7 @@ append_intset (GString *ret,
 
       g_return_if_fail (var != NULL);
 
-      if (var[0] == QUIRK_PREFIX_CHAR)
-        {
-          g_string_append_printf (ret, "%sQuirk:   %s\n", indent, var + 1);
-        }
-      else
-        {
-          g_string_append_printf (ret, "%sFeature: %s\n", indent, var);
-        }
+      append_feature (ret, var, indent);
     }
 }
 
@@ -728,7 +1048,11 @@ gabble_capability_set_dump (const GabbleCapabilitySet *caps,
 
   ret = g_string_new (indent);
   g_string_append (ret, "--begin--\n");
-  append_intset (ret, tp_handle_set_peek (caps->handles), indent);
+  append_known (ret, caps->known, indent);
+
+  if (caps->others != NULL)
+    append_intset (ret, tp_handle_set_peek (caps->others), indent);
+
   g_string_append (ret, indent);
   g_string_append (ret, "--end--\n");
   return g_string_free (ret, FALSE);
@@ -739,34 +1063,50 @@ gabble_capability_set_dump_diff (const GabbleCapabilitySet *old_caps,
     const GabbleCapabilitySet *new_caps,
     const gchar *indent)
 {
-  TpIntset *old_ints, *new_ints, *rem, *add;
+  guint64 known_rem[KNOWN_FEATURE_WORDS], known_add[KNOWN_FEATURE_WORDS];
+  TpIntset *empty, *old_ints, *new_ints, *rem, *add;
+  gboolean any_rem = FALSE, any_add = FALSE;
   GString *ret;
+  guint i;
 
   g_return_val_if_fail (old_caps != NULL, NULL);
   g_return_val_if_fail (new_caps != NULL, NULL);
 
-  old_ints = tp_handle_set_peek (old_caps->handles);
-  new_ints = tp_handle_set_peek (new_caps->handles);
-
-  if (tp_intset_is_equal (old_ints, new_ints))
+  if (gabble_capability_set_equals (old_caps, new_caps))
     return g_strdup_printf ("%s--no change--", indent);
 
+  for (i = 0; i < KNOWN_FEATURE_WORDS; i++)
+    {
+      known_rem[i] = old_caps->known[i] & ~new_caps->known[i];
+      known_add[i] = new_caps->known[i] & ~old_caps->known[i];
+      any_rem = any_rem || (known_rem[i] != 0);
+      any_add = any_add || (known_add[i] != 0);
+    }
+
+  empty = tp_intset_new ();
+  old_ints = (old_caps->others == NULL ? empty :
+      tp_handle_set_peek (old_caps->others));
+  new_ints = (new_caps->others == NULL ? empty :
+      tp_handle_set_peek (new_caps->others));
+
   rem = tp_intset_difference (old_ints, new_ints);
   add = tp_intset_difference (new_ints, old_ints);
 
   ret = g_string_new ("");
 
-  if (!tp_intset_is_empty (rem))
+  if (any_rem || !tp_intset_is_empty (rem))
     {
       g_string_append (ret, indent);
       g_string_append (ret, "--removed--\n");
+      append_known (ret, known_rem, indent);
       append_intset (ret, rem, indent);
     }
 
-  if (!tp_intset_is_empty (add))
+  if (any_add || !tp_intset_is_empty (add))
     {
       g_string_append (ret, indent);
       g_string_append (ret, "--added--\n");
+      append_known (ret, known_add, indent);
       append_intset (ret, add, indent);
     }
 
@@ -775,6 +1115,7 @@ gabble_capability_set_dump_diff (const GabbleCapabilitySet *old_caps,
 
   tp_intset_destroy (add);
   tp_intset_destroy (rem);
+  tp_intset_destroy (empty);
 
   return g_string_free (ret, FALSE);
 }
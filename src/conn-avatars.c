@@ -27,6 +27,7 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include "base64.h"
 #include "presence.h"
 #include "presence-cache.h"
 #include "conn-presence.h"
@@ -415,8 +416,6 @@ parse_avatar (WockyNode *vcard,
   WockyNode *type_node;
   WockyNode *binval_node;
   const gchar *binval_value;
-  guchar *st;
-  gsize outlen;
 
   photo_node = wocky_node_get_child (vcard, "PHOTO");
 
@@ -456,16 +455,8 @@ parse_avatar (WockyNode *vcard,
       return FALSE;
     }
 
-  st = g_base64_decode (binval_value, &outlen);
-  *avatar = g_string_new_len ((gchar *) st, outlen);
-  g_free (st);
-
-  if (NULL == *avatar)
-    {
-      g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
-        "failed to decode avatar from base64");
-      return FALSE;
-    }
+  *avatar = g_string_new (NULL);
+  gabble_base64_decode_append (*avatar, binval_value);
 
   return TRUE;
 }
@@ -580,6 +571,22 @@ out:
 }
 
 
+/* Returns a vCard from the on-disk store containing the avatar @contact is
+ * currently advertising, or NULL. */
+static WockyNodeTree *
+dup_stored_vcard_for_current_avatar (GabbleConnection *self,
+    TpHandle contact)
+{
+  GabblePresence *presence = gabble_presence_cache_get (
+      self->presence_cache, contact);
+
+  if (presence == NULL || tp_str_empty (presence->avatar_sha1))
+    return NULL;
+
+  return gabble_vcard_manager_dup_stored_vcard_for_avatar (
+      self->vcard_manager, presence->avatar_sha1);
+}
+
 /**
  * gabble_connection_request_avatar
  *
@@ -600,6 +607,7 @@ gabble_connection_request_avatar (TpSvcConnectionInterfaceAvatars *iface,
       TP_HANDLE_TYPE_CONTACT);
   GError *err = NULL;
   WockyNode *vcard_node;
+  WockyNodeTree *stored;
 
   TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
 
@@ -616,10 +624,18 @@ gabble_connection_request_avatar (TpSvcConnectionInterfaceAvatars *iface,
       _request_avatar_cb (self->vcard_manager, NULL, contact, vcard_node, NULL,
           context);
     }
+  else if ((stored = dup_stored_vcard_for_current_avatar (self, contact))
+      != NULL)
+    {
+      _request_avatar_cb (self->vcard_manager, NULL, contact,
+          wocky_node_tree_get_top_node (stored), NULL, context);
+      g_object_unref (stored);
+    }
   else
     {
-      gabble_vcard_manager_request (self->vcard_manager, contact, 0,
-          _request_avatar_cb, context, NULL);
+      gabble_vcard_manager_request_full (self->vcard_manager, contact, 0,
+          GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, _request_avatar_cb,
+          context, NULL);
     }
 }
 
@@ -699,6 +715,7 @@ gabble_connection_request_avatars (TpSvcConnectionInterfaceAvatars *iface,
   for (i = 0; i < contacts->len; i++)
     {
       WockyNode *vcard_node;
+      WockyNodeTree *stored;
       TpHandle contact = g_array_index (contacts, TpHandle, i);
 
       if (gabble_vcard_manager_get_cached (self->vcard_manager,
@@ -706,6 +723,14 @@ gabble_connection_request_avatars (TpSvcConnectionInterfaceAvatars *iface,
         {
           emit_avatar_retrieved (iface, contact, vcard_node);
         }
+      else if ((stored = dup_stored_vcard_for_current_avatar (self, contact))
+          != NULL)
+        {
+          /* someone else's vCard, perhaps, but the same picture */
+          emit_avatar_retrieved (iface, contact,
+              wocky_node_tree_get_top_node (stored));
+          g_object_unref (stored);
+        }
       else
         {
           if (NULL == g_hash_table_lookup (self->avatar_requests,
@@ -720,8 +745,9 @@ gabble_connection_request_avatars (TpSvcConnectionInterfaceAvatars *iface,
               g_hash_table_insert (self->avatar_requests,
                   GUINT_TO_POINTER (contact), ctx);
 
-              gabble_vcard_manager_request (self->vcard_manager,
-                contact, 0, request_avatars_cb, ctx, NULL);
+              gabble_vcard_manager_request_full (self->vcard_manager,
+                contact, 0, GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND,
+                request_avatars_cb, ctx, NULL);
             }
         }
     }
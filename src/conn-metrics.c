@@ -0,0 +1,47 @@
+/*
+ * conn-metrics.c - Gabble connection code exposing metrics
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "conn-metrics.h"
+
+#include "extensions/extensions.h"
+
+#include "metrics.h"
+
+static void
+conn_metrics_get_snapshot (GabbleSvcConnectionInterfaceGabbleMetrics *iface,
+    DBusGMethodInvocation *context)
+{
+  GHashTable *snapshot = gabble_metrics_dup_snapshot ();
+
+  gabble_svc_connection_interface_gabble_metrics_return_from_get_snapshot (
+      context, snapshot);
+  g_hash_table_unref (snapshot);
+}
+
+void
+conn_metrics_iface_init (gpointer g_iface,
+    gpointer iface_data)
+{
+#define IMPLEMENT(x) \
+  gabble_svc_connection_interface_gabble_metrics_implement_##x (\
+  g_iface, conn_metrics_##x)
+  IMPLEMENT (get_snapshot);
+#undef IMPLEMENT
+}
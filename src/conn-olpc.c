@@ -2781,29 +2781,30 @@ forget_activity_invites (GabbleConnection *conn,
 }
 
 static void
-muc_channel_contact_join_cb (GabbleMucChannel *chan,
-                             TpHandle contact,
-                             GabbleOlpcActivity *activity)
+muc_channel_contacts_join_cb (GabbleMucChannel *chan,
+                              const TpIntset *contacts,
+                              GabbleOlpcActivity *activity)
 {
   GabbleConnection *conn;
   TpBaseConnection *base;
+  TpHandleSet *invitees;
+  TpIntsetFastIter iter;
+  TpHandle contact;
 
   g_object_get (activity, "connection", &conn, NULL);
   base = TP_BASE_CONNECTION (conn);
+  invitees = g_object_get_qdata ((GObject *) chan, invitees_quark ());
 
-  if (contact == tp_base_connection_get_self_handle (base))
-    {
-      /* We join the channel, forget about all invites we received about
-       * this activity */
-      forget_activity_invites (conn, activity->room);
-    }
-  else
+  tp_intset_fast_iter_init (&iter, contacts);
+  while (tp_intset_fast_iter_next (&iter, &contact))
     {
-      GQuark quark = invitees_quark ();
-      TpHandleSet *invitees;
-
-      invitees = g_object_get_qdata ((GObject *) chan, quark);
-      if (invitees != NULL)
+      if (contact == tp_base_connection_get_self_handle (base))
+        {
+          /* We join the channel, forget about all invites we received about
+           * this activity */
+          forget_activity_invites (conn, activity->room);
+        }
+      else if (invitees != NULL)
         {
           DEBUG ("contact %d joined the muc, remove the invite we sent to him",
               contact);
@@ -2849,8 +2850,8 @@ muc_factory_new_channel_cb (gpointer key,
       activity);
   g_signal_connect (chan, "pre-invite", G_CALLBACK (muc_channel_pre_invite_cb),
       activity);
-  g_signal_connect (chan, "contact-join",
-      G_CALLBACK (muc_channel_contact_join_cb), activity);
+  g_signal_connect (chan, "contacts-join",
+      G_CALLBACK (muc_channel_contacts_join_cb), activity);
 }
 
 static void
@@ -35,6 +35,7 @@
 
 #include "connection.h"
 #include "debug.h"
+#include "handler-profile.h"
 #include "plugin-loader.h"
 #include "presence-cache.h"
 #include "presence.h"
@@ -44,6 +45,15 @@
 
 #define GOOGLE_SHARED_STATUS_VERSION "2"
 
+/* Contacts' presence changes are collected and emitted together in one
+ * PresencesChanged signal, at most this many milliseconds after the first
+ * change in the batch; 0 means "when the main loop is next idle", which
+ * still coalesces all the presences in one read from the server. Raising it
+ * also collapses contacts flapping between statuses into their final one. */
+#define PRESENCES_CHANGED_MAX_DELAY 0
+/* Batches are flushed early if they reach this many contacts. */
+#define PRESENCES_CHANGED_MAX_BATCH 1000
+
 typedef enum {
     INVISIBILITY_METHOD_NONE = 0,
     INVISIBILITY_METHOD_PRESENCE_INVISIBLE, /* presence type=invisible */
@@ -82,6 +92,15 @@ struct _GabbleConnectionPresencePrivate {
 
     /* The previous presence when using shared status */
     GabblePresenceId previous_shared_status;
+
+    /* contacts whose presence has changed since we last emitted
+     * PresencesChanged for them, and the source which will emit it */
+    TpHandleSet *presences_changed_pending;
+    guint presences_changed_id;
+    /* number of contacts' presence changes queued, and the number of
+     * signals they were coalesced into */
+    guint presences_changed_queued;
+    guint presences_changed_signals;
 };
 
 static const TpPresenceStatusOptionalArgumentSpec gabble_status_arguments[] = {
@@ -1334,8 +1353,8 @@ initial_presence_setup_cb (GObject *source_object,
   if (priv->invisibility_method == INVISIBILITY_METHOD_PRIVACY &&
       self->session != NULL)
     {
-      priv->iq_list_push_id = wocky_c2s_porter_register_handler_from_server (
-          WOCKY_C2S_PORTER (wocky_session_get_porter (self->session)),
+      priv->iq_list_push_id = gabble_handler_profile_register_from_server (
+          wocky_session_get_porter (self->session),
           WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_SET,
           WOCKY_PORTER_HANDLER_PRIORITY_NORMAL,
           iq_privacy_list_push_cb, self,
@@ -1456,9 +1475,8 @@ shared_status_setup_cb (GObject *source_object,
 
       priv->invisibility_method = INVISIBILITY_METHOD_SHARED_STATUS;
 
-      priv->iq_shared_status_cb = wocky_c2s_porter_register_handler_from_server (
-          WOCKY_C2S_PORTER (porter),
-          WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_SET,
+      priv->iq_shared_status_cb = gabble_handler_profile_register_from_server (
+          porter, WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_SET,
           WOCKY_PORTER_HANDLER_PRIORITY_NORMAL,
           iq_shared_status_changed_cb, self,
           '(', "query",
@@ -1838,6 +1856,39 @@ OUT:
 }
 
 
+static gboolean
+flush_presences_changed (gpointer user_data)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (user_data);
+  GabbleConnectionPresencePrivate *priv = conn->presence_priv;
+  TpHandleSet *pending = priv->presences_changed_pending;
+  GArray *handles;
+
+  priv->presences_changed_id = 0;
+
+  if (tp_handle_set_is_empty (pending))
+    return FALSE;
+
+  priv->presences_changed_pending = tp_handle_set_new (
+      tp_base_connection_get_handles ((TpBaseConnection *) conn,
+          TP_HANDLE_TYPE_CONTACT));
+
+  /* Repeated changes to the same contact within the batch are collapsed, so
+   * this emits their presence as it is now. */
+  handles = tp_intset_to_array (tp_handle_set_peek (pending));
+
+  priv->presences_changed_signals++;
+  DEBUG ("emitting presence for %u contacts (%u changes in %u signals "
+      "so far)", handles->len, priv->presences_changed_queued,
+      priv->presences_changed_signals);
+
+  conn_presence_emit_presence_update (conn, handles);
+
+  g_array_unref (handles);
+  tp_handle_set_destroy (pending);
+  return FALSE;
+}
+
 static void
 connection_presences_updated_cb (
     GabblePresenceCache *cache,
@@ -1845,8 +1896,32 @@ connection_presences_updated_cb (
     gpointer user_data)
 {
   GabbleConnection *conn = GABBLE_CONNECTION (user_data);
+  GabbleConnectionPresencePrivate *priv = conn->presence_priv;
+  guint i;
 
-  conn_presence_emit_presence_update (conn, handles);
+  for (i = 0; i < handles->len; i++)
+    tp_handle_set_add (priv->presences_changed_pending,
+        g_array_index (handles, TpHandle, i));
+
+  priv->presences_changed_queued += handles->len;
+
+  if (tp_handle_set_size (priv->presences_changed_pending) >=
+      PRESENCES_CHANGED_MAX_BATCH)
+    {
+      if (priv->presences_changed_id != 0)
+        g_source_remove (priv->presences_changed_id);
+
+      flush_presences_changed (conn);
+    }
+  else if (priv->presences_changed_id == 0)
+    {
+      if (PRESENCES_CHANGED_MAX_DELAY == 0)
+        priv->presences_changed_id = g_idle_add (flush_presences_changed,
+            conn);
+      else
+        priv->presences_changed_id = g_timeout_add (
+            PRESENCES_CHANGED_MAX_DELAY, flush_presences_changed, conn);
+    }
 }
 
 
@@ -1950,6 +2025,9 @@ conn_presence_init (GabbleConnection *conn)
 {
   conn->presence_priv = g_slice_new0 (GabbleConnectionPresencePrivate);
   conn->presence_priv->previous_shared_status = GABBLE_PRESENCE_UNKNOWN;
+  conn->presence_priv->presences_changed_pending = tp_handle_set_new (
+      tp_base_connection_get_handles ((TpBaseConnection *) conn,
+          TP_HANDLE_TYPE_CONTACT));
 
   g_signal_connect (conn->presence_cache, "presences-updated",
       G_CALLBACK (connection_presences_updated_cb), conn);
@@ -1974,6 +2052,12 @@ conn_presence_dispose (GabbleConnection *self)
   GabbleConnectionPresencePrivate *priv = self->presence_priv;
   WockyPorter *porter;
 
+  if (priv->presences_changed_id != 0)
+    {
+      g_source_remove (priv->presences_changed_id);
+      priv->presences_changed_id = 0;
+    }
+
   if (self->session == NULL)
     return;
 
@@ -1998,6 +2082,7 @@ conn_presence_finalize (GabbleConnection *conn)
   GabbleConnectionPresencePrivate *priv = conn->presence_priv;
 
   g_free (priv->invisible_list_name);
+  tp_handle_set_destroy (priv->presences_changed_pending);
 
   if (priv->privacy_statuses != NULL)
       g_hash_table_unref (priv->privacy_statuses);
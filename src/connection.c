@@ -53,10 +53,13 @@
 #include "conn-sidecars.h"
 #include "conn-mail-notif.h"
 #include "conn-olpc.h"
+#include "conn-metrics.h"
 #include "conn-power-saving.h"
 #include "debug.h"
 #include "disco.h"
+#include "handler-profile.h"
 #include "im-factory.h"
+#include "metrics.h"
 #include "muc-factory.h"
 #include "namespaces.h"
 #include "presence-cache.h"
@@ -82,6 +85,18 @@ static guint disco_reply_timeout = 5;
 
 #define DISCONNECT_TIMEOUT 5
 
+/* Contacts' capability changes are collected and emitted together in one
+ * ContactCapabilitiesChanged signal, at most this many milliseconds after
+ * the first change in the batch; 0 means "when the main loop is next idle",
+ * which still coalesces all the presences in one read from the server. */
+#define CAPS_CHANGED_MAX_DELAY 0
+/* Batches are flushed early if they reach this many contacts. */
+#define CAPS_CHANGED_MAX_BATCH 1000
+
+/* Maximum number of distinct capability sets whose channel classes we
+ * remember; see gabble_connection_build_contact_caps(). */
+#define CONTACT_CAPS_CACHE_SIZE 256
+
 static void gabble_conn_contact_caps_iface_init (gpointer, gpointer);
 static void conn_contact_capabilities_fill_contact_attributes (GObject *obj,
   const GArray *contacts, GHashTable *attributes_hash);
@@ -116,6 +131,8 @@ G_DEFINE_TYPE_WITH_CODE(GabbleConnection,
       tp_presence_mixin_simple_presence_iface_init);
     G_IMPLEMENT_INTERFACE (GABBLE_TYPE_SVC_CONNECTION_INTERFACE_GABBLE_DECLOAK,
       conn_decloak_iface_init);
+    G_IMPLEMENT_INTERFACE (GABBLE_TYPE_SVC_CONNECTION_INTERFACE_GABBLE_METRICS,
+      conn_metrics_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CONNECTION_INTERFACE_LOCATION,
       location_iface_init);
     G_IMPLEMENT_INTERFACE (GABBLE_TYPE_SVC_OLPC_BUDDY_INFO,
@@ -149,6 +166,7 @@ enum
     PROP_REQUIRE_ENCRYPTION,
     PROP_REGISTER,
     PROP_LOW_BANDWIDTH,
+    PROP_PARALLEL_BYTESTREAMS,
     PROP_STREAM_SERVER,
     PROP_USERNAME,
     PROP_PASSWORD,
@@ -198,6 +216,8 @@ struct _GabbleConnectionPrivate
 
   gboolean low_bandwidth;
 
+  gboolean parallel_bytestreams;
+
   guint keepalive_interval;
 
   gchar *https_proxy_server;
@@ -259,6 +279,20 @@ struct _GabbleConnectionPrivate
    * gchar * (client name) => GPtrArray<owned WockyDataForm> */
   GHashTable *client_data_forms;
 
+  /* contacts whose capabilities have changed since we last emitted
+   * ContactCapabilitiesChanged, and the source which will emit it */
+  TpHandleSet *caps_changed_pending;
+  guint caps_changed_id;
+  /* number of contacts' caps changes queued, and the number of signals
+   * they were coalesced into */
+  guint caps_changed_queued;
+  guint caps_changed_signals;
+
+  /* GabbleCapabilitySet * (owned copy) => GPtrArray * of requestable
+   * channel classes that contacts other than ourselves with those
+   * capabilities have, built by the caps channel managers */
+  GHashTable *contact_caps_cache;
+
   /* auth manager */
   GabbleAuthManager *auth_manager;
 
@@ -423,6 +457,14 @@ gabble_connection_constructor (GType type,
   g_signal_connect (self->vcard_manager, "nickname-update", G_CALLBACK
       (gabble_conn_aliasing_nickname_updated), self);
 
+  priv->caps_changed_pending = tp_handle_set_new (
+      tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT));
+  priv->contact_caps_cache = g_hash_table_new_full (
+      (GHashFunc) gabble_capability_set_hash,
+      (GEqualFunc) gabble_capability_set_equals,
+      (GDestroyNotify) gabble_capability_set_free,
+      (GDestroyNotify) g_ptr_array_unref);
+
   self->presence_cache = gabble_presence_cache_new (self);
   g_signal_connect (self->presence_cache, "nickname-update", G_CALLBACK
       (gabble_conn_aliasing_nickname_updated), self);
@@ -592,6 +634,9 @@ gabble_connection_get_property (GObject    *object,
     case PROP_LOW_BANDWIDTH:
       g_value_set_boolean (value, priv->low_bandwidth);
       break;
+    case PROP_PARALLEL_BYTESTREAMS:
+      g_value_set_boolean (value, priv->parallel_bytestreams);
+      break;
     case PROP_USERNAME:
       g_value_set_string (value, priv->username);
       break;
@@ -708,6 +753,9 @@ gabble_connection_set_property (GObject      *object,
     case PROP_LOW_BANDWIDTH:
       priv->low_bandwidth = g_value_get_boolean (value);
       break;
+    case PROP_PARALLEL_BYTESTREAMS:
+      priv->parallel_bytestreams = g_value_get_boolean (value);
+      break;
     case PROP_STREAM_SERVER:
       g_free (priv->stream_server);
       priv->stream_server = g_value_dup_string (value);
@@ -883,6 +931,7 @@ static const gchar *implemented_interfaces[] = {
     TP_IFACE_CONNECTION_INTERFACE_CONTACT_CAPABILITIES,
     TP_IFACE_CONNECTION_INTERFACE_LOCATION,
     GABBLE_IFACE_CONNECTION_INTERFACE_GABBLE_DECLOAK,
+    GABBLE_IFACE_CONNECTION_INTERFACE_GABBLE_METRICS,
     TP_IFACE_CONNECTION_INTERFACE_SIDECARS1,
     TP_IFACE_CONNECTION_INTERFACE_CLIENT_TYPES,
     TP_IFACE_CONNECTION_INTERFACE_ADDRESSING,
@@ -1065,6 +1114,14 @@ gabble_connection_class_init (GabbleConnectionClass *gabble_connection_class)
           FALSE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (object_class, PROP_PARALLEL_BYTESTREAMS,
+      g_param_spec_boolean (
+          "parallel-bytestreams", "Use IBB and SOCKS5 in parallel",
+          "Whether to offer and accept carrying bytestream data in-band while "
+          "SOCKS5 is being set up.",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_property (object_class, PROP_STREAM_SERVER,
       g_param_spec_string (
           "stream-server", "The server name used to initialise the stream.",
@@ -1300,6 +1357,15 @@ gabble_connection_dispose (GObject *object)
 
   g_hash_table_unref (priv->client_data_forms);
 
+  if (priv->caps_changed_id != 0)
+    {
+      g_source_remove (priv->caps_changed_id);
+      priv->caps_changed_id = 0;
+    }
+
+  tp_clear_pointer (&priv->caps_changed_pending, tp_handle_set_destroy);
+  tp_clear_pointer (&priv->contact_caps_cache, g_hash_table_unref);
+
   if (priv->disconnect_timer != 0)
     {
       g_source_remove (priv->disconnect_timer);
@@ -1904,6 +1970,25 @@ connector_connected (GabbleConnection *self,
       return;
     }
 
+  if (conn != NULL)
+    {
+      WockyStanza *features = NULL;
+
+      g_object_get (priv->connector, "features", &features, NULL);
+
+      if (features != NULL)
+        {
+          if (wocky_node_get_child_ns (wocky_stanza_get_top_node (features),
+                "ver", NS_ROSTER_VER) != NULL)
+            {
+              DEBUG ("Server supports roster versioning");
+              self->features |= GABBLE_CONNECTION_FEATURES_ROSTER_VERSIONING;
+            }
+
+          g_object_unref (features);
+        }
+    }
+
   /* We don't need the connector any more */
   tp_clear_object (&priv->connector);
 
@@ -1919,6 +2004,7 @@ connector_connected (GabbleConnection *self,
 
   self->session = wocky_session_new_with_connection (conn, jid);
   priv->porter = wocky_session_get_porter (self->session);
+  gabble_handler_profile_watch_porter (priv->porter);
 
   g_assert (WOCKY_IS_C2S_PORTER (priv->porter));
   priv->pinger = wocky_ping_new (WOCKY_C2S_PORTER (priv->porter),
@@ -2610,6 +2696,7 @@ iq_disco_cb (WockyPorter *porter,
   const GabbleCapabilitySet *features = NULL;
   const GPtrArray *identities = NULL;
   const GPtrArray *data_forms = NULL;
+  gint64 start = g_get_monotonic_time ();
 
   /* query's existence is checked by WockyPorter before this function is called */
   query = wocky_node_get_child (wocky_stanza_get_top_node (stanza), "query");
@@ -2729,6 +2816,7 @@ iq_disco_cb (WockyPorter *porter,
     }
 
   g_object_unref (result);
+  gabble_metrics_record_since (GABBLE_METRIC_HANDLE_IQ, start);
 
   return TRUE;
 }
@@ -3071,17 +3159,18 @@ connection_initial_presence_cb (GObject *source_object,
  *                          D-BUS EXPORTED METHODS                          *
  ****************************************************************************/
 
-static void gabble_free_rcc_list (GPtrArray *rccs)
-{
-  g_boxed_free (TP_ARRAY_TYPE_REQUESTABLE_CHANNEL_CLASS_LIST, rccs);
-}
-
 /**
  * gabble_connection_build_contact_caps:
  * @handle: a contact
  * @caps: @handle's XMPP capabilities
  *
- * Returns: an array containing the channel classes corresponding to @caps.
+ * The caps channel managers' answer only depends on @caps for contacts other
+ * than ourselves, so the result is shared between all such contacts with
+ * equal capabilities until the next UpdateCapabilities() call.
+ *
+ * Returns: (transfer full): a possibly-shared array containing the channel
+ *  classes corresponding to @caps, which must not be modified, and must be
+ *  released with g_ptr_array_unref()
  */
 static GPtrArray *
 gabble_connection_build_contact_caps (
@@ -3090,9 +3179,22 @@ gabble_connection_build_contact_caps (
     const GabbleCapabilitySet *caps)
 {
   TpBaseConnection *base_conn = TP_BASE_CONNECTION (self);
+  GabbleConnectionPrivate *priv = self->priv;
+  gboolean cacheable =
+      (handle != tp_base_connection_get_self_handle (base_conn));
   TpChannelManagerIter iter;
   TpChannelManager *manager;
-  GPtrArray *ret = g_ptr_array_new ();
+  GPtrArray *ret;
+
+  if (cacheable)
+    {
+      ret = g_hash_table_lookup (priv->contact_caps_cache, caps);
+
+      if (ret != NULL)
+        return g_ptr_array_ref (ret);
+    }
+
+  ret = g_ptr_array_new_with_free_func ((GDestroyNotify) tp_value_array_free);
 
   tp_base_connection_channel_manager_iter_init (&iter, base_conn);
 
@@ -3105,6 +3207,17 @@ gabble_connection_build_contact_caps (
         }
     }
 
+  if (cacheable)
+    {
+      /* Anyone still using the old arrays holds their own reference. */
+      if (g_hash_table_size (priv->contact_caps_cache) >=
+          CONTACT_CAPS_CACHE_SIZE)
+        g_hash_table_remove_all (priv->contact_caps_cache);
+
+      g_hash_table_insert (priv->contact_caps_cache,
+          gabble_capability_set_copy (caps), g_ptr_array_ref (ret));
+    }
+
   return ret;
 }
 
@@ -3124,7 +3237,7 @@ _emit_capabilities_changed (GabbleConnection *conn,
   caps_arr = gabble_connection_build_contact_caps (conn, handle, new_set);
 
   hash = g_hash_table_new_full (NULL, NULL, NULL,
-      (GDestroyNotify) gabble_free_rcc_list);
+      (GDestroyNotify) g_ptr_array_unref);
   g_hash_table_insert (hash, GUINT_TO_POINTER (handle), caps_arr);
 
   tp_svc_connection_interface_contact_capabilities_emit_contact_capabilities_changed (
@@ -3171,6 +3284,89 @@ gabble_connection_get_handle_contact_capabilities (
   return gabble_connection_build_contact_caps (self, handle, caps);
 }
 
+static gboolean
+flush_capabilities_changed (gpointer user_data)
+{
+  GabbleConnection *self = GABBLE_CONNECTION (user_data);
+  GabbleConnectionPrivate *priv = self->priv;
+  TpIntsetFastIter iter;
+  TpHandle handle;
+  GHashTable *hash;
+
+  priv->caps_changed_id = 0;
+
+  if (tp_handle_set_is_empty (priv->caps_changed_pending))
+    return FALSE;
+
+  /* o.f.T.C.ContactCapabilities */
+  hash = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) g_ptr_array_unref);
+
+  tp_intset_fast_iter_init (&iter,
+      tp_handle_set_peek (priv->caps_changed_pending));
+
+  /* Repeated changes to the same contact within the batch are collapsed, so
+   * look up their capabilities as they are now. */
+  while (tp_intset_fast_iter_next (&iter, &handle))
+    g_hash_table_insert (hash, GUINT_TO_POINTER (handle),
+        gabble_connection_get_handle_contact_capabilities (self, handle));
+
+  priv->caps_changed_signals++;
+  DEBUG ("emitting capabilities for %u contacts (%u changes in %u signals "
+      "so far)", g_hash_table_size (hash), priv->caps_changed_queued,
+      priv->caps_changed_signals);
+
+  tp_handle_set_destroy (priv->caps_changed_pending);
+  priv->caps_changed_pending = tp_handle_set_new (
+      tp_base_connection_get_handles ((TpBaseConnection *) self,
+          TP_HANDLE_TYPE_CONTACT));
+
+  tp_svc_connection_interface_contact_capabilities_emit_contact_capabilities_changed (
+      self, hash);
+
+  g_hash_table_unref (hash);
+  return FALSE;
+}
+
+/*
+ * queue_capabilities_changed:
+ *
+ * Like _emit_capabilities_changed(), but coalesces changes to many contacts
+ * into a single signal; see CAPS_CHANGED_MAX_DELAY.
+ */
+static void
+queue_capabilities_changed (GabbleConnection *self,
+    TpHandle handle,
+    const GabbleCapabilitySet *old_set,
+    const GabbleCapabilitySet *new_set)
+{
+  GabbleConnectionPrivate *priv = self->priv;
+
+  if (gabble_capability_set_equals (old_set, new_set))
+    return;
+
+  priv->caps_changed_queued++;
+  tp_handle_set_add (priv->caps_changed_pending, handle);
+
+  if (tp_handle_set_size (priv->caps_changed_pending) >=
+      CAPS_CHANGED_MAX_BATCH)
+    {
+      if (priv->caps_changed_id != 0)
+        g_source_remove (priv->caps_changed_id);
+
+      flush_capabilities_changed (self);
+    }
+  else if (priv->caps_changed_id == 0)
+    {
+      if (CAPS_CHANGED_MAX_DELAY == 0)
+        priv->caps_changed_id = g_idle_add (flush_capabilities_changed,
+            self);
+      else
+        priv->caps_changed_id = g_timeout_add (CAPS_CHANGED_MAX_DELAY,
+            flush_capabilities_changed, self);
+    }
+}
+
 static void
 connection_capabilities_update_cb (GabblePresenceCache *cache,
     TpHandle handle,
@@ -3180,7 +3376,7 @@ connection_capabilities_update_cb (GabblePresenceCache *cache,
 {
   GabbleConnection *conn = GABBLE_CONNECTION (user_data);
 
-  _emit_capabilities_changed (conn, handle, old_cap_set, new_cap_set);
+  queue_capabilities_changed (conn, handle, old_cap_set, new_cap_set);
 }
 
 static const gchar *
@@ -3310,6 +3506,10 @@ gabble_connection_update_capabilities (
    * advertising spurious caps in initial presence */
   gabble_capability_set_clear (self->priv->bonus_caps);
 
+  /* The channel managers' idea of what contacts can do may depend on what
+   * our clients can do */
+  g_hash_table_remove_all (self->priv->contact_caps_cache);
+
   DEBUG ("enter");
 
   for (i = 0; i < clients->len; i++)
@@ -3431,9 +3631,14 @@ conn_contact_capabilities_fill_contact_attributes (GObject *obj,
   for (i = 0; i < contacts->len; i++)
     {
       TpHandle handle = g_array_index (contacts, TpHandle, i);
-      GValue *val = tp_g_value_slice_new_take_boxed (
-          TP_ARRAY_TYPE_REQUESTABLE_CHANNEL_CLASS_LIST,
-          gabble_connection_get_handle_contact_capabilities (self, handle));
+      GPtrArray *arr = gabble_connection_get_handle_contact_capabilities (
+          self, handle);
+      /* The array may be shared, and freeing the GValue would free it
+       * regardless of its refcount, so the GValue needs its own copy. */
+      GValue *val = tp_g_value_slice_new_boxed (
+          TP_ARRAY_TYPE_REQUESTABLE_CHANNEL_CLASS_LIST, arr);
+
+      g_ptr_array_unref (arr);
 
       tp_contacts_mixin_set_contact_attribute (attributes_hash,
           handle,
@@ -3473,7 +3678,7 @@ gabble_connection_get_contact_capabilities (
     }
 
   ret = g_hash_table_new_full (NULL, NULL, NULL,
-      (GDestroyNotify) gabble_free_rcc_list);
+      (GDestroyNotify) g_ptr_array_unref);
 
   for (i = 0; i < handles->len; i++)
     {
@@ -20,6 +20,19 @@
 #include <telepathy-glib/telepathy-glib.h>
 
 static GabbleDebugFlags flags = 0;
+/* whether a client has enabled the Debug interface */
+static gboolean sender_enabled = FALSE;
+
+GabbleDebugFlags gabble_debug_active_flags = 0;
+
+static void
+update_active_flags (void)
+{
+  if (sender_enabled)
+    gabble_debug_active_flags = (GabbleDebugFlags) ~0;
+  else
+    gabble_debug_active_flags = flags;
+}
 
 /* Remember to keep this array up to date with the GabbleDebugFlags enum in debug.h */
 static GDebugKey keys[] = {
@@ -74,6 +87,26 @@ void gabble_debug_set_flags_from_env ()
 void gabble_debug_set_flags (GabbleDebugFlags new_flags)
 {
   flags |= new_flags;
+  update_active_flags ();
+}
+
+static void
+sender_enabled_notify_cb (GObject *sender,
+    GParamSpec *pspec,
+    gpointer user_data)
+{
+  g_object_get (sender, "enabled", &sender_enabled, NULL);
+  update_active_flags ();
+}
+
+/* Keeps gabble_debug_active_flags up to date with whether anybody is
+ * listening to @sender, a TpDebugSender, for as long as it exists */
+void
+gabble_debug_watch_sender (GObject *sender)
+{
+  g_signal_connect (sender, "notify::enabled",
+      G_CALLBACK (sender_enabled_notify_cb), NULL);
+  sender_enabled_notify_cb (sender, NULL, NULL);
 }
 
 gboolean gabble_debug_flag_is_set (GabbleDebugFlags flag)
@@ -143,6 +176,10 @@ void gabble_log (GLogLevelFlags level,
   gchar *message;
   va_list args;
 
+  /* Usually the DEBUG() macro has already checked this */
+  if (level == G_LOG_LEVEL_DEBUG && !(flag & gabble_debug_active_flags))
+    return;
+
   va_start (args, format);
   message = g_strdup_vprintf (format, args);
   va_end (args);
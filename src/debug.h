@@ -40,9 +40,16 @@ typedef enum
   GABBLE_DEBUG_CLIENT_TYPES  = 1 << 27,
 } GabbleDebugFlags;
 
+/* The flags whose debug messages anyone will see: the ones set from
+ * GABBLE_DEBUG, or all of them while a client has enabled the Debug
+ * interface. The macros below check it before formatting anything, so
+ * disabled DEBUG()s cost a single test. */
+extern GabbleDebugFlags gabble_debug_active_flags;
+
 void gabble_debug_set_flags_from_env (void);
 void gabble_debug_set_flags (GabbleDebugFlags flags);
 gboolean gabble_debug_flag_is_set (GabbleDebugFlags flag);
+void gabble_debug_watch_sender (GObject *sender);
 void gabble_debug_free (void);
 void gabble_log (GLogLevelFlags level, GabbleDebugFlags flag,
     const gchar *format, ...) G_GNUC_PRINTF (3, 4);
@@ -74,18 +81,25 @@ G_END_DECLS
       G_STRFUNC, G_STRLOC, ##__VA_ARGS__)
 
 #define DEBUG(format, ...) \
-      gabble_log (G_LOG_LEVEL_DEBUG, DEBUG_FLAG, "%s (%s): " format, \
-          G_STRFUNC, G_STRLOC, ##__VA_ARGS__)
-#define DEBUGGING gabble_debug_flag_is_set (DEBUG_FLAG)
+    G_STMT_START { \
+      if (G_UNLIKELY (gabble_debug_active_flags & DEBUG_FLAG)) \
+        gabble_log (G_LOG_LEVEL_DEBUG, DEBUG_FLAG, "%s (%s): " format, \
+            G_STRFUNC, G_STRLOC, ##__VA_ARGS__); \
+    } G_STMT_END
+#define DEBUGGING (G_UNLIKELY (gabble_debug_active_flags & DEBUG_FLAG))
 
 #define STANZA_DEBUG(st, s) \
       NODE_DEBUG (wocky_stanza_get_top_node (st), s)
 
 #define NODE_DEBUG(n, s) \
     G_STMT_START { \
-      gchar *debug_tmp = wocky_node_to_string (n); \
-      gabble_log (G_LOG_LEVEL_DEBUG, DEBUG_FLAG, "%s: %s:\n%s", G_STRFUNC, s, debug_tmp); \
-      g_free (debug_tmp); \
+      if (DEBUGGING) \
+        { \
+          gchar *debug_tmp = wocky_node_to_string (n); \
+          gabble_log (G_LOG_LEVEL_DEBUG, DEBUG_FLAG, "%s: %s:\n%s", \
+              G_STRFUNC, s, debug_tmp); \
+          g_free (debug_tmp); \
+        } \
     } G_STMT_END
 
 #endif /* DEBUG_FLAG */
@@ -946,6 +946,8 @@ check_address_and_access_control (GabbleFileTransferChannel *self,
   return FALSE;
 }
 
+static void try_splice (GabbleFileTransferChannel *self);
+
 static void
 channel_open (GabbleFileTransferChannel *self)
 {
@@ -967,7 +969,10 @@ channel_open (GabbleFileTransferChannel *self)
           TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
 
       if (self->priv->transport != NULL)
-        gibber_transport_block_receiving (self->priv->transport, FALSE);
+        {
+          gibber_transport_block_receiving (self->priv->transport, FALSE);
+          try_splice (self);
+        }
     }
   else
     {
@@ -1938,6 +1943,56 @@ transport_handler (GibberTransport *transport,
     }
 }
 
+/*
+ * Called instead of bytestream_data_received_cb() and transport_handler()
+ * once the bytestream moves the data itself.
+ */
+static void
+bytestream_splice_progress_cb (GabbleBytestreamIface *bytestream,
+                               gsize received,
+                               gsize sent,
+                               gpointer user_data)
+{
+  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+
+  if (self->priv->state != TP_FILE_TRANSFER_STATE_OPEN)
+    return;
+
+  transferred_chunk (self, (guint64) received + sent);
+
+  if (self->priv->transferred_bytes + self->priv->initial_offset <
+      self->priv->size)
+    return;
+
+  gabble_file_transfer_channel_set_state (
+      TP_SVC_CHANNEL_TYPE_FILE_TRANSFER (self),
+      TP_FILE_TRANSFER_STATE_COMPLETED,
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
+
+  if (received > 0)
+    {
+      DEBUG ("Received all the file. Transfer is complete");
+      gibber_transport_disconnect (self->priv->transport);
+    }
+  else
+    {
+      DEBUG ("All the file has been sent. Closing the bytestream");
+      gabble_bytestream_iface_close (self->priv->bytestream, NULL);
+    }
+}
+
+static void
+try_splice (GabbleFileTransferChannel *self)
+{
+  if (self->priv->bytestream == NULL || self->priv->transport == NULL ||
+      self->priv->state != TP_FILE_TRANSFER_STATE_OPEN)
+    return;
+
+  if (gabble_bytestream_iface_splice (self->priv->bytestream,
+        self->priv->transport, bytestream_splice_progress_cb, self))
+    DEBUG ("file data is spliced between the bytestream and the socket");
+}
+
 static void
 bytestream_write_blocked_cb (GabbleBytestreamIface *bytestream,
                              gboolean blocked,
@@ -2060,6 +2115,8 @@ new_connection_cb (GibberListener *listener,
     /* Outgoing file transfer */
     file_transfer_send (self);
 
+  try_splice (self);
+
   /* stop listening on local socket */
   tp_clear_object (&self->priv->listener);
 }
@@ -34,6 +34,7 @@
 #include <wocky/wocky.h>
 
 #include "debug.h"
+#include "handler-profile.h"
 #include "connection-manager.h"
 #include "plugin-loader.h"
 
@@ -158,8 +159,10 @@ gabble_main (int argc,
     }
 
   debug_sender = tp_debug_sender_dup ();
+  gabble_debug_watch_sender ((GObject *) debug_sender);
 
   g_log_set_default_handler (log_handler, NULL);
+  gabble_handler_profile_init ();
 
   if (g_getenv ("GABBLE_PERSIST") != NULL)
     tp_debug_set_persistent (TRUE);
@@ -171,6 +174,7 @@ gabble_main (int argc,
   out = tp_run_connection_manager ("telepathy-gabble", VERSION,
       construct_cm, argc, argv);
 
+  gabble_handler_profile_deinit ();
   g_object_unref (loader);
 
   g_log_set_default_handler (g_log_default_handler, NULL);
@@ -0,0 +1,565 @@
+/*
+ * handler-profile.c - Profiling WockyPorter stanza handlers
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * When GABBLE_PROFILE_HANDLERS is set, every stanza handler registered on a
+ * connection's porter -- by Gabble, by plugins or by Wocky itself -- is
+ * wrapped so that we know how often it is called, how long it takes and how
+ * big the stanzas it is given are. Handlers which take longer than the
+ * budget are reported as they happen, and the totals are reported on
+ * SIGUSR1 and when Gabble exits, so that a stalled main loop can be blamed
+ * on someone.
+ *
+ * Registrations are intercepted by replacing the porter class's
+ * WockyPorterInterface methods, so nobody has to opt in.
+ * wocky_c2s_porter_register_handler_from_server() isn't part of that
+ * interface, so Gabble uses gabble_handler_profile_register_from_server()
+ * instead.
+ *
+ * Handlers are told apart by their callback's address and the stanzas they
+ * match; "info symbol 0x..." in gdb, or addr2line, turns the address into a
+ * function name.
+ */
+
+#include "config.h"
+#include "handler-profile.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef G_OS_UNIX
+#include <signal.h>
+#endif
+
+#define DEBUG_FLAG GABBLE_DEBUG_CONNECTION
+#include "debug.h"
+
+/* Handlers which take longer than this, in milliseconds, are reported as
+ * slow unless GABBLE_PROFILE_HANDLERS says otherwise */
+#define HANDLER_PROFILE_DEFAULT_BUDGET 10
+
+/* How often, in seconds, we check whether SIGUSR1 has asked for the totals.
+ * g_unix_signal_add() would save polling, but only supports SIGUSR1 from
+ * GLib 2.36 */
+#define HANDLER_PROFILE_SIGNAL_POLL_INTERVAL 1
+
+typedef struct {
+    gchar *name;
+    guint64 calls;
+    guint64 slow_calls;
+    gint64 total_time;
+    gint64 max_time;
+    guint64 total_size;
+    guint64 max_size;
+} HandlerStats;
+
+typedef struct {
+    WockyPorterHandlerFunc callback;
+    gpointer user_data;
+    HandlerStats *stats;
+} ProfiledHandler;
+
+typedef guint (*RegisterFromFunc) (WockyPorter *self,
+    WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    const gchar *from,
+    guint priority,
+    WockyPorterHandlerFunc callback,
+    gpointer user_data,
+    WockyStanza *stanza);
+
+typedef guint (*RegisterFromAnyoneFunc) (WockyPorter *self,
+    WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    guint priority,
+    WockyPorterHandlerFunc callback,
+    gpointer user_data,
+    WockyStanza *stanza);
+
+typedef void (*UnregisterFunc) (WockyPorter *self,
+    guint id);
+
+static gboolean enabled = FALSE;
+static gint64 budget = 0;
+static guint sigusr1_poll_id = 0;
+
+#ifdef G_OS_UNIX
+/* set by the SIGUSR1 handler, which can't safely do anything more */
+static volatile sig_atomic_t dump_requested = 0;
+#endif
+
+/* name => owned HandlerStats */
+static GHashTable *all_stats = NULL;
+
+/* The porter class whose methods we've replaced, and its originals */
+static GType profiled_type = 0;
+static RegisterFromFunc real_register_from = NULL;
+static RegisterFromAnyoneFunc real_register_from_anyone = NULL;
+static UnregisterFunc real_unregister = NULL;
+
+/* qdata on each porter: handler id => owned ProfiledHandler */
+static GQuark
+handlers_quark (void)
+{
+  static GQuark quark = 0;
+
+  if (G_UNLIKELY (quark == 0))
+    quark = g_quark_from_static_string ("gabble-profiled-handlers");
+
+  return quark;
+}
+
+static void
+handler_stats_free (gpointer p)
+{
+  HandlerStats *stats = p;
+
+  g_free (stats->name);
+  g_slice_free (HandlerStats, stats);
+}
+
+static void
+profiled_handler_free (gpointer p)
+{
+  g_slice_free (ProfiledHandler, p);
+}
+
+static gboolean
+add_attribute_size (const gchar *key,
+    const gchar *value,
+    const gchar *pref,
+    const gchar *ns,
+    gpointer user_data)
+{
+  gsize *size = user_data;
+
+  /* ' key="value"' */
+  *size += strlen (key) + strlen (value) + 4;
+  return TRUE;
+}
+
+/* Roughly how many bytes @node took up on the wire; serializing it for real
+ * would cost more than most handlers */
+static gsize
+node_size (WockyNode *node)
+{
+  gsize size = 2 * strlen (node->name) + 5;
+  GSList *l;
+
+  wocky_node_each_attribute (node, add_attribute_size, &size);
+
+  if (node->content != NULL)
+    size += strlen (node->content);
+
+  for (l = node->children; l != NULL; l = l->next)
+    size += node_size (l->data);
+
+  return size;
+}
+
+static gboolean
+profiled_handler_cb (WockyPorter *porter,
+    WockyStanza *stanza,
+    gpointer user_data)
+{
+  ProfiledHandler *handler = user_data;
+  /* the handler might unregister itself, freeing @handler */
+  HandlerStats *stats = handler->stats;
+  guint64 size = node_size (wocky_stanza_get_top_node (stanza));
+  gint64 start = g_get_monotonic_time ();
+  gint64 elapsed;
+  gboolean ret;
+
+  ret = handler->callback (porter, stanza, handler->user_data);
+  elapsed = g_get_monotonic_time () - start;
+
+  stats->calls++;
+  stats->total_time += elapsed;
+  stats->max_time = MAX (stats->max_time, elapsed);
+  stats->total_size += size;
+  stats->max_size = MAX (stats->max_size, size);
+
+  if (elapsed > budget)
+    {
+      stats->slow_calls++;
+      g_message ("slow stanza handler %s took %" G_GINT64_FORMAT " us "
+          "on a %" G_GUINT64_FORMAT "-byte stanza", stats->name, elapsed,
+          size);
+    }
+
+  return ret;
+}
+
+static HandlerStats *
+stats_for (WockyPorterHandlerFunc callback,
+    WockyStanzaType type,
+    WockyStanza *pattern)
+{
+  GString *name = g_string_new (NULL);
+  HandlerStats *stats;
+
+  /* Function pointers can't portably be printed with %p, but this is only
+   * for humans with a debugger */
+  g_string_printf (name, "%p", (gpointer) callback);
+
+  if (pattern != NULL)
+    {
+      WockyNode *top = wocky_stanza_get_top_node (pattern);
+      const gchar *sub_type = wocky_node_get_attribute (top, "type");
+      WockyNode *child = wocky_node_get_first_child (top);
+
+      if (type != WOCKY_STANZA_TYPE_NONE)
+        g_string_append_printf (name, " %s", top->name);
+
+      if (sub_type != NULL)
+        g_string_append_printf (name, " type='%s'", sub_type);
+
+      if (child != NULL)
+        g_string_append_printf (name, " <%s xmlns='%s'/>", child->name,
+            wocky_node_get_ns (child));
+    }
+
+  stats = g_hash_table_lookup (all_stats, name->str);
+
+  if (stats == NULL)
+    {
+      stats = g_slice_new0 (HandlerStats);
+      stats->name = g_string_free (name, FALSE);
+      g_hash_table_insert (all_stats, stats->name, stats);
+    }
+  else
+    {
+      g_string_free (name, TRUE);
+    }
+
+  return stats;
+}
+
+/* Makes a handler to register instead of @callback, remembering what
+ * @callback was so that it can be called and accounted for */
+static ProfiledHandler *
+profiled_handler_new (WockyPorterHandlerFunc callback,
+    gpointer user_data,
+    WockyStanzaType type,
+    WockyStanza *pattern)
+{
+  ProfiledHandler *handler = g_slice_new (ProfiledHandler);
+
+  handler->callback = callback;
+  handler->user_data = user_data;
+  handler->stats = stats_for (callback, type, pattern);
+  return handler;
+}
+
+static void
+profiled_handler_registered (WockyPorter *porter,
+    guint id,
+    ProfiledHandler *handler)
+{
+  GHashTable *handlers;
+
+  if (id == 0)
+    {
+      profiled_handler_free (handler);
+      return;
+    }
+
+  handlers = g_object_get_qdata (G_OBJECT (porter), handlers_quark ());
+
+  if (handlers == NULL)
+    {
+      handlers = g_hash_table_new_full (NULL, NULL, NULL,
+          profiled_handler_free);
+      g_object_set_qdata_full (G_OBJECT (porter), handlers_quark (),
+          handlers, (GDestroyNotify) g_hash_table_unref);
+    }
+
+  g_hash_table_insert (handlers, GUINT_TO_POINTER (id), handler);
+}
+
+static guint
+profiled_register_from (WockyPorter *porter,
+    WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    const gchar *from,
+    guint priority,
+    WockyPorterHandlerFunc callback,
+    gpointer user_data,
+    WockyStanza *stanza)
+{
+  ProfiledHandler *handler = profiled_handler_new (callback, user_data,
+      type, stanza);
+  guint id;
+
+  id = real_register_from (porter, type, sub_type, from, priority,
+      profiled_handler_cb, handler, stanza);
+  profiled_handler_registered (porter, id, handler);
+  return id;
+}
+
+static guint
+profiled_register_from_anyone (WockyPorter *porter,
+    WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    guint priority,
+    WockyPorterHandlerFunc callback,
+    gpointer user_data,
+    WockyStanza *stanza)
+{
+  ProfiledHandler *handler = profiled_handler_new (callback, user_data,
+      type, stanza);
+  guint id;
+
+  id = real_register_from_anyone (porter, type, sub_type, priority,
+      profiled_handler_cb, handler, stanza);
+  profiled_handler_registered (porter, id, handler);
+  return id;
+}
+
+static void
+profiled_unregister (WockyPorter *porter,
+    guint id)
+{
+  GHashTable *handlers = g_object_get_qdata (G_OBJECT (porter),
+      handlers_quark ());
+
+  real_unregister (porter, id);
+
+  if (handlers != NULL)
+    g_hash_table_remove (handlers, GUINT_TO_POINTER (id));
+}
+
+#ifdef G_OS_UNIX
+static void
+sigusr1_handler (int signum)
+{
+  dump_requested = 1;
+}
+
+static gboolean
+sigusr1_poll_cb (gpointer user_data)
+{
+  if (dump_requested)
+    {
+      dump_requested = 0;
+      gabble_handler_profile_dump ();
+    }
+
+  return TRUE;
+}
+#endif
+
+/*
+ * gabble_handler_profile_init:
+ *
+ * Turns profiling on if GABBLE_PROFILE_HANDLERS is set. Its value is the
+ * budget in milliseconds, beyond which handlers are reported as slow.
+ */
+void
+gabble_handler_profile_init (void)
+{
+  const gchar *env = g_getenv ("GABBLE_PROFILE_HANDLERS");
+  gint64 ms;
+#ifdef G_OS_UNIX
+  struct sigaction action;
+#endif
+
+  if (env == NULL)
+    return;
+
+  ms = g_ascii_strtoll (env, NULL, 10);
+
+  if (ms <= 0)
+    ms = HANDLER_PROFILE_DEFAULT_BUDGET;
+
+  enabled = TRUE;
+  budget = ms * 1000;
+  all_stats = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      handler_stats_free);
+
+#ifdef G_OS_UNIX
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = sigusr1_handler;
+  sigemptyset (&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+
+  if (sigaction (SIGUSR1, &action, NULL) == 0)
+    sigusr1_poll_id = g_timeout_add_seconds (
+        HANDLER_PROFILE_SIGNAL_POLL_INTERVAL, sigusr1_poll_cb, NULL);
+  else
+    DEBUG ("couldn't handle SIGUSR1: %s", g_strerror (errno));
+#endif
+
+  g_message ("profiling stanza handlers; budget is %" G_GINT64_FORMAT " ms",
+      ms);
+}
+
+/*
+ * gabble_handler_profile_watch_porter:
+ *
+ * Wraps handlers which are registered with @porter from now on, if
+ * profiling is on.
+ */
+void
+gabble_handler_profile_watch_porter (WockyPorter *porter)
+{
+  WockyPorterInterface *iface;
+
+  if (!enabled)
+    return;
+
+  if (profiled_type != 0)
+    {
+      if (G_OBJECT_TYPE (porter) != profiled_type)
+        DEBUG ("already profiling %s; can't profile %s's handlers too",
+            g_type_name (profiled_type), G_OBJECT_TYPE_NAME (porter));
+
+      return;
+    }
+
+  profiled_type = G_OBJECT_TYPE (porter);
+  iface = g_type_interface_peek (G_OBJECT_GET_CLASS (porter),
+      WOCKY_TYPE_PORTER);
+
+  real_register_from = iface->register_handler_from_by_stanza;
+  real_register_from_anyone = iface->register_handler_from_anyone_by_stanza;
+  real_unregister = iface->unregister_handler;
+
+  iface->register_handler_from_by_stanza = profiled_register_from;
+  iface->register_handler_from_anyone_by_stanza =
+      profiled_register_from_anyone;
+  iface->unregister_handler = profiled_unregister;
+}
+
+/*
+ * gabble_handler_profile_register_from_server:
+ *
+ * The same as wocky_c2s_porter_register_handler_from_server(), but profiled
+ * if profiling is on.
+ */
+guint
+gabble_handler_profile_register_from_server (WockyPorter *porter,
+    WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    guint priority,
+    WockyPorterHandlerFunc callback,
+    gpointer user_data,
+    ...)
+{
+  WockyStanza *stanza;
+  ProfiledHandler *handler = NULL;
+  va_list ap;
+  guint id;
+
+  va_start (ap, user_data);
+  stanza = wocky_stanza_build_va (type, WOCKY_STANZA_SUB_TYPE_NONE,
+      NULL, NULL, ap);
+  g_assert (stanza != NULL);
+  va_end (ap);
+
+  if (enabled && G_OBJECT_TYPE (porter) == profiled_type)
+    {
+      handler = profiled_handler_new (callback, user_data, type, stanza);
+      callback = profiled_handler_cb;
+      user_data = handler;
+    }
+
+  id = wocky_c2s_porter_register_handler_from_server_by_stanza (
+      WOCKY_C2S_PORTER (porter), type, sub_type, priority, callback,
+      user_data, stanza);
+
+  if (handler != NULL)
+    profiled_handler_registered (porter, id, handler);
+
+  g_object_unref (stanza);
+  return id;
+}
+
+static gint
+compare_total_time (gconstpointer a,
+    gconstpointer b)
+{
+  const HandlerStats *left = *(HandlerStats * const *) a;
+  const HandlerStats *right = *(HandlerStats * const *) b;
+
+  if (left->total_time == right->total_time)
+    return 0;
+
+  return left->total_time > right->total_time ? -1 : 1;
+}
+
+/*
+ * gabble_handler_profile_dump:
+ *
+ * Reports what every handler has cost so far, the most expensive first.
+ */
+void
+gabble_handler_profile_dump (void)
+{
+  GPtrArray *sorted;
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  if (!enabled)
+    return;
+
+  sorted = g_ptr_array_sized_new (g_hash_table_size (all_stats));
+  g_hash_table_iter_init (&iter, all_stats);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (sorted, value);
+
+  g_ptr_array_sort (sorted, compare_total_time);
+
+  g_message ("stanza handlers, most expensive first: calls (slow), "
+      "total/max time in us, mean/max stanza size in bytes, handler");
+
+  for (i = 0; i < sorted->len; i++)
+    {
+      HandlerStats *stats = g_ptr_array_index (sorted, i);
+
+      g_message ("%" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT ") "
+          "%" G_GINT64_FORMAT "/%" G_GINT64_FORMAT " "
+          "%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " %s",
+          stats->calls, stats->slow_calls,
+          stats->total_time, stats->max_time,
+          stats->calls == 0 ? 0 : stats->total_size / stats->calls,
+          stats->max_size, stats->name);
+    }
+
+  g_ptr_array_unref (sorted);
+}
+
+/*
+ * gabble_handler_profile_deinit:
+ *
+ * Reports the final totals. The porter class's methods stay wrapped, so
+ * the statistics are never freed.
+ */
+void
+gabble_handler_profile_deinit (void)
+{
+  gabble_handler_profile_dump ();
+
+  if (sigusr1_poll_id != 0)
+    g_source_remove (sigusr1_poll_id);
+
+  sigusr1_poll_id = 0;
+}
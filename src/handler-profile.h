@@ -0,0 +1,43 @@
+/*
+ * handler-profile.h - Headers for profiling WockyPorter stanza handlers
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_HANDLER_PROFILE_H__
+#define __GABBLE_HANDLER_PROFILE_H__
+
+#include <glib.h>
+#include <wocky/wocky.h>
+
+G_BEGIN_DECLS
+
+void gabble_handler_profile_init (void);
+void gabble_handler_profile_watch_porter (WockyPorter *porter);
+void gabble_handler_profile_dump (void);
+void gabble_handler_profile_deinit (void);
+
+guint gabble_handler_profile_register_from_server (WockyPorter *porter,
+    WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    guint priority,
+    WockyPorterHandlerFunc callback,
+    gpointer user_data,
+    ...) G_GNUC_NULL_TERMINATED;
+
+G_END_DECLS
+
+#endif /* __GABBLE_HANDLER_PROFILE_H__ */
@@ -38,6 +38,7 @@
 #include "disco.h"
 #include "im-channel.h"
 #include "message-util.h"
+#include "metrics.h"
 #include "namespaces.h"
 
 static void channel_manager_iface_init (gpointer, gpointer);
@@ -194,12 +195,12 @@ static GabbleIMChannel *get_channel_for_incoming_message (
     gboolean create_if_missing);
 
 /**
- * im_factory_message_cb:
+ * im_factory_handle_message:
  *
  * Called by Wocky when we get an incoming <message>.
  */
 static gboolean
-im_factory_message_cb (
+im_factory_handle_message (
     WockyPorter *porter,
     WockyStanza *message,
     gpointer user_data)
@@ -268,6 +269,19 @@ im_factory_message_cb (
   return TRUE;
 }
 
+static gboolean
+im_factory_message_cb (
+    WockyPorter *porter,
+    WockyStanza *message,
+    gpointer user_data)
+{
+  gint64 start = g_get_monotonic_time ();
+  gboolean ret = im_factory_handle_message (porter, message, user_data);
+
+  gabble_metrics_record_since (GABBLE_METRIC_HANDLE_MESSAGE, start);
+  return ret;
+}
+
 /* Signals incoming delivery receipts. http://xmpp.org/extensions/xep-0184.html
  */
 static gboolean
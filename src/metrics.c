@@ -0,0 +1,216 @@
+/*
+ * metrics.c - Gabble's performance counters
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Process-wide counters, gauges and latency histograms, cheap enough to keep
+ * up to date all the time and published by the Gabble.Metrics connection
+ * interface. Everything happens in the main thread, so there is no locking.
+ *
+ * Histograms are HDR-style: durations below 2 * HISTOGRAM_SUB_BUCKETS us each
+ * have their own bucket, and each power of two above that is split into
+ * HISTOGRAM_SUB_BUCKETS equal buckets, so every recorded duration is known to
+ * within 1/HISTOGRAM_SUB_BUCKETS of its value.
+ */
+
+#include "config.h"
+#include "metrics.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "extensions/extensions.h"
+
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+/* Durations of 2^HISTOGRAM_MAX_BITS us (about 12 days) or more all go in
+ * the last bucket */
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_N_BUCKETS \
+  (2 * HISTOGRAM_SUB_BUCKETS + \
+   (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS - 1) * \
+      HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    guint64 count;
+    guint64 total;
+    guint64 max;
+    guint64 buckets[HISTOGRAM_N_BUCKETS];
+} Histogram;
+
+static const gchar * const counter_names[] = {
+  "pipeline.requests-sent",
+  "pipeline.timeouts",
+  "caps.cache-hits",
+  "caps.cache-misses",
+  "vcard.cache-hits",
+  "vcard.store-hits",
+  "vcard.cache-misses",
+  "bytestream.ibb.bytes-sent",
+  "bytestream.ibb.bytes-received",
+  "bytestream.socks5.bytes-sent",
+  "bytestream.socks5.bytes-received",
+  "bytestream.socks5.read-wakeups",
+  "bytestream.socks5.reads",
+  "bytestream.muc.bytes-sent",
+  "bytestream.muc.bytes-received",
+};
+
+static const gchar * const gauge_names[] = {
+  "pipeline.queued",
+  "pipeline.in-flight",
+  "caps.disco-waiters",
+  "presence.deferred",
+};
+
+static const gchar * const histogram_names[] = {
+  "pipeline.latency",
+  "stanza.presence.handling-time",
+  "stanza.message.handling-time",
+  "stanza.iq.handling-time",
+};
+
+G_STATIC_ASSERT (G_N_ELEMENTS (counter_names) == NUM_GABBLE_METRIC_COUNTERS);
+G_STATIC_ASSERT (G_N_ELEMENTS (gauge_names) == NUM_GABBLE_METRIC_GAUGES);
+G_STATIC_ASSERT (G_N_ELEMENTS (histogram_names) ==
+    NUM_GABBLE_METRIC_HISTOGRAMS);
+
+static guint64 counters[NUM_GABBLE_METRIC_COUNTERS];
+static gint64 gauges[NUM_GABBLE_METRIC_GAUGES];
+static Histogram histograms[NUM_GABBLE_METRIC_HISTOGRAMS];
+
+void
+gabble_metrics_count (GabbleMetricCounter counter,
+    guint64 n)
+{
+  counters[counter] += n;
+}
+
+void
+gabble_metrics_gauge_add (GabbleMetricGauge gauge,
+    gint64 delta)
+{
+  gauges[gauge] += delta;
+}
+
+static guint
+histogram_bucket (guint64 value)
+{
+  guint bits, shift;
+
+  if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+    return value;
+
+  bits = g_bit_storage (value);
+
+  if (bits > HISTOGRAM_MAX_BITS)
+    return HISTOGRAM_N_BUCKETS - 1;
+
+  /* the top HISTOGRAM_SUB_BUCKET_BITS + 1 bits of value pick the bucket */
+  shift = bits - HISTOGRAM_SUB_BUCKET_BITS - 1;
+
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+      (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/* The largest value which goes in bucket @i */
+static guint64
+histogram_bucket_upper_bound (guint i)
+{
+  guint shift;
+
+  if (i < 2 * HISTOGRAM_SUB_BUCKETS)
+    return i;
+
+  if (i == HISTOGRAM_N_BUCKETS - 1)
+    return G_MAXUINT64;
+
+  shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+
+  return ((guint64) (i % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS + 1)
+      << shift) - 1;
+}
+
+void
+gabble_metrics_record (GabbleMetricHistogram histogram,
+    gint64 usec)
+{
+  Histogram *h = &histograms[histogram];
+  guint64 value = MAX (usec, 0);
+
+  h->count++;
+  h->total += value;
+  h->max = MAX (h->max, value);
+  h->buckets[histogram_bucket (value)]++;
+}
+
+static GValue *
+histogram_to_value (Histogram *h)
+{
+  GPtrArray *buckets = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) tp_value_array_free);
+  GValue *value;
+  guint i;
+
+  for (i = 0; i < HISTOGRAM_N_BUCKETS; i++)
+    {
+      if (h->buckets[i] == 0)
+        continue;
+
+      g_ptr_array_add (buckets, tp_value_array_build (2,
+          G_TYPE_UINT64, histogram_bucket_upper_bound (i),
+          G_TYPE_UINT64, h->buckets[i],
+          G_TYPE_INVALID));
+    }
+
+  value = tp_g_value_slice_new_take_boxed (
+      GABBLE_STRUCT_TYPE_LATENCY_HISTOGRAM,
+      tp_value_array_build (4,
+          G_TYPE_UINT64, h->count,
+          G_TYPE_UINT64, h->total,
+          G_TYPE_UINT64, h->max,
+          GABBLE_ARRAY_TYPE_LATENCY_BUCKET_LIST, buckets,
+          G_TYPE_INVALID));
+
+  g_ptr_array_unref (buckets);
+  return value;
+}
+
+/*
+ * gabble_metrics_dup_snapshot:
+ *
+ * Returns: (transfer full): a map from each metric's name to its current
+ *  value, as returned by Gabble.Metrics.GetSnapshot
+ */
+GHashTable *
+gabble_metrics_dup_snapshot (void)
+{
+  GHashTable *snapshot = tp_asv_new (NULL, NULL);
+  guint i;
+
+  for (i = 0; i < NUM_GABBLE_METRIC_COUNTERS; i++)
+    tp_asv_set_uint64 (snapshot, counter_names[i], counters[i]);
+
+  for (i = 0; i < NUM_GABBLE_METRIC_GAUGES; i++)
+    tp_asv_set_int64 (snapshot, gauge_names[i], gauges[i]);
+
+  for (i = 0; i < NUM_GABBLE_METRIC_HISTOGRAMS; i++)
+    g_hash_table_insert (snapshot, (gchar *) histogram_names[i],
+        histogram_to_value (&histograms[i]));
+
+  return snapshot;
+}
@@ -0,0 +1,82 @@
+/*
+ * metrics.h - Headers for Gabble's performance counters
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_METRICS_H__
+#define __GABBLE_METRICS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Remember to keep these enums up to date with the names in metrics.c */
+
+/* Things which only ever go up */
+typedef enum
+{
+  GABBLE_METRIC_PIPELINE_REQUESTS_SENT,
+  GABBLE_METRIC_PIPELINE_TIMEOUTS,
+  GABBLE_METRIC_CAPS_CACHE_HITS,
+  GABBLE_METRIC_CAPS_CACHE_MISSES,
+  GABBLE_METRIC_VCARD_CACHE_HITS,
+  GABBLE_METRIC_VCARD_STORE_HITS,
+  GABBLE_METRIC_VCARD_CACHE_MISSES,
+  GABBLE_METRIC_IBB_BYTES_SENT,
+  GABBLE_METRIC_IBB_BYTES_RECEIVED,
+  GABBLE_METRIC_SOCKS5_BYTES_SENT,
+  GABBLE_METRIC_SOCKS5_BYTES_RECEIVED,
+  GABBLE_METRIC_SOCKS5_READ_WAKEUPS,
+  GABBLE_METRIC_SOCKS5_READS,
+  GABBLE_METRIC_MUC_BYTES_SENT,
+  GABBLE_METRIC_MUC_BYTES_RECEIVED,
+  NUM_GABBLE_METRIC_COUNTERS
+} GabbleMetricCounter;
+
+/* Things which go up and down */
+typedef enum
+{
+  GABBLE_METRIC_PIPELINE_QUEUED,
+  GABBLE_METRIC_PIPELINE_IN_FLIGHT,
+  GABBLE_METRIC_DISCO_WAITERS,
+  GABBLE_METRIC_DEFERRED_PRESENCES,
+  NUM_GABBLE_METRIC_GAUGES
+} GabbleMetricGauge;
+
+/* How long things take, in microseconds */
+typedef enum
+{
+  GABBLE_METRIC_PIPELINE_LATENCY,
+  GABBLE_METRIC_HANDLE_PRESENCE,
+  GABBLE_METRIC_HANDLE_MESSAGE,
+  GABBLE_METRIC_HANDLE_IQ,
+  NUM_GABBLE_METRIC_HISTOGRAMS
+} GabbleMetricHistogram;
+
+void gabble_metrics_count (GabbleMetricCounter counter, guint64 n);
+void gabble_metrics_gauge_add (GabbleMetricGauge gauge, gint64 delta);
+void gabble_metrics_record (GabbleMetricHistogram histogram, gint64 usec);
+
+/* Records the time since @start, a g_get_monotonic_time () */
+#define gabble_metrics_record_since(histogram, start) \
+  gabble_metrics_record (histogram, g_get_monotonic_time () - (start))
+
+GHashTable *gabble_metrics_dup_snapshot (void);
+
+G_END_DECLS
+
+#endif /* __GABBLE_METRICS_H__ */
@@ -101,7 +101,7 @@ enum
     READY,
     JOIN_ERROR,
     PRE_INVITE,
-    CONTACT_JOIN,
+    CONTACTS_JOIN,
     PRE_PRESENCE,
     NEW_TUBE,
 
@@ -197,6 +197,11 @@ struct _GabbleMucChannelPrivate
 
   /* tube ID => owned GabbleTubeIface */
   GHashTable *tubes;
+  /* contact handle => owned GHashTable of tube ID => borrowed
+   * GabbleTubeDBus, for each D-Bus tube the contact has a name in. Kept in
+   * step with the tubes' own D-Bus names so that a member's presence only
+   * costs as much as the tubes they're actually in. */
+  GHashTable *dbus_tubes_by_contact;
 
 #ifdef ENABLE_VOIP
   /* Current active call */
@@ -256,6 +261,8 @@ gabble_muc_channel_init (GabbleMucChannel *self)
 
   priv->tubes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify) g_object_unref);
+  priv->dbus_tubes_by_contact = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) g_hash_table_unref);
 }
 
 static TpHandle create_room_identity (GabbleMucChannel *)
@@ -1222,14 +1229,16 @@ gabble_muc_channel_class_init (GabbleMucChannelClass *gabble_muc_channel_class)
                   g_cclosure_marshal_VOID__STRING,
                   G_TYPE_NONE, 1, G_TYPE_STRING);
 
-  signals[CONTACT_JOIN] =
-    g_signal_new ("contact-join",
+  /* Emitted with a const TpIntset * of the owners of all the members whose
+   * real JIDs we could see, once the initial roster has been received */
+  signals[CONTACTS_JOIN] =
+    g_signal_new ("contacts-join",
                   G_OBJECT_CLASS_TYPE (gabble_muc_channel_class),
                   G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
                   0,
                   NULL, NULL,
-                  g_cclosure_marshal_VOID__UINT,
-                  G_TYPE_NONE, 1, G_TYPE_UINT);
+                  g_cclosure_marshal_VOID__POINTER,
+                  G_TYPE_NONE, 1, G_TYPE_POINTER);
 
   signals[PRE_PRESENCE] =
     g_signal_new ("pre-presence",
@@ -1302,6 +1311,7 @@ gabble_muc_channel_dispose (GObject *object)
   tp_clear_object (&priv->requests_cancellable);
   tp_clear_object (&priv->room_config);
 
+  tp_clear_pointer (&priv->dbus_tubes_by_contact, g_hash_table_unref);
   tp_clear_pointer (&priv->tubes, g_hash_table_unref);
 
   if (G_OBJECT_CLASS (gabble_muc_channel_parent_class)->dispose)
@@ -1579,6 +1589,7 @@ close_channel (GabbleMucChannel *chan, const gchar *reason,
   /* Ensure we stay alive even while telling everyone else to abandon us. */
   g_object_ref (chan);
 
+  g_hash_table_remove_all (priv->dbus_tubes_by_contact);
   g_hash_table_remove_all (priv->tubes);
 
 #ifdef ENABLE_VOIP
@@ -1963,9 +1974,24 @@ tube_closed_cb (GabbleTubeIface *tube,
 {
   GabbleMucChannelPrivate *priv = gmuc->priv;
   guint64 tube_id;
+  GHashTableIter iter;
+  gpointer value;
 
   g_object_get (tube, "id", &tube_id, NULL);
 
+  if (GABBLE_IS_TUBE_DBUS (tube))
+    {
+      g_hash_table_iter_init (&iter, priv->dbus_tubes_by_contact);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          GHashTable *contact_tubes = value;
+
+          if (g_hash_table_remove (contact_tubes, GUINT_TO_POINTER (tube_id))
+              && g_hash_table_size (contact_tubes) == 0)
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
   g_hash_table_remove (priv->tubes, GUINT_TO_POINTER (tube_id));
 }
 
@@ -2166,6 +2192,26 @@ gabble_muc_channel_handle_si_stream_request (GabbleMucChannel *self,
   gabble_tube_iface_add_bytestream (tube, bytestream);
 }
 
+static void
+contact_dbus_tube_add (GabbleMucChannel *gmuc,
+    TpHandle contact,
+    guint64 tube_id,
+    GabbleTubeDBus *tube)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+  GHashTable *contact_tubes = g_hash_table_lookup (
+      priv->dbus_tubes_by_contact, GUINT_TO_POINTER (contact));
+
+  if (contact_tubes == NULL)
+    {
+      contact_tubes = g_hash_table_new (g_direct_hash, g_direct_equal);
+      g_hash_table_insert (priv->dbus_tubes_by_contact,
+          GUINT_TO_POINTER (contact), contact_tubes);
+    }
+
+  g_hash_table_insert (contact_tubes, GUINT_TO_POINTER (tube_id), tube);
+}
+
 static void
 tubes_presence_update (GabbleMucChannel *gmuc,
     TpHandle contact,
@@ -2179,7 +2225,7 @@ tubes_presence_update (GabbleMucChannel *gmuc,
   WockyNode *tubes_node;
   GHashTable *old_dbus_tubes;
   GHashTableIter iter;
-  gpointer key, value;
+  gpointer value;
   WockyNodeIter i;
   WockyNode *tube_node;
 
@@ -2187,42 +2233,39 @@ tubes_presence_update (GabbleMucChannel *gmuc,
     /* We don't need to inspect our own presence */
     return;
 
+  /* Take the D-Bus tubes previously announced by the contact; any still in
+   * old_dbus_tubes at the end have been left */
+  old_dbus_tubes = g_hash_table_lookup (priv->dbus_tubes_by_contact,
+      GUINT_TO_POINTER (contact));
+
+  if (old_dbus_tubes != NULL)
+    g_hash_table_steal (priv->dbus_tubes_by_contact,
+        GUINT_TO_POINTER (contact));
+  else
+    old_dbus_tubes = g_hash_table_new (g_direct_hash, g_direct_equal);
+
   presence_type = wocky_node_get_attribute (pnode, "type");
   if (!tp_strdiff (presence_type, "unavailable"))
     {
-      g_hash_table_iter_init (&iter, priv->tubes);
+      g_hash_table_iter_init (&iter, old_dbus_tubes);
       while (g_hash_table_iter_next (&iter, NULL, &value))
-        {
-          GabbleTubeDBus *tube = value;
-
-          if (!GABBLE_IS_TUBE_DBUS (value))
-            continue;
+        gabble_tube_dbus_remove_name (GABBLE_TUBE_DBUS (value), contact);
 
-          gabble_tube_dbus_remove_name (tube, contact);
-        }
+      g_hash_table_remove_all (old_dbus_tubes);
     }
 
   tubes_node = wocky_node_get_child_ns (pnode, "tubes", NS_TUBES);
 
   if (tubes_node == NULL)
-    return;
-
-  /* Fill old_dbus_tubes with D-BUS tubes previously announced by
-   * the contact */
-  old_dbus_tubes = g_hash_table_new (g_direct_hash, g_direct_equal);
-
-  g_hash_table_iter_init (&iter, priv->tubes);
-  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      if (!GABBLE_IS_TUBE_DBUS (value))
-        continue;
+      /* Nothing has changed */
+      if (g_hash_table_size (old_dbus_tubes) > 0)
+        g_hash_table_insert (priv->dbus_tubes_by_contact,
+            GUINT_TO_POINTER (contact), old_dbus_tubes);
+      else
+        g_hash_table_unref (old_dbus_tubes);
 
-      if (gabble_tube_dbus_handle_in_names (GABBLE_TUBE_DBUS (value),
-              contact))
-        {
-          g_hash_table_insert (old_dbus_tubes,
-              key, value);
-        }
+      return;
     }
 
   wocky_node_iter_init (&i, tubes_node, NULL, NULL);
@@ -2274,11 +2317,12 @@ tubes_presence_update (GabbleMucChannel *gmuc,
               g_hash_table_unref (parameters);
             }
         }
-      else
+      else if (g_hash_table_remove (old_dbus_tubes,
+                 GUINT_TO_POINTER (tube_id)))
         {
-          /* The contact is in the tube.
-           * Remove it from old_dbus_tubes if needed */
-          g_hash_table_remove (old_dbus_tubes, GUINT_TO_POINTER (tube_id));
+          /* The contact was already in the tube and still is */
+          contact_dbus_tube_add (gmuc, contact, tube_id,
+              GABBLE_TUBE_DBUS (tube));
         }
 
       if (tube == NULL)
@@ -2307,8 +2351,10 @@ tubes_presence_update (GabbleMucChannel *gmuc,
                   continue;
                 }
 
-              gabble_tube_dbus_add_name (GABBLE_TUBE_DBUS (tube),
-                  contact, new_name);
+              if (gabble_tube_dbus_add_name (GABBLE_TUBE_DBUS (tube),
+                      contact, new_name))
+                contact_dbus_tube_add (gmuc, contact, tube_id,
+                    GABBLE_TUBE_DBUS (tube));
             }
         }
     }
@@ -2593,7 +2639,9 @@ update_roster_presence (GabbleMucChannel *gmuc,
         tp_handle_set_add (owners, owner);
     }
 
-  gabble_presence_parse_presence_message (conn->presence_cache,
+  /* In a big room, most members' presences will never be looked at, so
+   * leave parsing them until somebody asks */
+  gabble_presence_cache_defer_presence_message (conn->presence_cache,
       handle, member->from, (WockyStanza *) member->presence_stanza);
 
   tp_handle_set_add (members, handle);
@@ -2601,15 +2649,6 @@ update_roster_presence (GabbleMucChannel *gmuc,
       GUINT_TO_POINTER (handle),
       GUINT_TO_POINTER (owner));
 
-  /* make a note of the fact that owner JIDs are visible to us    */
-  /* notify whomever that an identifiable contact joined the MUC  */
-  if (owner != 0)
-    {
-      tp_group_mixin_change_flags (G_OBJECT (gmuc), 0,
-          TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
-      g_signal_emit (gmuc, signals[CONTACT_JOIN], 0, owner);
-    }
-
   handle_tube_presence (gmuc, handle, member->presence_stanza);
 }
 
@@ -2648,10 +2687,22 @@ handle_join (WockyMuc *muc,
       GUINT_TO_POINTER (tp_base_connection_get_self_handle (base_conn)));
 
   tp_handle_set_add (members, myself);
+  DEBUG ("joined with %u members", tp_handle_set_size (members));
+
+  /* make a note of the fact that owner JIDs are visible to us */
+  if (!tp_handle_set_is_empty (owners))
+    tp_group_mixin_change_flags (G_OBJECT (gmuc), 0,
+        TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
+
   tp_group_mixin_add_handle_owners (G_OBJECT (gmuc), omap);
   tp_group_mixin_change_members (G_OBJECT (gmuc), "",
       tp_handle_set_peek (members), NULL, NULL, NULL, 0, 0);
 
+  /* notify whomever that identifiable contacts joined the MUC */
+  if (!tp_handle_set_is_empty (owners))
+    g_signal_emit (gmuc, signals[CONTACTS_JOIN], 0,
+        tp_handle_set_peek (owners));
+
   /* accept the config of the room if it was created for us: */
   if (codes & WOCKY_MUC_CODE_NEW_ROOM)
     {
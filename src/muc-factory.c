@@ -41,6 +41,7 @@
 #include "media-factory.h"
 #endif
 #include "message-util.h"
+#include "metrics.h"
 #include "muc-channel.h"
 #include "namespaces.h"
 #include "presence-cache.h"
@@ -760,13 +761,13 @@ process_obsolete_invite (GabbleMucFactory *fac,
 }
 
 /**
- * muc_factory_message_cb:
+ * muc_factory_handle_message:
  *
  * Called by Wocky when we get an incoming <message>.
  * We filter only groupchat and MUC messages, ignoring the rest.
  */
 static gboolean
-muc_factory_message_cb (
+muc_factory_handle_message (
     WockyPorter *porter,
     WockyStanza *message,
     gpointer user_data)
@@ -805,6 +806,19 @@ muc_factory_message_cb (
   return FALSE;
 }
 
+static gboolean
+muc_factory_message_cb (
+    WockyPorter *porter,
+    WockyStanza *message,
+    gpointer user_data)
+{
+  gint64 start = g_get_monotonic_time ();
+  gboolean ret = muc_factory_handle_message (porter, message, user_data);
+
+  gabble_metrics_record_since (GABBLE_METRIC_HANDLE_MESSAGE, start);
+  return ret;
+}
+
 void
 gabble_muc_factory_broadcast_presence (GabbleMucFactory *self)
 {
@@ -106,6 +106,7 @@
 #define NS_RECEIPTS             "urn:xmpp:receipts"
 #define NS_REGISTER             "jabber:iq:register"
 #define NS_ROSTER               "jabber:iq:roster"
+#define NS_ROSTER_VER           "urn:xmpp:features:rosterver"
 #define NS_SEARCH               "jabber:iq:search"
 #define NS_SI                   "http://jabber.org/protocol/si"
 #define NS_SI_MULTIPLE          "http://telepathy.freedesktop.org/xmpp/si-multiple"
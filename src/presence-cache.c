@@ -45,6 +45,7 @@
 #include "conn-presence.h"
 #include "debug.h"
 #include "disco.h"
+#include "metrics.h"
 #include "gabble-signals-marshal.h"
 #include "namespaces.h"
 #include "util.h"
@@ -59,6 +60,16 @@
  * contact will disclose their presence later, or not at all. */
 #define DECLOAK_PERIOD 5
 
+/* Maximum number of distinct caps URIs whose parsed form we keep around. A
+ * roster of any size tends to have only a handful of distinct clients, so
+ * this comfortably covers the working set. */
+#define PARSED_CAPS_CACHE_SIZE 500
+
+/* Deferred presences (see gabble_presence_cache_defer_presence_message())
+ * are parsed this many at a time whenever the main loop is otherwise idle,
+ * until the backlog is gone. */
+#define DEFERRED_PRESENCES_PER_IDLE 50
+
 G_DEFINE_TYPE (GabblePresenceCache, gabble_presence_cache, G_TYPE_OBJECT);
 
 /* properties */
@@ -95,8 +106,18 @@ struct _GabblePresenceCachePrivate
   GHashTable *presence;
   TpHandleSet *presence_handles;
 
+  /* handle => owned DeferredPresence which hasn't been parsed yet, and the
+   * idle source working through them */
+  GHashTable *deferred;
+  guint deferred_id;
+
   GHashTable *capabilities;
   GHashTable *disco_pending;
+
+  /* gchar *uri => owned ParsedCaps, most recently used at the head of
+   * parsed_caps_lru */
+  GHashTable *parsed_caps;
+  GQueue parsed_caps_lru;
   guint caps_serial;
 
   guint unsure_id;
@@ -119,6 +140,22 @@ struct _GabblePresenceCachePrivate
   gboolean dispose_has_run;
 };
 
+typedef struct {
+    gchar *from;
+    WockyStanza *stanza;
+} DeferredPresence;
+
+static void
+deferred_presence_free (gpointer p)
+{
+  DeferredPresence *deferred = p;
+
+  g_free (deferred->from);
+  g_object_unref (deferred->stanza);
+  g_slice_free (DeferredPresence, deferred);
+  gabble_metrics_gauge_add (GABBLE_METRIC_DEFERRED_PRESENCES, -1);
+}
+
 typedef struct _DiscoWaiter DiscoWaiter;
 
 struct _DiscoWaiter
@@ -154,6 +191,7 @@ disco_waiter_new (TpHandleRepoIface *repo,
   waiter->hash = g_strdup (hash);
   waiter->ver = g_strdup (ver);
   waiter->serial = serial;
+  gabble_metrics_gauge_add (GABBLE_METRIC_DISCO_WAITERS, 1);
 
   DEBUG ("created waiter %p for handle %u with serial %u", waiter, handle,
       serial);
@@ -173,6 +211,7 @@ disco_waiter_free (DiscoWaiter *waiter)
   g_free (waiter->hash);
   g_free (waiter->ver);
   g_slice_free (DiscoWaiter, waiter);
+  gabble_metrics_gauge_add (GABBLE_METRIC_DISCO_WAITERS, -1);
 }
 
 static void
@@ -482,6 +521,10 @@ gabble_presence_cache_init (GabblePresenceCache *cache)
       (GDestroyNotify) capability_info_free);
   priv->disco_pending = g_hash_table_new_full (g_str_hash, g_str_equal,
     g_free, (GDestroyNotify) disco_waiter_list_free);
+  /* keys are owned by the values */
+  priv->parsed_caps = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) parsed_caps_unref);
+  g_queue_init (&priv->parsed_caps_lru);
   priv->caps_serial = 1;
 
   priv->decloak_requests = g_hash_table_new_full (NULL, NULL, NULL,
@@ -489,6 +532,9 @@ gabble_presence_cache_init (GabblePresenceCache *cache)
 
   priv->location = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
       (GDestroyNotify) g_hash_table_unref);
+
+  priv->deferred = g_hash_table_new_full (NULL, NULL, NULL,
+      deferred_presence_free);
 }
 
 static void gabble_presence_cache_add_bundle_caps (GabblePresenceCache *cache,
@@ -555,6 +601,13 @@ gabble_presence_cache_dispose (GObject *object)
       priv->unsure_id = 0;
     }
 
+  if (priv->deferred_id != 0)
+    {
+      g_source_remove (priv->deferred_id);
+      priv->deferred_id = 0;
+    }
+
+  tp_clear_pointer (&priv->deferred, g_hash_table_unref);
   tp_clear_pointer (&priv->decloak_requests, g_hash_table_unref);
   tp_clear_pointer (&priv->decloak_handles, tp_handle_set_destroy);
 
@@ -566,6 +619,11 @@ gabble_presence_cache_dispose (GObject *object)
   tp_clear_pointer (&priv->presence, g_hash_table_unref);
   tp_clear_pointer (&priv->capabilities, g_hash_table_unref);
   tp_clear_pointer (&priv->disco_pending, g_hash_table_unref);
+
+  while (!g_queue_is_empty (&priv->parsed_caps_lru))
+    parsed_caps_evict (self, g_queue_peek_head (&priv->parsed_caps_lru));
+
+  tp_clear_pointer (&priv->parsed_caps, g_hash_table_unref);
   tp_clear_pointer (&priv->presence_handles, tp_handle_set_destroy);
   tp_clear_pointer (&priv->location, g_hash_table_unref);
 
@@ -1176,15 +1234,20 @@ emit_capabilities_discovered (GabblePresenceCache *cache,
   g_signal_emit (cache, signals[CAPABILITIES_DISCOVERED], 0, handle);
 }
 
+/* Returns the client types advertised by @lm_node's identities, and sets
+ * *registered_account if it has an account/registered identity, for which
+ * the client type depends on the resource: see client_types_for_resource(). */
 static guint
-client_types_from_message (TpHandle handle,
+client_types_from_identities (TpHandle handle,
     WockyNode *lm_node,
-    const gchar *resource)
+    gboolean *registered_account)
 {
   WockyNode *identity, *query_result = (WockyNode *) lm_node;
   WockyNodeIter iter;
   guint client_types = 0;
 
+  *registered_account = FALSE;
+
   /* Find all identity nodes in the result. */
   wocky_node_iter_init (&iter, query_result, "identity", NS_DISCO_INFO);
   while (wocky_node_iter_next (&iter, &identity))
@@ -1207,10 +1270,9 @@ client_types_from_message (TpHandle handle,
       they're phones. */
 
       if (!tp_strdiff (category, "account")
-          && (resource != NULL && g_str_has_prefix (resource, "android"))
           && !tp_strdiff (type, "registered"))
         {
-          client_types |= GABBLE_CLIENT_TYPE_PHONE;
+          *registered_account = TRUE;
         }
       else if (!tp_strdiff (category, "client") &&
           gabble_flag_from_nick (GABBLE_TYPE_CLIENT_TYPE, type, &value))
@@ -1223,6 +1285,33 @@ client_types_from_message (TpHandle handle,
   return client_types;
 }
 
+static guint
+client_types_for_resource (guint client_types,
+    gboolean registered_account,
+    const gchar *resource)
+{
+  if (registered_account &&
+      resource != NULL && g_str_has_prefix (resource, "android"))
+    client_types |= GABBLE_CLIENT_TYPE_PHONE;
+
+  return client_types;
+}
+
+static guint
+client_types_from_message (TpHandle handle,
+    WockyNode *lm_node,
+    const gchar *resource)
+{
+  gboolean registered_account;
+  guint client_types;
+
+  client_types = client_types_from_identities (handle, lm_node,
+      &registered_account);
+
+  return client_types_for_resource (client_types, registered_account,
+      resource);
+}
+
 static GPtrArray *
 data_forms_from_message (WockyNode *node)
 {
@@ -1246,6 +1335,159 @@ data_forms_from_message (WockyNode *node)
   return out;
 }
 
+/* The parsed form of a trusted disco reply for a caps URI. Entries are
+ * immutable once created, and shared by every contact advertising the same
+ * URI, so that we only parse each distinct disco reply once however many
+ * presences refer to it. */
+typedef struct {
+    gint refcount;
+    gchar *uri;
+    GabbleCapabilitySet *cap_set;
+    /* array of WockyDataForm */
+    GPtrArray *data_forms;
+    /* bitfield of GabbleClientType flags, not counting the Android quirk */
+    guint client_types;
+    gboolean registered_account;
+    /* link in priv->parsed_caps_lru, or NULL if evicted */
+    GList *link;
+} ParsedCaps;
+
+static ParsedCaps *
+parsed_caps_new (const gchar *uri,
+    WockyNode *query)
+{
+  ParsedCaps *parsed;
+  GabbleCapabilitySet *cap_set;
+
+  cap_set = gabble_capability_set_new_from_stanza (query);
+
+  if (cap_set == NULL)
+    return NULL;
+
+  parsed = g_slice_new0 (ParsedCaps);
+  parsed->refcount = 1;
+  parsed->uri = g_strdup (uri);
+  parsed->cap_set = cap_set;
+  parsed->data_forms = data_forms_from_message (query);
+  parsed->client_types = client_types_from_identities (0, query,
+      &parsed->registered_account);
+
+  return parsed;
+}
+
+static ParsedCaps *
+parsed_caps_ref (ParsedCaps *parsed)
+{
+  g_atomic_int_inc (&parsed->refcount);
+  return parsed;
+}
+
+static void
+parsed_caps_unref (ParsedCaps *parsed)
+{
+  if (!g_atomic_int_dec_and_test (&parsed->refcount))
+    return;
+
+  g_assert (parsed->link == NULL);
+
+  g_free (parsed->uri);
+  gabble_capability_set_free (parsed->cap_set);
+  g_ptr_array_unref (parsed->data_forms);
+  g_slice_free (ParsedCaps, parsed);
+}
+
+static void
+parsed_caps_evict (GabblePresenceCache *cache,
+    ParsedCaps *parsed)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+
+  g_queue_delete_link (&priv->parsed_caps_lru, parsed->link);
+  parsed->link = NULL;
+  /* drops the cache's reference */
+  g_hash_table_remove (priv->parsed_caps, parsed->uri);
+}
+
+static void
+parsed_caps_insert (GabblePresenceCache *cache,
+    ParsedCaps *parsed)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  ParsedCaps *old = g_hash_table_lookup (priv->parsed_caps, parsed->uri);
+
+  if (old == parsed)
+    return;
+
+  if (old != NULL)
+    parsed_caps_evict (cache, old);
+
+  while (g_queue_get_length (&priv->parsed_caps_lru) >= PARSED_CAPS_CACHE_SIZE)
+    parsed_caps_evict (cache, g_queue_peek_tail (&priv->parsed_caps_lru));
+
+  g_queue_push_head (&priv->parsed_caps_lru, parsed);
+  parsed->link = priv->parsed_caps_lru.head;
+  g_hash_table_insert (priv->parsed_caps, parsed->uri,
+      parsed_caps_ref (parsed));
+}
+
+/*
+ * parsed_caps_lookup:
+ *
+ * Returns: a new reference to the parsed trusted disco reply for @uri, from
+ *  our own cache if possible or from the WockyCapsCache otherwise, or NULL
+ *  if we don't have one.
+ */
+static ParsedCaps *
+parsed_caps_lookup (GabblePresenceCache *cache,
+    const gchar *uri)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  ParsedCaps *parsed = g_hash_table_lookup (priv->parsed_caps, uri);
+  WockyCapsCache *caps_cache;
+  WockyNodeTree *cached_query_reply;
+
+  if (parsed != NULL)
+    {
+      /* move it to the front of the queue */
+      g_queue_unlink (&priv->parsed_caps_lru, parsed->link);
+      g_queue_push_head_link (&priv->parsed_caps_lru, parsed->link);
+      gabble_metrics_count (GABBLE_METRIC_CAPS_CACHE_HITS, 1);
+      return parsed_caps_ref (parsed);
+    }
+
+  caps_cache = wocky_caps_cache_dup_shared ();
+  cached_query_reply = wocky_caps_cache_lookup (caps_cache, uri);
+  g_object_unref (caps_cache);
+
+  if (cached_query_reply == NULL)
+    {
+      gabble_metrics_count (GABBLE_METRIC_CAPS_CACHE_MISSES, 1);
+      return NULL;
+    }
+
+  gabble_metrics_count (GABBLE_METRIC_CAPS_CACHE_HITS, 1);
+
+  parsed = parsed_caps_new (uri,
+      wocky_node_tree_get_top_node (cached_query_reply));
+
+  if (parsed == NULL)
+    {
+      gchar *query_str = wocky_node_to_string (
+          wocky_node_tree_get_top_node (cached_query_reply));
+
+      g_warning ("couldn't re-parse cached query node, which was: %s",
+          query_str);
+      g_free (query_str);
+    }
+  else
+    {
+      parsed_caps_insert (cache, parsed);
+    }
+
+  g_object_unref (cached_query_reply);
+  return parsed;
+}
+
 static void
 _signal_presences_updated (GabblePresenceCache *cache,
     TpHandle handle)
@@ -1389,6 +1631,7 @@ _caps_disco_cb (GabbleDisco *disco,
     {
       WockyNodeTree *query_node = wocky_node_tree_new_from_node (query_result);
       WockyCapsCache *caps_cache = wocky_caps_cache_dup_shared ();
+      ParsedCaps *parsed;
 
       if (DEBUGGING)
         {
@@ -1403,6 +1646,16 @@ _caps_disco_cb (GabbleDisco *disco,
       g_object_unref (caps_cache);
       g_object_unref (query_node);
 
+      /* ...and our parsed copy of it, so that other contacts using the same
+       * node don't need to re-parse it. */
+      parsed = parsed_caps_new (node, query_result);
+
+      if (parsed != NULL)
+        {
+          parsed_caps_insert (cache, parsed);
+          parsed_caps_unref (parsed);
+        }
+
       /* We trust this caps node. Serve all its waiters. */
       for (i = waiters; NULL != i; i = i->next)
         {
@@ -1517,11 +1770,9 @@ _process_caps_uri (GabblePresenceCache *cache,
                    guint serial)
 {
   GabbleCapabilityInfo *info;
-  WockyNodeTree *cached_query_reply;
-  GabbleCapabilitySet *cached_caps = NULL;
+  ParsedCaps *parsed;
   GabblePresenceCachePrivate *priv;
   TpHandleRepoIface *contact_repo;
-  WockyCapsCache *caps_cache;
   gchar *uri = g_strdup_printf ("%s#%s", node, fragment);
   const gchar *ns = NULL;
 
@@ -1530,33 +1781,14 @@ _process_caps_uri (GabblePresenceCache *cache,
       (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
   info = capability_info_get (cache, uri);
 
-  caps_cache = wocky_caps_cache_dup_shared ();
-  cached_query_reply = wocky_caps_cache_lookup (caps_cache, uri);
-
-  if (cached_query_reply != NULL)
-    {
-      WockyNode *query = wocky_node_tree_get_top_node (cached_query_reply);
-
-      cached_caps = gabble_capability_set_new_from_stanza (query);
+  parsed = parsed_caps_lookup (cache, uri);
 
-      if (cached_caps == NULL)
-        {
-          gchar *query_str = wocky_node_to_string (query);
-
-          g_warning ("couldn't re-parse cached query node, which was: %s",
-              query_str);
-          g_free (query_str);
-        }
-    }
-
-  g_object_unref (caps_cache);
-
-  if (cached_caps != NULL ||
+  if (parsed != NULL ||
       info->trust >= CAPABILITY_BUNDLE_ENOUGH_TRUST ||
       tp_intset_is_member (info->guys, handle))
     {
       GabblePresence *presence = gabble_presence_cache_get (cache, handle);
-      GabbleCapabilitySet *cap_set = cached_caps ? cached_caps : info->cap_set;
+      GabbleCapabilitySet *cap_set = parsed ? parsed->cap_set : info->cap_set;
 
       /* we already have enough trust for this node; apply the cached value to
        * the (handle, resource) */
@@ -1567,29 +1799,22 @@ _process_caps_uri (GabblePresenceCache *cache,
         {
           guint types;
 
-          gabble_presence_set_capabilities (
-              presence, resource, cap_set, info->data_forms, serial);
+          gabble_presence_set_capabilities (presence, resource, cap_set,
+              parsed ? parsed->data_forms : info->data_forms, serial);
 
           /* We can only get this information from actual disco replies,
            * so we depend on having this information from the caps cache. */
-          if (cached_query_reply != NULL)
-            {
-              WockyNode *query = wocky_node_tree_get_top_node (cached_query_reply);
-              types = client_types_from_message (handle, query, resource);
-            }
+          if (parsed != NULL)
+            types = client_types_for_resource (parsed->client_types,
+                parsed->registered_account, resource);
           else
-            {
-              types = info->client_types;
-            }
+            types = info->client_types;
 
           if (gabble_presence_update_client_types (presence, resource, types))
             g_signal_emit (cache, signals[CLIENT_TYPES_UPDATED], 0, handle);
         }
       else
         DEBUG ("presence not found");
-
-      if (cached_caps != NULL)
-        gabble_capability_set_free (cached_caps);
     }
   else if (hash == NULL && get_google_cap (fragment, &ns))
     {
@@ -1682,8 +1907,8 @@ _process_caps_uri (GabblePresenceCache *cache,
     }
 
 out:
-  if (cached_query_reply != NULL)
-    g_object_unref (cached_query_reply);
+  if (parsed != NULL)
+    parsed_caps_unref (parsed);
 
   g_free (uri);
 }
@@ -1803,6 +2028,9 @@ presence_cache_check_for_decloak_request (
 }
 
 
+static void presence_cache_parse_deferred (GabblePresenceCache *cache,
+    TpHandle handle);
+
 /* FIXME: in a cruel twist of fate, this is called by GabbleMucChannel!
  * Presumably this is because the handler priority here is MIN, so WockyMuc
  * steals the presence stanza before we can scrape our information out of it?
@@ -1824,6 +2052,9 @@ gabble_presence_parse_presence_message (
   GabblePresenceId presence_id;
   GabblePresence *presence;
 
+  /* Anything we deferred from this contact came before @message */
+  presence_cache_parse_deferred (cache, handle);
+
   /* The server should not send back the presence stanza about ourself (same
    * resource). If it does, we just ignore the received stanza. We want to
    * avoid any infinite ping-pong with the server due to XEP-0153 4.2-2-3.
@@ -2002,6 +2233,8 @@ gabble_presence_cache_presence_cb (
       (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
   const char *from = wocky_stanza_get_from (message);
   TpHandle handle;
+  gint64 start = g_get_monotonic_time ();
+  gboolean ret;
 
   if (NULL == from)
     {
@@ -2016,7 +2249,9 @@ gabble_presence_cache_presence_cb (
       return FALSE;
     }
 
-  return gabble_presence_parse_presence_message (cache, handle, from, message);
+  ret = gabble_presence_parse_presence_message (cache, handle, from, message);
+  gabble_metrics_record_since (GABBLE_METRIC_HANDLE_PRESENCE, start);
+  return ret;
 }
 
 
@@ -2028,6 +2263,99 @@ gabble_presence_cache_new (GabbleConnection *conn)
                        NULL);
 }
 
+/* Parses @handle's deferred presence, if there is one, so that what we
+ * know about them is up to date */
+static void
+presence_cache_parse_deferred (GabblePresenceCache *cache,
+    TpHandle handle)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  DeferredPresence *deferred;
+
+  if (priv->deferred == NULL)
+    return;
+
+  deferred = g_hash_table_lookup (priv->deferred, GUINT_TO_POINTER (handle));
+
+  if (deferred == NULL)
+    return;
+
+  g_hash_table_steal (priv->deferred, GUINT_TO_POINTER (handle));
+  gabble_presence_parse_presence_message (cache, handle, deferred->from,
+      deferred->stanza);
+  deferred_presence_free (deferred);
+}
+
+static gboolean
+presence_cache_parse_deferred_cb (gpointer user_data)
+{
+  GabblePresenceCache *cache = user_data;
+  GabblePresenceCachePrivate *priv = cache->priv;
+  TpHandle handles[DEFERRED_PRESENCES_PER_IDLE];
+  GHashTableIter iter;
+  gpointer key;
+  guint i, n = 0;
+  gboolean ret = FALSE;
+
+  /* Parsing can emit signals, whose handlers could defer or parse more, so
+   * pick the handles first */
+  g_hash_table_iter_init (&iter, priv->deferred);
+  while (n < DEFERRED_PRESENCES_PER_IDLE &&
+      g_hash_table_iter_next (&iter, &key, NULL))
+    handles[n++] = GPOINTER_TO_UINT (key);
+
+  g_object_ref (cache);
+
+  for (i = 0; i < n && priv->deferred != NULL; i++)
+    presence_cache_parse_deferred (cache, handles[i]);
+
+  /* deferred is NULL if a signal handler disposed the cache */
+  if (priv->deferred != NULL && g_hash_table_size (priv->deferred) > 0)
+    {
+      ret = TRUE;
+    }
+  else if (priv->deferred != NULL)
+    {
+      DEBUG ("no deferred presences left");
+      priv->deferred_id = 0;
+    }
+
+  g_object_unref (cache);
+  return ret;
+}
+
+/*
+ * gabble_presence_cache_defer_presence_message:
+ *
+ * Like gabble_presence_parse_presence_message(), but for when a lot of
+ * presences arrive at once and nobody is likely to ask about most of them
+ * straight away, such as the members of a MUC we've just joined. @message is
+ * parsed as soon as anything looks up @handle in the cache, or a little later
+ * when the main loop has nothing better to do.
+ */
+void
+gabble_presence_cache_defer_presence_message (GabblePresenceCache *cache,
+    TpHandle handle,
+    const gchar *from,
+    WockyStanza *message)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  DeferredPresence *deferred;
+
+  /* Whatever we deferred before is older than this, so it has to go first */
+  presence_cache_parse_deferred (cache, handle);
+
+  deferred = g_slice_new (DeferredPresence);
+  deferred->from = g_strdup (from);
+  deferred->stanza = g_object_ref (message);
+  gabble_metrics_gauge_add (GABBLE_METRIC_DEFERRED_PRESENCES, 1);
+  g_hash_table_insert (priv->deferred, GUINT_TO_POINTER (handle), deferred);
+
+  if (priv->deferred_id == 0)
+    priv->deferred_id = g_idle_add_full (G_PRIORITY_LOW,
+        presence_cache_parse_deferred_cb, cache, NULL);
+}
+
 GabblePresence *
 gabble_presence_cache_get (GabblePresenceCache *cache, TpHandle handle)
 {
@@ -2037,6 +2365,8 @@ gabble_presence_cache_get (GabblePresenceCache *cache, TpHandle handle)
 
   g_assert (tp_handle_is_valid (contact_repo, handle, NULL));
 
+  presence_cache_parse_deferred (cache, handle);
+
   return g_hash_table_lookup (priv->presence, GUINT_TO_POINTER (handle));
 }
 
@@ -2048,6 +2378,8 @@ gabble_presence_cache_get_for_contact (
   GabblePresenceCachePrivate *priv = cache->priv;
   TpHandle handle = ensure_handle_from_contact (priv->conn, contact);
 
+  presence_cache_parse_deferred (cache, handle);
+
   return g_hash_table_lookup (priv->presence, GUINT_TO_POINTER (handle));
 }
 
@@ -2332,6 +2664,7 @@ gabble_presence_cache_really_remove (
 
   jid = tp_handle_inspect (contact_repo, handle);
   DEBUG ("forced to discard cached presence for jid %s", jid);
+  g_hash_table_remove (priv->deferred, GUINT_TO_POINTER (handle));
   g_hash_table_remove (priv->presence, GUINT_TO_POINTER (handle));
   tp_handle_set_remove (priv->presence_handles, handle);
 }
@@ -2460,6 +2793,8 @@ gabble_presence_cache_is_unsure (GabblePresenceCache *cache,
   GabblePresenceCachePrivate *priv = cache->priv;
   TpBaseConnection *base_conn = TP_BASE_CONNECTION (priv->conn);
 
+  presence_cache_parse_deferred (cache, handle);
+
   /* we might not have had any presence at all - if we're not connected yet, or
    * are still in the "unsure period", assume we might get initial presence
    * soon.
@@ -2618,6 +2953,8 @@ gabble_presence_cache_disco_in_progress (GabblePresenceCache *cache,
   GList *l, *waiter_list;
   gboolean in_progress = FALSE;
 
+  presence_cache_parse_deferred (cache, handle);
+
   waiter_list = g_hash_table_get_values (priv->disco_pending);
 
   for (l = waiter_list; !in_progress && l != NULL; l = l->next)
@@ -126,6 +126,8 @@ gboolean gabble_presence_parse_presence_message (
     TpHandle handle,
     const gchar *from,
     WockyStanza *message);
+void gabble_presence_cache_defer_presence_message (GabblePresenceCache *cache,
+    TpHandle handle, const gchar *from, WockyStanza *message);
 
 void gabble_presence_cache_contacts_added_to_olpc_view (
     GabblePresenceCache *cache, TpHandleSet *handles);
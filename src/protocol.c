@@ -102,6 +102,10 @@ static TpCMParamSpec jabber_params[] = {
     TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER(FALSE),
     0 /* unused */, NULL, NULL },
 
+  { "parallel-bytestreams", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER(FALSE),
+    0 /* unused */, NULL, NULL },
+
   { "https-proxy-server", DBUS_TYPE_STRING_AS_STRING, G_TYPE_STRING, 0, NULL,
     0 /* unused */,
     /* FIXME: validate properly */
@@ -247,6 +251,7 @@ struct ParamMapping {
   SAME ("require-encryption"),
   SAME ("register"),
   SAME ("low-bandwidth"),
+  SAME ("parallel-bytestreams"),
   SAME ("https-proxy-server"),
   SAME ("https-proxy-port"),
   SAME ("fallback-conference-server"),
@@ -27,10 +27,31 @@
 
 #include "connection.h"
 #include "debug.h"
+#include "metrics.h"
 #include "util.h"
 
 #define DEFAULT_REQUEST_TIMEOUT 180
+
+/* The number of requests we allow in flight at once starts at
+ * REQUEST_PIPELINE_SIZE, and then moves between the MIN and MAX sizes
+ * according to how each reply's round-trip time compares to the recent best
+ * for the domain it came from: if replies slow down, the server is probably
+ * queueing our requests, so we send fewer at a time. We never go below the
+ * size we used before the window adapted. */
 #define REQUEST_PIPELINE_SIZE 10
+#define REQUEST_PIPELINE_MIN_SIZE REQUEST_PIPELINE_SIZE
+#define REQUEST_PIPELINE_MAX_SIZE 32
+
+/* A domain's baseline round-trip time is the fastest of its last this many
+ * replies, so that it follows a route which has become slower for good
+ * rather than treating every later reply as queued */
+#define REQUEST_PIPELINE_BASELINE_SAMPLES 8
+
+/* How many requests of each priority may be sent in each round, before
+ * lower priorities get a turn; this means background requests can't be
+ * starved completely by a steady stream of interactive ones. */
+static const guint priority_weights[NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES] =
+    { 1, 4, 16 };
 
 /* Properties */
 enum
@@ -47,20 +68,45 @@ struct _GabbleRequestPipelineItem
   WockyStanza *message;
   guint timer_id;
   guint timeout;
+  GabbleRequestPipelinePriority priority;
   gboolean in_flight;
   gboolean zombie;
+  /* when the request was sent, in monotonic microseconds */
+  gint64 sent_at;
+  /* our link in whichever queue we're in */
+  GList *link;
 
   GabbleRequestPipelineCb callback;
   gpointer user_data;
 };
 
+typedef struct {
+    /* round-trip times in microseconds, oldest overwritten first */
+    gint64 samples[REQUEST_PIPELINE_BASELINE_SAMPLES];
+    guint n_samples;
+    guint next;
+} RttBaseline;
+
 struct _GabbleRequestPipelinePrivate
 {
   GabbleConnection *connection;
-  GSList *pending_items;
-  GSList *items_in_flight;
+  /* One FIFO of items per priority */
+  GQueue pending_items[NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES];
+  guint n_pending;
+  /* How many more items of each priority we may send in this round */
+  guint credits[NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES];
+  GQueue items_in_flight;
   /* Zombie storage (items which were cancelled while the IQ was in flight) */
-  GSList *crypt_items;
+  GQueue crypt_items;
+
+  /* How many items may be in flight at once */
+  guint window;
+  /* owned domain ("" for our own server) => owned RttBaseline, since
+   * requests to remote servers legitimately take longer */
+  GHashTable *baselines;
+  /* Smoothed ratio of round-trip times to their domains' baselines, in
+   * percent; 0 if unknown */
+  guint rtt_ratio;
 
   gboolean dispose_has_run;
 };
@@ -76,12 +122,32 @@ gabble_request_pipeline_error_quark (void)
 
 #define GABBLE_REQUEST_PIPELINE_GET_PRIVATE(o) ((o)->priv)
 
+static void
+rtt_baseline_free (RttBaseline *baseline)
+{
+  g_slice_free (RttBaseline, baseline);
+}
+
 static void
 gabble_request_pipeline_init (GabbleRequestPipeline *obj)
 {
   GabbleRequestPipelinePrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (obj,
       GABBLE_TYPE_REQUEST_PIPELINE, GabbleRequestPipelinePrivate);
+  guint i;
+
   obj->priv = priv;
+
+  for (i = 0; i < NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES; i++)
+    {
+      g_queue_init (&priv->pending_items[i]);
+      priv->credits[i] = priority_weights[i];
+    }
+
+  g_queue_init (&priv->items_in_flight);
+  g_queue_init (&priv->crypt_items);
+  priv->window = REQUEST_PIPELINE_SIZE;
+  priv->baselines = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) rtt_baseline_free);
 }
 
 static void gabble_request_pipeline_set_property (GObject *object,
@@ -167,6 +233,19 @@ gabble_request_pipeline_new (GabbleConnection *conn)
   return self;
 }
 
+static GQueue *
+item_get_queue (GabbleRequestPipelineItem *item)
+{
+  GabbleRequestPipelinePrivate *priv = item->pipeline->priv;
+
+  if (item->zombie)
+    return &priv->crypt_items;
+  else if (item->in_flight)
+    return &priv->items_in_flight;
+  else
+    return &priv->pending_items[item->priority];
+}
+
 static void
 delete_item (GabbleRequestPipelineItem *item)
 {
@@ -177,17 +256,20 @@ delete_item (GabbleRequestPipelineItem *item)
 
   DEBUG ("deleting item %p", item);
 
-  if (item->zombie)
-    {
-      priv->crypt_items = g_slist_remove (priv->crypt_items, item);
-    }
-  else if (item->in_flight)
+  /* the link is NULL if response_cb has already taken the item out */
+  if (item->link != NULL)
     {
-      priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
-    }
-  else
-    {
-      priv->pending_items = g_slist_remove (priv->pending_items, item);
+      g_queue_delete_link (item_get_queue (item), item->link);
+
+      if (!item->zombie && !item->in_flight)
+        {
+          priv->n_pending--;
+          gabble_metrics_gauge_add (GABBLE_METRIC_PIPELINE_QUEUED, -1);
+        }
+      else if (!item->zombie)
+        {
+          gabble_metrics_gauge_add (GABBLE_METRIC_PIPELINE_IN_FLIGHT, -1);
+        }
     }
 
   if (item->timer_id)
@@ -217,10 +299,10 @@ gabble_request_pipeline_create_zombie (GabbleRequestPipeline *pipeline,
 
   if (item->in_flight)
     {
+      g_queue_unlink (&priv->items_in_flight, item->link);
+      gabble_metrics_gauge_add (GABBLE_METRIC_PIPELINE_IN_FLIGHT, -1);
       item->zombie = TRUE;
-
-      priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
-      priv->crypt_items = g_slist_prepend (priv->crypt_items, item);
+      g_queue_push_head_link (&priv->crypt_items, item->link);
 
       gabble_request_pipeline_go (pipeline);
     }
@@ -240,17 +322,45 @@ gabble_request_pipeline_item_cancel (GabbleRequestPipelineItem *item)
   gabble_request_pipeline_create_zombie (item->pipeline, item, &cancelled);
 }
 
+/*
+ * gabble_request_pipeline_item_promote:
+ * @item: a request
+ * @priority: the priority it should have
+ *
+ * If @item has not been sent yet, and @priority is higher than its current
+ * priority, moves it to the back of @priority's queue. This is useful if
+ * a user starts waiting for the result of a background request.
+ */
+void
+gabble_request_pipeline_item_promote (GabbleRequestPipelineItem *item,
+    GabbleRequestPipelinePriority priority)
+{
+  GabbleRequestPipelinePrivate *priv = item->pipeline->priv;
+
+  g_return_if_fail (priority < NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES);
+
+  if (item->in_flight || item->zombie || priority <= item->priority)
+    return;
+
+  DEBUG ("promoting item %p from priority %u to %u", item, item->priority,
+      priority);
+
+  g_queue_unlink (&priv->pending_items[item->priority], item->link);
+  item->priority = priority;
+  g_queue_push_tail_link (&priv->pending_items[item->priority], item->link);
+}
+
 static void
 gabble_request_pipeline_flush (GabbleRequestPipeline *self,
-    GSList **list)
+    GQueue *queue)
 {
   GabbleRequestPipelineItem *item;
   GError disconnected = { TP_ERROR, TP_ERROR_DISCONNECTED,
       "Request failed because connection became disconnected" };
 
-  while (*list != NULL)
+  while (!g_queue_is_empty (queue))
     {
-      item = (*list)->data;
+      item = g_queue_peek_head (queue);
 
       if (!item->zombie)
         (item->callback) (self->priv->connection, NULL, item->user_data,
@@ -266,6 +376,7 @@ gabble_request_pipeline_dispose (GObject *object)
   GabbleRequestPipeline *self = GABBLE_REQUEST_PIPELINE (object);
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (self);
+  guint i;
 
   if (priv->dispose_has_run)
     return;
@@ -275,7 +386,10 @@ gabble_request_pipeline_dispose (GObject *object)
   DEBUG ("disposing request-pipeline");
 
   gabble_request_pipeline_flush (self, &priv->items_in_flight);
-  gabble_request_pipeline_flush (self, &priv->pending_items);
+
+  for (i = NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES; i > 0; i--)
+    gabble_request_pipeline_flush (self, &priv->pending_items[i - 1]);
+
   gabble_request_pipeline_flush (self, &priv->crypt_items);
 
   g_idle_remove_by_data (self);
@@ -287,9 +401,88 @@ gabble_request_pipeline_dispose (GObject *object)
 static void
 gabble_request_pipeline_finalize (GObject *object)
 {
+  GabbleRequestPipeline *self = GABBLE_REQUEST_PIPELINE (object);
+
+  g_hash_table_unref (self->priv->baselines);
+
   G_OBJECT_CLASS (gabble_request_pipeline_parent_class)->finalize (object);
 }
 
+/* Adds @rtt to the baseline for @item's destination, and returns the
+ * baseline including it */
+static gint64
+update_baseline (GabbleRequestPipeline *pipeline,
+    GabbleRequestPipelineItem *item,
+    gint64 rtt)
+{
+  GabbleRequestPipelinePrivate *priv = pipeline->priv;
+  const gchar *to = wocky_node_get_attribute (
+      wocky_stanza_get_top_node (item->message), "to");
+  gchar *domain = NULL;
+  RttBaseline *baseline;
+  gint64 min_rtt;
+  guint i;
+
+  if (to == NULL || !wocky_decode_jid (to, NULL, &domain, NULL))
+    {
+      g_free (domain);
+      domain = g_strdup ("");
+    }
+
+  baseline = g_hash_table_lookup (priv->baselines, domain);
+
+  if (baseline == NULL)
+    {
+      baseline = g_slice_new0 (RttBaseline);
+      g_hash_table_insert (priv->baselines, domain, baseline);
+    }
+  else
+    {
+      g_free (domain);
+    }
+
+  baseline->samples[baseline->next] = rtt;
+  baseline->next = (baseline->next + 1) % REQUEST_PIPELINE_BASELINE_SAMPLES;
+  baseline->n_samples = MIN (baseline->n_samples + 1,
+      REQUEST_PIPELINE_BASELINE_SAMPLES);
+
+  min_rtt = rtt;
+
+  for (i = 0; i < baseline->n_samples; i++)
+    min_rtt = MIN (min_rtt, baseline->samples[i]);
+
+  return MAX (min_rtt, 1);
+}
+
+/* A simplified version of TCP Vegas: grow the window while replies come back
+ * about as fast as recent ones from the same domain, and shrink it when
+ * they start taking noticeably longer. */
+static void
+update_window (GabbleRequestPipeline *pipeline,
+    GabbleRequestPipelineItem *item,
+    gint64 rtt)
+{
+  GabbleRequestPipelinePrivate *priv = pipeline->priv;
+  guint ratio = MIN (rtt * 100 / update_baseline (pipeline, item, rtt),
+      G_MAXUINT / 8);
+
+  if (priv->rtt_ratio == 0)
+    priv->rtt_ratio = ratio;
+  else
+    priv->rtt_ratio = (7 * priv->rtt_ratio + ratio) / 8;
+
+  if (priv->rtt_ratio < 150)
+    {
+      if (priv->window < REQUEST_PIPELINE_MAX_SIZE)
+        priv->window++;
+    }
+  else if (priv->rtt_ratio > 200)
+    {
+      if (priv->window > REQUEST_PIPELINE_MIN_SIZE)
+        priv->window--;
+    }
+}
+
 static void
 response_cb (GabbleConnection *conn,
              WockyStanza *sent,
@@ -298,24 +491,35 @@ response_cb (GabbleConnection *conn,
              gpointer user_data)
 {
   GabbleRequestPipelineItem *item = (GabbleRequestPipelineItem *) user_data;
-  GabbleRequestPipeline *pipeline = item->pipeline;
+  GabbleRequestPipeline *pipeline = GABBLE_REQUEST_PIPELINE (object);
   GabbleRequestPipelinePrivate *priv;
 
   g_assert (GABBLE_IS_REQUEST_PIPELINE (pipeline));
   priv = GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
 
-  DEBUG ("got reply for request %p", item);
-
-  if (NULL == g_slist_find (priv->items_in_flight, item))
+  /* if we've been disposed, the item has already been freed */
+  if (priv->dispose_has_run)
       return;
 
-  g_assert (item->in_flight);
+  DEBUG ("got reply for request %p", item);
 
-  priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
+  g_assert (item->pipeline == pipeline);
+  g_assert (item->in_flight);
 
   if (!item->zombie)
     {
       GError *error = NULL;
+      gint64 latency = g_get_monotonic_time () - item->sent_at;
+
+      update_window (pipeline, item, latency);
+      gabble_metrics_record (GABBLE_METRIC_PIPELINE_LATENCY, latency);
+
+      /* take the item out of flight before calling back, so that if the
+       * callback enqueues another request it sees the free slot */
+      g_queue_delete_link (&priv->items_in_flight, item->link);
+      item->link = NULL;
+      gabble_metrics_gauge_add (GABBLE_METRIC_PIPELINE_IN_FLIGHT, -1);
+
       wocky_stanza_extract_errors (reply, NULL, &error, NULL, NULL);
       item->callback (priv->connection, reply, item->user_data, error);
       g_clear_error (&error);
@@ -334,15 +538,56 @@ static gboolean
 timeout_cb (gpointer data)
 {
   GabbleRequestPipelineItem *item = (GabbleRequestPipelineItem *) data;
+  GabbleRequestPipelinePrivate *priv = item->pipeline->priv;
   GError timed_out = { GABBLE_REQUEST_PIPELINE_ERROR,
       GABBLE_REQUEST_PIPELINE_ERROR_TIMEOUT,
       "Request timed out" };
 
+  /* The server is struggling (or has lost the request): back off */
+  priv->window = MAX (REQUEST_PIPELINE_MIN_SIZE, priv->window / 2);
+  DEBUG ("request %p timed out; window is now %u", item, priv->window);
+  gabble_metrics_count (GABBLE_METRIC_PIPELINE_TIMEOUTS, 1);
+
+  item->timer_id = 0;
   gabble_request_pipeline_create_zombie (item->pipeline, item, &timed_out);
 
   return FALSE;
 }
 
+/* Picks the next item to send, by weighted round-robin between the
+ * priorities, and removes it from its queue. */
+static GabbleRequestPipelineItem *
+pop_next_pending (GabbleRequestPipeline *pipeline)
+{
+  GabbleRequestPipelinePrivate *priv = pipeline->priv;
+  guint i;
+
+  if (priv->n_pending == 0)
+    return NULL;
+
+  while (TRUE)
+    {
+      for (i = NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES; i > 0; i--)
+        {
+          GQueue *queue = &priv->pending_items[i - 1];
+
+          if (priv->credits[i - 1] > 0 && !g_queue_is_empty (queue))
+            {
+              GList *link = g_queue_pop_head_link (queue);
+
+              priv->credits[i - 1]--;
+              priv->n_pending--;
+              gabble_metrics_gauge_add (GABBLE_METRIC_PIPELINE_QUEUED, -1);
+              return link->data;
+            }
+        }
+
+      /* every priority with something to send has had its turn */
+      for (i = 0; i < NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES; i++)
+        priv->credits[i] = priority_weights[i];
+    }
+}
+
 static void
 send_next_request (GabbleRequestPipeline *pipeline)
 {
@@ -351,28 +596,31 @@ send_next_request (GabbleRequestPipeline *pipeline)
   GabbleRequestPipelineItem *item;
   GError *error = NULL;
 
-  if (priv->pending_items == NULL)
-      return;
+  item = pop_next_pending (pipeline);
 
-  item = priv->pending_items->data;
+  if (item == NULL)
+      return;
 
-  DEBUG ("processing request %p", item);
+  DEBUG ("processing request %p (priority %u)", item, item->priority);
 
   g_assert (item->in_flight == FALSE);
 
-  priv->pending_items = g_slist_remove (priv->pending_items, item);
+  item->in_flight = TRUE;
+  g_queue_push_head_link (&priv->items_in_flight, item->link);
+  gabble_metrics_gauge_add (GABBLE_METRIC_PIPELINE_IN_FLIGHT, 1);
 
   if (!_gabble_connection_send_with_reply (priv->connection, item->message,
       response_cb, G_OBJECT (pipeline), item, &error))
     {
       item->callback (priv->connection, NULL, item->user_data, error);
+      g_error_free (error);
       delete_item (item);
       send_next_request (pipeline);
     }
   else
     {
-      priv->items_in_flight = g_slist_prepend (priv->items_in_flight, item);
-      item->in_flight = TRUE;
+      gabble_metrics_count (GABBLE_METRIC_PIPELINE_REQUESTS_SENT, 1);
+      item->sent_at = g_get_monotonic_time ();
       item->timer_id = g_timeout_add_seconds (item->timeout, timeout_cb, item);
     }
 }
@@ -383,12 +631,12 @@ gabble_request_pipeline_go (GabbleRequestPipeline *pipeline)
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
 
-  DEBUG ("called; %d pending items, %d items in flight",
-    g_slist_length (priv->pending_items),
-    g_slist_length (priv->items_in_flight));
+  DEBUG ("called; %u pending items, %u of %u items in flight",
+    priv->n_pending, g_queue_get_length (&priv->items_in_flight),
+    priv->window);
 
-  while (priv->pending_items &&
-      (g_slist_length (priv->items_in_flight) < REQUEST_PIPELINE_SIZE))
+  while (priv->n_pending > 0 &&
+      g_queue_get_length (&priv->items_in_flight) < priv->window)
     {
       send_next_request (pipeline);
     }
@@ -408,33 +656,52 @@ gabble_request_pipeline_enqueue (GabbleRequestPipeline *pipeline,
                                  guint timeout,
                                  GabbleRequestPipelineCb callback,
                                  gpointer user_data)
+{
+  return gabble_request_pipeline_enqueue_full (pipeline, msg, timeout,
+      GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, callback, user_data);
+}
+
+GabbleRequestPipelineItem *
+gabble_request_pipeline_enqueue_full (GabbleRequestPipeline *pipeline,
+                                      WockyStanza *msg,
+                                      guint timeout,
+                                      GabbleRequestPipelinePriority priority,
+                                      GabbleRequestPipelineCb callback,
+                                      gpointer user_data)
 {
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
   GabbleRequestPipelineItem *item = g_slice_new0 (GabbleRequestPipelineItem);
 
   g_return_val_if_fail (callback != NULL, NULL);
+  g_return_val_if_fail (priority < NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES,
+      NULL);
 
   item->pipeline = pipeline;
   item->message = msg;
   if (timeout == 0)
       timeout = DEFAULT_REQUEST_TIMEOUT;
   item->timeout = timeout;
+  item->priority = priority;
   item->in_flight = FALSE;
   item->callback = callback;
   item->user_data = user_data;
 
   g_object_ref (msg);
 
-  priv->pending_items = g_slist_append (priv->pending_items, item);
+  g_queue_push_tail (&priv->pending_items[priority], item);
+  item->link = g_queue_peek_tail_link (&priv->pending_items[priority]);
+  priv->n_pending++;
+  gabble_metrics_gauge_add (GABBLE_METRIC_PIPELINE_QUEUED, 1);
 
-  DEBUG ("enqueued new request as item %p", item);
-  DEBUG ("number of items in flight: %d", g_slist_length (priv->items_in_flight));
+  DEBUG ("enqueued new request as item %p (priority %u)", item, priority);
+  DEBUG ("number of items in flight: %u",
+      g_queue_get_length (&priv->items_in_flight));
 
   /* If the pipeline isn't full, schedule a run. Run it delayed so that if
    * there's an error, the callback will be called after this function returns.
    */
-  if (g_slist_length (priv->items_in_flight) < REQUEST_PIPELINE_SIZE)
+  if (g_queue_get_length (&priv->items_in_flight) < priv->window)
     gabble_idle_add_weak (delayed_run_pipeline, G_OBJECT (pipeline));
 
   return item;
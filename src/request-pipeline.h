@@ -44,6 +44,22 @@ typedef enum
   GABBLE_REQUEST_PIPELINE_ERROR_TIMEOUT
 } GabbleRequestPipelineError;
 
+/**
+ * GabbleRequestPipelinePriority:
+ * @GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND: Bulk requests which nobody
+ *  is actively waiting for, such as fetching every contact's avatar
+ * @GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL: The default
+ * @GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE: Requests which a user is
+ *  waiting for, such as opening a contact's information dialog
+ */
+typedef enum
+{
+  GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND,
+  GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL,
+  GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE,
+  NUM_GABBLE_REQUEST_PIPELINE_PRIORITIES
+} GabbleRequestPipelinePriority;
+
 GQuark gabble_request_pipeline_error_quark (void);
 #define GABBLE_REQUEST_PIPELINE_ERROR gabble_request_pipeline_error_quark ()
 
@@ -79,7 +95,13 @@ GabbleRequestPipeline *gabble_request_pipeline_new (GabbleConnection *conn);
 GabbleRequestPipelineItem *gabble_request_pipeline_enqueue
     (GabbleRequestPipeline *pipeline, WockyStanza *msg, guint timeout,
      GabbleRequestPipelineCb callback, gpointer user_data);
+GabbleRequestPipelineItem *gabble_request_pipeline_enqueue_full
+    (GabbleRequestPipeline *pipeline, WockyStanza *msg, guint timeout,
+     GabbleRequestPipelinePriority priority,
+     GabbleRequestPipelineCb callback, gpointer user_data);
 void gabble_request_pipeline_item_cancel (GabbleRequestPipelineItem *req);
+void gabble_request_pipeline_item_promote (GabbleRequestPipelineItem *req,
+    GabbleRequestPipelinePriority priority);
 
 G_END_DECLS
 
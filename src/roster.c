@@ -37,12 +37,17 @@
 #include "conn-util.h"
 #include "connection.h"
 #include "debug.h"
+#include "handler-profile.h"
 #include "namespaces.h"
 #include "presence-cache.h"
 #include "util.h"
 
 #define GOOGLE_ROSTER_VERSION "2"
 
+/* Seconds to wait after the roster changes before rewriting the on-disk
+ * snapshot, so that a burst of pushes only costs one write. */
+#define ROSTER_SNAPSHOT_SAVE_DELAY 5
+
 /* signal enum */
 enum
 {
@@ -65,11 +70,23 @@ struct _GabbleRosterPrivate
   GHashTable *items;
   /* Used as a set of own (gchar *) */
   GHashTable *groups;
+  /* owned group name => owned TpHandleSet of the items in that group;
+   * groups with no members have no entry */
+  GHashTable *group_members;
 
   /* set of contacts whose subscription requests will automatically be
    * accepted during this session */
   TpHandleSet *pre_authorized;
 
+  /* XEP-0237 version of the roster in @items, or NULL if unknown */
+  gchar *version;
+  /* where this account's roster snapshot lives, or NULL if not yet known */
+  gchar *snapshot_path;
+  guint snapshot_save_id;
+  /* TRUE if @items was loaded from the snapshot and the server has not yet
+   * answered our roster query */
+  gboolean from_snapshot;
+
   gboolean received;
   gboolean dispose_has_run;
 };
@@ -222,6 +239,9 @@ gabble_roster_finalize (GObject *object)
   DEBUG ("called with %p", object);
 
   g_hash_table_unref (priv->items);
+  tp_clear_pointer (&priv->group_members, g_hash_table_unref);
+  g_free (priv->version);
+  g_free (priv->snapshot_path);
 
   G_OBJECT_CLASS (gabble_roster_parent_class)->finalize (object);
 }
@@ -446,6 +466,43 @@ _gabble_roster_item_ensure (GabbleRoster *roster,
   return item;
 }
 
+static void
+roster_group_index_add (GabbleRoster *roster,
+    const gchar *group,
+    TpHandle contact)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+  TpHandleSet *members = g_hash_table_lookup (priv->group_members, group);
+
+  if (members == NULL)
+    {
+      TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+          (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
+
+      members = tp_handle_set_new (contact_repo);
+      g_hash_table_insert (priv->group_members, g_strdup (group), members);
+    }
+
+  tp_handle_set_add (members, contact);
+}
+
+static void
+roster_group_index_remove (GabbleRoster *roster,
+    const gchar *group,
+    TpHandle contact)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+  TpHandleSet *members = g_hash_table_lookup (priv->group_members, group);
+
+  if (members == NULL)
+    return;
+
+  tp_handle_set_remove (members, contact);
+
+  if (tp_handle_set_is_empty (members))
+    g_hash_table_remove (priv->group_members, group);
+}
+
 static gboolean
 _gabble_roster_item_maybe_remove (GabbleRoster *roster,
     TpHandle handle)
@@ -454,6 +511,8 @@ _gabble_roster_item_maybe_remove (GabbleRoster *roster,
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
       (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
   GabbleRosterItem *item;
+  GHashTableIter iter;
+  gpointer k;
 
   g_assert (roster != NULL);
   g_assert (GABBLE_IS_ROSTER (roster));
@@ -490,6 +549,11 @@ _gabble_roster_item_maybe_remove (GabbleRoster *roster,
     }
 
   DEBUG ("removing contact#%u", handle);
+
+  g_hash_table_iter_init (&iter, item->groups);
+  while (g_hash_table_iter_next (&iter, &k, NULL))
+    roster_group_index_remove (roster, k, handle);
+
   item = NULL;
   g_hash_table_remove (priv->items, GUINT_TO_POINTER (handle));
   return TRUE;
@@ -640,6 +704,20 @@ _gabble_roster_item_update (GabbleRoster *roster,
   added_to = group_set_update (item->groups, new_groups);
   group_set_difference_update (item->groups, removed_from);
 
+  if (g_hash_table_size (added_to) > 0 || g_hash_table_size (removed_from) > 0)
+    {
+      GHashTableIter iter;
+      gpointer k;
+
+      g_hash_table_iter_init (&iter, added_to);
+      while (g_hash_table_iter_next (&iter, &k, NULL))
+        roster_group_index_add (roster, k, contact_handle);
+
+      g_hash_table_iter_init (&iter, removed_from);
+      while (g_hash_table_iter_next (&iter, &k, NULL))
+        roster_group_index_remove (roster, k, contact_handle);
+    }
+
   if (roster->priv->groups != NULL)
     {
       GHashTable *created_groups;
@@ -817,33 +895,27 @@ _gabble_roster_item_put_group_in_message (gpointer k,
 }
 
 /*
- * _gabble_roster_item_to_message:
+ * _gabble_roster_item_add_to_query:
  * @roster: the roster
- * @item: the state we would like the contact's roster item to have (*not*
- *  the state it currently has!)
  * @handle: a contact
+ * @item: the state to describe
+ * @query_node: a &lt;query xmlns='jabber:iq:roster'/&gt; node
  *
- * Returns: the necessary IQ to change @handle's state to match that of @item
+ * Appends an &lt;item/&gt; describing @item to @query_node.
  */
-static WockyStanza *
-_gabble_roster_item_to_message (GabbleRoster *roster,
-                                TpHandle handle,
-                                GabbleRosterItem *item)
+static void
+_gabble_roster_item_add_to_query (GabbleRoster *roster,
+                                  TpHandle handle,
+                                  GabbleRosterItem *item,
+                                  WockyNode *query_node)
 {
   GabbleRosterPrivate *priv = roster->priv;
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
       (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
-  WockyStanza *message;
-  WockyNode *query_node, *item_node;
+  WockyNode *item_node;
   const gchar *jid;
 
-  g_assert (roster != NULL);
-  g_assert (GABBLE_IS_ROSTER (roster));
   g_assert (tp_handle_is_valid (contact_repo, handle, NULL));
-  g_assert (item != NULL);
-
-  message = _gabble_roster_message_new (roster, WOCKY_STANZA_SUB_TYPE_SET,
-      &query_node);
 
   item_node = wocky_node_add_child (query_node, "item");
 
@@ -857,7 +929,7 @@ _gabble_roster_item_to_message (GabbleRoster *roster,
     }
 
   if (item->subscription == GABBLE_ROSTER_SUBSCRIPTION_REMOVE)
-    goto DONE;
+    return;
 
   if ((priv->conn->features & GABBLE_CONNECTION_FEATURES_GOOGLE_ROSTER) &&
       item->google_type != GOOGLE_ITEM_TYPE_NORMAL)
@@ -880,8 +952,33 @@ _gabble_roster_item_to_message (GabbleRoster *roster,
       g_hash_table_foreach (item->groups,
           _gabble_roster_item_put_group_in_message, item_node);
     }
+}
+
+/*
+ * _gabble_roster_item_to_message:
+ * @roster: the roster
+ * @item: the state we would like the contact's roster item to have (*not*
+ *  the state it currently has!)
+ * @handle: a contact
+ *
+ * Returns: the necessary IQ to change @handle's state to match that of @item
+ */
+static WockyStanza *
+_gabble_roster_item_to_message (GabbleRoster *roster,
+                                TpHandle handle,
+                                GabbleRosterItem *item)
+{
+  WockyStanza *message;
+  WockyNode *query_node;
+
+  g_assert (roster != NULL);
+  g_assert (GABBLE_IS_ROSTER (roster));
+  g_assert (item != NULL);
+
+  message = _gabble_roster_message_new (roster, WOCKY_STANZA_SUB_TYPE_SET,
+      &query_node);
+  _gabble_roster_item_add_to_query (roster, handle, item, query_node);
 
-DONE:
   return message;
 }
 
@@ -1359,6 +1456,244 @@ process_roster (
   tp_handle_set_destroy (referenced_handles);
 }
 
+static gchar *
+roster_snapshot_dup_path (GabbleRoster *roster)
+{
+  TpBaseConnection *base = (TpBaseConnection *) roster->priv->conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  TpHandle self_handle = tp_base_connection_get_self_handle (base);
+  const gchar *dir = g_getenv ("GABBLE_ROSTER_CACHE");
+  gchar *escaped, *filename, *path;
+
+  /* like WOCKY_CAPS_CACHE, ":memory:" means "don't touch the disk" */
+  if (self_handle == 0 || !tp_strdiff (dir, ":memory:"))
+    return NULL;
+
+  escaped = tp_escape_as_identifier (tp_handle_inspect (contact_repo,
+        self_handle));
+  filename = g_strconcat (escaped, ".xml", NULL);
+
+  if (dir != NULL)
+    path = g_build_filename (dir, filename, NULL);
+  else
+    path = g_build_filename (g_get_user_cache_dir (), "telepathy", "gabble",
+        "roster", filename, NULL);
+
+  g_free (filename);
+  g_free (escaped);
+  return path;
+}
+
+/*
+ * roster_snapshot_load:
+ *
+ * Populates the roster from the snapshot saved at the end of a previous
+ * session, so that the contact list is usable before the server has answered
+ * our roster query. Returns %TRUE if a snapshot was loaded.
+ */
+static gboolean
+roster_snapshot_load (GabbleRoster *roster)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+  WockyXmppReader *reader;
+  WockyStanza *stanza;
+  WockyNode *query_node = NULL;
+  gchar *contents;
+  gsize length;
+  GError *error = NULL;
+
+  if (priv->snapshot_path == NULL)
+    priv->snapshot_path = roster_snapshot_dup_path (roster);
+
+  if (priv->snapshot_path == NULL)
+    return FALSE;
+
+  if (!g_file_get_contents (priv->snapshot_path, &contents, &length, &error))
+    {
+      DEBUG ("no roster snapshot: %s", error->message);
+      g_clear_error (&error);
+      return FALSE;
+    }
+
+  reader = wocky_xmpp_reader_new_no_stream ();
+  wocky_xmpp_reader_push (reader, (const guint8 *) contents, length);
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_free (contents);
+
+  if (stanza != NULL)
+    query_node = wocky_node_get_child_ns (wocky_stanza_get_top_node (stanza),
+        "query", WOCKY_XMPP_NS_ROSTER);
+
+  if (query_node == NULL)
+    {
+      DEBUG ("ignoring malformed roster snapshot %s", priv->snapshot_path);
+    }
+  else
+    {
+      g_free (priv->version);
+      priv->version = g_strdup (wocky_node_get_attribute (query_node, "ver"));
+      DEBUG ("loading roster snapshot %s, version %s", priv->snapshot_path,
+          priv->version);
+
+      process_roster (roster, query_node);
+      priv->from_snapshot = TRUE;
+    }
+
+  tp_clear_object (&stanza);
+  g_object_unref (reader);
+  return priv->from_snapshot;
+}
+
+static void
+roster_snapshot_save (GabbleRoster *roster)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+  WockyXmppWriter *writer;
+  WockyStanza *stanza;
+  WockyNode *query_node;
+  GHashTableIter iter;
+  gpointer k, v;
+  const guint8 *data;
+  gsize length;
+  gchar *dir;
+  GError *error = NULL;
+
+  if (priv->snapshot_path == NULL)
+    priv->snapshot_path = roster_snapshot_dup_path (roster);
+
+  if (priv->snapshot_path == NULL)
+    return;
+
+  stanza = _gabble_roster_message_new (roster, WOCKY_STANZA_SUB_TYPE_RESULT,
+      &query_node);
+
+  if (priv->version != NULL)
+    wocky_node_set_attribute (query_node, "ver", priv->version);
+
+  g_hash_table_iter_init (&iter, priv->items);
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      GabbleRosterItem *item = v;
+
+      /* only save what is really on the server-side roster */
+      if (item->subscription != GABBLE_ROSTER_SUBSCRIPTION_REMOVE)
+        _gabble_roster_item_add_to_query (roster, GPOINTER_TO_UINT (k), item,
+            query_node);
+    }
+
+  writer = wocky_xmpp_writer_new_no_stream ();
+  wocky_xmpp_writer_write_stanza (writer, stanza, &data, &length);
+
+  dir = g_path_get_dirname (priv->snapshot_path);
+  g_mkdir_with_parents (dir, 0700);
+
+  if (g_file_set_contents (priv->snapshot_path, (const gchar *) data, length,
+        &error))
+    {
+      DEBUG ("saved roster snapshot %s, version %s", priv->snapshot_path,
+          priv->version);
+    }
+  else
+    {
+      DEBUG ("couldn't save roster snapshot: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (dir);
+  g_object_unref (writer);
+  g_object_unref (stanza);
+}
+
+static gboolean
+roster_snapshot_save_cb (gpointer user_data)
+{
+  GabbleRoster *roster = user_data;
+
+  roster->priv->snapshot_save_id = 0;
+  roster_snapshot_save (roster);
+  return FALSE;
+}
+
+static void
+roster_snapshot_queue_save (GabbleRoster *roster)
+{
+  if (roster->priv->snapshot_save_id == 0)
+    roster->priv->snapshot_save_id = g_timeout_add_seconds (
+        ROSTER_SNAPSHOT_SAVE_DELAY, roster_snapshot_save_cb, roster);
+}
+
+/*
+ * roster_remove_stale_items:
+ * @roster: a roster object
+ * @query_node: the full roster the server sent in reply to our query
+ *
+ * Removes any items we loaded from the snapshot which are no longer on the
+ * server-side roster, by processing them as if the server had pushed
+ * subscription='remove' for each one.
+ */
+static void
+roster_remove_stale_items (GabbleRoster *roster,
+    WockyNode *query_node)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
+  TpHandleSet *present = tp_handle_set_new (contact_repo);
+  WockyStanza *removals;
+  WockyNode *removals_query;
+  WockyNodeIter i;
+  WockyNode *item_node;
+  GHashTableIter iter;
+  gpointer k, v;
+  gboolean any = FALSE;
+
+  wocky_node_iter_init (&i, query_node, "item", NULL);
+  while (wocky_node_iter_next (&i, &item_node))
+    {
+      const gchar *jid = wocky_node_get_attribute (item_node, "jid");
+      TpHandle handle;
+
+      if (jid == NULL)
+        continue;
+
+      handle = tp_handle_lookup (contact_repo, jid, NULL, NULL);
+
+      if (handle != 0)
+        tp_handle_set_add (present, handle);
+    }
+
+  removals = _gabble_roster_message_new (roster, WOCKY_STANZA_SUB_TYPE_SET,
+      &removals_query);
+
+  g_hash_table_iter_init (&iter, priv->items);
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      GabbleRosterItem *item = v;
+      TpHandle handle = GPOINTER_TO_UINT (k);
+
+      if (item->subscription == GABBLE_ROSTER_SUBSCRIPTION_REMOVE ||
+          tp_handle_set_is_member (present, handle))
+        continue;
+
+      item_node = wocky_node_add_child (removals_query, "item");
+      wocky_node_set_attribute (item_node, "jid",
+          tp_handle_inspect (contact_repo, handle));
+      wocky_node_set_attribute (item_node, "subscription", "remove");
+      any = TRUE;
+    }
+
+  if (any)
+    {
+      DEBUG ("removing items which were in the snapshot but have since left "
+          "the roster");
+      process_roster (roster, removals_query);
+    }
+
+  g_object_unref (removals);
+  tp_handle_set_destroy (present);
+}
+
 static void roster_item_apply_edits (GabbleRoster *roster, TpHandle contact,
     GabbleRosterItem *item);
 
@@ -1385,11 +1720,19 @@ got_roster_iq (GabbleRoster *roster,
   iq_node = wocky_stanza_get_top_node (message);
   query_node = wocky_node_get_child_ns (iq_node, "query",
       WOCKY_XMPP_NS_ROSTER);
+  wocky_stanza_get_type_info (message, NULL, &sub_type);
 
   if (query_node == NULL)
-    return FALSE;
+    {
+      /* XEP-0237 §2.4: an empty result means the version we sent is still
+       * current, so the snapshot we loaded is the roster; any changes will
+       * follow as pushes. */
+      if (sub_type != WOCKY_STANZA_SUB_TYPE_RESULT || !priv->from_snapshot ||
+          priv->received)
+        return FALSE;
 
-  wocky_stanza_get_type_info (message, NULL, &sub_type);
+      DEBUG ("roster is unchanged since version %s", priv->version);
+    }
 
   /* if this is a result, it's from our initial query. if it's a set,
    * it's a roster push. otherwise, it's not for us. */
@@ -1410,7 +1753,29 @@ got_roster_iq (GabbleRoster *roster,
       return FALSE;
     }
 
-  process_roster (roster, query_node);
+  if (query_node != NULL)
+    {
+      const gchar *ver = wocky_node_get_attribute (query_node, "ver");
+
+      process_roster (roster, query_node);
+
+      if (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT)
+        {
+          if (priv->from_snapshot)
+            roster_remove_stale_items (roster, query_node);
+
+          /* a full roster without a version makes ours meaningless */
+          g_free (priv->version);
+          priv->version = g_strdup (ver);
+        }
+      else if (ver != NULL)
+        {
+          g_free (priv->version);
+          priv->version = g_strdup (ver);
+        }
+
+      roster_snapshot_queue_save (roster);
+    }
 
   if (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT)
     {
@@ -1462,9 +1827,14 @@ got_roster_iq (GabbleRoster *roster,
       conn_presence_emit_presence_update (priv->conn, members);
       g_array_unref (members);
 
-      /* The roster is now complete and we can emit signals... */
-      tp_base_contact_list_set_list_received ((TpBaseContactList *) roster);
+      /* The roster is now complete and we can emit signals (unless we
+       * already started doing so when we loaded the snapshot)... */
+      if (tp_base_contact_list_get_state ((TpBaseContactList *) roster,
+            NULL) != TP_CONTACT_LIST_STATE_SUCCESS)
+        tp_base_contact_list_set_list_received ((TpBaseContactList *) roster);
+
       priv->received = TRUE;
+      priv->from_snapshot = FALSE;
 
       /* ... and carry out any pending edits */
       for (;
@@ -1735,6 +2105,13 @@ gabble_roster_close_all (GabbleRoster *self)
       self->priv->porter_available_id = 0;
     }
 
+  if (priv->snapshot_save_id != 0)
+    {
+      g_source_remove (priv->snapshot_save_id);
+      priv->snapshot_save_id = 0;
+      roster_snapshot_save (self);
+    }
+
   tp_clear_pointer (&priv->groups, g_hash_table_unref);
   tp_clear_pointer (&priv->pre_authorized, tp_handle_set_destroy);
 
@@ -1790,6 +2167,47 @@ roster_received_cb (GObject *source_object,
   tp_weak_ref_destroy (weak_ref);
 }
 
+/*
+ * gabble_roster_request_roster:
+ *
+ * Loads the roster snapshot, if there is one, and asks the server for the
+ * roster. If the server supports XEP-0237 we tell it which version we have,
+ * so it can reply with just the changes since then.
+ */
+static void
+gabble_roster_request_roster (GabbleRoster *self)
+{
+  GabbleRosterPrivate *priv = self->priv;
+  WockyStanza *stanza;
+  WockyNode *query_node;
+
+  if (!priv->received && !priv->from_snapshot &&
+      roster_snapshot_load (self))
+    {
+      /* let clients see the contacts straight away; the server's reply will
+       * be applied as changes */
+      tp_base_contact_list_set_list_received ((TpBaseContactList *) self);
+    }
+
+  stanza = _gabble_roster_message_new (self, WOCKY_STANZA_SUB_TYPE_GET,
+      &query_node);
+
+  if (priv->conn->features & GABBLE_CONNECTION_FEATURES_ROSTER_VERSIONING)
+    {
+      const gchar *ver = "";
+
+      if (priv->from_snapshot && priv->version != NULL)
+        ver = priv->version;
+
+      wocky_node_set_attribute (query_node, "ver", ver);
+    }
+
+  conn_util_send_iq_async (priv->conn, stanza, priv->cancel_on_disconnect,
+      roster_received_cb, tp_weak_ref_new (self, NULL, NULL));
+
+  g_object_unref (stanza);
+}
+
 static void
 gabble_roster_porter_available_cb (GabbleConnection *conn,
     WockyPorter *porter,
@@ -1799,8 +2217,7 @@ gabble_roster_porter_available_cb (GabbleConnection *conn,
   g_assert (self->priv->iq_cb == 0);
   g_assert (self->priv->presence_cb == 0);
 
-  self->priv->iq_cb = wocky_c2s_porter_register_handler_from_server (
-      WOCKY_C2S_PORTER (porter),
+  self->priv->iq_cb = gabble_handler_profile_register_from_server (porter,
       WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_NONE,
       WOCKY_PORTER_HANDLER_PRIORITY_NORMAL, gabble_roster_iq_cb, self,
       '(', "query",
@@ -1824,7 +2241,6 @@ connection_status_changed_cb (GabbleConnection *conn,
     {
     case TP_CONNECTION_STATUS_CONNECTED:
         {
-          WockyStanza *stanza;
           TpBaseContactList *base = TP_BASE_CONTACT_LIST (self);
 
           self->priv->cancel_on_disconnect = g_cancellable_new ();
@@ -1832,15 +2248,7 @@ connection_status_changed_cb (GabbleConnection *conn,
           if (tp_base_contact_list_get_download_at_connection (base))
             {
               DEBUG ("requesting roster");
-
-              stanza = _gabble_roster_message_new (self, WOCKY_STANZA_SUB_TYPE_GET,
-                  NULL);
-
-              conn_util_send_iq_async (conn, stanza,
-                  self->priv->cancel_on_disconnect,
-                  roster_received_cb, tp_weak_ref_new (self, NULL, NULL));
-
-              g_object_unref (stanza);
+              gabble_roster_request_roster (self);
             }
           else
             {
@@ -1889,6 +2297,8 @@ gabble_roster_constructed (GObject *obj)
 
   self->priv->groups = g_hash_table_new_full (g_str_hash, g_str_equal,
       g_free, NULL);
+  self->priv->group_members = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) tp_handle_set_destroy);
   self->priv->pre_authorized = tp_handle_set_new (contact_repo);
 }
 
@@ -2991,18 +3401,8 @@ gabble_roster_download_async (TpBaseContactList *base,
 
   if (!tp_base_contact_list_get_download_at_connection (base))
     {
-      WockyStanza *stanza;
-
       DEBUG ("Downloading roster requested");
-
-      stanza = _gabble_roster_message_new (self, WOCKY_STANZA_SUB_TYPE_GET,
-          NULL);
-
-      conn_util_send_iq_async (self->priv->conn, stanza,
-          self->priv->cancel_on_disconnect,
-          roster_received_cb, tp_weak_ref_new (self, NULL, NULL));
-
-      g_object_unref (stanza);
+      gabble_roster_request_roster (self);
     }
   else
     {
@@ -3158,26 +3558,15 @@ gabble_roster_dup_group_members (TpBaseContactList *base,
     const gchar *group)
 {
   GabbleRoster *self = GABBLE_ROSTER (base);
-  TpHandleSet *set;
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
       (TpBaseConnection *) self->priv->conn, TP_HANDLE_TYPE_CONTACT);
-  GHashTableIter iter;
-  gpointer k, v;
+  TpHandleSet *members = g_hash_table_lookup (self->priv->group_members,
+      group);
 
-  set = tp_handle_set_new (contact_repo);
-
-  g_hash_table_iter_init (&iter, self->priv->items);
+  if (members == NULL)
+    return tp_handle_set_new (contact_repo);
 
-  while (g_hash_table_iter_next (&iter, &k, &v))
-    {
-      GabbleRosterItem *item = v;
-
-      if (item->groups != NULL &&
-          g_hash_table_lookup (item->groups, group) != NULL)
-        tp_handle_set_add (set, GPOINTER_TO_UINT (k));
-    }
-
-  return set;
+  return tp_handle_set_copy (members);
 }
 
 static void
@@ -3253,8 +3642,10 @@ gabble_roster_set_group_members_async (TpBaseContactList *base,
   GabbleRoster *self = GABBLE_ROSTER (base);
   GSimpleAsyncResult *result = gabble_simple_async_countdown_new (self,
       callback, user_data, gabble_roster_set_group_members_async, 1);
-  GHashTableIter iter;
-  gpointer k;
+  TpHandleSet *old_members = g_hash_table_lookup (self->priv->group_members,
+      group);
+  TpIntsetFastIter iter;
+  TpHandle contact;
 
   /* we create the group even if @contacts is empty, as the base class
    * requires */
@@ -3264,16 +3655,24 @@ gabble_roster_set_group_members_async (TpBaseContactList *base,
       tp_base_contact_list_groups_created (base, &group, 1);
     }
 
-  g_hash_table_iter_init (&iter, self->priv->items);
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
 
-  while (g_hash_table_iter_next (&iter, &k, NULL))
+  while (tp_intset_fast_iter_next (&iter, &contact))
     {
-      TpHandle contact = GPOINTER_TO_UINT (k);
-
-      if (tp_handle_set_is_member (contacts, contact))
+      if (_gabble_roster_item_lookup (self, contact) != NULL)
         gabble_roster_handle_add_to_group (self, contact, group, result);
-      else
-        gabble_roster_handle_remove_from_group (self, contact, group, result);
+    }
+
+  if (old_members != NULL)
+    {
+      tp_intset_fast_iter_init (&iter, tp_handle_set_peek (old_members));
+
+      while (tp_intset_fast_iter_next (&iter, &contact))
+        {
+          if (!tp_handle_set_is_member (contacts, contact))
+            gabble_roster_handle_remove_from_group (self, contact, group,
+                result);
+        }
     }
 
   gabble_simple_async_countdown_dec (result);
@@ -3354,8 +3753,10 @@ gabble_roster_remove_group_removed_cb (GObject *source,
 
   if (context->group != NULL)
     {
-      GHashTableIter iter;
-      gpointer k, v;
+      TpHandleSet *members = g_hash_table_lookup (self->priv->group_members,
+          context->group);
+      TpIntsetFastIter iter;
+      TpHandle contact;
       TpHandle remaining_member = 0;
 
       /* Now that we've signalled the group being removed, to be internally
@@ -3371,15 +3772,11 @@ gabble_roster_remove_group_removed_cb (GObject *source,
        * removal, so that TpBaseContactList can see who used to be in the
        * group. */
 
-      g_hash_table_iter_init (&iter, self->priv->items);
-
-      while (g_hash_table_iter_next (&iter, &k, &v))
+      if (members != NULL)
         {
-          TpHandle contact = GPOINTER_TO_UINT (k);
-          GabbleRosterItem *item = v;
+          tp_intset_fast_iter_init (&iter, tp_handle_set_peek (members));
 
-          if (item->groups != NULL && g_hash_table_lookup (item->groups,
-                context->group) != NULL)
+          while (tp_intset_fast_iter_next (&iter, &contact))
             {
               if (!tp_handle_set_is_member (context->contacts, contact))
                 remaining_member = contact;
@@ -3393,16 +3790,20 @@ gabble_roster_remove_group_removed_cb (GObject *source,
           tp_base_contact_list_groups_removed ((TpBaseContactList *) self,
               (const gchar * const *) &context->group, 1);
 
-          g_hash_table_iter_init (&iter, self->priv->items);
-
-          while (g_hash_table_iter_next (&iter, NULL, &v))
+          if (members != NULL)
             {
-              GabbleRosterItem *item = v;
+              tp_intset_fast_iter_init (&iter, tp_handle_set_peek (members));
+
+              while (tp_intset_fast_iter_next (&iter, &contact))
+                {
+                  GabbleRosterItem *item = _gabble_roster_item_lookup (self,
+                      contact);
+
+                  if (item != NULL)
+                    g_hash_table_remove (item->groups, context->group);
+                }
 
-              if (item->groups != NULL &&
-                  g_hash_table_lookup (item->groups,
-                    context->group) != NULL)
-                g_hash_table_remove (item->groups, context->group);
+              g_hash_table_remove (self->priv->group_members, context->group);
             }
         }
       else
@@ -3425,8 +3826,9 @@ gabble_roster_remove_group_async (TpBaseContactList *base,
     gpointer user_data)
 {
   GabbleRoster *self = GABBLE_ROSTER (base);
-  GHashTableIter iter;
-  gpointer k, v;
+  TpIntsetFastIter iter;
+  TpHandle contact;
+  TpHandleSet *members;
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
       (TpBaseConnection *) self->priv->conn, TP_HANDLE_TYPE_CONTACT);
   GSimpleAsyncResult *result;
@@ -3447,20 +3849,18 @@ gabble_roster_remove_group_async (TpBaseContactList *base,
       g_hash_table_lookup (self->priv->groups, context->group) == NULL)
     goto finally;
 
-  g_hash_table_iter_init (&iter, self->priv->items);
+  members = g_hash_table_lookup (self->priv->group_members, context->group);
 
-  while (g_hash_table_iter_next (&iter, &k, &v))
-    {
-      TpHandle contact = GPOINTER_TO_UINT (k);
-      GabbleRosterItem *item = v;
+  if (members == NULL)
+    goto finally;
 
-      if (item->groups != NULL && g_hash_table_lookup (item->groups,
-            context->group) != NULL)
-        {
-          tp_handle_set_add (context->contacts, contact);
-          gabble_roster_handle_remove_from_group (self, contact, context->group,
-              result);
-        }
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (members));
+
+  while (tp_intset_fast_iter_next (&iter, &contact))
+    {
+      tp_handle_set_add (context->contacts, contact);
+      gabble_roster_handle_remove_from_group (self, contact, context->group,
+          result);
     }
 
 finally:
@@ -0,0 +1,524 @@
+/*
+ * socks5-proxy-cache.c - Gabble's on-disk SOCKS5 proxy cache
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * The cache remembers the SOCKS5 proxies we've found for an account across
+ * connections, along with how well they've worked, so that the first
+ * bytestream after connecting can offer relays without waiting for them to
+ * be discovered again, and so that the ones which work best are offered
+ * first.
+ *
+ * Proxies are ranked by their cost: roughly how long, in microseconds, we
+ * expect to spend getting through to the proxy and moving
+ * PROXY_COST_TRANSFER_SIZE bytes through it, multiplied up for each failure
+ * since it last worked.
+ */
+
+#include "config.h"
+#include "socks5-proxy-cache.h"
+
+#include <glib/gstdio.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_BYTESTREAM
+
+#include "debug.h"
+
+/* What we assume about proxies we haven't measured yet */
+#define PROXY_DEFAULT_LATENCY G_TIME_SPAN_SECOND
+#define PROXY_DEFAULT_THROUGHPUT (128 * 1024)
+
+#define PROXY_COST_TRANSFER_SIZE (1024 * 1024)
+
+/* Transfers smaller than this say more about the latency than about the
+ * proxy's bandwidth, so they don't count towards its throughput */
+#define PROXY_MIN_TRANSFER_SIZE (64 * 1024)
+
+/* Data which arrives more than this many microseconds after the previous
+ * data means the stream was idle, not that the proxy was slow, so the gap
+ * isn't counted against the proxy */
+#define PROXY_METER_IDLE_GAP (2 * G_TIME_SPAN_SECOND)
+
+/* A proxy which has failed this many times in a row isn't brought back from
+ * the cache when we connect; we wait until it's been discovered again */
+#define PROXY_MAX_RECENT_FAILURES 3
+
+/* Proxies we haven't seen for this many seconds are forgotten, and we keep
+ * at most PROXY_CACHE_MAX_SIZE of them */
+#define PROXY_CACHE_LIFETIME (7 * 24 * 60 * 60)
+#define PROXY_CACHE_MAX_SIZE 32
+
+/* Proxies we've seen or got through to within this many seconds are assumed
+ * to still be where they were, so needn't be discovered again */
+#define PROXY_CACHE_FRESH_TIME (6 * 60 * 60)
+
+/* Seconds to wait after a change before saving, so that a burst of changes
+ * only costs one write */
+#define PROXY_CACHE_SAVE_DELAY 5
+
+struct _GabbleSocks5ProxyCache {
+    /* NULL if we're not saving anything */
+    gchar *path;
+    /* borrowed JID => owned GabbleSocks5ProxyRecord */
+    GHashTable *records;
+    guint save_id;
+};
+
+static void
+proxy_record_free (GabbleSocks5ProxyRecord *record)
+{
+  g_free (record->jid);
+  g_free (record->host);
+  g_slice_free (GabbleSocks5ProxyRecord, record);
+}
+
+static gint64
+proxy_record_cost (const GabbleSocks5ProxyRecord *record)
+{
+  gint64 latency = PROXY_DEFAULT_LATENCY;
+  guint64 throughput = PROXY_DEFAULT_THROUGHPUT;
+
+  if (record != NULL && record->latency > 0)
+    latency = record->latency;
+
+  if (record != NULL && record->throughput > 0)
+    throughput = record->throughput;
+
+  return (latency + (gint64) PROXY_COST_TRANSFER_SIZE * G_USEC_PER_SEC /
+        (gint64) throughput) *
+      (1 + (record != NULL ? record->recent_failures : 0));
+}
+
+static gint
+proxy_record_compare_cost (gconstpointer a,
+    gconstpointer b)
+{
+  gint64 left = proxy_record_cost (a);
+  gint64 right = proxy_record_cost (b);
+
+  if (left < right)
+    return -1;
+
+  return (left > right);
+}
+
+static void
+cache_save (GabbleSocks5ProxyCache *cache)
+{
+  GKeyFile *file = g_key_file_new ();
+  GHashTableIter iter;
+  gpointer v;
+  gchar *data, *dir;
+  gsize length;
+  GError *error = NULL;
+
+  g_hash_table_iter_init (&iter, cache->records);
+  while (g_hash_table_iter_next (&iter, NULL, &v))
+    {
+      GabbleSocks5ProxyRecord *record = v;
+      gchar *group = tp_escape_as_identifier (record->jid);
+
+      g_key_file_set_string (file, group, "jid", record->jid);
+      g_key_file_set_string (file, group, "host", record->host);
+      g_key_file_set_integer (file, group, "port", record->port);
+      g_key_file_set_boolean (file, group, "fallback", record->fallback);
+      g_key_file_set_integer (file, group, "successes", record->successes);
+      g_key_file_set_integer (file, group, "failures", record->failures);
+      g_key_file_set_integer (file, group, "recent-failures",
+          record->recent_failures);
+      g_key_file_set_int64 (file, group, "latency", record->latency);
+      g_key_file_set_uint64 (file, group, "throughput", record->throughput);
+      g_key_file_set_int64 (file, group, "seen", record->last_seen);
+      g_free (group);
+    }
+
+  data = g_key_file_to_data (file, &length, NULL);
+  dir = g_path_get_dirname (cache->path);
+  g_mkdir_with_parents (dir, 0700);
+
+  if (!g_file_set_contents (cache->path, data, length, &error))
+    {
+      DEBUG ("couldn't save SOCKS5 proxy cache: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (dir);
+  g_free (data);
+  g_key_file_free (file);
+}
+
+static gboolean
+cache_save_cb (gpointer user_data)
+{
+  GabbleSocks5ProxyCache *cache = user_data;
+
+  cache->save_id = 0;
+  cache_save (cache);
+  return FALSE;
+}
+
+static void
+cache_queue_save (GabbleSocks5ProxyCache *cache)
+{
+  if (cache->path != NULL && cache->save_id == 0)
+    cache->save_id = g_timeout_add_seconds (PROXY_CACHE_SAVE_DELAY,
+        cache_save_cb, cache);
+}
+
+static void
+cache_load (GabbleSocks5ProxyCache *cache)
+{
+  GKeyFile *file = g_key_file_new ();
+  gchar **groups;
+  gsize i, n_groups;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  GError *error = NULL;
+
+  if (!g_key_file_load_from_file (file, cache->path, G_KEY_FILE_NONE, &error))
+    {
+      DEBUG ("no SOCKS5 proxy cache at %s: %s", cache->path, error->message);
+      g_clear_error (&error);
+      goto out;
+    }
+
+  groups = g_key_file_get_groups (file, &n_groups);
+
+  for (i = 0; i < n_groups; i++)
+    {
+      GabbleSocks5ProxyRecord *record;
+      gchar *jid = g_key_file_get_string (file, groups[i], "jid", NULL);
+      gchar *host = g_key_file_get_string (file, groups[i], "host", NULL);
+      gint port = g_key_file_get_integer (file, groups[i], "port", NULL);
+      gint64 last_seen = g_key_file_get_int64 (file, groups[i], "seen", NULL);
+
+      if (jid == NULL || host == NULL || port <= 0 || port > G_MAXUINT16 ||
+          now - last_seen > PROXY_CACHE_LIFETIME)
+        {
+          g_free (jid);
+          g_free (host);
+          continue;
+        }
+
+      record = g_slice_new0 (GabbleSocks5ProxyRecord);
+      record->jid = jid;
+      record->host = host;
+      record->port = port;
+      record->fallback = g_key_file_get_boolean (file, groups[i], "fallback",
+          NULL);
+      record->successes = g_key_file_get_integer (file, groups[i],
+          "successes", NULL);
+      record->failures = g_key_file_get_integer (file, groups[i],
+          "failures", NULL);
+      record->recent_failures = g_key_file_get_integer (file, groups[i],
+          "recent-failures", NULL);
+      record->latency = g_key_file_get_int64 (file, groups[i], "latency",
+          NULL);
+      record->throughput = g_key_file_get_uint64 (file, groups[i],
+          "throughput", NULL);
+      record->last_seen = last_seen;
+
+      g_hash_table_replace (cache->records, record->jid, record);
+    }
+
+  DEBUG ("loaded %u SOCKS5 proxies", g_hash_table_size (cache->records));
+
+  g_strfreev (groups);
+
+out:
+  g_key_file_free (file);
+}
+
+/*
+ * gabble_socks5_proxy_cache_new:
+ * @account: the bare JID of the account whose proxies to remember
+ *
+ * Returns: a cache, which only lasts as long as the connection if the
+ *  GABBLE_SOCKS5_PROXY_CACHE environment variable is ":memory:"
+ */
+GabbleSocks5ProxyCache *
+gabble_socks5_proxy_cache_new (const gchar *account)
+{
+  GabbleSocks5ProxyCache *cache;
+  const gchar *dir = g_getenv ("GABBLE_SOCKS5_PROXY_CACHE");
+  gchar *escaped;
+
+  cache = g_slice_new0 (GabbleSocks5ProxyCache);
+  cache->records = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) proxy_record_free);
+
+  if (!tp_strdiff (dir, ":memory:"))
+    return cache;
+
+  escaped = tp_escape_as_identifier (account);
+
+  if (dir != NULL)
+    cache->path = g_build_filename (dir, escaped, NULL);
+  else
+    cache->path = g_build_filename (g_get_user_cache_dir (), "telepathy",
+        "gabble", "socks5-proxies", escaped, NULL);
+
+  cache_load (cache);
+
+  g_free (escaped);
+  return cache;
+}
+
+void
+gabble_socks5_proxy_cache_flush (GabbleSocks5ProxyCache *cache)
+{
+  if (cache->save_id != 0)
+    {
+      g_source_remove (cache->save_id);
+      cache->save_id = 0;
+      cache_save (cache);
+    }
+}
+
+void
+gabble_socks5_proxy_cache_free (GabbleSocks5ProxyCache *cache)
+{
+  gabble_socks5_proxy_cache_flush (cache);
+
+  g_hash_table_unref (cache->records);
+  g_free (cache->path);
+  g_slice_free (GabbleSocks5ProxyCache, cache);
+}
+
+static void
+cache_evict_oldest (GabbleSocks5ProxyCache *cache)
+{
+  GHashTableIter iter;
+  gpointer v;
+  GabbleSocks5ProxyRecord *oldest = NULL;
+
+  g_hash_table_iter_init (&iter, cache->records);
+  while (g_hash_table_iter_next (&iter, NULL, &v))
+    {
+      GabbleSocks5ProxyRecord *record = v;
+
+      if (oldest == NULL || record->last_seen < oldest->last_seen)
+        oldest = record;
+    }
+
+  if (oldest != NULL)
+    {
+      DEBUG ("forgetting %s", oldest->jid);
+      g_hash_table_remove (cache->records, oldest->jid);
+    }
+}
+
+/*
+ * gabble_socks5_proxy_cache_add:
+ *
+ * Remembers that @jid is a SOCKS5 proxy listening on @host:@port, or that
+ * it still is.
+ */
+void
+gabble_socks5_proxy_cache_add (GabbleSocks5ProxyCache *cache,
+    const gchar *jid,
+    const gchar *host,
+    guint16 port,
+    gboolean fallback)
+{
+  GabbleSocks5ProxyRecord *record = g_hash_table_lookup (cache->records, jid);
+
+  if (record == NULL)
+    {
+      if (g_hash_table_size (cache->records) >= PROXY_CACHE_MAX_SIZE)
+        cache_evict_oldest (cache);
+
+      record = g_slice_new0 (GabbleSocks5ProxyRecord);
+      record->jid = g_strdup (jid);
+      g_hash_table_insert (cache->records, record->jid, record);
+    }
+
+  if (tp_strdiff (record->host, host))
+    {
+      g_free (record->host);
+      record->host = g_strdup (host);
+    }
+
+  record->port = port;
+  record->fallback = fallback;
+  record->last_seen = g_get_real_time () / G_USEC_PER_SEC;
+  cache_queue_save (cache);
+}
+
+/*
+ * gabble_socks5_proxy_cache_record_connect:
+ * @latency: how long it took to get through to the proxy, in microseconds;
+ *  ignored unless @success is %TRUE
+ *
+ * Records whether we (or a peer) could use @jid as a relay. Does nothing if
+ * @jid isn't a proxy we know about.
+ */
+void
+gabble_socks5_proxy_cache_record_connect (GabbleSocks5ProxyCache *cache,
+    const gchar *jid,
+    gboolean success,
+    gint64 latency)
+{
+  GabbleSocks5ProxyRecord *record = g_hash_table_lookup (cache->records, jid);
+
+  if (record == NULL)
+    return;
+
+  if (success)
+    {
+      if (record->latency == 0)
+        record->latency = latency;
+      else
+        record->latency = (3 * record->latency + latency) / 4;
+
+      record->successes++;
+      record->recent_failures = 0;
+      record->last_seen = g_get_real_time () / G_USEC_PER_SEC;
+    }
+  else
+    {
+      record->failures++;
+      record->recent_failures++;
+    }
+
+  DEBUG ("%s: %u successes, %u failures (%u recent), %" G_GINT64_FORMAT
+      " ms", jid, record->successes, record->failures,
+      record->recent_failures, record->latency / G_TIME_SPAN_MILLISECOND);
+
+  cache_queue_save (cache);
+}
+
+/*
+ * gabble_socks5_proxy_cache_record_transfer:
+ * @duration: how long it took to move @bytes, in microseconds
+ *
+ * Records how fast data went through @jid. Does nothing if @jid isn't a proxy
+ * we know about, or the transfer was too short to tell.
+ */
+void
+gabble_socks5_proxy_cache_record_transfer (GabbleSocks5ProxyCache *cache,
+    const gchar *jid,
+    guint64 bytes,
+    gint64 duration)
+{
+  GabbleSocks5ProxyRecord *record = g_hash_table_lookup (cache->records, jid);
+  guint64 throughput;
+
+  if (record == NULL || bytes < PROXY_MIN_TRANSFER_SIZE || duration <= 0)
+    return;
+
+  throughput = bytes * G_USEC_PER_SEC / (guint64) duration;
+
+  if (record->throughput == 0)
+    record->throughput = throughput;
+  else
+    record->throughput = (3 * record->throughput + throughput) / 4;
+
+  DEBUG ("%s: %" G_GUINT64_FORMAT " bytes/s", jid, record->throughput);
+
+  cache_queue_save (cache);
+}
+
+/*
+ * gabble_socks5_proxy_meter_add:
+ * @now: the monotonic time at which @bytes went through the proxy
+ *
+ * Counts @bytes towards @meter. Data which arrives after an idle gap has
+ * nothing to be timed against, so it only starts the clock again.
+ */
+void
+gabble_socks5_proxy_meter_add (GabbleSocks5ProxyMeter *meter,
+    gsize bytes,
+    gint64 now)
+{
+  if (meter->last_data != 0 && now - meter->last_data <= PROXY_METER_IDLE_GAP)
+    {
+      meter->bytes += bytes;
+      meter->duration += now - meter->last_data;
+    }
+
+  meter->last_data = now;
+}
+
+/*
+ * gabble_socks5_proxy_cache_get_cost:
+ *
+ * Returns: how expensive we expect using @jid as a relay to be, for sorting
+ *  proxies; lower is better
+ */
+gint64
+gabble_socks5_proxy_cache_get_cost (GabbleSocks5ProxyCache *cache,
+    const gchar *jid)
+{
+  return proxy_record_cost (g_hash_table_lookup (cache->records, jid));
+}
+
+/*
+ * gabble_socks5_proxy_cache_lookup:
+ *
+ * Returns: (transfer none): what we know about @jid, or %NULL if it isn't a
+ *  proxy we know about
+ */
+const GabbleSocks5ProxyRecord *
+gabble_socks5_proxy_cache_lookup (GabbleSocks5ProxyCache *cache,
+    const gchar *jid)
+{
+  return g_hash_table_lookup (cache->records, jid);
+}
+
+/*
+ * gabble_socks5_proxy_cache_is_fresh:
+ *
+ * Returns: %TRUE if @jid has been seen or used recently enough, and hasn't
+ *  failed since, that it's not worth asking it for its address again
+ */
+gboolean
+gabble_socks5_proxy_cache_is_fresh (GabbleSocks5ProxyCache *cache,
+    const gchar *jid)
+{
+  GabbleSocks5ProxyRecord *record = g_hash_table_lookup (cache->records, jid);
+
+  return (record != NULL && record->recent_failures == 0 &&
+      g_get_real_time () / G_USEC_PER_SEC - record->last_seen <
+          PROXY_CACHE_FRESH_TIME);
+}
+
+/*
+ * gabble_socks5_proxy_cache_get_usable:
+ *
+ * Returns: (transfer container): a list of borrowed GabbleSocks5ProxyRecord,
+ *  for the proxies worth offering, cheapest first
+ */
+GList *
+gabble_socks5_proxy_cache_get_usable (GabbleSocks5ProxyCache *cache)
+{
+  GHashTableIter iter;
+  gpointer v;
+  GList *usable = NULL;
+
+  g_hash_table_iter_init (&iter, cache->records);
+  while (g_hash_table_iter_next (&iter, NULL, &v))
+    {
+      GabbleSocks5ProxyRecord *record = v;
+
+      if (record->recent_failures < PROXY_MAX_RECENT_FAILURES)
+        usable = g_list_prepend (usable, record);
+    }
+
+  return g_list_sort (usable, proxy_record_compare_cost);
+}
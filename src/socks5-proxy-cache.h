@@ -0,0 +1,82 @@
+/*
+ * socks5-proxy-cache.h - Headers for Gabble's on-disk SOCKS5 proxy cache
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_SOCKS5_PROXY_CACHE_H__
+#define __GABBLE_SOCKS5_PROXY_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleSocks5ProxyCache GabbleSocks5ProxyCache;
+
+typedef struct {
+    gchar *jid;
+    gchar *host;
+    guint16 port;
+    /* TRUE if it came from fallback-socks5-proxies rather than the server */
+    gboolean fallback;
+    guint successes;
+    guint failures;
+    /* failures since the last success */
+    guint recent_failures;
+    /* smoothed time to get through to the proxy, in microseconds, or 0 */
+    gint64 latency;
+    /* smoothed bytes per second through the proxy, or 0 */
+    guint64 throughput;
+    /* seconds since the epoch */
+    gint64 last_seen;
+} GabbleSocks5ProxyRecord;
+
+/* Measures how fast data goes through a proxy, leaving out the time when
+ * there was nothing to send. Zero-fill it to start. */
+typedef struct {
+    /* bytes which were timed */
+    guint64 bytes;
+    /* how long they took, in microseconds */
+    gint64 duration;
+    /* monotonic time of the last data, or 0 */
+    gint64 last_data;
+} GabbleSocks5ProxyMeter;
+
+void gabble_socks5_proxy_meter_add (GabbleSocks5ProxyMeter *meter,
+    gsize bytes, gint64 now);
+
+GabbleSocks5ProxyCache *gabble_socks5_proxy_cache_new (const gchar *account);
+void gabble_socks5_proxy_cache_free (GabbleSocks5ProxyCache *cache);
+void gabble_socks5_proxy_cache_flush (GabbleSocks5ProxyCache *cache);
+
+void gabble_socks5_proxy_cache_add (GabbleSocks5ProxyCache *cache,
+    const gchar *jid, const gchar *host, guint16 port, gboolean fallback);
+void gabble_socks5_proxy_cache_record_connect (GabbleSocks5ProxyCache *cache,
+    const gchar *jid, gboolean success, gint64 latency);
+void gabble_socks5_proxy_cache_record_transfer (GabbleSocks5ProxyCache *cache,
+    const gchar *jid, guint64 bytes, gint64 duration);
+
+gint64 gabble_socks5_proxy_cache_get_cost (GabbleSocks5ProxyCache *cache,
+    const gchar *jid);
+GList *gabble_socks5_proxy_cache_get_usable (GabbleSocks5ProxyCache *cache);
+const GabbleSocks5ProxyRecord *gabble_socks5_proxy_cache_lookup (
+    GabbleSocks5ProxyCache *cache, const gchar *jid);
+gboolean gabble_socks5_proxy_cache_is_fresh (GabbleSocks5ProxyCache *cache,
+    const gchar *jid);
+
+G_END_DECLS
+
+#endif /* __GABBLE_SOCKS5_PROXY_CACHE_H__ */
@@ -47,15 +47,6 @@
 #include "tube-iface.h"
 #include "util.h"
 
-/* When we receive D-Bus messages to be delivered to the application and the
- * application is not yet connected to the D-Bus tube, theses D-Bus messages
- * are queued and delivered when the application connects to the D-Bus tube.
- *
- * If the application never connects, there is a risk that the contact sends
- * too many messages and eat all the memory. To avoid this, there is an
- * arbitrary limit on the queue size set to 4MB. */
-#define MAX_QUEUE_SIZE (4096*1024)
-
 static void tube_iface_init (gpointer g_iface, gpointer iface_data);
 static void dbustube_iface_init (gpointer g_iface, gpointer iface_data);
 
@@ -138,14 +129,20 @@ struct _GabbleTubeDBusPrivate
   /* the queue of D-Bus messages to be delivered to a local client when it
    * will connect */
   GSList *dbus_msg_queue;
-  /* current size of the queue in bytes. The maximum is MAX_QUEUE_SIZE */
+  /* current size of the queue in bytes. The maximum is
+   * GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE */
   unsigned long dbus_msg_queue_size;
+  /* TRUE if we stopped reading from the bytestream because the queue is
+   * full */
+  gboolean reading_blocked;
   /* mapping of contact handle -> D-Bus name (empty for 1-1 D-Bus tubes) */
   GHashTable *dbus_names;
   /* mapping of D-Bus name -> contact handle */
   GHashTable *dbus_name_to_handle;
 
-  /* Message reassembly buffer (CONTACT tubes only) */
+  /* Message reassembly buffer (CONTACT tubes only). Only ever holds the
+   * start of a message which hasn't been completely received yet; whole
+   * messages are parsed straight out of the data the bytestream gives us. */
   GString *reassembly_buffer;
   /* Number of bytes that will be in the next message, 0 if unknown */
   guint32 reassembly_bytes_needed;
@@ -314,6 +311,13 @@ new_connection_cb (DBusServer *server,
     }
   priv->dbus_msg_queue = NULL;
   priv->dbus_msg_queue_size = 0;
+
+  if (priv->reading_blocked)
+    {
+      DEBUG ("queue is empty; reading from the bytestream again");
+      priv->reading_blocked = FALSE;
+      gabble_bytestream_iface_block_reading (priv->bytestream, FALSE);
+    }
 }
 
 static void
@@ -1115,6 +1119,36 @@ gabble_tube_dbus_offer (GabbleTubeDBus *tube,
   return TRUE;
 }
 
+/* Decides what to do with a message of @len bytes which arrives while no
+ * local application is connected, with @queue_size bytes already queued. If
+ * the application never connects to the private dbus connection, we don't
+ * want to eat all the memory, so only GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE bytes
+ * are queued. In a room, any more messages are dropped; with a single
+ * contact, we stop reading until the application connects. Messages which
+ * were already on their way are still queued.
+ *
+ * Only extern for the benefit of tests/test-dtube-reassembly.c
+ */
+GabbleTubeDBusQueueAction
+_gabble_tube_dbus_queue_action (gboolean in_room,
+    gsize queue_size,
+    gsize len,
+    gboolean reading_blocked)
+{
+  if (in_room)
+    {
+      if (queue_size + len > GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE)
+        return GABBLE_TUBE_DBUS_QUEUE_DROP;
+
+      return GABBLE_TUBE_DBUS_QUEUE_KEEP;
+    }
+
+  if (!reading_blocked && queue_size + len >= GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE)
+    return GABBLE_TUBE_DBUS_QUEUE_KEEP_AND_BLOCK;
+
+  return GABBLE_TUBE_DBUS_QUEUE_KEEP;
+}
+
 static void
 message_received (GabbleTubeDBus *tube,
                   TpHandle sender,
@@ -1129,6 +1163,7 @@ message_received (GabbleTubeDBus *tube,
   const gchar *sender_name;
   const gchar *destination;
   guint32 serial;
+  GabbleTubeDBusQueueAction action;
 
   msg = dbus_message_demarshal (data, len, &error);
 
@@ -1171,20 +1206,30 @@ message_received (GabbleTubeDBus *tube,
     {
       DEBUG ("no D-Bus connection: queuing the message");
 
-      /* If the application never connects to the private dbus connection, we
-       * don't want to eat all the memory. Only queue MAX_QUEUE_SIZE bytes. If
-       * there are more messages, drop them. */
-      if (priv->dbus_msg_queue_size + len > MAX_QUEUE_SIZE)
+      action = _gabble_tube_dbus_queue_action (
+          cls->target_handle_type == TP_HANDLE_TYPE_ROOM,
+          priv->dbus_msg_queue_size, len, priv->reading_blocked);
+
+      if (action == GABBLE_TUBE_DBUS_QUEUE_DROP)
         {
           DEBUG ("D-Bus message queue size limit reached (%u bytes). "
                  "Ignore this message.",
-                 MAX_QUEUE_SIZE);
+                 GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE);
           goto unref;
         }
 
       priv->dbus_msg_queue = g_slist_prepend (priv->dbus_msg_queue, msg);
       priv->dbus_msg_queue_size += len;
 
+      if (action == GABBLE_TUBE_DBUS_QUEUE_KEEP_AND_BLOCK)
+        {
+          DEBUG ("D-Bus message queue size limit reached (%u bytes). "
+                 "Stop reading until the application connects.",
+                 GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE);
+          priv->reading_blocked = TRUE;
+          gabble_bytestream_iface_block_reading (priv->bytestream, TRUE);
+        }
+
       /* returns without unref the message */
       return;
     }
@@ -1201,19 +1246,171 @@ unref:
 }
 
 static guint32
-collect_le32 (char *str)
+collect_le32 (const char *str)
 {
-  unsigned char *bytes = (unsigned char *) str;
+  const unsigned char *bytes = (const unsigned char *) str;
 
   return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
 }
 
 static guint32
-collect_be32 (char *str)
+collect_be32 (const char *str)
+{
+  const unsigned char *bytes = (const unsigned char *) str;
+
+  return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+/* Each D-Bus message has a 16-byte fixed header, in which
+ *
+ * * byte 0 is 'l' (ell) or 'B' for endianness
+ * * bytes 4-7 are body length "n" in bytes in that endianness
+ * * bytes 12-15 are length "m" of param array in bytes in that
+ *   endianness
+ *
+ * followed by m + n + ((8 - (m % 8)) % 8) bytes of other content.
+ *
+ * Works out the length of the message starting with @header from its fixed
+ * header, and puts it in @length. Returns FALSE if it isn't a valid message.
+ *
+ * Only extern for the benefit of tests/test-dtube-reassembly.c
+ */
+gboolean
+_gabble_tube_dbus_message_length (const gchar *header,
+    guint32 *length)
+{
+  guint32 body_length, params_length, m;
+
+  if (header[0] == DBUS_BIG_ENDIAN)
+    {
+      body_length = collect_be32 (header + 4);
+      m = collect_be32 (header + 12);
+    }
+  else if (header[0] == DBUS_LITTLE_ENDIAN)
+    {
+      body_length = collect_le32 (header + 4);
+      m = collect_le32 (header + 12);
+    }
+  else
+    {
+      DEBUG ("D-Bus message has unknown endianness byte 0x%x",
+          (unsigned int) header[0]);
+      return FALSE;
+    }
+
+  /* pad to 8-byte boundary */
+  params_length = m + ((8 - (m % 8)) % 8);
+  g_assert (params_length % 8 == 0);
+  g_assert (params_length >= m);
+  g_assert (params_length < m + 8);
+
+  /* n.b.: this looks as if it could be simplified to just the third
+   * test, but that would be wrong if the addition had overflowed, so
+   * don't do that. The first and second tests are sufficient to
+   * ensure no overflow on 32-bit platforms */
+  if (body_length > DBUS_MAXIMUM_MESSAGE_LENGTH ||
+      params_length > DBUS_MAXIMUM_ARRAY_LENGTH ||
+      params_length + body_length + 16 > DBUS_MAXIMUM_MESSAGE_LENGTH)
+    {
+      DEBUG ("D-Bus message is too large to be valid");
+      return FALSE;
+    }
+
+  *length = params_length + body_length + 16;
+  return TRUE;
+}
+
+/* Splits the byte stream of a 1-1 tube back into D-Bus messages. @buffer
+ * holds the start of a message which hasn't been completely received yet,
+ * if any, and @bytes_needed its total length (0 if we haven't seen its whole
+ * fixed header). @data first tops that message up with just the bytes it
+ * still needs; after that, whole messages are passed to @func straight out
+ * of @data, and only a trailing partial message is copied into @buffer.
+ *
+ * Returns FALSE if a message isn't valid, in which case the stream can't be
+ * resynchronised.
+ *
+ * Only extern for the benefit of tests/test-dtube-reassembly.c
+ */
+gboolean
+_gabble_tube_dbus_reassemble (GString *buffer,
+    guint32 *bytes_needed,
+    const gchar *data,
+    gsize len,
+    GabbleTubeDBusMessageFunc func,
+    gpointer user_data)
+{
+  const gchar *p = data;
+  gsize left = len;
+
+  /* Finish off the message we were part-way through, if any, copying
+   * no more of @data than it needs */
+  while (buffer->len > 0 && left > 0)
+    {
+      gsize want, n;
+
+      if (buffer->len < 16)
+        want = 16;
+      else
+        want = *bytes_needed;
+
+      n = MIN (want - buffer->len, left);
+      g_string_append_len (buffer, p, n);
+      p += n;
+      left -= n;
+
+      if (buffer->len < want)
+        break;
+
+      if (*bytes_needed == 0)
+        {
+          if (!_gabble_tube_dbus_message_length (buffer->str, bytes_needed))
+            return FALSE;
+
+          continue;
+        }
+
+      func (buffer->str, *bytes_needed, user_data);
+      g_string_truncate (buffer, 0);
+      *bytes_needed = 0;
+    }
+
+  /* Then deliver whole messages straight out of @data */
+  while (buffer->len == 0 && left >= 16)
+    {
+      if (!_gabble_tube_dbus_message_length (p, bytes_needed))
+        return FALSE;
+
+      if (left < *bytes_needed)
+        break;
+
+      func (p, *bytes_needed, user_data);
+      p += *bytes_needed;
+      left -= *bytes_needed;
+      *bytes_needed = 0;
+    }
+
+  /* and keep the start of the next one until the rest arrives */
+  if (left > 0)
+    g_string_append_len (buffer, p, left);
+
+  return TRUE;
+}
+
+typedef struct {
+  GabbleTubeDBus *tube;
+  TpHandle sender;
+} ReassemblyContext;
+
+static void
+reassembled_message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
 {
-  unsigned char *bytes = (unsigned char *) str;
+  ReassemblyContext *ctx = user_data;
 
-  return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 24) | bytes[3];
+  DEBUG ("Received complete D-Bus message of size %" G_GSIZE_FORMAT, len);
+  message_received (ctx->tube, ctx->sender, data, len);
 }
 
 static void
@@ -1230,96 +1427,25 @@ data_received_cb (GabbleBytestreamIface *stream,
   if (cls->target_handle_type == TP_HANDLE_TYPE_CONTACT)
     {
       GString *buf = priv->reassembly_buffer;
+      ReassemblyContext ctx = { tube, sender };
 
       g_assert (buf != NULL);
 
-      g_string_append_len (buf, data->str, data->len);
-      DEBUG ("Received %" G_GSIZE_FORMAT " bytes, so we now have %"
-          G_GSIZE_FORMAT " bytes in reassembly buffer", data->len, buf->len);
-
-      /* Each D-Bus message has a 16-byte fixed header, in which
-       *
-       * * byte 0 is 'l' (ell) or 'B' for endianness
-       * * bytes 4-7 are body length "n" in bytes in that endianness
-       * * bytes 12-15 are length "m" of param array in bytes in that
-       *   endianness
-       *
-       * followed by m + n + ((8 - (m % 8)) % 8) bytes of other content.
-       */
+      DEBUG ("Received %" G_GSIZE_FORMAT " bytes, with %" G_GSIZE_FORMAT
+          " bytes already in reassembly buffer", data->len, buf->len);
 
-      while (buf->len >= 16)
+      if (!_gabble_tube_dbus_reassemble (buf, &priv->reassembly_bytes_needed,
+              data->str, data->len, reassembled_message_cb, &ctx))
         {
-          guint32 body_length, params_length, m;
-
-          /* see if we have a whole message and have already calculated
-           * how many bytes it needs */
-
-          if (priv->reassembly_bytes_needed != 0)
-            {
-              if (buf->len >= priv->reassembly_bytes_needed)
-                {
-                  DEBUG ("Received complete D-Bus message of size %"
-                      G_GINT32_FORMAT, priv->reassembly_bytes_needed);
-                  message_received (tube, sender, buf->str,
-                      priv->reassembly_bytes_needed);
-                  g_string_erase (buf, 0, priv->reassembly_bytes_needed);
-                  priv->reassembly_bytes_needed = 0;
-                }
-              else
-                {
-                  /* we'll have to wait for more data */
-                  break;
-                }
-            }
-
-          if (buf->len < 16)
-            break;
-
-          /* work out how big the next message is going to be */
-
-          if (buf->str[0] == DBUS_BIG_ENDIAN)
-            {
-              body_length = collect_be32 (buf->str + 4);
-              m = collect_be32 (buf->str + 12);
-            }
-          else if (buf->str[0] == DBUS_LITTLE_ENDIAN)
-            {
-              body_length = collect_le32 (buf->str + 4);
-              m = collect_le32 (buf->str + 12);
-            }
-          else
-            {
-              DEBUG ("D-Bus message has unknown endianness byte 0x%x, "
-                  "closing tube", (unsigned int) buf->str[0]);
-              gabble_tube_iface_close ((GabbleTubeIface *) tube, TRUE);
-              return;
-            }
-
-          /* pad to 8-byte boundary */
-          params_length = m + ((8 - (m % 8)) % 8);
-          g_assert (params_length % 8 == 0);
-          g_assert (params_length >= m);
-          g_assert (params_length < m + 8);
-
-          priv->reassembly_bytes_needed = params_length + body_length + 16;
-
-          /* n.b.: this looks as if it could be simplified to just the third
-           * test, but that would be wrong if the addition had overflowed, so
-           * don't do that. The first and second tests are sufficient to
-           * ensure no overflow on 32-bit platforms */
-          if (body_length > DBUS_MAXIMUM_MESSAGE_LENGTH ||
-              params_length > DBUS_MAXIMUM_ARRAY_LENGTH ||
-              priv->reassembly_bytes_needed > DBUS_MAXIMUM_MESSAGE_LENGTH)
-            {
-              DEBUG ("D-Bus message is too large to be valid, closing tube");
-              gabble_tube_iface_close ((GabbleTubeIface *) tube, TRUE);
-              return;
-            }
-
-          g_assert (priv->reassembly_bytes_needed != 0);
-          DEBUG ("We need %" G_GINT32_FORMAT " bytes for the next full "
-              "message", priv->reassembly_bytes_needed);
+          DEBUG ("received an invalid D-Bus message, closing tube");
+          gabble_tube_iface_close ((GabbleTubeIface *) tube, TRUE);
+          return;
         }
+
+      if (buf->len > 0)
+        DEBUG ("%" G_GSIZE_FORMAT " bytes of the next message buffered; "
+            "%" G_GUINT32_FORMAT " needed", buf->len,
+            priv->reassembly_bytes_needed);
     }
   else
     {
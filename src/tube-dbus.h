@@ -32,6 +32,17 @@
 
 G_BEGIN_DECLS
 
+/* When we receive D-Bus messages to be delivered to the application and the
+ * application is not yet connected to the D-Bus tube, theses D-Bus messages
+ * are queued and delivered when the application connects to the D-Bus tube.
+ *
+ * If the application never connects, there is a risk that the contact sends
+ * too many messages and eat all the memory. To avoid this, there is an
+ * arbitrary limit on the queue size set to 4MB. Once it's reached, we stop
+ * reading from a 1-1 tube's bytestream until the application connects;
+ * messages from a room can't be held back, so they're dropped. */
+#define GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE (4096*1024)
+
 typedef struct _GabbleTubeDBus GabbleTubeDBus;
 typedef struct _GabbleTubeDBusClass GabbleTubeDBusClass;
 typedef struct _GabbleTubeDBusPrivate GabbleTubeDBusPrivate;
@@ -89,6 +100,26 @@ const gchar * const * gabble_tube_dbus_channel_get_allowed_properties (void);
 /* Only extern for the benefit of tests/test-dtube-unique-names.c */
 gchar *_gabble_generate_dbus_unique_name (const gchar *nick);
 
+/* Only extern for the benefit of tests/test-dtube-reassembly.c */
+typedef enum {
+  GABBLE_TUBE_DBUS_QUEUE_DROP,
+  GABBLE_TUBE_DBUS_QUEUE_KEEP,
+  GABBLE_TUBE_DBUS_QUEUE_KEEP_AND_BLOCK
+} GabbleTubeDBusQueueAction;
+
+typedef void (*GabbleTubeDBusMessageFunc) (const gchar *data, gsize len,
+    gpointer user_data);
+
+GabbleTubeDBusQueueAction _gabble_tube_dbus_queue_action (gboolean in_room,
+    gsize queue_size, gsize len, gboolean reading_blocked);
+
+gboolean _gabble_tube_dbus_message_length (const gchar *header,
+    guint32 *length);
+
+gboolean _gabble_tube_dbus_reassemble (GString *buffer,
+    guint32 *bytes_needed, const gchar *data, gsize len,
+    GabbleTubeDBusMessageFunc func, gpointer user_data);
+
 G_END_DECLS
 
 #endif /* #ifndef __GABBLE_TUBE_DBUS_H__ */
@@ -326,6 +326,19 @@ transport_buffer_empty_cb (GibberTransport *transport,
   gabble_bytestream_iface_block_reading (bytestream, FALSE);
 }
 
+/* Once both the bytestream and the local socket are up, let the data flow
+ * between them without passing through us if possible */
+static void
+try_splice (GibberTransport *transport,
+            GabbleBytestreamIface *bytestream)
+{
+  if (gibber_transport_get_state (transport) != GIBBER_TRANSPORT_CONNECTED)
+    return;
+
+  if (gabble_bytestream_iface_splice (bytestream, transport, NULL, NULL))
+    DEBUG ("connection is spliced to the bytestream");
+}
+
 static void
 add_transport (GabbleTubeStream *self,
                GibberTransport *transport,
@@ -340,6 +353,8 @@ add_transport (GabbleTubeStream *self,
 
   /* We can transfer transport's data; unblock it. */
   gibber_transport_block_receiving (transport, FALSE);
+
+  try_splice (transport, bytestream);
 }
 
 static void
@@ -894,6 +909,7 @@ transport_connected_cb (GibberTransport *transport,
     return;
 
   gabble_bytestream_iface_block_reading (bytestream, FALSE);
+  try_splice (transport, bytestream);
 }
 
 static GibberTransport *
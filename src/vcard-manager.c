@@ -30,13 +30,17 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_VCARD
 
+#include "base64.h"
 #include "conn-aliasing.h"
 #include "conn-contact-info.h"
 #include "connection.h"
 #include "debug.h"
+#include "metrics.h"
 #include "namespaces.h"
+#include "presence-cache.h"
 #include "request-pipeline.h"
 #include "util.h"
+#include "vcard-store.h"
 
 static guint default_request_timeout = 180;
 #define VCARD_CACHE_ENTRY_TTL 60
@@ -114,6 +118,10 @@ struct _GabbleVCardManagerPrivate
   /* Timer which runs out when the first item in the @timed_cache expires */
   guint cache_timer;
 
+  /* Contacts' vCards from previous connections, or NULL if we're not
+   * connected yet or the store is disabled */
+  GabbleVCardStore *store;
+
   /* Things to do with my own vCard, which is somewhat special - mainly because
    * we can edit it. There's only one self_handle, so there's no point
    * bloating every cache entry with these fields. */
@@ -143,6 +151,7 @@ struct _GabbleVCardManagerRequest
   GabbleVCardCacheEntry *entry;
   guint timer_id;
   guint timeout;
+  GabbleRequestPipelinePriority priority;
 
   GabbleVCardManagerCb callback;
   gpointer user_data;
@@ -407,6 +416,24 @@ cache_entry_timeout (gpointer data)
 }
 
 
+static void
+cache_entry_set_expiry (GabbleVCardCacheEntry *entry)
+{
+  GabbleVCardManagerPrivate *priv = entry->manager->priv;
+
+  entry->expires = time (NULL) + VCARD_CACHE_ENTRY_TTL;
+  tp_heap_add (priv->timed_cache, entry);
+
+  if (priv->cache_timer == 0)
+    {
+      GabbleVCardCacheEntry *first =
+          tp_heap_peek_first (priv->timed_cache);
+
+      priv->cache_timer = g_timeout_add_seconds (
+          first->expires - time (NULL), cache_entry_timeout, entry->manager);
+    }
+}
+
 static void
 cache_entry_attempt_to_free (GabbleVCardCacheEntry *entry)
 {
@@ -462,6 +489,11 @@ gabble_vcard_manager_invalidate_cache (GabbleVCardManager *manager,
 
   g_return_if_fail (tp_handle_is_valid (contact_repo, handle, NULL));
 
+  /* otherwise the next lookup would bring the old vCard straight back */
+  if (priv->store != NULL)
+    gabble_vcard_store_remove (priv->store,
+        tp_handle_inspect (contact_repo, handle));
+
   if (!entry)
       return;
 
@@ -555,6 +587,8 @@ gabble_vcard_manager_dispose (GObject *object)
   if (priv->cache_timer)
       g_source_remove (priv->cache_timer);
 
+  tp_clear_pointer (&priv->store, gabble_vcard_store_free);
+
   g_hash_table_foreach (priv->cache, disconnect_entry_foreach, NULL);
 
   tp_heap_destroy (priv->timed_cache);
@@ -581,13 +615,19 @@ gabble_vcard_manager_finalize (GObject *object)
   G_OBJECT_CLASS (gabble_vcard_manager_parent_class)->finalize (object);
 }
 
+/* Number of base64 characters vcard_get_avatar_sha1() decodes at once */
+#define AVATAR_DECODE_CHUNK 4096
+
 gchar *
 vcard_get_avatar_sha1 (WockyNode *vcard)
 {
   gchar *sha1;
   const gchar *binval_value;
-  guchar *avatar;
-  gsize outlen;
+  guint8 avatar[GABBLE_BASE64_DECODED_MAX_SIZE (AVATAR_DECODE_CHUNK)];
+  GabbleBase64DecodeState state = { 0, 0, { 0, 0 } };
+  GChecksum *checksum;
+  gsize remaining;
+  gsize decoded = 0;
   WockyNode *node;
   WockyNode *binval;
 
@@ -607,20 +647,34 @@ vcard_get_avatar_sha1 (WockyNode *vcard)
   if (!binval_value)
     return g_strdup ("");
 
-  avatar = g_base64_decode (binval_value, &outlen);
+  /* Hash the avatar a piece at a time rather than decoding it all into a
+   * buffer we're only going to throw away */
+  checksum = g_checksum_new (G_CHECKSUM_SHA1);
 
-  if (avatar)
+  for (remaining = strlen (binval_value); remaining > 0;)
     {
-      sha1 = sha1_hex ((gchar *) avatar, outlen);
-      g_free (avatar);
-      DEBUG ("Successfully decoded PHOTO.BINVAL, SHA-1 %s", sha1);
+      gsize n = MIN (remaining, AVATAR_DECODE_CHUNK);
+      gsize outlen = gabble_base64_decode_step (binval_value, n, avatar,
+          &state);
+
+      g_checksum_update (checksum, avatar, outlen);
+      decoded += outlen;
+      binval_value += n;
+      remaining -= n;
     }
-  else
+
+  /* An empty or garbage BINVAL is no avatar, not an empty one */
+  if (decoded == 0)
     {
-      DEBUG ("Avatar is in garbled Base64, ignoring it!");
-      sha1 = g_strdup ("");
+      DEBUG ("PHOTO.BINVAL decoded to nothing");
+      g_checksum_free (checksum);
+      return g_strdup ("");
     }
 
+  sha1 = g_ascii_strdown (g_checksum_get_string (checksum), -1);
+  g_checksum_free (checksum);
+  DEBUG ("Successfully decoded PHOTO.BINVAL, SHA-1 %s", sha1);
+
   return sha1;
 }
 
@@ -670,9 +724,15 @@ status_changed_cb (GObject *object,
 
   if (status == TP_CONNECTION_STATUS_CONNECTED)
     {
+      TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+          TP_HANDLE_TYPE_CONTACT);
       gchar *alias;
       GabbleConnectionAliasSource alias_src;
 
+      if (priv->store == NULL)
+        priv->store = gabble_vcard_store_new (tp_handle_inspect (contact_repo,
+              tp_base_connection_get_self_handle (base)));
+
       /* if we have a better alias, patch it into our vCard on the server */
       alias_src = _gabble_connection_get_cached_alias (conn,
           tp_base_connection_get_self_handle (base), &alias);
@@ -691,6 +751,11 @@ status_changed_cb (GObject *object,
           tp_base_connection_get_self_handle (base), 0,
           initial_request_cb, NULL, (GObject *) self);
     }
+  else if (status == TP_CONNECTION_STATUS_DISCONNECTED && priv->store != NULL)
+    {
+      /* no point waiting: nothing else is going to change */
+      gabble_vcard_store_flush (priv->store);
+    }
 }
 
 /**
@@ -799,19 +864,22 @@ extract_nickname (WockyNode *vcard_node)
   return g_strdup (nick);
 }
 
-static void
-observe_vcard (GabbleConnection *conn,
-               GabbleVCardManager *manager,
-               TpHandle handle,
-               WockyNode *vcard_node)
+/* Returns the best alias in @vcard_node, or NULL; if @field is not NULL,
+ * sets it to the name of the element the alias came from. */
+static gchar *
+vcard_get_alias (WockyNode *vcard_node,
+    const gchar **field)
 {
-  const gchar *field = "<NICKNAME>";
   gchar *alias;
-  const gchar *old_alias;
 
   alias = extract_nickname (vcard_node);
 
-  if (alias == NULL)
+  if (alias != NULL)
+    {
+      if (field != NULL)
+        *field = "<NICKNAME>";
+    }
+  else
     {
       WockyNode *fn_node = wocky_node_get_child (vcard_node, "FN");
 
@@ -821,12 +889,29 @@ observe_vcard (GabbleConnection *conn,
 
           if (!tp_str_empty (fn))
             {
-              field = "<FN>";
+              if (field != NULL)
+                *field = "<FN>";
+
               alias = g_strdup (fn);
             }
         }
     }
 
+  return alias;
+}
+
+static void
+observe_vcard (GabbleConnection *conn,
+               GabbleVCardManager *manager,
+               TpHandle handle,
+               WockyNode *vcard_node)
+{
+  const gchar *field = NULL;
+  gchar *alias;
+  const gchar *old_alias;
+
+  alias = vcard_get_alias (vcard_node, &field);
+
   g_signal_emit (G_OBJECT (manager), signals[VCARD_UPDATE], 0, handle);
 
   old_alias = gabble_vcard_manager_get_cached_alias (manager, handle);
@@ -1347,16 +1432,17 @@ pipeline_reply_cb (GabbleConnection *conn,
 
   /* Put the message in the cache */
   entry->vcard_node = wocky_node_tree_new_from_node (vcard_node);
+  cache_entry_set_expiry (entry);
 
-  entry->expires = time (NULL) + VCARD_CACHE_ENTRY_TTL;
-  tp_heap_add (priv->timed_cache, entry);
-  if (priv->cache_timer == 0)
+  /* ... and remember it for next time */
+  if (priv->store != NULL &&
+      entry->handle != tp_base_connection_get_self_handle (base))
     {
-      GabbleVCardCacheEntry *first =
-          tp_heap_peek_first (priv->timed_cache);
+      gchar *sha1 = vcard_get_avatar_sha1 (vcard_node);
 
-      priv->cache_timer = g_timeout_add_seconds (
-          first->expires - time (NULL), cache_entry_timeout, self);
+      gabble_vcard_store_put (priv->store,
+          tp_handle_inspect (contact_repo, entry->handle), vcard_node, sha1);
+      g_free (sha1);
     }
 
   /* We have freshly updated cache for our vCard, edit it if
@@ -1397,6 +1483,8 @@ request_send (GabbleVCardManagerRequest *request, guint timeout)
   if (entry->pipeline_item)
     {
       DEBUG ("adding to cache entry %p with <iq> already pending", entry);
+      gabble_request_pipeline_item_promote (entry->pipeline_item,
+          request->priority);
     }
   else if (entry->suspended_timer_id != 0)
     {
@@ -1428,8 +1516,9 @@ request_send (GabbleVCardManagerRequest *request, guint timeout)
           ')',
           NULL);
 
-      entry->pipeline_item = gabble_request_pipeline_enqueue (
-          conn->req_pipeline, msg, timeout, pipeline_reply_cb, request);
+      entry->pipeline_item = gabble_request_pipeline_enqueue_full (
+          conn->req_pipeline, msg, timeout, request->priority,
+          pipeline_reply_cb, request);
 
       g_object_unref (msg);
 
@@ -1461,6 +1550,22 @@ gabble_vcard_manager_request (GabbleVCardManager *self,
                               GabbleVCardManagerCb callback,
                               gpointer user_data,
                               GObject *object)
+{
+  return gabble_vcard_manager_request_full (self, handle, timeout,
+      GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, callback, user_data, object);
+}
+
+/* As gabble_vcard_manager_request(), but with a specific priority. If the
+ * vCard is already being requested at a lower priority, that request is
+ * promoted to @priority. */
+GabbleVCardManagerRequest *
+gabble_vcard_manager_request_full (GabbleVCardManager *self,
+                                   TpHandle handle,
+                                   guint timeout,
+                                   GabbleRequestPipelinePriority priority,
+                                   GabbleVCardManagerCb callback,
+                                   gpointer user_data,
+                                   GObject *object)
 {
   GabbleVCardManagerPrivate *priv = self->priv;
   TpBaseConnection *base = (TpBaseConnection *) priv->connection;
@@ -1480,6 +1585,7 @@ gabble_vcard_manager_request (GabbleVCardManager *self,
   request = g_slice_new0 (GabbleVCardManagerRequest);
   DEBUG ("Created request %p to retrieve <%u>'s vCard", request, handle);
   request->timeout = timeout;
+  request->priority = priority;
   request->manager = self;
   request->entry = entry;
   request->callback = callback;
@@ -1613,6 +1719,69 @@ gabble_vcard_manager_cancel_request (GabbleVCardManager *self,
   cancel_request (request);
 }
 
+/*
+ * cache_entry_load_from_store:
+ *
+ * If we have nothing cached for @handle, but we have their vCard from a
+ * previous connection and it's not known to be out of date, cache that as if
+ * we'd just fetched it. Returns the new cache entry, or NULL.
+ */
+static GabbleVCardCacheEntry *
+cache_entry_load_from_store (GabbleVCardManager *self,
+    TpHandle handle)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->connection;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  GabbleVCardCacheEntry *entry;
+  GabblePresence *presence;
+  const gchar *jid, *stored_sha1;
+  WockyNodeTree *tree;
+
+  /* our own vCard is fetched at connection time, and we need the real thing
+   * to edit it */
+  if (priv->store == NULL ||
+      handle == tp_base_connection_get_self_handle (base) ||
+      g_hash_table_lookup (priv->cache, GUINT_TO_POINTER (handle)) != NULL)
+    return NULL;
+
+  jid = tp_handle_inspect (contact_repo, handle);
+  stored_sha1 = gabble_vcard_store_get_avatar_sha1 (priv->store, jid);
+
+  if (stored_sha1 == NULL)
+    return NULL;
+
+  /* XEP-0153 tells us when a contact's avatar changes, which is the most
+   * likely reason for their vCard to change. If we haven't had their
+   * presence yet, assume it hasn't. */
+  presence = gabble_presence_cache_get (priv->connection->presence_cache,
+      handle);
+
+  if (presence != NULL && presence->avatar_sha1 != NULL &&
+      tp_strdiff (presence->avatar_sha1, stored_sha1))
+    {
+      DEBUG ("stored vCard for %s has an out-of-date avatar", jid);
+      return NULL;
+    }
+
+  tree = gabble_vcard_store_lookup (priv->store, jid);
+
+  if (tree == NULL)
+    return NULL;
+
+  entry = cache_entry_get (self, handle);
+  entry->vcard_node = tree;
+  cache_entry_set_expiry (entry);
+
+  if (!g_hash_table_contains (priv->alias_cache, GUINT_TO_POINTER (handle)))
+    g_hash_table_insert (priv->alias_cache, GUINT_TO_POINTER (handle),
+        vcard_get_alias (wocky_node_tree_get_top_node (tree), NULL));
+
+  gabble_metrics_count (GABBLE_METRIC_VCARD_STORE_HITS, 1);
+  return entry;
+}
+
 /**
  * Return cached message for the handle's vCard if it's available.
  */
@@ -1630,8 +1799,16 @@ gabble_vcard_manager_get_cached (GabbleVCardManager *self,
   g_return_val_if_fail (tp_handle_is_valid (contact_repo, handle, NULL),
       FALSE);
 
+  if (entry == NULL)
+    entry = cache_entry_load_from_store (self, handle);
+  else if (entry->vcard_node != NULL)
+    gabble_metrics_count (GABBLE_METRIC_VCARD_CACHE_HITS, 1);
+
   if ((entry == NULL) || (entry->vcard_node == NULL))
+    {
+      gabble_metrics_count (GABBLE_METRIC_VCARD_CACHE_MISSES, 1);
       return FALSE;
+    }
 
   if (node != NULL)
     *node = wocky_node_tree_get_top_node (entry->vcard_node);
@@ -1658,6 +1835,9 @@ gabble_vcard_manager_get_cached_alias (GabbleVCardManager *self,
 
   g_return_val_if_fail (tp_handle_is_valid (contact_repo, handle, NULL), NULL);
 
+  if (!g_hash_table_contains (priv->alias_cache, GUINT_TO_POINTER (handle)))
+    cache_entry_load_from_store (self, handle);
+
   /* Return NULL for uncached or negatively cached contacts. */
   return g_hash_table_lookup (priv->alias_cache, GUINT_TO_POINTER (handle));
 }
@@ -1681,10 +1861,33 @@ gabble_vcard_manager_has_cached_alias (GabbleVCardManager *self,
   g_return_val_if_fail (tp_handle_is_valid (contact_repo, handle, NULL),
       FALSE);
 
+  if (!g_hash_table_contains (priv->alias_cache, GUINT_TO_POINTER (handle)))
+    cache_entry_load_from_store (self, handle);
+
   /* Return TRUE for positively or negatively cached contacts. */
   return g_hash_table_contains (priv->alias_cache, GUINT_TO_POINTER (handle));
 }
 
+/*
+ * gabble_vcard_manager_dup_stored_vcard_for_avatar:
+ *
+ * Returns: (transfer full): a vCard from a previous connection whose avatar
+ *  has SHA-1 @avatar_sha1, or %NULL. The vCard might not be from the contact
+ *  you're interested in, so only use its PHOTO.
+ */
+WockyNodeTree *
+gabble_vcard_manager_dup_stored_vcard_for_avatar (GabbleVCardManager *self,
+    const gchar *avatar_sha1)
+{
+  g_return_val_if_fail (GABBLE_IS_VCARD_MANAGER (self), NULL);
+
+  if (self->priv->store == NULL || tp_str_empty (avatar_sha1))
+    return NULL;
+
+  return gabble_vcard_store_lookup_by_avatar (self->priv->store,
+      avatar_sha1);
+}
+
 /* For unit tests only */
 void
 gabble_vcard_manager_set_suspend_reply_timeout (guint timeout)
@@ -25,6 +25,7 @@
 #include <glib-object.h>
 #include <wocky/wocky.h>
 
+#include "request-pipeline.h"
 #include "types.h"
 
 G_BEGIN_DECLS
@@ -104,6 +105,10 @@ GabbleVCardManagerRequest *gabble_vcard_manager_request (GabbleVCardManager *,
                                                        GabbleVCardManagerCb,
                                                        gpointer user_data,
                                                        GObject *object);
+GabbleVCardManagerRequest *gabble_vcard_manager_request_full (
+    GabbleVCardManager *, TpHandle, guint timeout,
+    GabbleRequestPipelinePriority priority, GabbleVCardManagerCb,
+    gpointer user_data, GObject *object);
 
 void gabble_vcard_manager_cancel_request (GabbleVCardManager *manager,
                                           GabbleVCardManagerRequest *request);
@@ -117,6 +122,8 @@ gboolean gabble_vcard_manager_get_cached (GabbleVCardManager *,
                                           TpHandle,
                                           WockyNode **);
 void gabble_vcard_manager_invalidate_cache (GabbleVCardManager *, TpHandle);
+WockyNodeTree *gabble_vcard_manager_dup_stored_vcard_for_avatar (
+    GabbleVCardManager *self, const gchar *avatar_sha1);
 
 typedef void (*GabbleVCardManagerEditCb)(GabbleVCardManager *self,
                                          GabbleVCardManagerEditRequest *request,
@@ -0,0 +1,850 @@
+/*
+ * vcard-store.c - Gabble's on-disk vCard store
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * The store keeps contacts' vCards across connections, so that avatars and
+ * aliases which haven't changed can be served without asking the server.
+ *
+ * Each distinct vCard is saved once, in vcards/<SHA-1 of its XML>.xml, and
+ * an index file maps each contact's JID to the vCard we last saw for them,
+ * the SHA-1 of the avatar it contains, and when it was fetched and last
+ * used. If the vCards take up more than VCARD_STORE_MAX_SIZE bytes, the
+ * least recently used contacts are forgotten, and any vCards nobody refers
+ * to any more are deleted. vCards fetched more than VCARD_STORE_MAX_AGE
+ * seconds ago are not used.
+ *
+ * The index and all the vCards it refers to are read and parsed in a thread
+ * when the store is created, into a separate store which is merged into
+ * this one once the thread has finished, and then kept in memory, so
+ * looking a vCard up never touches the disk. Until then, lookups only find
+ * vCards put since the store was created, so the caller fetches the rest
+ * from the server, and the index isn't saved, since it would forget
+ * everything that's still loading.
+ */
+
+#include "config.h"
+#include "vcard-store.h"
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_VCARD
+
+#include "debug.h"
+
+/* Upper bound on the total size of the vCards kept on disk for one account */
+#define VCARD_STORE_MAX_SIZE (16 * 1024 * 1024)
+
+/* Seconds after fetching a vCard that we stop using it, since contacts can
+ * change their name or other details without changing their avatar */
+#define VCARD_STORE_MAX_AGE (24 * 60 * 60)
+
+/* Seconds to wait after a change before rewriting the index, so that a burst
+ * of vCards only costs one write */
+#define VCARD_STORE_SAVE_DELAY 5
+
+typedef struct {
+    gchar *jid;
+    /* SHA-1 of the vCard's XML, which is also its file name */
+    gchar *vcard_hash;
+    /* SHA-1 of the avatar in the vCard, or "" if it has none */
+    gchar *avatar_sha1;
+    /* seconds since the epoch */
+    gint64 last_used;
+    gint64 fetched;
+} StoreRecord;
+
+typedef struct {
+    gsize size;
+    /* number of StoreRecords referring to this vCard */
+    guint refcount;
+    /* the parsed vCard, which must not be modified since it's shared with
+     * whoever looked it up */
+    WockyNodeTree *tree;
+} StoreBlob;
+
+typedef struct _StoreLoad StoreLoad;
+
+struct _GabbleVCardStore {
+    /* directory holding the index and the vcards/ subdirectory */
+    gchar *dir;
+    /* owned JID => owned StoreRecord */
+    GHashTable *records;
+    /* owned vCard hash => owned StoreBlob */
+    GHashTable *blobs;
+    /* owned avatar SHA-1 => owned vCard hash of some vCard containing it;
+     * may be stale, so check @blobs before using it */
+    GHashTable *avatars;
+    /* total size of everything in @blobs */
+    gsize total_size;
+    guint save_id;
+
+    /* non-NULL until what's on disk has been merged in */
+    StoreLoad *load;
+    /* owned JIDs whose vCards were removed while loading, and so mustn't be
+     * brought back from disk; NULL once loaded */
+    GHashTable *removed_while_loading;
+};
+
+struct _StoreLoad {
+    /* the store being loaded, or NULL if it was freed first */
+    GabbleVCardStore *owner;
+    /* filled in by the loading thread; nothing else touches it until the
+     * thread has finished */
+    GabbleVCardStore *loaded;
+    /* seconds since the epoch when loading started; vCards written after
+     * that were put by @owner in the meantime, so aren't orphans */
+    gint64 started;
+    /* what the loading thread threw away, for debugging */
+    guint n_expired;
+    guint n_unreadable;
+    guint n_orphans;
+};
+
+static void
+store_record_free (StoreRecord *record)
+{
+  g_free (record->jid);
+  g_free (record->vcard_hash);
+  g_free (record->avatar_sha1);
+  g_slice_free (StoreRecord, record);
+}
+
+static void
+store_blob_free (StoreBlob *blob)
+{
+  g_object_unref (blob->tree);
+  g_slice_free (StoreBlob, blob);
+}
+
+static gchar *
+store_dup_vcard_path (GabbleVCardStore *store,
+    const gchar *vcard_hash)
+{
+  gchar *filename = g_strconcat (vcard_hash, ".xml", NULL);
+  gchar *path = g_build_filename (store->dir, "vcards", filename, NULL);
+
+  g_free (filename);
+  return path;
+}
+
+static void
+store_blob_unref (GabbleVCardStore *store,
+    const gchar *vcard_hash)
+{
+  StoreBlob *blob = g_hash_table_lookup (store->blobs, vcard_hash);
+  gchar *path;
+
+  g_return_if_fail (blob != NULL);
+
+  if (--blob->refcount > 0)
+    return;
+
+  path = store_dup_vcard_path (store, vcard_hash);
+  g_unlink (path);
+  g_free (path);
+
+  store->total_size -= blob->size;
+  g_hash_table_remove (store->blobs, vcard_hash);
+}
+
+static void
+store_remove_record (GabbleVCardStore *store,
+    const gchar *jid)
+{
+  StoreRecord *record = g_hash_table_lookup (store->records, jid);
+
+  if (record == NULL)
+    return;
+
+  store_blob_unref (store, record->vcard_hash);
+  g_hash_table_remove (store->records, jid);
+}
+
+/* @tree and @size describe the vCard whose hash is @vcard_hash, and are only
+ * used if we don't have it already */
+static void
+store_add_record (GabbleVCardStore *store,
+    const gchar *jid,
+    const gchar *vcard_hash,
+    const gchar *avatar_sha1,
+    WockyNodeTree *tree,
+    gsize size,
+    gint64 last_used,
+    gint64 fetched)
+{
+  StoreRecord *record = g_slice_new0 (StoreRecord);
+  StoreBlob *blob = g_hash_table_lookup (store->blobs, vcard_hash);
+
+  if (blob == NULL)
+    {
+      blob = g_slice_new0 (StoreBlob);
+      blob->size = size;
+      blob->tree = g_object_ref (tree);
+      g_hash_table_insert (store->blobs, g_strdup (vcard_hash), blob);
+      store->total_size += size;
+    }
+
+  blob->refcount++;
+
+  store_remove_record (store, jid);
+
+  record->jid = g_strdup (jid);
+  record->vcard_hash = g_strdup (vcard_hash);
+  record->avatar_sha1 = g_strdup (avatar_sha1);
+  record->last_used = last_used;
+  record->fetched = fetched;
+  g_hash_table_insert (store->records, record->jid, record);
+
+  if (!tp_str_empty (avatar_sha1))
+    g_hash_table_insert (store->avatars, g_strdup (avatar_sha1),
+        g_strdup (vcard_hash));
+}
+
+static gint
+store_record_compare_last_used (gconstpointer a,
+    gconstpointer b)
+{
+  const StoreRecord *left = a;
+  const StoreRecord *right = b;
+
+  if (left->last_used < right->last_used)
+    return -1;
+
+  return (left->last_used > right->last_used);
+}
+
+/* Forget the least recently used contacts until we're within our size
+ * limit, sparing @keep_jid if possible. */
+static void
+store_evict (GabbleVCardStore *store,
+    const gchar *keep_jid)
+{
+  GList *records, *l;
+
+  if (store->total_size <= VCARD_STORE_MAX_SIZE)
+    return;
+
+  records = g_list_sort (g_hash_table_get_values (store->records),
+      store_record_compare_last_used);
+
+  for (l = records;
+      l != NULL && store->total_size > VCARD_STORE_MAX_SIZE;
+      l = l->next)
+    {
+      StoreRecord *record = l->data;
+
+      if (!tp_strdiff (record->jid, keep_jid))
+        continue;
+
+      DEBUG ("evicting vCard for %s", record->jid);
+      store_remove_record (store, record->jid);
+    }
+
+  g_list_free (records);
+}
+
+static void
+store_save_index (GabbleVCardStore *store)
+{
+  GKeyFile *index = g_key_file_new ();
+  GHashTableIter iter;
+  gpointer v;
+  gchar *path, *data;
+  gsize length;
+  GError *error = NULL;
+
+  g_hash_table_iter_init (&iter, store->records);
+  while (g_hash_table_iter_next (&iter, NULL, &v))
+    {
+      StoreRecord *record = v;
+      gchar *group = tp_escape_as_identifier (record->jid);
+
+      g_key_file_set_string (index, group, "jid", record->jid);
+      g_key_file_set_string (index, group, "vcard", record->vcard_hash);
+      g_key_file_set_string (index, group, "avatar", record->avatar_sha1);
+      g_key_file_set_int64 (index, group, "used", record->last_used);
+      g_key_file_set_int64 (index, group, "fetched", record->fetched);
+      g_free (group);
+    }
+
+  data = g_key_file_to_data (index, &length, NULL);
+  path = g_build_filename (store->dir, "index", NULL);
+
+  if (!g_file_set_contents (path, data, length, &error))
+    {
+      DEBUG ("couldn't save vCard store index: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (path);
+  g_free (data);
+  g_key_file_free (index);
+}
+
+static gboolean
+store_save_cb (gpointer user_data)
+{
+  GabbleVCardStore *store = user_data;
+
+  /* try again later */
+  if (store->load != NULL)
+    return TRUE;
+
+  store->save_id = 0;
+  store_save_index (store);
+  return FALSE;
+}
+
+static void
+store_queue_save (GabbleVCardStore *store)
+{
+  if (store->save_id == 0)
+    store->save_id = g_timeout_add_seconds (VCARD_STORE_SAVE_DELAY,
+        store_save_cb, store);
+}
+
+/* Called in the loading thread, so mustn't log anything. Returns NULL if
+ * the vCard can't be read, or isn't the one called @vcard_hash. */
+static WockyNodeTree *
+store_read_vcard (GabbleVCardStore *store,
+    const gchar *vcard_hash,
+    gsize *size)
+{
+  WockyNodeTree *tree = NULL;
+  WockyXmppReader *reader;
+  WockyStanza *stanza;
+  gchar *path = store_dup_vcard_path (store, vcard_hash);
+  gchar *contents, *actual_hash;
+  gsize length;
+
+  if (!g_file_get_contents (path, &contents, &length, NULL))
+    {
+      g_free (path);
+      return NULL;
+    }
+
+  /* it's content-addressed, so we can cheaply check it's intact */
+  actual_hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, contents,
+      length);
+
+  if (tp_strdiff (actual_hash, vcard_hash))
+    goto out;
+
+  reader = wocky_xmpp_reader_new_no_stream ();
+  wocky_xmpp_reader_push (reader, (const guint8 *) contents, length);
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+
+  if (stanza != NULL)
+    {
+      WockyNode *top = wocky_stanza_get_top_node (stanza);
+
+      if (!tp_strdiff (top->name, "vCard"))
+        {
+          tree = wocky_node_tree_new_from_node (top);
+          *size = length;
+        }
+
+      g_object_unref (stanza);
+    }
+
+  g_object_unref (reader);
+
+out:
+  g_free (actual_hash);
+  g_free (contents);
+  g_free (path);
+  return tree;
+}
+
+/* Called in the loading thread */
+static void
+store_load_index (StoreLoad *load)
+{
+  GabbleVCardStore *store = load->loaded;
+  GKeyFile *index = g_key_file_new ();
+  gchar *path = g_build_filename (store->dir, "index", NULL);
+  gchar **groups;
+  gsize i, n_groups;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  if (!g_key_file_load_from_file (index, path, G_KEY_FILE_NONE, NULL))
+    goto out;
+
+  groups = g_key_file_get_groups (index, &n_groups);
+
+  for (i = 0; i < n_groups; i++)
+    {
+      gchar *jid = g_key_file_get_string (index, groups[i], "jid", NULL);
+      gchar *vcard_hash = g_key_file_get_string (index, groups[i], "vcard",
+          NULL);
+      gchar *avatar_sha1 = g_key_file_get_string (index, groups[i], "avatar",
+          NULL);
+      gint64 last_used = g_key_file_get_int64 (index, groups[i], "used",
+          NULL);
+      gint64 fetched = g_key_file_get_int64 (index, groups[i], "fetched",
+          NULL);
+      WockyNodeTree *tree = NULL;
+      gsize size = 0;
+
+      if (jid == NULL || vcard_hash == NULL || avatar_sha1 == NULL)
+        goto next;
+
+      if (now - fetched >= VCARD_STORE_MAX_AGE)
+        {
+          load->n_expired++;
+          goto next;
+        }
+
+      if (!g_hash_table_contains (store->blobs, vcard_hash))
+        {
+          tree = store_read_vcard (store, vcard_hash, &size);
+
+          if (tree == NULL)
+            {
+              load->n_unreadable++;
+              goto next;
+            }
+        }
+
+      store_add_record (store, jid, vcard_hash, avatar_sha1, tree, size,
+          last_used, fetched);
+
+next:
+      tp_clear_object (&tree);
+      g_free (jid);
+      g_free (vcard_hash);
+      g_free (avatar_sha1);
+    }
+
+  g_strfreev (groups);
+
+out:
+  g_free (path);
+  g_key_file_free (index);
+}
+
+/* Called in the loading thread. Deletes every file under vcards/ that the
+ * index doesn't refer to, such as vCards we wrote but then crashed before
+ * saving the index, and those we've just decided are too old, but not
+ * those the main thread has written since we started. */
+static void
+store_sweep (StoreLoad *load)
+{
+  GabbleVCardStore *store = load->loaded;
+  gchar *path = g_build_filename (store->dir, "vcards", NULL);
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  if (dir == NULL)
+    goto out;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *vcard_hash = NULL;
+
+      if (g_str_has_suffix (name, ".xml"))
+        vcard_hash = g_strndup (name, strlen (name) - strlen (".xml"));
+
+      if (vcard_hash == NULL ||
+          !g_hash_table_contains (store->blobs, vcard_hash))
+        {
+          gchar *orphan = g_build_filename (path, name, NULL);
+          GStatBuf buf;
+
+          if (g_stat (orphan, &buf) == 0 && buf.st_mtime < load->started)
+            {
+              g_unlink (orphan);
+              load->n_orphans++;
+            }
+
+          g_free (orphan);
+        }
+
+      g_free (vcard_hash);
+    }
+
+  g_dir_close (dir);
+
+out:
+  g_free (path);
+}
+
+static GabbleVCardStore *
+store_new_empty (const gchar *dir)
+{
+  GabbleVCardStore *store = g_slice_new0 (GabbleVCardStore);
+
+  store->dir = g_strdup (dir);
+  store->records = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) store_record_free);
+  store->blobs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) store_blob_free);
+  store->avatars = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      g_free);
+
+  return store;
+}
+
+static void
+store_destroy (GabbleVCardStore *store)
+{
+  g_hash_table_unref (store->records);
+  g_hash_table_unref (store->blobs);
+  g_hash_table_unref (store->avatars);
+  tp_clear_pointer (&store->removed_while_loading, g_hash_table_unref);
+  g_free (store->dir);
+  g_slice_free (GabbleVCardStore, store);
+}
+
+static void
+store_load_free (StoreLoad *load)
+{
+  store_destroy (load->loaded);
+  g_slice_free (StoreLoad, load);
+}
+
+/* Runs in the main thread once the loading thread has finished, and merges
+ * what it loaded into the store, except for contacts whose vCards have been
+ * put or removed in the meantime. */
+static gboolean
+store_loaded_cb (gpointer user_data)
+{
+  StoreLoad *load = user_data;
+  GabbleVCardStore *store = load->owner;
+  GabbleVCardStore *loaded = load->loaded;
+  GHashTableIter iter;
+  gpointer v;
+
+  if (store == NULL)
+    goto out;
+
+  g_hash_table_iter_init (&iter, loaded->records);
+  while (g_hash_table_iter_next (&iter, NULL, &v))
+    {
+      StoreRecord *record = v;
+      StoreBlob *blob;
+
+      if (g_hash_table_contains (store->records, record->jid) ||
+          g_hash_table_contains (store->removed_while_loading, record->jid))
+        continue;
+
+      blob = g_hash_table_lookup (loaded->blobs, record->vcard_hash);
+      store_add_record (store, record->jid, record->vcard_hash,
+          record->avatar_sha1, blob->tree, blob->size, record->last_used,
+          record->fetched);
+    }
+
+  DEBUG ("loaded %u vCards for %u contacts (%" G_GSIZE_FORMAT " bytes); "
+      "dropped %u expired and %u unreadable contacts, and %u orphaned files",
+      g_hash_table_size (loaded->blobs), g_hash_table_size (loaded->records),
+      loaded->total_size, load->n_expired, load->n_unreadable,
+      load->n_orphans);
+
+  store->load = NULL;
+  tp_clear_pointer (&store->removed_while_loading, g_hash_table_unref);
+
+  if (load->n_expired > 0 || load->n_unreadable > 0 ||
+      store->total_size > VCARD_STORE_MAX_SIZE)
+    store_queue_save (store);
+
+  store_evict (store, NULL);
+
+out:
+  store_load_free (load);
+  return FALSE;
+}
+
+static gpointer
+store_load_thread (gpointer user_data)
+{
+  StoreLoad *load = user_data;
+  GSource *source;
+
+  store_load_index (load);
+  store_sweep (load);
+
+  /* hand @load back to the main thread; we mustn't touch it after this */
+  source = g_idle_source_new ();
+  g_source_set_callback (source, store_loaded_cb, load, NULL);
+  g_source_attach (source, NULL);
+  g_source_unref (source);
+  return NULL;
+}
+
+/*
+ * gabble_vcard_store_new:
+ * @account: the bare JID of the account whose contacts' vCards to store
+ *
+ * Returns: a store, which starts loading in the background, or %NULL if the
+ *  GABBLE_VCARD_CACHE environment variable is ":memory:", which means "don't
+ *  touch the disk"
+ */
+GabbleVCardStore *
+gabble_vcard_store_new (const gchar *account)
+{
+  GabbleVCardStore *store;
+  StoreLoad *load;
+  const gchar *env = g_getenv ("GABBLE_VCARD_CACHE");
+  gchar *escaped, *dir;
+
+  if (!tp_strdiff (env, ":memory:"))
+    return NULL;
+
+  escaped = tp_escape_as_identifier (account);
+
+  if (env != NULL)
+    dir = g_build_filename (env, escaped, NULL);
+  else
+    dir = g_build_filename (g_get_user_cache_dir (), "telepathy", "gabble",
+        "vcards", escaped, NULL);
+
+  store = store_new_empty (dir);
+  store->removed_while_loading = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, NULL);
+
+  load = g_slice_new0 (StoreLoad);
+  load->owner = store;
+  load->loaded = store_new_empty (dir);
+  load->started = g_get_real_time () / G_USEC_PER_SEC;
+  store->load = load;
+
+  /* the thread hands @load back through the main loop when it's done, so
+   * nothing ever waits for it */
+  g_thread_unref (g_thread_new ("vcard-store", store_load_thread, load));
+
+  g_free (dir);
+  g_free (escaped);
+  return store;
+}
+
+void
+gabble_vcard_store_flush (GabbleVCardStore *store)
+{
+  if (store->save_id == 0)
+    return;
+
+  g_source_remove (store->save_id);
+  store->save_id = 0;
+
+  /* The vCards put since we started loading are on disk, but will be swept
+   * up as orphans next time; that's better than forgetting everything
+   * else. */
+  if (store->load != NULL)
+    DEBUG ("still loading, so not saving the index");
+  else
+    store_save_index (store);
+}
+
+void
+gabble_vcard_store_free (GabbleVCardStore *store)
+{
+  gabble_vcard_store_flush (store);
+
+  /* the loading thread's result is thrown away when it arrives */
+  if (store->load != NULL)
+    store->load->owner = NULL;
+
+  store_destroy (store);
+}
+
+/*
+ * gabble_vcard_store_put:
+ * @store: a store
+ * @jid: a contact's bare JID
+ * @vcard: the contact's <vCard/>, just fetched from the server
+ * @avatar_sha1: the SHA-1 of the avatar in @vcard, or "" if it has none
+ *
+ * Remembers @vcard as @jid's vCard.
+ */
+void
+gabble_vcard_store_put (GabbleVCardStore *store,
+    const gchar *jid,
+    WockyNode *vcard,
+    const gchar *avatar_sha1)
+{
+  StoreRecord *record;
+  WockyXmppWriter *writer;
+  WockyNodeTree *tree;
+  const guint8 *data;
+  gsize length;
+  gchar *vcard_hash;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  g_return_if_fail (avatar_sha1 != NULL);
+
+  record = g_hash_table_lookup (store->records, jid);
+
+  tree = wocky_node_tree_new_from_node (vcard);
+  writer = wocky_xmpp_writer_new_no_stream ();
+  wocky_xmpp_writer_write_node_tree (writer, tree, &data, &length);
+  vcard_hash = g_compute_checksum_for_data (G_CHECKSUM_SHA1, data, length);
+
+  if (record != NULL && !tp_strdiff (record->vcard_hash, vcard_hash))
+    {
+      record->last_used = now;
+      record->fetched = now;
+      goto out;
+    }
+
+  if (!g_hash_table_contains (store->blobs, vcard_hash))
+    {
+      gchar *path = store_dup_vcard_path (store, vcard_hash);
+      gchar *dir = g_path_get_dirname (path);
+      GError *error = NULL;
+
+      g_mkdir_with_parents (dir, 0700);
+
+      if (!g_file_set_contents (path, (const gchar *) data, length, &error))
+        {
+          DEBUG ("couldn't save vCard for %s: %s", jid, error->message);
+          g_clear_error (&error);
+          g_free (dir);
+          g_free (path);
+          goto out;
+        }
+
+      g_free (dir);
+      g_free (path);
+    }
+
+  DEBUG ("storing vCard %s for %s", vcard_hash, jid);
+  store_add_record (store, jid, vcard_hash, avatar_sha1, tree, length, now,
+      now);
+  store_evict (store, jid);
+
+out:
+  store_queue_save (store);
+  g_free (vcard_hash);
+  g_object_unref (writer);
+  g_object_unref (tree);
+}
+
+/*
+ * gabble_vcard_store_remove:
+ *
+ * Forgets @jid's vCard, if we have one.
+ */
+void
+gabble_vcard_store_remove (GabbleVCardStore *store,
+    const gchar *jid)
+{
+  if (store->removed_while_loading != NULL)
+    g_hash_table_add (store->removed_while_loading, g_strdup (jid));
+
+  if (!g_hash_table_contains (store->records, jid))
+    return;
+
+  DEBUG ("forgetting stored vCard for %s", jid);
+  store_remove_record (store, jid);
+  store_queue_save (store);
+}
+
+/* Returns @jid's record, unless it's too old to use, in which case it's
+ * forgotten, or it's still being loaded */
+static StoreRecord *
+store_lookup_record (GabbleVCardStore *store,
+    const gchar *jid)
+{
+  StoreRecord *record = g_hash_table_lookup (store->records, jid);
+
+  if (record != NULL &&
+      g_get_real_time () / G_USEC_PER_SEC - record->fetched >=
+          VCARD_STORE_MAX_AGE)
+    {
+      DEBUG ("stored vCard for %s has expired", jid);
+      store_remove_record (store, jid);
+      store_queue_save (store);
+      return NULL;
+    }
+
+  return record;
+}
+
+/*
+ * gabble_vcard_store_get_avatar_sha1:
+ *
+ * Returns: the SHA-1 of the avatar in @jid's stored vCard, "" if it has no
+ *  avatar, or %NULL if we have no usable vCard for @jid
+ */
+const gchar *
+gabble_vcard_store_get_avatar_sha1 (GabbleVCardStore *store,
+    const gchar *jid)
+{
+  StoreRecord *record = store_lookup_record (store, jid);
+
+  if (record == NULL)
+    return NULL;
+
+  return record->avatar_sha1;
+}
+
+/*
+ * gabble_vcard_store_lookup:
+ *
+ * Returns: (transfer full): @jid's stored vCard, which must not be
+ *  modified, or %NULL if we have no usable vCard for @jid
+ */
+WockyNodeTree *
+gabble_vcard_store_lookup (GabbleVCardStore *store,
+    const gchar *jid)
+{
+  StoreRecord *record = store_lookup_record (store, jid);
+  StoreBlob *blob;
+
+  if (record == NULL)
+    return NULL;
+
+  blob = g_hash_table_lookup (store->blobs, record->vcard_hash);
+  g_return_val_if_fail (blob != NULL, NULL);
+
+  DEBUG ("using stored vCard for %s", jid);
+  record->last_used = g_get_real_time () / G_USEC_PER_SEC;
+  store_queue_save (store);
+  return g_object_ref (blob->tree);
+}
+
+/*
+ * gabble_vcard_store_lookup_by_avatar:
+ *
+ * Returns: (transfer full): a stored vCard, which must not be modified,
+ *  whose avatar has SHA-1 @avatar_sha1, or %NULL if we have none
+ */
+WockyNodeTree *
+gabble_vcard_store_lookup_by_avatar (GabbleVCardStore *store,
+    const gchar *avatar_sha1)
+{
+  const gchar *vcard_hash;
+  StoreBlob *blob = NULL;
+
+  vcard_hash = g_hash_table_lookup (store->avatars, avatar_sha1);
+
+  if (vcard_hash != NULL)
+    blob = g_hash_table_lookup (store->blobs, vcard_hash);
+
+  if (blob == NULL)
+    {
+      g_hash_table_remove (store->avatars, avatar_sha1);
+      return NULL;
+    }
+
+  return g_object_ref (blob->tree);
+}
@@ -0,0 +1,187 @@
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "src/base64.h"
+
+static void
+test_encode (void)
+{
+  guint8 data[300];
+  gchar out[GABBLE_BASE64_ENCODED_SIZE (sizeof (data)) + 1];
+  gsize len, i;
+
+  for (len = 0; len < sizeof (data); len++)
+    {
+      gchar *expected;
+
+      for (i = 0; i < len; i++)
+        data[i] = g_random_int ();
+
+      expected = g_base64_encode (data, len);
+      g_assert_cmpuint (gabble_base64_encode_to (data, len, out), ==,
+          strlen (expected));
+      g_assert_cmpstr (out, ==, expected);
+      g_free (expected);
+    }
+}
+
+static void
+check_decode (const gchar *in)
+{
+  guchar *expected;
+  gsize expected_len, len = strlen (in), split;
+  GString *str = g_string_new ("prefix");
+  guint8 *out = g_malloc (GABBLE_BASE64_DECODED_MAX_SIZE (len) + 3);
+
+  expected = g_base64_decode (in, &expected_len);
+
+  gabble_base64_decode_append (str, in);
+  g_assert_cmpuint (str->len, ==, 6 + expected_len);
+  g_assert (memcmp (str->str + 6, expected, expected_len) == 0);
+
+  /* Splitting the input anywhere gives the same result */
+  for (split = 0; split <= len; split++)
+    {
+      GabbleBase64DecodeState state = { 0, 0, { 0, 0 } };
+      gsize n;
+
+      n = gabble_base64_decode_step (in, split, out, &state);
+      n += gabble_base64_decode_step (in + split, len - split, out + n,
+          &state);
+      g_assert_cmpuint (n, ==, expected_len);
+      g_assert (memcmp (out, expected, n) == 0);
+    }
+
+  g_string_free (str, TRUE);
+  g_free (expected);
+  g_free (out);
+}
+
+static void
+test_decode (void)
+{
+  guint8 data[100];
+  guint i, j;
+
+  check_decode ("");
+  check_decode ("QQ==");
+  check_decode ("QUI=");
+  check_decode ("QUJD");
+  /* GLib skips anything that isn't base64, and so should we */
+  check_decode ("QU\nJD\r\nR A==");
+  check_decode ("!!QUJD**");
+  check_decode ("QQ==QUJD");
+
+  for (i = 0; i < 200; i++)
+    {
+      gsize len = g_random_int_range (0, sizeof (data));
+      gchar *encoded;
+
+      for (j = 0; j < len; j++)
+        data[j] = g_random_int ();
+
+      encoded = g_base64_encode (data, len);
+
+      /* sprinkle some junk in */
+      if (len > 0 && i % 2)
+        encoded[g_random_int_range (0, strlen (encoded))] = '\n';
+
+      check_decode (encoded);
+      g_free (encoded);
+    }
+}
+
+static gchar *
+encode_with (GabbleBase64Kernel kernel,
+    const guint8 *data,
+    gsize len)
+{
+  gchar *out = g_malloc (GABBLE_BASE64_ENCODED_SIZE (len) + 1);
+
+  g_assert (gabble_base64_set_kernel (kernel));
+  gabble_base64_encode_to (data, len, out);
+  return out;
+}
+
+static GString *
+decode_with (GabbleBase64Kernel kernel,
+    const gchar *in)
+{
+  GString *out = g_string_new ("");
+
+  g_assert (gabble_base64_set_kernel (kernel));
+  gabble_base64_decode_append (out, in);
+  return out;
+}
+
+/* Every vector kernel this machine can run gives the same results as the
+ * scalar code, on inputs long enough to use it several times over */
+static void
+test_kernels (void)
+{
+  GabbleBase64Kernel kernel;
+  guint8 data[1000];
+  guint i, j;
+
+  for (kernel = GABBLE_BASE64_KERNEL_SCALAR + 1;
+      kernel < NUM_GABBLE_BASE64_KERNELS;
+      kernel++)
+    {
+      if (!gabble_base64_set_kernel (kernel))
+        {
+          g_test_message ("kernel %u isn't available here", kernel);
+          continue;
+        }
+
+      for (i = 0; i < 300; i++)
+        {
+          gsize len = g_random_int_range (0, sizeof (data));
+          gchar *expected_enc, *enc;
+          GString *expected_dec, *dec;
+
+          for (j = 0; j < len; j++)
+            data[j] = g_random_int ();
+
+          expected_enc = encode_with (GABBLE_BASE64_KERNEL_SCALAR, data, len);
+          enc = encode_with (kernel, data, len);
+          g_assert_cmpstr (enc, ==, expected_enc);
+
+          /* junk, padding or high-bit characters in the middle of a block
+           * have to stop the kernel without changing the result */
+          if (len > 0 && i % 2)
+            enc[g_random_int_range (0, strlen (enc))] =
+                "\n=!\x80"[g_random_int_range (0, 4)];
+
+          expected_dec = decode_with (GABBLE_BASE64_KERNEL_SCALAR, enc);
+          dec = decode_with (kernel, enc);
+          g_assert_cmpuint (dec->len, ==, expected_dec->len);
+          g_assert (memcmp (dec->str, expected_dec->str, dec->len) == 0);
+
+          if (i % 2 == 0)
+            {
+              g_assert_cmpuint (dec->len, ==, len);
+              g_assert (memcmp (dec->str, data, len) == 0);
+            }
+
+          g_string_free (expected_dec, TRUE);
+          g_string_free (dec, TRUE);
+          g_free (expected_enc);
+          g_free (enc);
+        }
+    }
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/base64/encode", test_encode);
+  g_test_add_func ("/base64/decode", test_decode);
+  g_test_add_func ("/base64/kernels", test_kernels);
+
+  return g_test_run ();
+}
@@ -0,0 +1,174 @@
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <glib-object.h>
+
+#include "gabble/capabilities.h"
+#include "src/debug.h"
+#include "src/namespaces.h"
+
+#define NS_UNKNOWN_1 "http://example.com/not-a-well-known-feature"
+#define NS_UNKNOWN_2 "urn:example:also-not-well-known"
+
+static GabbleCapabilitySet *
+make_set (const gchar *first, ...)
+{
+  GabbleCapabilitySet *caps = gabble_capability_set_new ();
+  const gchar *cap;
+  va_list ap;
+
+  va_start (ap, first);
+
+  for (cap = first; cap != NULL; cap = va_arg (ap, const gchar *))
+    gabble_capability_set_add (caps, cap);
+
+  va_end (ap);
+
+  return caps;
+}
+
+static void
+test_add_remove (void)
+{
+  GabbleCapabilitySet *caps = gabble_capability_set_new ();
+
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 0);
+  g_assert (!gabble_capability_set_has (caps, NS_IBB));
+  g_assert (!gabble_capability_set_has (caps, NS_UNKNOWN_1));
+
+  gabble_capability_set_add (caps, NS_IBB);
+  gabble_capability_set_add (caps, NS_UNKNOWN_1);
+  gabble_capability_set_add (caps, NS_IBB);
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 2);
+  g_assert (gabble_capability_set_has (caps, NS_IBB));
+  g_assert (gabble_capability_set_has (caps, NS_UNKNOWN_1));
+  g_assert (!gabble_capability_set_has (caps, NS_UNKNOWN_2));
+
+  g_assert (gabble_capability_set_remove (caps, NS_IBB));
+  g_assert (!gabble_capability_set_remove (caps, NS_IBB));
+  g_assert (gabble_capability_set_remove (caps, NS_UNKNOWN_1));
+  g_assert (!gabble_capability_set_remove (caps, NS_UNKNOWN_2));
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 0);
+
+  gabble_capability_set_add (caps, QUIRK_OMITS_CONTENT_CREATORS);
+  g_assert (gabble_capability_set_has (caps, QUIRK_OMITS_CONTENT_CREATORS));
+  gabble_capability_set_clear (caps);
+  g_assert (!gabble_capability_set_has (caps, QUIRK_OMITS_CONTENT_CREATORS));
+
+  gabble_capability_set_free (caps);
+}
+
+static void
+test_set_operations (void)
+{
+  GabbleCapabilitySet *a = make_set (NS_IBB, NS_SI, NS_UNKNOWN_1, NULL);
+  GabbleCapabilitySet *b = make_set (NS_SI, NS_TUBES, NS_UNKNOWN_1,
+      NS_UNKNOWN_2, NULL);
+  GabbleCapabilitySet *tmp, *expected;
+
+  tmp = gabble_capability_set_copy (a);
+  g_assert (gabble_capability_set_equals (tmp, a));
+  gabble_capability_set_update (tmp, b);
+  expected = make_set (NS_IBB, NS_SI, NS_TUBES, NS_UNKNOWN_1, NS_UNKNOWN_2,
+      NULL);
+  g_assert (gabble_capability_set_equals (tmp, expected));
+  g_assert (gabble_capability_set_at_least (tmp, a));
+  g_assert (gabble_capability_set_at_least (tmp, b));
+  g_assert (!gabble_capability_set_at_least (a, tmp));
+  gabble_capability_set_free (expected);
+  gabble_capability_set_free (tmp);
+
+  tmp = gabble_capability_set_copy (a);
+  gabble_capability_set_intersect (tmp, b);
+  expected = make_set (NS_SI, NS_UNKNOWN_1, NULL);
+  g_assert (gabble_capability_set_equals (tmp, expected));
+  gabble_capability_set_free (expected);
+  gabble_capability_set_free (tmp);
+
+  tmp = gabble_capability_set_copy (a);
+  gabble_capability_set_exclude (tmp, b);
+  expected = make_set (NS_IBB, NULL);
+  g_assert (gabble_capability_set_equals (tmp, expected));
+  g_assert (gabble_capability_set_has_one (a, tmp));
+  g_assert (!gabble_capability_set_has_one (b, tmp));
+  gabble_capability_set_free (expected);
+  gabble_capability_set_free (tmp);
+
+  gabble_capability_set_free (a);
+  gabble_capability_set_free (b);
+}
+
+static void
+test_equals_and_hash (void)
+{
+  GabbleCapabilitySet *a = make_set (NS_UNKNOWN_2, NS_IBB, NS_UNKNOWN_1,
+      NULL);
+  GabbleCapabilitySet *b = make_set (NS_UNKNOWN_1, NS_IBB, NS_UNKNOWN_2,
+      NULL);
+  GabbleCapabilitySet *empty = gabble_capability_set_new ();
+
+  g_assert (gabble_capability_set_equals (a, b));
+  g_assert_cmpuint (gabble_capability_set_hash (a), ==,
+      gabble_capability_set_hash (b));
+
+  /* A set which used to have unknown features but doesn't any more is equal
+   * to one which never did. */
+  gabble_capability_set_remove (a, NS_UNKNOWN_1);
+  gabble_capability_set_remove (a, NS_UNKNOWN_2);
+  gabble_capability_set_remove (a, NS_IBB);
+  g_assert (gabble_capability_set_equals (a, empty));
+  g_assert_cmpuint (gabble_capability_set_hash (a), ==,
+      gabble_capability_set_hash (empty));
+
+  g_assert (!gabble_capability_set_equals (b, empty));
+
+  gabble_capability_set_free (a);
+  gabble_capability_set_free (b);
+  gabble_capability_set_free (empty);
+}
+
+static void
+count_features (gpointer feature,
+    gpointer user_data)
+{
+  guint *n = user_data;
+
+  (*n)++;
+}
+
+static void
+test_foreach_skips_quirks (void)
+{
+  GabbleCapabilitySet *caps = make_set (NS_IBB, NS_UNKNOWN_1,
+      QUIRK_OMITS_CONTENT_CREATORS, NULL);
+  guint n = 0;
+
+  gabble_capability_set_foreach (caps, count_features, &n);
+  g_assert_cmpuint (n, ==, 2);
+
+  gabble_capability_set_free (caps);
+}
+
+int main (int argc, char **argv)
+{
+  int ret;
+
+  g_type_init ();
+  gabble_capabilities_init (NULL);
+  gabble_debug_set_flags_from_env ();
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/capabilities/add-remove", test_add_remove);
+  g_test_add_func ("/capabilities/set-operations", test_set_operations);
+  g_test_add_func ("/capabilities/equals-and-hash", test_equals_and_hash);
+  g_test_add_func ("/capabilities/foreach-skips-quirks",
+      test_foreach_skips_quirks);
+
+  ret = g_test_run ();
+
+  gabble_capabilities_finalize (NULL);
+  gabble_debug_free ();
+
+  return ret;
+}
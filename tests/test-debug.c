@@ -0,0 +1,102 @@
+#include "config.h"
+
+#include <glib.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_PRESENCE
+#include "src/debug.h"
+
+/* Enough DEBUG()s to be measurable, as if one were made for each of this
+ * many stanzas */
+#define N_STANZAS 1000000
+
+static guint evaluated = 0;
+
+static const gchar *
+expensive (void)
+{
+  evaluated++;
+  return "something";
+}
+
+static guint logged = 0;
+
+static void
+log_handler (const gchar *log_domain,
+    GLogLevelFlags log_level,
+    const gchar *message,
+    gpointer user_data)
+{
+  logged++;
+}
+
+static void
+test_disabled (void)
+{
+  evaluated = 0;
+  logged = 0;
+
+  DEBUG ("%s", expensive ());
+  NODE_DEBUG (NULL, "never serialized");
+
+  g_assert_cmpuint (evaluated, ==, 0);
+  g_assert_cmpuint (logged, ==, 0);
+  g_assert (!DEBUGGING);
+}
+
+static void
+test_disabled_perf (void)
+{
+  guint i;
+  gdouble elapsed;
+
+  if (!g_test_perf ())
+    return;
+
+  g_test_timer_start ();
+
+  for (i = 0; i < N_STANZAS; i++)
+    DEBUG ("received stanza %u from %s", i, "someone@example.com/foo");
+
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed * 1e9 / N_STANZAS,
+      "%.2f ns per disabled DEBUG ()", elapsed * 1e9 / N_STANZAS);
+}
+
+static void
+test_enabled (void)
+{
+  evaluated = 0;
+  logged = 0;
+
+  gabble_debug_set_flags (GABBLE_DEBUG_PRESENCE);
+  g_assert (DEBUGGING);
+
+  DEBUG ("%s", expensive ());
+
+  g_assert_cmpuint (evaluated, ==, 1);
+  g_assert_cmpuint (logged, ==, 1);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  int ret;
+
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  /* Gabble's own log domain, rather than this test's */
+  g_log_set_handler ("gabble", G_LOG_LEVEL_DEBUG, log_handler, NULL);
+
+  /* the flags can only be turned on, so the disabled cases go first */
+  g_test_add_func ("/debug/disabled", test_disabled);
+  g_test_add_func ("/debug/disabled-perf", test_disabled_perf);
+  g_test_add_func ("/debug/enabled", test_enabled);
+
+  ret = g_test_run ();
+
+  gabble_debug_free ();
+
+  return ret;
+}
@@ -0,0 +1,410 @@
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "src/tube-dbus.h"
+
+static void
+append_be32 (GString *s,
+    guint32 x)
+{
+  g_string_append_c (s, (x >> 24) & 0xff);
+  g_string_append_c (s, (x >> 16) & 0xff);
+  g_string_append_c (s, (x >> 8) & 0xff);
+  g_string_append_c (s, x & 0xff);
+}
+
+static void
+append_le32 (GString *s,
+    guint32 x)
+{
+  g_string_append_c (s, x & 0xff);
+  g_string_append_c (s, (x >> 8) & 0xff);
+  g_string_append_c (s, (x >> 16) & 0xff);
+  g_string_append_c (s, (x >> 24) & 0xff);
+}
+
+/* Appends a message to @s whose header says it has @fields_len bytes of
+ * header fields and a @body_len-byte body, all filled with @fill, and
+ * returns its total length. The content isn't valid D-Bus, but the
+ * reassembler only looks at the fixed header. */
+static gsize
+append_message (GString *s,
+    gchar endianness,
+    guint32 fields_len,
+    guint32 body_len,
+    gchar fill)
+{
+  void (*append32) (GString *, guint32) =
+      endianness == 'B' ? append_be32 : append_le32;
+  gsize start = s->len;
+  gsize padded = fields_len + ((8 - (fields_len % 8)) % 8);
+  gsize i;
+
+  g_string_append_c (s, endianness);
+  /* method call, no flags, protocol version 1 */
+  g_string_append_c (s, 1);
+  g_string_append_c (s, 0);
+  g_string_append_c (s, 1);
+  append32 (s, body_len);
+  /* serial */
+  append32 (s, 1);
+  append32 (s, fields_len);
+
+  for (i = 0; i < padded + body_len; i++)
+    g_string_append_c (s, fill);
+
+  return s->len - start;
+}
+
+typedef struct {
+  GPtrArray *messages;
+  /* simulates the queue of a tube which nobody has connected to yet */
+  gboolean in_room;
+  gsize queue_size;
+  gboolean reading_blocked;
+  guint times_blocked;
+  guint dropped;
+} Receiver;
+
+static void
+receiver_init (Receiver *r,
+    gboolean in_room)
+{
+  memset (r, 0, sizeof (*r));
+  r->messages = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) g_bytes_unref);
+  r->in_room = in_room;
+}
+
+static void
+receiver_clear (Receiver *r)
+{
+  g_ptr_array_unref (r->messages);
+}
+
+static void
+message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  Receiver *r = user_data;
+  GabbleTubeDBusQueueAction action;
+
+  action = _gabble_tube_dbus_queue_action (r->in_room, r->queue_size, len,
+      r->reading_blocked);
+
+  if (action == GABBLE_TUBE_DBUS_QUEUE_DROP)
+    {
+      r->dropped++;
+      return;
+    }
+
+  g_ptr_array_add (r->messages, g_bytes_new (data, len));
+  r->queue_size += len;
+
+  if (action == GABBLE_TUBE_DBUS_QUEUE_KEEP_AND_BLOCK)
+    {
+      g_assert (!r->reading_blocked);
+      r->reading_blocked = TRUE;
+      r->times_blocked++;
+    }
+}
+
+static void
+assert_message (Receiver *r,
+    guint i,
+    const gchar *expected,
+    gsize len)
+{
+  GBytes *bytes;
+
+  g_assert_cmpuint (i, <, r->messages->len);
+  bytes = g_ptr_array_index (r->messages, i);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, len);
+  g_assert (memcmp (g_bytes_get_data (bytes, NULL), expected, len) == 0);
+}
+
+static void
+test_length (void)
+{
+  GString *s = g_string_new ("");
+  guint32 length;
+  gsize expected;
+
+  /* the header fields are padded to 8 bytes before the body */
+  expected = append_message (s, 'l', 13, 5, 'x');
+  g_assert_cmpuint (expected, ==, 16 + 16 + 5);
+  g_assert (_gabble_tube_dbus_message_length (s->str, &length));
+  g_assert_cmpuint (length, ==, expected);
+
+  /* a big-endian length has its most significant byte first */
+  g_string_truncate (s, 0);
+  expected = append_message (s, 'B', 0x0108, 0x020304, 'x');
+  g_assert_cmpuint (expected, ==, 16 + 0x0108 + 0x020304);
+  g_assert (_gabble_tube_dbus_message_length (s->str, &length));
+  g_assert_cmpuint (length, ==, expected);
+
+  /* the same header read with the other endianness would be huge */
+  s->str[0] = 'l';
+  g_assert (!_gabble_tube_dbus_message_length (s->str, &length));
+
+  /* nor is anything but 'l' and 'B' an endianness */
+  s->str[0] = 'x';
+  g_assert (!_gabble_tube_dbus_message_length (s->str, &length));
+
+  /* a header claiming a body longer than any message is rejected */
+  g_string_truncate (s, 0);
+  g_string_append_len (s, "B\1\0\1" "\xff\xff\xff\xff" "\0\0\0\1" "\0\0\0\0",
+      16);
+  g_assert (!_gabble_tube_dbus_message_length (s->str, &length));
+
+  g_string_free (s, TRUE);
+}
+
+static void
+test_whole (void)
+{
+  GString *stream = g_string_new ("");
+  GString *buffer = g_string_new ("");
+  guint32 needed = 0;
+  gsize len1, len2, len3;
+  Receiver r;
+
+  receiver_init (&r, FALSE);
+
+  len1 = append_message (stream, 'l', 3, 4, 'a');
+  len2 = append_message (stream, 'B', 8, 0, 'b');
+  len3 = append_message (stream, 'l', 0, 100, 'c');
+
+  g_assert (_gabble_tube_dbus_reassemble (buffer, &needed, stream->str,
+        stream->len, message_cb, &r));
+
+  /* every message came straight out of the data, leaving nothing behind */
+  g_assert_cmpuint (r.messages->len, ==, 3);
+  assert_message (&r, 0, stream->str, len1);
+  assert_message (&r, 1, stream->str + len1, len2);
+  assert_message (&r, 2, stream->str + len1 + len2, len3);
+  g_assert_cmpuint (buffer->len, ==, 0);
+  g_assert_cmpuint (needed, ==, 0);
+
+  receiver_clear (&r);
+  g_string_free (buffer, TRUE);
+  g_string_free (stream, TRUE);
+}
+
+static void
+test_split (void)
+{
+  GString *stream = g_string_new ("");
+  gsize len1, len2, split, second;
+
+  len1 = append_message (stream, 'B', 5, 7, 'a');
+  len2 = append_message (stream, 'l', 16, 3, 'b');
+
+  /* split the two messages into three reads at every possible pair of
+   * points, including inside the fixed headers */
+  for (split = 0; split <= stream->len; split++)
+    {
+      for (second = split; second <= stream->len; second++)
+        {
+          GString *buffer = g_string_new ("");
+          guint32 needed = 0;
+          Receiver r;
+
+          receiver_init (&r, FALSE);
+
+          g_assert (_gabble_tube_dbus_reassemble (buffer, &needed,
+                stream->str, split, message_cb, &r));
+          g_assert (_gabble_tube_dbus_reassemble (buffer, &needed,
+                stream->str + split, second - split, message_cb, &r));
+          g_assert (_gabble_tube_dbus_reassemble (buffer, &needed,
+                stream->str + second, stream->len - second, message_cb, &r));
+
+          g_assert_cmpuint (r.messages->len, ==, 2);
+          assert_message (&r, 0, stream->str, len1);
+          assert_message (&r, 1, stream->str + len1, len2);
+          g_assert_cmpuint (buffer->len, ==, 0);
+          g_assert_cmpuint (needed, ==, 0);
+
+          receiver_clear (&r);
+          g_string_free (buffer, TRUE);
+        }
+    }
+
+  g_string_free (stream, TRUE);
+}
+
+static void
+test_byte_at_a_time (void)
+{
+  GString *stream = g_string_new ("");
+  GString *buffer = g_string_new ("");
+  guint32 needed = 0;
+  gsize len1, len2, i;
+  Receiver r;
+
+  receiver_init (&r, FALSE);
+
+  len1 = append_message (stream, 'B', 0x0100, 0x0203, 'a');
+  len2 = append_message (stream, 'B', 1, 0, 'b');
+
+  for (i = 0; i < stream->len; i++)
+    {
+      g_assert (_gabble_tube_dbus_reassemble (buffer, &needed,
+            stream->str + i, 1, message_cb, &r));
+
+      /* only the message we're part-way through is ever buffered */
+      if (i < len1)
+        g_assert_cmpuint (buffer->len, ==, (i + 1) % len1);
+      else
+        g_assert_cmpuint (buffer->len, ==, (i + 1 - len1) % len2);
+    }
+
+  g_assert_cmpuint (r.messages->len, ==, 2);
+  assert_message (&r, 0, stream->str, len1);
+  assert_message (&r, 1, stream->str + len1, len2);
+
+  receiver_clear (&r);
+  g_string_free (buffer, TRUE);
+  g_string_free (stream, TRUE);
+}
+
+static void
+test_invalid (void)
+{
+  GString *stream = g_string_new ("");
+  GString *buffer = g_string_new ("");
+  guint32 needed = 0;
+  gsize len1;
+  Receiver r;
+
+  receiver_init (&r, FALSE);
+
+  len1 = append_message (stream, 'l', 0, 8, 'a');
+  append_message (stream, 'l', 0, 8, 'b');
+  stream->str[len1] = '?';
+
+  /* the message before the garbage is still delivered */
+  g_assert (!_gabble_tube_dbus_reassemble (buffer, &needed, stream->str,
+        stream->len, message_cb, &r));
+  g_assert_cmpuint (r.messages->len, ==, 1);
+  assert_message (&r, 0, stream->str, len1);
+
+  receiver_clear (&r);
+  g_string_free (buffer, TRUE);
+  g_string_free (stream, TRUE);
+}
+
+static void
+test_queue_action (void)
+{
+  gsize max = GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE;
+
+  /* a room drops whatever doesn't fit */
+  g_assert_cmpuint (_gabble_tube_dbus_queue_action (TRUE, 0, 100, FALSE),
+      ==, GABBLE_TUBE_DBUS_QUEUE_KEEP);
+  g_assert_cmpuint (_gabble_tube_dbus_queue_action (TRUE, max - 100, 100,
+        FALSE), ==, GABBLE_TUBE_DBUS_QUEUE_KEEP);
+  g_assert_cmpuint (_gabble_tube_dbus_queue_action (TRUE, max - 100, 101,
+        FALSE), ==, GABBLE_TUBE_DBUS_QUEUE_DROP);
+
+  /* a 1-1 tube keeps everything, and stops reading once it's full */
+  g_assert_cmpuint (_gabble_tube_dbus_queue_action (FALSE, 0, 100, FALSE),
+      ==, GABBLE_TUBE_DBUS_QUEUE_KEEP);
+  g_assert_cmpuint (_gabble_tube_dbus_queue_action (FALSE, max - 100, 99,
+        FALSE), ==, GABBLE_TUBE_DBUS_QUEUE_KEEP);
+  g_assert_cmpuint (_gabble_tube_dbus_queue_action (FALSE, max - 100, 100,
+        FALSE), ==, GABBLE_TUBE_DBUS_QUEUE_KEEP_AND_BLOCK);
+  g_assert_cmpuint (_gabble_tube_dbus_queue_action (FALSE, max, 100,
+        FALSE), ==, GABBLE_TUBE_DBUS_QUEUE_KEEP_AND_BLOCK);
+
+  /* ... but only asks for that once */
+  g_assert_cmpuint (_gabble_tube_dbus_queue_action (FALSE, max, 100,
+        TRUE), ==, GABBLE_TUBE_DBUS_QUEUE_KEEP);
+}
+
+static void
+test_blocked (void)
+{
+  GString *stream = g_string_new ("");
+  /* three of these don't fit in the queue, but two do */
+  guint32 body = GABBLE_TUBE_DBUS_MAX_QUEUE_SIZE * 2 / 5;
+  gsize len;
+  guint i;
+
+  len = append_message (stream, 'B', 0, body, 'a');
+  append_message (stream, 'B', 0, body, 'b');
+  append_message (stream, 'B', 0, body, 'c');
+  append_message (stream, 'B', 0, 16, 'd');
+
+  for (i = 0; i < 2; i++)
+    {
+      gboolean in_room = (i == 1);
+      GString *buffer = g_string_new ("");
+      guint32 needed = 0;
+      Receiver r;
+
+      receiver_init (&r, in_room);
+
+      /* the whole burst arrives in one read, split inside the third
+       * message, so the 1-1 tube fills its queue part-way through */
+      g_assert (_gabble_tube_dbus_reassemble (buffer, &needed, stream->str,
+            2 * len + 100, message_cb, &r));
+      g_assert_cmpuint (r.messages->len, ==, 2);
+      g_assert_cmpuint (r.times_blocked, ==, 0);
+
+      g_assert (_gabble_tube_dbus_reassemble (buffer, &needed,
+            stream->str + 2 * len + 100, stream->len - 2 * len - 100,
+            message_cb, &r));
+
+      if (in_room)
+        {
+          /* the room dropped the third message, but had room for the
+           * small one after it */
+          g_assert_cmpuint (r.dropped, ==, 1);
+          g_assert_cmpuint (r.messages->len, ==, 3);
+          assert_message (&r, 2, stream->str + 3 * len, 16 + 16);
+          g_assert_cmpuint (r.times_blocked, ==, 0);
+        }
+      else
+        {
+          /* the 1-1 tube asked to stop reading when the third message
+           * filled the queue, but still kept the message after it, which
+           * was already on its way */
+          g_assert_cmpuint (r.dropped, ==, 0);
+          g_assert_cmpuint (r.messages->len, ==, 4);
+          assert_message (&r, 2, stream->str + 2 * len, len);
+          assert_message (&r, 3, stream->str + 3 * len, 16 + 16);
+          g_assert_cmpuint (r.times_blocked, ==, 1);
+          g_assert (r.reading_blocked);
+        }
+
+      g_assert_cmpuint (buffer->len, ==, 0);
+
+      receiver_clear (&r);
+      g_string_free (buffer, TRUE);
+    }
+
+  g_string_free (stream, TRUE);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/dtube-reassembly/length", test_length);
+  g_test_add_func ("/dtube-reassembly/whole", test_whole);
+  g_test_add_func ("/dtube-reassembly/split", test_split);
+  g_test_add_func ("/dtube-reassembly/byte-at-a-time", test_byte_at_a_time);
+  g_test_add_func ("/dtube-reassembly/invalid", test_invalid);
+  g_test_add_func ("/dtube-reassembly/queue-action", test_queue_action);
+  g_test_add_func ("/dtube-reassembly/blocked", test_blocked);
+
+  return g_test_run ();
+}
@@ -0,0 +1,153 @@
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+#include <gibber/gibber-fd-relay.h>
+#include <gibber/gibber-unix-transport.h>
+
+/* Several times the smallest read buffer, so the transport has more to read
+ * after its first data-received */
+#define DATA_SIZE (64 * 1024)
+
+typedef struct {
+  GibberTransport *a;
+  GibberTransport *b;
+  GibberFdRelay *relay;
+  gboolean no_splice;
+  guint received_after_relay;
+} Test;
+
+static void
+a_received_cb (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  Test *test = user_data;
+  GError *error = NULL;
+
+  if (test->relay != NULL)
+    {
+      test->received_after_relay++;
+      return;
+    }
+
+  /* Forward what we've got, then splice the rest, as tubes do once the
+   * SOCKS5 bytestream opens */
+  g_assert (gibber_transport_send (test->b, buffer->data, buffer->length,
+        &error));
+  g_assert_no_error (error);
+
+  test->relay = gibber_fd_relay_new (GIBBER_FD_TRANSPORT (test->a),
+      GIBBER_FD_TRANSPORT (test->b), NULL, NULL, &error);
+
+  if (test->relay == NULL)
+    {
+      test->no_splice = TRUE;
+      g_clear_error (&error);
+    }
+}
+
+static GibberTransport *
+transport_new (int fd)
+{
+  GibberTransport *transport = GIBBER_TRANSPORT (gibber_unix_transport_new ());
+
+  gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (transport), fd, TRUE);
+  gibber_transport_set_state (transport, GIBBER_TRANSPORT_CONNECTED);
+  return transport;
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  gboolean *timed_out = user_data;
+
+  *timed_out = TRUE;
+  return FALSE;
+}
+
+static void
+test_relay_from_handler (void)
+{
+  Test test = { NULL, NULL, NULL, FALSE, 0 };
+  int in_pair[2], out_pair[2];
+  guint8 *data = g_malloc (DATA_SIZE);
+  guint8 *out = g_malloc (DATA_SIZE + 1);
+  gsize received = 0;
+  gboolean timed_out = FALSE;
+  guint timeout_id;
+  guint i;
+
+  for (i = 0; i < DATA_SIZE; i++)
+    data[i] = i % 251;
+
+  g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, in_pair) == 0);
+  g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, out_pair) == 0);
+
+  test.a = transport_new (in_pair[1]);
+  test.b = transport_new (out_pair[0]);
+  gibber_transport_set_handler (test.a, a_received_cb, &test);
+
+  /* All of it is waiting by the time the transport first reads */
+  g_assert_cmpint (write (in_pair[0], data, DATA_SIZE), ==, DATA_SIZE);
+
+  timeout_id = g_timeout_add_seconds (10, timeout_cb, &timed_out);
+
+  while (received < DATA_SIZE && !test.no_splice && !timed_out)
+    {
+      ssize_t n;
+
+      g_main_context_iteration (NULL, TRUE);
+
+      n = recv (out_pair[1], out + received, DATA_SIZE + 1 - received,
+          MSG_DONTWAIT);
+
+      if (n > 0)
+        received += n;
+      else
+        g_assert (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+  if (!test.no_splice)
+    {
+      g_assert (!timed_out);
+      g_source_remove (timeout_id);
+
+      /* The transport stopped reading as soon as the relay took over, so
+       * every byte arrived exactly once and in order */
+      g_assert_cmpuint (test.received_after_relay, ==, 0);
+      g_assert_cmpuint (received, ==, DATA_SIZE);
+      g_assert (memcmp (data, out, DATA_SIZE) == 0);
+
+      gibber_fd_relay_free (test.relay);
+    }
+  else
+    {
+      g_source_remove (timeout_id);
+    }
+
+  g_object_unref (test.a);
+  g_object_unref (test.b);
+  close (in_pair[0]);
+  close (out_pair[1]);
+  g_free (data);
+  g_free (out);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/fd-relay/relay-from-handler", test_relay_from_handler);
+
+  return g_test_run ();
+}
@@ -0,0 +1,164 @@
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+#include <gibber/gibber-unix-transport.h>
+
+/* Far more than a socket buffer holds, so most of it has to be queued */
+#define BACKLOG_SIZE (4 * 1024 * 1024)
+
+/* Several times the smallest read buffer, so one wakeup has more than one
+ * read's worth waiting */
+#define READ_SIZE (64 * 1024)
+
+/* Sizes to send it in: smaller than, around and bigger than a queue chunk */
+static const gsize sizes[] = { 1, 100, 4096, 16383, 16384, 16385, 70000 };
+
+static GibberTransport *
+transport_new (int fd)
+{
+  GibberTransport *transport = GIBBER_TRANSPORT (gibber_unix_transport_new ());
+
+  gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (transport), fd, TRUE);
+  gibber_transport_set_state (transport, GIBBER_TRANSPORT_CONNECTED);
+  return transport;
+}
+
+static void
+buffer_empty_cb (GibberTransport *transport,
+    gpointer user_data)
+{
+  gboolean *empty = user_data;
+
+  *empty = TRUE;
+}
+
+static void
+test_output_queue (void)
+{
+  GibberTransport *transport;
+  int pair[2];
+  guint8 *data = g_malloc (BACKLOG_SIZE);
+  guint8 *out = g_malloc (BACKLOG_SIZE + 1);
+  gsize sent = 0, received = 0;
+  gboolean empty = FALSE;
+  GError *error = NULL;
+  guint i;
+
+  for (i = 0; i < BACKLOG_SIZE; i++)
+    data[i] = i % 251;
+
+  g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  transport = transport_new (pair[0]);
+  g_signal_connect (transport, "buffer-empty", G_CALLBACK (buffer_empty_cb),
+      &empty);
+
+  /* Send it in pieces of all sizes, some bigger than a chunk, without the
+   * other end reading any of it yet */
+  for (i = 0; sent < BACKLOG_SIZE; i++)
+    {
+      gsize len = MIN (sizes[i % G_N_ELEMENTS (sizes)], BACKLOG_SIZE - sent);
+
+      g_assert (gibber_transport_send (transport, data + sent, len, &error));
+      g_assert_no_error (error);
+      sent += len;
+    }
+
+  /* The first few went straight into the socket, but the rest are queued */
+  g_assert (!gibber_transport_buffer_is_empty (transport));
+  empty = FALSE;
+
+  while (!empty || received < BACKLOG_SIZE)
+    {
+      ssize_t n;
+
+      g_main_context_iteration (NULL, FALSE);
+
+      n = recv (pair[1], out + received, BACKLOG_SIZE + 1 - received,
+          MSG_DONTWAIT);
+
+      if (n > 0)
+        received += n;
+      else
+        g_assert (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+  /* Everything arrived once and in order */
+  g_assert_cmpuint (received, ==, BACKLOG_SIZE);
+  g_assert (memcmp (data, out, BACKLOG_SIZE) == 0);
+  g_assert (gibber_transport_buffer_is_empty (transport));
+
+  g_object_unref (transport);
+  close (pair[1]);
+  g_free (data);
+  g_free (out);
+}
+
+static void
+received_cb (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  gsize *received = user_data;
+
+  *received += buffer->length;
+}
+
+static void
+test_read_stats (void)
+{
+  GibberTransport *transport;
+  GibberFdTransportReadStats stats;
+  int pair[2];
+  guint8 *data = g_malloc0 (READ_SIZE);
+  gsize received = 0;
+
+  g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  transport = transport_new (pair[0]);
+  gibber_transport_set_handler (transport, received_cb, &received);
+
+  gibber_fd_transport_get_read_stats (GIBBER_FD_TRANSPORT (transport),
+      &stats);
+  g_assert_cmpuint (stats.wakeups, ==, 0);
+  g_assert_cmpuint (stats.reads, ==, 0);
+  g_assert_cmpuint (stats.bytes, ==, 0);
+
+  /* All of it is waiting by the time the transport first reads */
+  g_assert_cmpint (write (pair[1], data, READ_SIZE), ==, READ_SIZE);
+
+  while (received < READ_SIZE)
+    g_main_context_iteration (NULL, TRUE);
+
+  gibber_fd_transport_get_read_stats (GIBBER_FD_TRANSPORT (transport),
+      &stats);
+  g_assert_cmpuint (stats.bytes, ==, READ_SIZE);
+  g_assert_cmpuint (stats.wakeups, >=, 1);
+  g_assert_cmpuint (stats.reads, >=, stats.wakeups);
+
+  /* Reads were batched: each wakeup took more than one minimum-sized
+   * buffer's worth */
+  g_assert_cmpuint (stats.bytes / stats.wakeups, >, 4096);
+
+  g_object_unref (transport);
+  close (pair[1]);
+  g_free (data);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/fd-transport/output-queue", test_output_queue);
+  g_test_add_func ("/fd-transport/read-stats", test_read_stats);
+
+  return g_test_run ();
+}
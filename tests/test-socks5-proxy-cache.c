@@ -0,0 +1,182 @@
+#include "config.h"
+
+#include <glib.h>
+
+#include "src/socks5-proxy-cache.h"
+
+#define MB (1024 * 1024)
+
+static GabbleSocks5ProxyCache *
+cache_new (void)
+{
+  GabbleSocks5ProxyCache *cache;
+
+  g_setenv ("GABBLE_SOCKS5_PROXY_CACHE", ":memory:", TRUE);
+  cache = gabble_socks5_proxy_cache_new ("test@example.com");
+
+  gabble_socks5_proxy_cache_add (cache, "a.example.com", "10.0.0.1", 7777,
+      FALSE);
+  gabble_socks5_proxy_cache_add (cache, "b.example.com", "10.0.0.2", 7777,
+      FALSE);
+  return cache;
+}
+
+static const gchar *
+nth_usable (GabbleSocks5ProxyCache *cache,
+    guint n)
+{
+  GList *usable = gabble_socks5_proxy_cache_get_usable (cache);
+  GabbleSocks5ProxyRecord *record = g_list_nth_data (usable, n);
+
+  g_list_free (usable);
+  return record == NULL ? NULL : record->jid;
+}
+
+static void
+test_throughput_ranking (void)
+{
+  GabbleSocks5ProxyCache *cache = cache_new ();
+  guint i;
+
+  gabble_socks5_proxy_cache_record_transfer (cache, "a.example.com",
+      4 * MB, G_TIME_SPAN_SECOND);
+  gabble_socks5_proxy_cache_record_transfer (cache, "b.example.com",
+      1 * MB, G_TIME_SPAN_SECOND);
+
+  g_assert_cmpstr (nth_usable (cache, 0), ==, "a.example.com");
+  g_assert_cmpstr (nth_usable (cache, 1), ==, "b.example.com");
+  g_assert_cmpint (
+      gabble_socks5_proxy_cache_get_cost (cache, "a.example.com"), <,
+      gabble_socks5_proxy_cache_get_cost (cache, "b.example.com"));
+
+  /* Transfers too small to tell anything don't change the order */
+  for (i = 0; i < 10; i++)
+    gabble_socks5_proxy_cache_record_transfer (cache, "a.example.com",
+        1024, G_TIME_SPAN_SECOND);
+
+  g_assert_cmpstr (nth_usable (cache, 0), ==, "a.example.com");
+
+  /* but if a slows right down, it's soon overtaken */
+  for (i = 0; i < 10; i++)
+    gabble_socks5_proxy_cache_record_transfer (cache, "a.example.com",
+        MB / 8, G_TIME_SPAN_SECOND);
+
+  g_assert_cmpstr (nth_usable (cache, 0), ==, "b.example.com");
+  g_assert_cmpstr (nth_usable (cache, 1), ==, "a.example.com");
+
+  gabble_socks5_proxy_cache_free (cache);
+}
+
+static void
+test_failures (void)
+{
+  GabbleSocks5ProxyCache *cache = cache_new ();
+  guint i;
+
+  gabble_socks5_proxy_cache_record_connect (cache, "a.example.com", TRUE,
+      10 * G_TIME_SPAN_MILLISECOND);
+  gabble_socks5_proxy_cache_record_connect (cache, "b.example.com", TRUE,
+      10 * G_TIME_SPAN_MILLISECOND);
+  gabble_socks5_proxy_cache_record_connect (cache, "a.example.com", FALSE,
+      0);
+  g_assert_cmpstr (nth_usable (cache, 0), ==, "b.example.com");
+
+  /* a proxy which keeps failing isn't offered at all */
+  for (i = 0; i < 2; i++)
+    gabble_socks5_proxy_cache_record_connect (cache, "a.example.com", FALSE,
+        0);
+
+  g_assert_cmpstr (nth_usable (cache, 0), ==, "b.example.com");
+  g_assert_cmpstr (nth_usable (cache, 1), ==, NULL);
+
+  /* until it works again */
+  gabble_socks5_proxy_cache_record_connect (cache, "a.example.com", TRUE,
+      5 * G_TIME_SPAN_MILLISECOND);
+  g_assert_cmpstr (nth_usable (cache, 0), ==, "a.example.com");
+
+  gabble_socks5_proxy_cache_free (cache);
+}
+
+static void
+test_fresh (void)
+{
+  GabbleSocks5ProxyCache *cache = cache_new ();
+  const GabbleSocks5ProxyRecord *record;
+
+  /* We've just heard from both, so needn't ask them again */
+  g_assert (gabble_socks5_proxy_cache_is_fresh (cache, "a.example.com"));
+  g_assert (gabble_socks5_proxy_cache_is_fresh (cache, "b.example.com"));
+  g_assert (!gabble_socks5_proxy_cache_is_fresh (cache, "c.example.com"));
+  g_assert (gabble_socks5_proxy_cache_lookup (cache, "c.example.com") ==
+      NULL);
+
+  /* but once one fails, we do */
+  gabble_socks5_proxy_cache_record_connect (cache, "a.example.com", FALSE,
+      0);
+  g_assert (!gabble_socks5_proxy_cache_is_fresh (cache, "a.example.com"));
+
+  /* and getting through to it shows it's still there */
+  gabble_socks5_proxy_cache_record_connect (cache, "a.example.com", TRUE,
+      20 * G_TIME_SPAN_MILLISECOND);
+  g_assert (gabble_socks5_proxy_cache_is_fresh (cache, "a.example.com"));
+
+  /* which is what streamhosts on it are ranked by */
+  record = gabble_socks5_proxy_cache_lookup (cache, "a.example.com");
+  g_assert (record != NULL);
+  g_assert_cmpint (record->latency, ==, 20 * G_TIME_SPAN_MILLISECOND);
+  g_assert_cmpuint (record->recent_failures, ==, 0);
+
+  gabble_socks5_proxy_cache_free (cache);
+}
+
+static void
+test_meter (void)
+{
+  GabbleSocks5ProxyMeter meter = { 0, 0, 0 };
+  gint64 now = 1000 * G_TIME_SPAN_SECOND;
+  guint i;
+
+  /* The first data only starts the clock */
+  gabble_socks5_proxy_meter_add (&meter, 4096, now);
+  g_assert_cmpuint (meter.bytes, ==, 0);
+
+  /* 1 MiB/s for a second */
+  for (i = 0; i < 16; i++)
+    {
+      now += G_TIME_SPAN_SECOND / 16;
+      gabble_socks5_proxy_meter_add (&meter, MB / 16, now);
+    }
+
+  g_assert_cmpuint (meter.bytes, ==, MB);
+  g_assert_cmpint (meter.duration, ==, G_TIME_SPAN_SECOND);
+
+  /* then nothing for an hour, as a stream tube might, and another burst at
+   * the same speed: the idle hour doesn't count */
+  now += G_TIME_SPAN_HOUR;
+  gabble_socks5_proxy_meter_add (&meter, 4096, now);
+
+  for (i = 0; i < 16; i++)
+    {
+      now += G_TIME_SPAN_SECOND / 16;
+      gabble_socks5_proxy_meter_add (&meter, MB / 16, now);
+    }
+
+  g_assert_cmpuint (meter.bytes, ==, 2 * MB);
+  g_assert_cmpint (meter.duration, ==, 2 * G_TIME_SPAN_SECOND);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/socks5-proxy-cache/throughput-ranking",
+      test_throughput_ranking);
+  g_test_add_func ("/socks5-proxy-cache/failures", test_failures);
+  g_test_add_func ("/socks5-proxy-cache/fresh", test_fresh);
+  g_test_add_func ("/socks5-proxy-cache/meter", test_meter);
+
+  return g_test_run ();
+}
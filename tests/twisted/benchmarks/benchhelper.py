@@ -0,0 +1,162 @@
+"""
+Infrastructure for benchmarking Gabble against the fake server.
+
+A Benchmark measures the CPU time used by the Gabble process, its peak
+resident set size and the number of D-Bus signals the connection emits
+between start() and finish(), and writes them out as one JSON object per
+line: appended to the file named by $GABBLE_BENCHMARK_OUTPUT if it's set,
+or printed on stdout otherwise.
+
+The process figures come from /proc, so they are only available on Linux;
+elsewhere they are reported as null.
+
+Scenarios are sized by GABBLE_BENCHMARK_* environment variables; see
+bench_param().
+"""
+
+import json
+import os
+import time
+
+from twisted.internet import reactor
+
+def bench_param(name, default):
+    """Returns the size GABBLE_BENCHMARK_<name> from the environment, or
+    default if it isn't set."""
+    return int(os.environ.get('GABBLE_BENCHMARK_' + name, default))
+
+def get_pid(bus, bus_name):
+    bus_daemon = bus.get_object('org.freedesktop.DBus',
+        '/org/freedesktop/DBus')
+    return int(bus_daemon.GetConnectionUnixProcessID(bus_name,
+        dbus_interface='org.freedesktop.DBus'))
+
+def get_cpu_time(pid):
+    """Returns the user and system CPU time used by pid, in seconds."""
+    try:
+        stat = open('/proc/%d/stat' % pid).read()
+    except IOError:
+        return None
+
+    # The second field is the command name in brackets, which may contain
+    # spaces; utime and stime are the 14th and 15th fields.
+    fields = stat[stat.rindex(')') + 2:].split()
+    ticks = int(fields[11]) + int(fields[12])
+    return float(ticks) / os.sysconf('SC_CLK_TCK')
+
+def reset_peak_rss(pid):
+    # Linux >= 4.0 resets VmHWM to the current RSS when you write 5 to
+    # clear_refs; on older kernels the peak covers the whole process lifetime
+    try:
+        f = open('/proc/%d/clear_refs' % pid, 'w')
+        f.write('5')
+        f.close()
+    except IOError:
+        pass
+
+def get_peak_rss(pid):
+    """Returns the peak resident set size of pid, in KiB."""
+    try:
+        status = open('/proc/%d/status' % pid)
+    except IOError:
+        return None
+
+    for line in status:
+        if line.startswith('VmHWM:'):
+            return int(line.split()[1])
+
+    return None
+
+class Benchmark(object):
+    def __init__(self, scenario, q, bus, conn, **parameters):
+        self.scenario = scenario
+        self.parameters = parameters
+        self.q = q
+        self.conn_path = conn.object.object_path
+        self.pid = get_pid(bus, conn.object.bus_name)
+
+        self.measuring = False
+        self.signals = {}
+        self.watches = {}
+        self.timings = {}
+
+        # Every D-Bus signal goes through q.append (looked up each time the
+        # test's signal receiver is called), so this sees them all. While
+        # measuring, signals are counted and passed to watches rather than
+        # queued: appending to the event queue is O(n) in its length, which
+        # would make the test harness the bottleneck.
+        real_append = q.append
+
+        def append(event):
+            if event.type != 'dbus-signal' or not self.measuring:
+                real_append(event)
+                return
+
+            if not event.path.startswith(self.conn_path):
+                return
+
+            self.signals[event.signal] = self.signals.get(event.signal, 0) + 1
+
+            for callback in self.watches.get(event.signal, []):
+                callback(event)
+
+        q.append = append
+
+    def watch(self, signal, callback):
+        """Calls callback(event) for each signal called signal emitted while
+        measuring."""
+        self.watches.setdefault(signal, []).append(callback)
+
+    def wait_until(self, condition, timeout=60):
+        """Runs the main loop until condition() returns True."""
+        deadline = time.time() + timeout
+
+        while not condition():
+            if time.time() > deadline:
+                raise AssertionError('%s: timed out after %ds' %
+                    (self.scenario, timeout))
+
+            reactor.iterate(0.01)
+
+    def start(self):
+        reset_peak_rss(self.pid)
+        self.start_cpu_time = get_cpu_time(self.pid)
+        self.start_time = time.time()
+        self.measuring = True
+
+    def mark(self, name):
+        """Records the wall-clock time since start() as name."""
+        self.timings[name] = time.time() - self.start_time
+
+    def finish(self):
+        self.mark('wall_time')
+        self.measuring = False
+
+        cpu_time = get_cpu_time(self.pid)
+
+        if cpu_time is not None and self.start_cpu_time is not None:
+            cpu_time -= self.start_cpu_time
+        else:
+            cpu_time = None
+
+        result = {
+            'scenario': self.scenario,
+            'parameters': self.parameters,
+            'cpu_time': cpu_time,
+            'peak_rss_kb': get_peak_rss(self.pid),
+            'signals': self.signals,
+            'total_signals': sum(self.signals.values()),
+            }
+        result.update(self.timings)
+
+        line = json.dumps(result, sort_keys=True)
+        output = os.environ.get('GABBLE_BENCHMARK_OUTPUT')
+
+        if output:
+            f = open(output, 'a')
+            f.write(line + '\n')
+            f.close()
+        else:
+            print line
+
+        return result
@@ -0,0 +1,95 @@
+"""
+Benchmark receiving a large file over IBB and SOCKS5 bytestreams.
+"""
+
+import errno
+import hashlib
+import os
+import socket
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+    '..', 'file-transfer'))
+
+from gabbletest import exec_test
+from file_transfer_helper import File, ReceiveFileTest
+import bytestream
+import constants as cs
+
+from benchhelper import Benchmark, bench_param
+
+from config import FILE_TRANSFER_ENABLED
+
+if not FILE_TRANSFER_ENABLED:
+    print "NOTE: built with --disable-file-transfer"
+    raise SystemExit(77)
+
+class ReceiveFileBenchmark(ReceiveFileTest):
+    def __init__(self, name, chunk_size, bytestream_cls, file, address_type,
+            access_control, access_control_param):
+        ReceiveFileTest.__init__(self, bytestream_cls, file, address_type,
+            access_control, access_control_param)
+        self.name = name
+        self.chunk_size = chunk_size
+
+    def test(self, q, bus, conn, stream):
+        self.bench = Benchmark('bytestream-' + self.name, q, bus, conn,
+            transfer_size=self.file.size, chunk_size=self.chunk_size)
+        ReceiveFileTest.test(self, q, bus, conn, stream)
+
+    def receive_file(self):
+        s = self.create_socket()
+        s.connect(self.address)
+        s.setblocking(False)
+
+        # accept_file() already sent the first two bytes, which Gabble has
+        # been holding on to until we connected
+        data = self.file.data
+        received = [0]
+        md5 = hashlib.md5()
+
+        def read_available():
+            while True:
+                try:
+                    chunk = s.recv(65536)
+                except socket.error, e:
+                    if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                        return False
+                    raise
+
+                if not chunk:
+                    return True
+
+                received[0] += len(chunk)
+                md5.update(chunk)
+
+        self.bench.start()
+
+        for i in range(2, len(data), self.chunk_size):
+            self.bytestream.send_data(data[i:i + self.chunk_size])
+
+        self.bench.wait_until(
+            lambda: read_available() or received[0] == len(data))
+        self.bench.finish()
+
+        s.close()
+        assert received[0] == len(data), (received[0], len(data))
+        assert md5.hexdigest() == self.file.hash
+
+if __name__ == '__main__':
+    size = bench_param('TRANSFER_SIZE', 4 * 1024 * 1024)
+    file_data = os.urandom(size)
+
+    if os.name == 'posix':
+        address_type = cs.SOCKET_ADDRESS_TYPE_UNIX
+    else:
+        address_type = cs.SOCKET_ADDRESS_TYPE_IPV4
+
+    for name, cls, chunk_size in [
+            ('ibb', bytestream.BytestreamIBBMsg,
+                bench_param('IBB_BLOCK_SIZE', 4096)),
+            ('socks5', bytestream.BytestreamS5B, 65536)]:
+        test = ReceiveFileBenchmark(name, chunk_size, cls,
+            File(data=file_data, name='benchmark.bin'), address_type,
+            cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+        exec_test(test.test)
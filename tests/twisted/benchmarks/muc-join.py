@@ -0,0 +1,36 @@
+"""
+Benchmark joining a MUC which already has lots of occupants.
+"""
+
+from gabbletest import exec_test, make_muc_presence, sync_stream
+from mucutil import try_to_join_muc
+
+from benchhelper import Benchmark, bench_param
+
+MUC = 'benchmark@conf.localhost'
+
+def test(q, bus, conn, stream):
+    occupants = bench_param('MUC_OCCUPANTS', 1000)
+    bench = Benchmark('muc-join', q, bus, conn, occupants=occupants)
+
+    presences = [
+        make_muc_presence('none', 'participant', MUC, 'occupant%d' % i)
+        for i in range(occupants)]
+
+    bench.start()
+    try_to_join_muc(q, bus, conn, stream, MUC)
+
+    for presence in presences:
+        stream.send(presence)
+
+    # our own presence comes last, and completes the join
+    stream.send(make_muc_presence('none', 'participant', MUC, 'test'))
+
+    q.expect('dbus-return', method='CreateChannel')
+    bench.mark('time_to_join')
+
+    sync_stream(q, stream)
+    bench.finish()
+
+if __name__ == '__main__':
+    exec_test(test)
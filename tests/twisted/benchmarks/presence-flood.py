@@ -0,0 +1,61 @@
+"""
+Benchmark a flood of presences from contacts using a handful of different
+clients, each of which Gabble has to discover the capabilities of.
+"""
+
+from gabbletest import exec_test, make_presence, sync_stream
+from caps_helper import compute_caps_hash, send_disco_reply
+import ns
+
+from benchhelper import Benchmark, bench_param
+
+CLIENT = 'http://example.com/benchmark'
+
+def test(q, bus, conn, stream):
+    count = bench_param('PRESENCE_COUNT', 2000)
+    variants = min(bench_param('CAPS_VARIANTS', 20), count)
+    bench = Benchmark('presence-flood', q, bus, conn,
+        presence_count=count, caps_variants=variants)
+
+    identities = ['client/pc/en/Benchmark']
+    features = {}
+
+    for v in range(variants):
+        feats = [ns.DISCO_INFO, ns.MUC, ns.FILE_TRANSFER,
+            '%s/feature%d' % (CLIENT, v)]
+        features[compute_caps_hash(identities, feats, {})] = feats
+
+    vers = features.keys()
+    presences = []
+
+    for i in range(count):
+        caps = { 'node': CLIENT, 'ver': vers[i % variants], 'hash': 'sha-1' }
+        presences.append(make_presence('contact%d@example.com/Res' % i,
+            show='away', status='Contact %d' % i, caps=caps))
+
+    changed = set()
+    bench.watch('PresencesChanged', lambda e: changed.update(e.args[0]))
+
+    bench.start()
+
+    for presence in presences:
+        stream.send(presence)
+
+    discovered = set()
+
+    while len(discovered) < variants:
+        e = q.expect('stream-iq', iq_type='get', query_ns=ns.DISCO_INFO,
+            predicate=lambda e: e.query.getAttribute('node', '').startswith(
+                CLIENT))
+        ver = e.query['node'].split('#', 1)[1]
+        send_disco_reply(stream, e.stanza, identities, features[ver])
+        discovered.add(ver)
+
+    bench.wait_until(lambda: len(changed) >= count)
+    bench.mark('time_to_presences')
+
+    sync_stream(q, stream)
+    bench.finish()
+
+if __name__ == '__main__':
+    exec_test(test)
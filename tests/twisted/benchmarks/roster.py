@@ -0,0 +1,42 @@
+"""
+Benchmark receiving a large roster: the time from the server sending it to
+ContactList.ContactListState becoming Success.
+"""
+
+from gabbletest import exec_test, make_result_iq, sync_stream
+import constants as cs
+import ns
+
+from benchhelper import Benchmark, bench_param
+
+def test(q, bus, conn, stream):
+    size = bench_param('ROSTER_SIZE', 2000)
+    groups = bench_param('ROSTER_GROUPS', 20)
+    bench = Benchmark('roster', q, bus, conn, roster_size=size, groups=groups)
+
+    event = q.expect('stream-iq', query_ns=ns.ROSTER)
+
+    roster = make_result_iq(stream, event.stanza)
+    query = roster.firstChildElement()
+
+    for i in range(size):
+        item = query.addElement('item')
+        item['jid'] = 'contact%d@example.com' % i
+        item['name'] = 'Contact %d' % i
+        item['subscription'] = 'both'
+        item.addElement('group', content='Group %d' % (i % groups))
+
+    states = []
+    bench.watch('ContactListStateChanged',
+        lambda e: states.append(e.args[0]))
+
+    bench.start()
+    stream.send(roster)
+    bench.wait_until(lambda: cs.CONTACT_LIST_STATE_SUCCESS in states)
+    bench.mark('time_to_roster')
+
+    sync_stream(q, stream)
+    bench.finish()
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,55 @@
+"""
+Benchmark refreshing the contact info of lots of contacts at once, each of
+whose vCards has to be fetched from the server.
+"""
+
+import base64
+
+from gabbletest import (exec_test, acknowledge_iq, make_result_iq,
+    sync_stream)
+import ns
+
+from benchhelper import Benchmark, bench_param
+
+def test(q, bus, conn, stream):
+    count = bench_param('VCARD_COUNT', 1000)
+    photo_size = bench_param('VCARD_PHOTO_SIZE', 4096)
+    bench = Benchmark('vcard-storm', q, bus, conn,
+        vcard_count=count, photo_size=photo_size)
+
+    # our own vCard, fetched on connection
+    event = q.expect('stream-iq', to=None, query_ns=ns.VCARD_TEMP,
+        query_name='vCard')
+    acknowledge_iq(stream, event.stanza)
+
+    jids = ['contact%d@example.com' % i for i in range(count)]
+    handles = conn.get_contact_handles_sync(jids)
+    photo = base64.b64encode('\x89PNG' + 'x' * max(photo_size - 4, 0))
+
+    changed = set()
+    bench.watch('ContactInfoChanged', lambda e: changed.add(e.args[0]))
+
+    bench.start()
+    conn.ContactInfo.RefreshContactInfo(handles)
+
+    for i in range(count):
+        event = q.expect('stream-iq', iq_type='get', query_ns=ns.VCARD_TEMP,
+            query_name='vCard')
+
+        result = make_result_iq(stream, event.stanza)
+        vcard = result.firstChildElement()
+        vcard.addElement('FN', content='Contact %s' % event.to)
+        vcard.addElement('NICKNAME', content=event.to.split('@')[0])
+        photo_node = vcard.addElement('PHOTO')
+        photo_node.addElement('TYPE', content='image/png')
+        photo_node.addElement('BINVAL', content=photo)
+        stream.send(result)
+
+    bench.wait_until(lambda: len(changed) >= count)
+    bench.mark('time_to_contact_info')
+
+    sync_stream(q, stream)
+    bench.finish()
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,168 @@
+"""
+Receive files with IBB and SOCKS5 in parallel, losing SOCKS5 before or after
+the switch, and check that what reaches the client is complete and in order
+or else that the transfer fails.
+"""
+
+import errno
+import socket
+import struct
+import time
+
+from twisted.internet import reactor
+from twisted.words.xish import xpath
+
+from gabbletest import exec_test
+from servicetest import assertEquals
+import bytestream
+import constants as cs
+
+from file_transfer_helper import File, ReceiveFileTest
+
+from config import FILE_TRANSFER_ENABLED
+
+if not FILE_TRANSFER_ENABLED:
+    print "NOTE: built with --disable-file-transfer"
+    raise SystemExit(77)
+
+class BytestreamParallel(bytestream.BytestreamSIFallback):
+    """Offers IBB and SOCKS5 in parallel. Data goes in-band until switch() is
+    called, then through SOCKS5 after a header saying how much went
+    in-band."""
+
+    def __init__(self, stream, q, sid, initiator, target, initiated):
+        bytestream.BytestreamSIFallback.__init__(self, stream, q, sid,
+            initiator, target, initiated)
+
+        self.socks5.hosts = [(self.initiator, '127.0.0.1')]
+        self.carrier_sent = 0
+        self.switched = False
+
+    def create_si_offer(self, profile, to=None):
+        iq, si = bytestream.BytestreamSIFallback.create_si_offer(self,
+            profile, to)
+        si_multiple = xpath.queryForNodes('/si/si-multiple', si)[0]
+        si_multiple.addElement('parallel')
+        return iq, si
+
+    def check_si_reply(self, iq):
+        bytestream.BytestreamSIFallback.check_si_reply(self, iq)
+        assert xpath.queryForNodes('/iq/si/si-multiple/parallel', iq), \
+            iq.toXml()
+        self.ibb.checked = True
+
+    def open_bytestream(self, expected_before=[], expected_after=[]):
+        # The transfer starts as soon as IBB is open
+        return self.ibb.open_bytestream(expected_before, expected_after)
+
+    def offer_socks5(self):
+        port = bytestream.listen_socks5(self.q)
+        self.socks5._send_socks5_init(port)
+
+    def open_socks5(self):
+        self.offer_socks5()
+        self.socks5._socks5_expect_connection([], [])
+
+        # Gabble has sent nothing in-band, and says so
+        e = self.q.expect('s5b-data-received',
+            transport=self.socks5.transport)
+        assertEquals('\0' * 8, e.data)
+
+    def switch(self):
+        self.socks5.send_data(struct.pack('>Q', self.carrier_sent))
+        self.switched = True
+
+    def send_data(self, data):
+        if self.switched:
+            self.socks5.send_data(data)
+        else:
+            self.ibb.send_data(data)
+            self.carrier_sent += len(data)
+
+def read_from_socket(s, size, timeout=10):
+    """Reads from s while running the reactor until size bytes or EOF."""
+    s.setblocking(False)
+    data = ''
+    deadline = time.time() + timeout
+
+    while len(data) < size and time.time() < deadline:
+        reactor.iterate(0.01)
+
+        try:
+            chunk = s.recv(65536)
+        except socket.error, e:
+            if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                continue
+            raise
+
+        if not chunk:
+            break
+
+        data += chunk
+
+    return data
+
+class ParallelTest(ReceiveFileTest):
+    def receive_file(self):
+        s = self.create_socket()
+        s.connect(self.address)
+
+        data = self.file.data
+        half = len(data) / 2
+
+        # accept_file() has sent the first two bytes in-band
+        self.bytestream.send_data(data[2:half])
+        self.lose_socks5(s, data, half)
+
+    def expect_completed(self, s, data):
+        received = read_from_socket(s, len(data))
+        assertEquals(len(data), len(received))
+        assert received == data
+
+        self.q.expect('dbus-signal', signal='FileTransferStateChanged',
+            args=[cs.FT_STATE_COMPLETED, cs.FT_STATE_CHANGE_REASON_NONE])
+
+class NoLossTest(ParallelTest):
+    def lose_socks5(self, s, data, half):
+        self.bytestream.open_socks5()
+        self.bytestream.switch()
+        self.bytestream.send_data(data[half:])
+        self.expect_completed(s, data)
+
+class LoseSocks5BeforeSwitchTest(ParallelTest):
+    def lose_socks5(self, s, data, half):
+        # SOCKS5 goes away before it's open, so Gabble carries on in-band
+        self.bytestream.offer_socks5()
+        e = self.q.expect('s5b-connected')
+        e.transport.loseConnection()
+        self.q.expect('stream-iq', iq_type='error', to=self.contact_full_jid)
+
+        self.bytestream.send_data(data[half:])
+        self.expect_completed(s, data)
+
+class LoseSocks5AfterSwitchTest(ParallelTest):
+    def lose_socks5(self, s, data, half):
+        self.bytestream.open_socks5()
+        self.bytestream.switch()
+        self.bytestream.send_data(data[half:half + 100])
+        self.bytestream.socks5.transport.loseConnection()
+
+        # The rest can't be recovered, so the transfer must fail rather
+        # than silently completing with data missing
+        self.q.expect('dbus-signal', signal='FileTransferStateChanged',
+            predicate=lambda e: e.args[0] == cs.FT_STATE_CANCELLED)
+
+        # Whatever did get through is the start of the file
+        received = read_from_socket(s, len(data))
+        assert len(received) < len(data), len(received)
+        assert received == data[:len(received)]
+
+if __name__ == '__main__':
+    file_data = ''.join([chr(i % 251) for i in range(20000)])
+
+    for test_cls in [NoLossTest, LoseSocks5BeforeSwitchTest,
+            LoseSocks5AfterSwitchTest]:
+        test = test_cls(BytestreamParallel,
+            File(data=file_data, name='parallel.bin'),
+            cs.SOCKET_ADDRESS_TYPE_IPV4, cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+        exec_test(test.test, params={'parallel-bytestreams': True})
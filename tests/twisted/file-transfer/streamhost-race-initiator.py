@@ -0,0 +1,65 @@
+"""
+Send a file over SOCKS5 when the receiver connects to Gabble's listener twice
+before sending CONNECT on either, as it does when racing several of the
+addresses Gabble offered, and check that Gabble uses the connection which
+finishes the handshake and closes the other.
+"""
+
+from twisted.internet import reactor
+
+import bytestream
+import constants as cs
+
+from file_transfer_helper import File, SendFileTest
+from gabbletest import exec_test
+
+from config import FILE_TRANSFER_ENABLED
+
+if not FILE_TRANSFER_ENABLED:
+    print "NOTE: built with --disable-file-transfer"
+    raise SystemExit(77)
+
+class BytestreamS5BTwoConnections(bytestream.BytestreamS5B):
+    def _connect(self, host, port):
+        connector = reactor.connectTCP(host, port,
+            bytestream.S5BFactory(self.q.append))
+        e = self.q.expect('s5b-connected')
+        return connector, e.transport
+
+    def _authenticate(self, transport):
+        # version 5, 1 auth method, no auth
+        transport.write('\x05\x01\x00')
+        # version 5, no auth
+        self.q.expect('s5b-data-received', transport=transport,
+            data='\x05\x00')
+
+    def wait_bytestream_open(self):
+        id, mode, sid, hosts = self._expect_socks5_init()
+
+        assert mode == 'tcp'
+        assert sid == self.stream_id
+
+        ours = [(host, port) for jid, host, port in hosts
+            if jid == self.initiator and bytestream.is_ipv4(host)]
+        assert ours, hosts
+        host, port = ours[0]
+
+        loser, first = self._connect(host, port)
+        _, self.transport = self._connect(host, port)
+
+        # Both get as far as authenticating; this used to make Gabble crash
+        self._authenticate(first)
+        self._authenticate(self.transport)
+
+        self._send_connect_cmd()
+        self._wait_connect_reply()
+
+        # Gabble has no use for the other connection now
+        self.q.expect('s5b-connection-lost', connector=loser)
+
+        self._send_socks5_reply(id, self.initiator)
+
+if __name__ == '__main__':
+    test = SendFileTest(BytestreamS5BTwoConnections, File(),
+        cs.SOCKET_ADDRESS_TYPE_IPV4, cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+    exec_test(test.test)
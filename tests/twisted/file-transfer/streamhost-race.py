@@ -0,0 +1,104 @@
+"""
+Receive a file over SOCKS5 when the first streamhost offered accepts the
+connection but never answers, and check that Gabble tries the next one
+without waiting for the first to time out, uses it, and gives up on the
+first.
+"""
+
+from twisted.internet import reactor
+from twisted.internet.error import CannotListenError
+from twisted.internet.protocol import Factory, Protocol
+from twisted.words.protocols.jabber.client import IQ
+
+from gabbletest import exec_test
+from servicetest import Event, EventPattern
+import bytestream
+import constants as cs
+import ns
+
+from file_transfer_helper import File, ReceiveFileTest
+
+from config import FILE_TRANSFER_ENABLED
+
+if not FILE_TRANSFER_ENABLED:
+    print "NOTE: built with --disable-file-transfer"
+    raise SystemExit(77)
+
+SLOW = 'slow.localhost'
+
+class StreamhostProtocol(Protocol):
+    def connectionMade(self):
+        self.factory.event_func(Event('s5b-connected',
+            streamhost=self.factory.jid, transport=self.transport))
+
+    def dataReceived(self, data):
+        self.factory.event_func(Event('s5b-data-received',
+            streamhost=self.factory.jid, data=data, transport=self.transport))
+
+    def connectionLost(self, reason):
+        self.factory.event_func(Event('s5b-connection-lost',
+            streamhost=self.factory.jid, transport=self.transport))
+
+class StreamhostFactory(Factory):
+    protocol = StreamhostProtocol
+
+    def __init__(self, event_func, jid):
+        self.event_func = event_func
+        self.jid = jid
+
+def listen_streamhost(q, jid):
+    for port in range(5000, 5100):
+        try:
+            reactor.listenTCP(port, StreamhostFactory(q.append, jid),
+                interface='localhost')
+        except CannotListenError:
+            continue
+        else:
+            return port
+
+    assert False, "Can't find a free port"
+
+class BytestreamS5BRace(bytestream.BytestreamS5B):
+    """Offers a streamhost which never answers, then one which works."""
+
+    def open_bytestream(self, expected_before=[], expected_after=[]):
+        iq = IQ(self.stream, 'set')
+        iq['to'] = self.target
+        iq['from'] = self.initiator
+        query = iq.addElement((ns.BYTESTREAMS, 'query'))
+        query['sid'] = self.stream_id
+        query['mode'] = 'tcp'
+
+        for jid in [SLOW, self.initiator]:
+            streamhost = query.addElement('streamhost')
+            streamhost['jid'] = jid
+            streamhost['host'] = '127.0.0.1'
+            streamhost['port'] = str(listen_streamhost(self.q, jid))
+
+        self.stream.send(iq)
+
+        # Both are new to Gabble, so it tries them in the order offered
+        events_before, _ = bytestream.wait_events(self.q, expected_before,
+            EventPattern('s5b-connected', streamhost=SLOW))
+        self.q.expect('s5b-data-received', streamhost=SLOW)
+
+        # The slow one keeps Gabble waiting, so it tries the other as well
+        self.q.expect('s5b-connected', streamhost=self.initiator)
+        self._wait_auth_request()
+        self._send_auth_reply()
+        self._wait_connect_cmd()
+        self._send_connect_reply()
+
+        events = self.q.expect_many(*(expected_after + [
+            EventPattern('s5b-connection-lost', streamhost=SLOW),
+            EventPattern('stream-iq', iq_type='result', to=self.initiator)]))
+
+        # Gabble used the one that answered, and hung up on the other
+        self._check_s5b_reply(events[-1].stanza)
+
+        return events_before, events[:-2]
+
+if __name__ == '__main__':
+    test = ReceiveFileTest(BytestreamS5BRace, File(),
+        cs.SOCKET_ADDRESS_TYPE_IPV4, cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+    exec_test(test.test)
@@ -0,0 +1,51 @@
+"""
+Test that stanza handlers still work when they're being profiled, and that
+SIGUSR1 makes Gabble report what they've cost.
+"""
+
+import dbus
+import os
+import signal
+
+from servicetest import ProxyWrapper, update_activation_environment
+from gabbletest import exec_test, elem_iq, elem
+import constants as cs
+import ns
+
+def is_message(e, text):
+    return text in e.args[3]
+
+def test(q, bus, conn, stream):
+    # Gabble's handler for this is profiled, but should work as usual
+    request = elem_iq(stream, 'get')(
+      elem(ns.VERSION, 'query')
+    )
+    stream.send(request)
+    q.expect('stream-iq', iq_id=request['id'], iq_type='result',
+        query_ns=ns.VERSION, query_name='query')
+
+    debug = ProxyWrapper(bus.get_object(conn.bus_name, cs.DEBUG_PATH),
+            cs.DEBUG_IFACE)
+    debug.Properties.Set(cs.DEBUG_IFACE, 'Enabled', True)
+
+    bus_daemon = dbus.Interface(
+        bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH),
+        dbus.BUS_DAEMON_IFACE)
+    os.kill(bus_daemon.GetConnectionUnixProcessID(conn.bus_name),
+        signal.SIGUSR1)
+
+    q.expect('dbus-signal', signal='NewDebugMessage',
+        predicate=lambda e: is_message(e, 'most expensive first'))
+    e = q.expect('dbus-signal', signal='NewDebugMessage',
+        predicate=lambda e: is_message(e,
+            "<query xmlns='%s'/>" % ns.VERSION))
+
+    # it was called once, for our request
+    assert e.args[3].startswith('1 ('), e.args[3]
+
+if __name__ == '__main__':
+    # This has to happen before Gabble is started. The budget is generous so
+    # that nothing is reported as slow under valgrind.
+    update_activation_environment(dbus.SessionBus(),
+        GABBLE_PROFILE_HANDLERS='10000')
+    exec_test(test)
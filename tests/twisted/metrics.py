@@ -0,0 +1,44 @@
+"""
+Smoke-test for the Gabble.Metrics connection interface.
+"""
+from gabbletest import exec_test, elem, elem_iq, make_presence, sync_stream
+from servicetest import assertContains, assertEquals
+import ns
+import constants as cs
+
+def test(q, bus, conn, stream):
+    assertContains(cs.CONN_IFACE_GABBLE_METRICS,
+        conn.Get(cs.CONN, 'Interfaces', dbus_interface=cs.PROPERTIES_IFACE))
+
+    before = conn.GetSnapshot(dbus_interface=cs.CONN_IFACE_GABBLE_METRICS)
+
+    # something asks what we support, which Gabble answers itself
+    stream.send(
+        elem_iq(stream, 'get', from_='romeo@montague.lit/Balcony')(
+          elem(ns.DISCO_INFO, 'query')
+        )
+      )
+    q.expect('stream-iq', iq_type='result', query_ns=ns.DISCO_INFO)
+
+    stream.send(make_presence('romeo@montague.lit/Balcony', show='away'))
+    sync_stream(q, stream)
+
+    after = conn.GetSnapshot(dbus_interface=cs.CONN_IFACE_GABBLE_METRICS)
+
+    # histograms are (count, total, maximum, [(upper bound, count)])
+    for name, handled in [('stanza.iq.handling-time', 1),
+                          ('stanza.presence.handling-time', 1)]:
+        count, total, maximum, buckets = after[name]
+        assertEquals(before[name][0] + handled, count)
+        assertEquals(count, sum([n for _, n in buckets]))
+        assert maximum <= total, (maximum, total)
+
+    # the bounds only ever go up
+    bounds = [b for b, _ in after['stanza.iq.handling-time'][3]]
+    assertEquals(sorted(bounds), bounds)
+
+    # nothing is left in the pipeline once connected
+    assertEquals(0, after['pipeline.in-flight'])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,93 @@
+"""
+Test joining a room with more members than Gabble parses the presences of
+in one go: they should all be added to the channel at once, and asking for
+their presences before Gabble has got round to parsing them all should still
+give the right answers.
+"""
+
+from gabbletest import exec_test, make_muc_presence, sync_stream
+from servicetest import (call_async, EventPattern, assertEquals,
+    assertLength, sync_dbus)
+from mucutil import try_to_join_muc
+import constants as cs
+
+ROOM = 'chat@conf.localhost'
+
+# Gabble works through deferred presences 50 at a time when it's idle, so
+# this is enough that it can't have finished by the time we ask
+N_MEMBERS = 500
+
+def member_presence(i):
+    if i % 2:
+        return ('away', 'back in %d minutes' % i)
+    else:
+        return ('dnd', '')
+
+def test(q, bus, conn, stream):
+    try_to_join_muc(q, bus, conn, stream, ROOM)
+
+    # the members should arrive in one MembersChanged, not one each
+    piecemeal = [EventPattern('dbus-signal', signal='MembersChanged',
+        predicate=lambda e: 0 < len(e.args[1]) <= N_MEMBERS)]
+    q.forbid_events(piecemeal)
+
+    expected = {}
+
+    for i in range(N_MEMBERS):
+        nick = 'member%d' % i
+        show, status = member_presence(i)
+
+        presence = make_muc_presence('none', 'participant', ROOM, nick)
+        presence.addElement('show', content=show)
+
+        if status:
+            presence.addElement('status', content=status)
+
+        stream.send(presence)
+
+        if show == 'away':
+            expected['%s/%s' % (ROOM, nick)] = (cs.PRESENCE_AWAY, show, status)
+        else:
+            expected['%s/%s' % (ROOM, nick)] = (cs.PRESENCE_BUSY, show, status)
+
+    stream.send(make_muc_presence('none', 'participant', ROOM, 'test'))
+
+    _, members_changed = q.expect_many(
+        EventPattern('dbus-return', method='CreateChannel'),
+        EventPattern('dbus-signal', signal='MembersChanged',
+            predicate=lambda e: len(e.args[1]) > 0))
+
+    added = members_changed.args[1]
+    assertLength(N_MEMBERS + 1, added)
+
+    # Ask for everyone's presence straight away, checking how many are still
+    # deferred at the same time
+    call_async(q, conn, 'GetSnapshot',
+        dbus_interface=cs.CONN_IFACE_GABBLE_METRICS)
+    call_async(q, conn.Contacts, 'GetContactAttributes', added,
+        [cs.CONN_IFACE_SIMPLE_PRESENCE], False)
+
+    snapshot, attributes = q.expect_many(
+        EventPattern('dbus-return', method='GetSnapshot'),
+        EventPattern('dbus-return', method='GetContactAttributes'))
+
+    # some presences were still waiting to be parsed when we asked...
+    assert snapshot.value[0]['presence.deferred'] > 0, snapshot.value[0]
+
+    # ... but we got them anyway
+    presences = {}
+
+    for attrs in attributes.value[0].values():
+        jid = attrs[cs.ATTR_CONTACT_ID]
+
+        if jid != '%s/test' % ROOM:
+            presences[jid] = attrs[cs.ATTR_PRESENCE]
+
+    assertEquals(expected, presences)
+
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+    q.unforbid_events(piecemeal)
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -60,6 +60,7 @@ PUBSUB_EVENT = "%s#event" % PUBSUB
 RECEIPTS = "urn:xmpp:receipts"
 REGISTER = "jabber:iq:register"
 ROSTER = "jabber:iq:roster"
+ROSTER_VER = "urn:xmpp:features:rosterver"
 SEARCH = 'jabber:iq:search'
 SI = 'http://jabber.org/protocol/si'
 SI_MULTIPLE = 'http://telepathy.freedesktop.org/xmpp/si-multiple'
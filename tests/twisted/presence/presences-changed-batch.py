@@ -0,0 +1,80 @@
+"""
+Test that a burst of contacts' presences is reported in one PresencesChanged
+signal, and that asking for a contact's presence as soon as Gabble has seen
+it change agrees with what the signal says.
+"""
+
+from twisted.words.protocols.jabber.client import IQ
+
+from gabbletest import exec_test, make_presence, sync_stream
+from servicetest import EventPattern, assertEquals, sync_dbus
+import ns
+import constants as cs
+
+N_CONTACTS = 100
+
+def test(q, bus, conn, stream):
+    event = q.expect('stream-iq', query_ns=ns.ROSTER)
+
+    jids = ['contact%d@foo.com' % i for i in range(N_CONTACTS)]
+    handles = conn.get_contact_handles_sync(jids)
+
+    event.stanza['type'] = 'result'
+
+    for jid in jids:
+        item = event.query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+
+    stream.send(event.stanza)
+
+    # get whatever Gabble says about the roster out of the way
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+
+    # everyone comes online in one go
+    expected = {}
+
+    for i, (jid, handle) in enumerate(zip(jids, handles)):
+        status = 'status %d' % i
+        stream.send(make_presence(jid + '/Res', show='away', status=status))
+        expected[handle] = (cs.PRESENCE_AWAY, 'away', status)
+
+    e = q.expect('dbus-signal', signal='PresencesChanged')
+    assertEquals(expected, e.args[0])
+
+    # and that was the only signal about it
+    again = [EventPattern('dbus-signal', signal='PresencesChanged')]
+    q.forbid_events(again)
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+    q.unforbid_events(again)
+
+    # Now one contact changes twice in a row. Gabble reports only where they
+    # ended up, and has already taken note of it by the time it answers the
+    # IQ that follows them.
+    jid, handle = jids[0], handles[0]
+    final = (cs.PRESENCE_EXTENDED_AWAY, 'xa', 'gone home')
+
+    stream.send(make_presence(jid + '/Res', show='dnd', status='busy'))
+    stream.send(make_presence(jid + '/Res', show='xa', status='gone home'))
+
+    iq = IQ(stream, 'get')
+    iq.addElement((ns.DISCO_INFO, 'query'))
+    stream.send(iq)
+
+    e, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='PresencesChanged'),
+        EventPattern('stream-iq', iq_type='result', iq_id=iq['id']))
+    assertEquals({handle: final}, e.args[0])
+
+    # asking straight away gives the same answer as the signal
+    attrs = conn.Contacts.GetContactAttributes([handle],
+        [cs.CONN_IFACE_SIMPLE_PRESENCE], False)
+    assertEquals(final, attrs[handle][cs.ATTR_PRESENCE])
+
+    presences = conn.SimplePresence.GetPresences([handle])
+    assertEquals(final, presences[handle])
+
+if __name__ == '__main__':
+    exec_test(test)
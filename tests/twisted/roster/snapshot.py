@@ -0,0 +1,128 @@
+"""
+Test that the roster is kept on disk between connections, and that its
+XEP-0237 version is used to ask the server only for what has changed.
+"""
+
+import dbus
+import glob
+import os
+import shutil
+import tempfile
+
+from twisted.words.protocols.jabber import xmlstream
+
+from servicetest import (assertEquals, assertLength,
+    update_activation_environment)
+from gabbletest import (exec_test, elem, make_result_iq, sync_stream,
+    XmppAuthenticator)
+from rostertest import make_roster_push
+import constants as cs
+import ns
+
+class RosterVerAuthenticator(XmppAuthenticator):
+    """Advertises roster versioning alongside resource binding."""
+
+    def streamIQ(self):
+        features = elem(xmlstream.NS_STREAMS, 'features')(
+            elem(ns.NS_XMPP_BIND, 'bind'),
+            elem(ns.NS_XMPP_SESSION, 'session'),
+            elem(ns.ROSTER_VER, 'ver'),
+        )
+        self.xmlstream.send(features)
+
+        self.xmlstream.addOnetimeObserver(
+            "/iq/bind[@xmlns='%s']" % ns.NS_XMPP_BIND, self.bindIq)
+        self.xmlstream.addOnetimeObserver(
+            "/iq/session[@xmlns='%s']" % ns.NS_XMPP_SESSION, self.sessionIq)
+
+def expect_roster_query(q, ver):
+    event = q.expect('stream-iq', iq_type='get', query_ns=ns.ROSTER)
+    assertEquals(ver, event.query.getAttribute('ver'))
+    return event
+
+def add_items(query, items):
+    for jid, subscription in items:
+        item = query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = subscription
+
+def check_contacts(q, conn, stream, expected):
+    sync_stream(q, stream)
+
+    attrs = conn.ContactList.GetContactListAttributes([], False)
+    contacts = {}
+
+    for a in attrs.values():
+        contacts[a[cs.CONN + '/contact-id']] = (
+            a[cs.CONN_IFACE_CONTACT_LIST + '/subscribe'],
+            a[cs.CONN_IFACE_CONTACT_LIST + '/publish'])
+
+    assertEquals(expected, contacts)
+
+def test_first(q, bus, conn, stream):
+    # there's nothing on disk yet, so we ask for the whole roster
+    event = expect_roster_query(q, '')
+
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query['ver'] = 'v1'
+    add_items(query, [('amy@foo.com', 'both'), ('bob@foo.com', 'to')])
+    stream.send(result)
+
+    check_contacts(q, conn, stream, {
+        'amy@foo.com': (cs.SUBSCRIPTION_STATE_YES, cs.SUBSCRIPTION_STATE_YES),
+        'bob@foo.com': (cs.SUBSCRIPTION_STATE_YES, cs.SUBSCRIPTION_STATE_NO),
+        })
+
+def test_unchanged(q, bus, conn, stream):
+    event = expect_roster_query(q, 'v1')
+
+    # an empty result means our copy is still current, so Amy and Bob stay
+    stream.send(make_result_iq(stream, event.stanza, add_query_node=False))
+
+    check_contacts(q, conn, stream, {
+        'amy@foo.com': (cs.SUBSCRIPTION_STATE_YES, cs.SUBSCRIPTION_STATE_YES),
+        'bob@foo.com': (cs.SUBSCRIPTION_STATE_YES, cs.SUBSCRIPTION_STATE_NO),
+        })
+
+    # changes after that are pushed, each with a new version
+    push = make_roster_push(stream, 'che@foo.com', 'from')
+    push.firstChildElement()['ver'] = 'v2'
+    stream.send(push)
+    q.expect('stream-iq', iq_type='result', iq_id='push')
+
+def test_changed(q, bus, conn, stream):
+    event = expect_roster_query(q, 'v2')
+
+    # the server has lost track of that version, so sends everything; Bob
+    # and Che have gone while we were away
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query['ver'] = 'v3'
+    add_items(query, [('amy@foo.com', 'both')])
+    stream.send(result)
+
+    check_contacts(q, conn, stream, {
+        'amy@foo.com': (cs.SUBSCRIPTION_STATE_YES, cs.SUBSCRIPTION_STATE_YES),
+        })
+
+def run(fun):
+    exec_test(fun, authenticator=RosterVerAuthenticator('test', 'pass'))
+
+if __name__ == '__main__':
+    cache_dir = tempfile.mkdtemp()
+
+    # This has to happen before Gabble is started
+    update_activation_environment(dbus.SessionBus(),
+        GABBLE_TEST_ROSTER_CACHE=cache_dir)
+
+    try:
+        run(test_first)
+
+        # the roster was saved when we disconnected
+        assertLength(1, glob.glob(os.path.join(cache_dir, '*.xml')))
+
+        run(test_unchanged)
+        run(test_changed)
+    finally:
+        shutil.rmtree(cache_dir)
@@ -700,6 +700,14 @@ def make_connection(bus, event_func, name, proto, params):
 
     return conn
 
+def update_activation_environment(bus, **env):
+    """Sets environment variables for services started by the bus from now
+    on. To affect the connection manager, call this before it's started."""
+    bus_daemon = dbus.Interface(
+        bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH),
+        dbus.BUS_DAEMON_IFACE)
+    bus_daemon.UpdateActivationEnvironment(env)
+
 def make_channel_proxy(conn, path, iface):
     bus = dbus.SessionBus()
     chan = bus.get_object(conn.object.bus_name, path)
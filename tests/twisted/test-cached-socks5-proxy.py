@@ -0,0 +1,115 @@
+"""
+Test that SOCKS5 proxies found on one connection are offered straight away
+on the next, without asking for them again while they're fresh.
+"""
+
+import dbus
+import shutil
+import tempfile
+
+from twisted.words.xish import xpath
+
+from gabbletest import (exec_test, elem, elem_iq, make_presence,
+    sync_stream)
+from servicetest import (EventPattern, call_async, assertEquals,
+    update_activation_environment)
+from caps_helper import send_disco_reply
+from bytestream import create_from_si_offer, BytestreamS5B
+import constants as cs
+import ns
+
+from config import FILE_TRANSFER_ENABLED
+
+if not FILE_TRANSFER_ENABLED:
+    print "NOTE: built with --disable-file-transfer"
+    raise SystemExit(77)
+
+PROXIES = {
+    'fallback1-proxy.localhost': '1111',
+    'fallback2-proxy.localhost': '2222',
+    'fallback3-proxy.localhost': '3333',
+    }
+
+params = { 'fallback-socks5-proxies': sorted(PROXIES) }
+
+looking_for_proxies = [
+    EventPattern('stream-iq', iq_type='get', query_ns=ns.BYTESTREAMS),
+    EventPattern('stream-iq', to='proxies.telepathy.im', iq_type='get',
+        query_ns=ns.DISCO_ITEMS),
+    ]
+
+def announce_alice(q, stream):
+    caps = { 'ext': '', 'ver': '0.0.0',
+        'node': 'http://example.com/fake-client0' }
+    stream.send(make_presence('alice@localhost/Test', caps=caps))
+
+    event = q.expect('stream-iq', to='alice@localhost/Test',
+        query_ns=ns.DISCO_INFO)
+    send_disco_reply(stream, event.stanza, [], [ns.FILE_TRANSFER])
+    sync_stream(q, stream)
+
+def send_file_to_alice(q, conn):
+    call_async(q, conn.Requests, 'CreateChannel', {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_FILE_TRANSFER,
+        cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+        cs.TARGET_ID: 'alice@localhost',
+        cs.FT_FILENAME: 'test.txt',
+        cs.FT_CONTENT_TYPE: 'text/plain',
+        cs.FT_SIZE: 10})
+
+def expect_offered_proxies(q, stream):
+    e = q.expect('stream-iq', to='alice@localhost/Test')
+    bytestream, profile = create_from_si_offer(stream, q, BytestreamS5B,
+        e.stanza, 'test@localhost/Resource')
+
+    result, si = bytestream.create_si_reply(e.stanza)
+    stream.send(result)
+
+    e = q.expect('stream-iq', to='alice@localhost/Test')
+
+    return dict((node['jid'], node['port'])
+        for node in xpath.queryForNodes('/iq/query/streamhost', e.stanza)
+        if node['jid'] != 'test@localhost/Resource')
+
+def test_discover(q, bus, conn, stream):
+    announce_alice(q, stream)
+    send_file_to_alice(q, conn)
+
+    # there's nothing cached, so each proxy is asked where it is
+    events = q.expect_many(*([EventPattern('dbus-return',
+            method='CreateChannel')] +
+        [EventPattern('stream-iq', to=jid, iq_type='get',
+            query_ns=ns.BYTESTREAMS) for jid in sorted(PROXIES)]))
+
+    for e in events[1:]:
+        jid = e.stanza['to']
+        stream.send(elem_iq(stream, 'result', id=e.stanza['id'], from_=jid)(
+            elem(ns.BYTESTREAMS, 'query')(
+                elem('streamhost', jid=jid, host='127.0.0.1',
+                    port=PROXIES[jid])())))
+
+    assertEquals(PROXIES, expect_offered_proxies(q, stream))
+
+def test_cached(q, bus, conn, stream):
+    # this time they're all fresh in the cache, so we don't go looking
+    q.forbid_events(looking_for_proxies)
+
+    announce_alice(q, stream)
+    send_file_to_alice(q, conn)
+    q.expect('dbus-return', method='CreateChannel')
+
+    assertEquals(PROXIES, expect_offered_proxies(q, stream))
+    sync_stream(q, stream)
+
+if __name__ == '__main__':
+    cache_dir = tempfile.mkdtemp()
+
+    # This has to happen before Gabble is started
+    update_activation_environment(dbus.SessionBus(),
+        GABBLE_TEST_SOCKS5_PROXY_CACHE=cache_dir)
+
+    try:
+        exec_test(test_discover, params=params)
+        exec_test(test_cached, params=params)
+    finally:
+        shutil.rmtree(cache_dir)
@@ -0,0 +1,62 @@
+"""
+Test that fetching vCards from a fast and a slow server at once doesn't make
+Gabble think the fast one is overloaded and send fewer requests at a time.
+"""
+
+from twisted.internet import reactor
+
+from servicetest import assertEquals
+from gabbletest import exec_test, acknowledge_iq, make_result_iq, sync_stream
+import ns
+
+# seconds each server takes to reply
+DELAYS = { 'near.example.com': 0.05, 'far.example.com': 0.3 }
+
+# how many requests Gabble keeps in flight before it has seen any replies
+INITIAL_WINDOW = 10
+
+def test(q, bus, conn, stream):
+    event = q.expect('stream-iq', to=None, query_ns=ns.VCARD_TEMP,
+        query_name='vCard')
+    acknowledge_iq(stream, event.stanza)
+
+    jids = ['contact%d@%s' % (i, domain)
+        for i in range(20) for domain in sorted(DELAYS)]
+    handles = conn.get_contact_handles_sync(jids)
+
+    outstanding = set()
+
+    def reply(stanza):
+        outstanding.remove(stanza['to'])
+        stream.send(make_result_iq(stream, stanza))
+
+    conn.Avatars.RequestAvatars(handles)
+
+    for i in range(len(jids)):
+        event = q.expect('stream-iq', iq_type='get', query_ns=ns.VCARD_TEMP,
+            query_name='vCard')
+        jid = event.stanza['to']
+        outstanding.add(jid)
+        reactor.callLater(DELAYS[jid.split('@')[1]], reply, event.stanza)
+
+    while outstanding:
+        sync_stream(q, stream)
+
+    # Each server was as fast as it ever is, so the window grew, rather than
+    # shrinking because the far one is slower than the near one; so now
+    # Gabble sends more than it started with without waiting for replies
+    more = ['more%d@near.example.com' % i for i in range(2 * INITIAL_WINDOW)]
+    conn.Avatars.RequestAvatars(conn.get_contact_handles_sync(more))
+
+    events = [q.expect('stream-iq', iq_type='get', query_ns=ns.VCARD_TEMP,
+            query_name='vCard')
+        for jid in more]
+    assertEquals(sorted(more), sorted(e.stanza['to'] for e in events))
+
+    for e in events:
+        stream.send(make_result_iq(stream, e.stanza))
+
+    sync_stream(q, stream)
+
+if __name__ == '__main__':
+    exec_test(test)
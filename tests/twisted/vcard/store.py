@@ -0,0 +1,127 @@
+"""
+Test that contacts' vCards are kept on disk between connections, and that
+expired, invalidated and orphaned ones aren't used.
+"""
+
+import dbus
+import glob
+import os
+import re
+import shutil
+import tempfile
+import time
+
+from servicetest import (call_async, EventPattern, assertEquals, assertLength,
+    update_activation_environment)
+from gabbletest import (exec_test, acknowledge_iq, make_result_iq,
+    send_error_reply, sync_stream)
+import constants as cs
+import ns
+
+BOB = 'bob@foo.com'
+
+def expect_own_vcard(q, stream):
+    # our own vCard is always fetched from the server
+    event = q.expect('stream-iq', to=None, query_ns=ns.VCARD_TEMP,
+        query_name='vCard')
+    acknowledge_iq(stream, event.stanza)
+
+def make_fetch_test(fn):
+    def test(q, bus, conn, stream):
+        expect_own_vcard(q, stream)
+        handle = conn.get_contact_handle_sync(BOB)
+
+        call_async(q, conn.ContactInfo, 'RequestContactInfo', handle)
+
+        event = q.expect('stream-iq', to=BOB, iq_type='get',
+            query_ns=ns.VCARD_TEMP, query_name='vCard')
+        result = make_result_iq(stream, event.stanza)
+        result.firstChildElement().addElement('FN', content=fn)
+        stream.send(result)
+
+        e = q.expect('dbus-return', method='RequestContactInfo')
+        assertEquals([(u'fn', [], [fn])], e.value[0])
+
+    return test
+
+def wait_for_store(bus, conn):
+    # the store is loaded in the background, and until it's done Gabble
+    # asks the server instead
+    debug = bus.get_object(conn.bus_name, cs.DEBUG_PATH)
+
+    for i in range(100):
+        messages = debug.GetMessages(dbus_interface=cs.DEBUG_IFACE)
+
+        for _, _, _, message in messages:
+            if 'loaded' in message and ' vCards for ' in message:
+                return
+
+        time.sleep(0.1)
+
+    assert False, "the vCard store never finished loading"
+
+def test_stored(q, bus, conn, stream):
+    expect_own_vcard(q, stream)
+    handle = conn.get_contact_handle_sync(BOB)
+    wait_for_store(bus, conn)
+
+    # Bob's vCard from last time is used without asking the server
+    forbidden = [EventPattern('stream-iq', to=BOB, query_ns=ns.VCARD_TEMP)]
+    q.forbid_events(forbidden)
+
+    call_async(q, conn.ContactInfo, 'RequestContactInfo', handle)
+    e = q.expect('dbus-return', method='RequestContactInfo')
+    assertEquals([(u'fn', [], [u'Bob'])], e.value[0])
+    sync_stream(q, stream)
+
+    q.unforbid_events(forbidden)
+
+    # Refreshing it forgets the stored copy, so if the server doesn't give us
+    # a new one there's nothing left for next time
+    call_async(q, conn.ContactInfo, 'RefreshContactInfo', [handle])
+    event = q.expect('stream-iq', to=BOB, iq_type='get',
+        query_ns=ns.VCARD_TEMP, query_name='vCard')
+    send_error_reply(stream, event.stanza)
+    sync_stream(q, stream)
+
+def account_dir(cache_dir):
+    dirs = glob.glob(os.path.join(cache_dir, '*'))
+    assertLength(1, dirs)
+    return dirs[0]
+
+if __name__ == '__main__':
+    cache_dir = tempfile.mkdtemp()
+
+    # This has to happen before Gabble is started
+    update_activation_environment(dbus.SessionBus(),
+        GABBLE_TEST_VCARD_CACHE=cache_dir)
+
+    try:
+        exec_test(make_fetch_test(u'Bob'))
+
+        # A vCard written just before crashing, which never made it into the
+        # index, is cleaned up
+        orphan = os.path.join(account_dir(cache_dir), 'vcards',
+            '0' * 40 + '.xml')
+        open(orphan, 'w').write('<vCard xmlns="vcard-temp"/>')
+        # files newer than the store's load are spared, as Gabble may have
+        # just written them
+        os.utime(orphan, (0, 0))
+
+        exec_test(test_stored)
+        assert not os.path.exists(orphan)
+
+        # Bob's vCard was invalidated, so it's fetched again
+        exec_test(make_fetch_test(u'Robert'))
+
+        # Pretend it was fetched a long time ago
+        index = os.path.join(account_dir(cache_dir), 'index')
+        data = open(index).read()
+        assert re.search(r'^fetched=[1-9]', data, re.M), data
+        open(index, 'w').write(
+            re.sub(r'^fetched=.*$', 'fetched=0', data, flags=re.M))
+
+        # so it's too old to use, and is fetched again
+        exec_test(make_fetch_test(u'Bobby'))
+    finally:
+        shutil.rmtree(cache_dir)